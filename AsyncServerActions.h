@@ -0,0 +1,808 @@
+/**
+  @AsyncServerActions request handlers as C++20 coroutines (boost::asio::awaitable).
+  A connection is a coroutine on a strand instead of a thread: socket I/O is co_await
+  async_read/async_write, blocking storage calls run on the user's storage root I/O pool
+  and are awaited. Backups receive the next batch of frames while the previous batch is
+  written; restores read the next batch from disk while the current one is sent.
+  Each handler returns the response status; the response frame, user lock release,
+  metrics, capture and socket close are done once, in connection(). The storage side of
+  every op is RequestOps, shared with the thread per connection handlers. A request's
+  Tracing::Trace travels with its coroutine and is lent to the pool threads it uses.
+  Available when boost.asio has coroutine support (C++20): HAVE_ASYNC_SERVER.
+ */
+
+#pragma once
+#include <utility>   // before asio: boost 1.74 awaitable.hpp uses std::exchange.
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include "ProtocolCodec.h"
+#include "ServerRequest.h"
+#include "ServerResponse.h"
+#include "FileManager.h"
+#include "BackupPipeline.h"
+#include "Connection.h"
+#include "Metrics.h"
+#include "Scheduler.h"
+#include "VersionStore.h"
+#include "SmallFileStore.h"
+#include "ReplicationLog.h"
+#include "MetadataSnapshot.h"
+#include "FileMatcher.h"
+#include "QuotaManager.h"
+#include "ContentIndex.h"
+#include "RequestOps.h"
+#include "Tracing.h"
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+#define HAVE_ASYNC_SERVER 1
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#else
+#define HAVE_ASYNC_SERVER 0
+#endif
+
+#define ASYNC_BATCH_FRAMES  64        // frames moved per socket call and per disk call.
+#define ASYNC_LOCK_RETRY_MS  100      // poll interval while another request of the user is served, or the user is migrated.
+
+#if HAVE_ASYNC_SERVER
+
+namespace AsyncServerActions {
+
+	using boost::asio::awaitable;
+	using boost::asio::use_awaitable;
+
+	/**
+	   One blocking storage call at a time, run on an I/O pool and awaited by the coroutine.
+	   The completion is posted back to the coroutine's executor and wakes it through a
+	   timer used as an event. A started call must be awaited before the Offload (and
+	   whatever the call references) goes away. Calls run on behalf of the request's trace.
+	 */
+	class Offload
+	{
+	public:
+		Offload(const boost::asio::any_io_executor& executor, const Tracing::Trace& trace) : _timer(executor, std::chrono::steady_clock::time_point::max()), _trace(trace), _done(true), _ok(true) {}
+
+		void start(StorageRoots::IoPool& pool, std::function<bool()> work)
+		{
+			_done = false;
+			pool.post([this, work = std::move(work)]()
+			{
+				bool ok = false;
+				{
+					const Tracing::Adopt adopt(_trace);
+					ok = work();
+				}
+				complete(ok);
+			});
+		}
+
+		/**
+		   @brief start a call that finishes later: `work` runs on the pool and hands its
+		          completion on, to be called once from any thread.
+		 */
+		void startDeferred(StorageRoots::IoPool& pool, std::function<void(std::function<void(bool)>)> work)
+		{
+			_done = false;
+			pool.post([this, work = std::move(work)]()
+			{
+				const Tracing::Adopt adopt(_trace);
+				work([this](const bool ok) { complete(ok); });
+			});
+		}
+
+		awaitable<bool> wait()
+		{
+			while (!_done)
+			{
+				boost::system::error_code error;
+				co_await _timer.async_wait(boost::asio::redirect_error(use_awaitable, error));
+			}
+			co_return _ok;
+		}
+
+		awaitable<bool> run(StorageRoots::IoPool& pool, std::function<bool()> work)
+		{
+			start(pool, std::move(work));
+			co_return co_await wait();
+		}
+
+		bool pending() const { return !_done; }
+
+	private:
+		void complete(const bool ok)
+		{
+			boost::asio::post(_timer.get_executor(), [this, ok]()
+			{
+				_ok = ok;
+				_done = true;
+				_timer.cancel();
+			});
+		}
+
+		boost::asio::steady_timer _timer;
+		const Tracing::Trace& _trace;
+		bool _done;
+		bool _ok;
+	};
+
+
+	/**
+	   I/O deadline of a connection: cancels the socket's pending operation when it expires.
+	   An expiry already queued when the deadline was disarmed (or re-armed) still runs: each
+	   arm() starts a new generation and only the current one may cancel the socket.
+	   Runs on the connection's strand.
+	 */
+	class Deadline
+	{
+	public:
+		explicit Deadline(boost::asio::ip::tcp::socket& sock) : _sock(sock), _timer(sock.get_executor()), _generation(std::make_shared<uint64_t>(0)) {}
+		~Deadline() { ++*_generation; }   // a queued expiry must not touch the socket any more.
+
+		void arm()
+		{
+			const uint64_t armed = ++*_generation;
+			_timer.expires_after(Connection::limits().ioTimeout);
+			_timer.async_wait([sock = &_sock, generation = _generation, armed](const boost::system::error_code& error)
+			{
+				if (error || *generation != armed)
+					return;   // disarmed, possibly after it expired.
+				Connection::stats().timeouts.fetch_add(1, std::memory_order_relaxed);
+				boost::system::error_code ignored;
+				sock->cancel(ignored);
+			});
+		}
+
+		void disarm()
+		{
+			++*_generation;
+			_timer.cancel();
+		}
+
+	private:
+		boost::asio::ip::tcp::socket& _sock;
+		boost::asio::steady_timer _timer;
+		std::shared_ptr<uint64_t> _generation;   // shared with queued expiries, which may outlive the deadline.
+	};
+
+	inline awaitable<bool> readFrames(boost::asio::ip::tcp::socket& sock, Deadline& deadline, uint8_t* data, const size_t length)
+	{
+		boost::system::error_code error;
+		deadline.arm();
+		co_await boost::asio::async_read(sock, boost::asio::buffer(data, length), boost::asio::redirect_error(use_awaitable, error));
+		deadline.disarm();
+		co_return !error;
+	}
+
+	inline awaitable<bool> writeFrames(boost::asio::ip::tcp::socket& sock, Deadline& deadline, const uint8_t* data, const size_t length)
+	{
+		boost::system::error_code error;
+		deadline.arm();
+		co_await boost::asio::async_write(sock, boost::asio::buffer(data, length), boost::asio::redirect_error(use_awaitable, error));
+		deadline.disarm();
+		co_return !error;
+	}
+
+
+	/**
+	   @brief Connection::drain() on the coroutine: discard the rest of a refused request, the send side shut down.
+	 */
+	inline awaitable<void> drain(boost::asio::ip::tcp::socket& sock)
+	{
+		boost::system::error_code error;
+		sock.shutdown(boost::asio::ip::tcp::socket::shutdown_send, error);
+		boost::asio::steady_timer limit(sock.get_executor());
+		limit.expires_after(std::chrono::milliseconds(CONNECTION_DRAIN_MS));
+		limit.async_wait([sock = &sock](const boost::system::error_code& expired)
+		{
+			boost::system::error_code ignored;
+			if (!expired)
+				sock->cancel(ignored);
+		});
+		std::vector<uint8_t> discard(16 * 1024);
+		size_t discarded = 0;
+		while (!error && discarded < CONNECTION_DRAIN_BYTES)
+			discarded += co_await sock.async_read_some(boost::asio::buffer(discard), boost::asio::redirect_error(use_awaitable, error));
+		limit.cancel();
+	}
+
+
+	/**
+	   Requests of one user are served one at a time.
+	 */
+	class UserLocks
+	{
+	public:
+		static UserLocks& instance()
+		{
+			static UserLocks locks;
+			return locks;
+		}
+
+		bool tryLock(const uint32_t userID)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _busy.insert(userID).second;
+		}
+
+		void unlock(const uint32_t userID)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_busy.erase(userID);
+		}
+
+	private:
+		std::mutex _mutex;
+		std::set<uint32_t> _busy;
+	};
+
+	inline awaitable<void> lockUser(const uint32_t userID)
+	{
+		if (UserLocks::instance().tryLock(userID))
+			co_return;
+		Metrics::instance().lockContended.fetch_add(1, std::memory_order_relaxed);
+		const auto start = std::chrono::steady_clock::now();
+		boost::asio::steady_timer retry(co_await boost::asio::this_coro::executor);
+		while (!UserLocks::instance().tryLock(userID))
+		{
+			retry.expires_after(std::chrono::milliseconds(ASYNC_LOCK_RETRY_MS));
+			boost::system::error_code error;
+			co_await retry.async_wait(boost::asio::redirect_error(use_awaitable, error));
+		}
+		Metrics::instance().lockWait.record(Metrics::elapsedMicros(start));
+	}
+
+	/**
+	   @brief StorageRoots::UserLease for a coroutine: a user being migrated is polled for
+	          like a locked one, so no thread blocks on the move.
+	   @return the user's folder, leased. adopt it with UserLease(userID, folder, std::adopt_lock).
+	 */
+	inline awaitable<std::string> leaseUser(const uint32_t userID)
+	{
+		std::string folder;
+		if (StorageRoots::instance().tryAcquire(userID, folder))
+			co_return folder;
+		boost::asio::steady_timer retry(co_await boost::asio::this_coro::executor);
+		while (!StorageRoots::instance().tryAcquire(userID, folder))
+		{
+			retry.expires_after(std::chrono::milliseconds(ASYNC_LOCK_RETRY_MS));
+			boost::system::error_code error;
+			co_await retry.async_wait(boost::asio::redirect_error(use_awaitable, error));
+		}
+		co_return folder;
+	}
+
+	/**
+	   @brief Scheduler::Transfer::pace for a coroutine: the rate limits are waited out on a timer,
+	          never on a storage root's I/O pool, whose threads only take a slot (Transfer::Io).
+	 */
+	inline awaitable<void> pace(Scheduler::Transfer& transfer, const uint32_t bytes)
+	{
+		const auto wait = transfer.delay(bytes);
+		if (wait.count() <= 0)
+			co_return;
+		boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor);
+		timer.expires_after(wait);
+		boost::system::error_code error;
+		co_await timer.async_wait(boost::asio::redirect_error(use_awaitable, error));
+	}
+
+
+	/**
+	   Everything a handler needs about its request.
+	 */
+	struct Context
+	{
+		boost::asio::ip::tcp::socket& sock;
+		Deadline& deadline;
+		const Request& request;
+		const DirectoryCache::Directory& dir;
+		const std::string& filename;
+		const std::string& path;   // file to read: the live file or one of its versions.
+		StorageRoots::IoPool& pool;
+		Offload& disk;
+		const Tracing::Trace& trace;
+		std::stringstream& err;
+		bool responded = false;   // the handler sent the response itself.
+	};
+
+	/**
+	   @brief send the response header frame, which carries the first payload bytes.
+	   @param size whole payload size.
+	   @param first payload start, at least as long as the frame's room for it.
+	 */
+	inline awaitable<bool> sendHeader(Context& c, const uint16_t status, const std::string& name, const uint32_t size, const uint8_t* first)
+	{
+		ServerResponse::Response response;
+		response.status = status;
+		response.nameLen = static_cast<uint16_t>(name.size());
+		response.filename = reinterpret_cast<uint8_t*>(const_cast<char*>(name.data()));
+		response.payload.m_size = size;
+		response.payload.m_payload = const_cast<uint8_t*>(first);
+		uint8_t frame[PACKET_SIZE] = {};
+		ServerResponseFuncs::serializeResponse(response, frame);
+		response.filename = nullptr;   // not owned.
+		response.payload.m_payload = nullptr;
+		c.responded = true;
+		co_return co_await writeFrames(c.sock, c.deadline, frame, PACKET_SIZE);
+	}
+
+	inline uint32_t frameHeaderSize(const std::string& name)
+	{
+		ServerResponse::Response response;
+		response.nameLen = static_cast<uint16_t>(name.size());
+		return response.sizeWithoutPayload();
+	}
+
+
+	/**
+	   @brief receive the payload in batches and write each batch while the next one arrives.
+	 */
+	inline awaitable<uint16_t> backup(Context& c)
+	{
+		const uint32_t userID = c.request.header.m_userID;
+		const uint32_t size = c.request.payload.m_size;
+		QuotaManager::Prior prior;
+		if (!co_await c.disk.run(c.pool, [&]() { return RequestOps::admitBackup(c.dir, c.filename, size, prior, c.err); }))
+			co_return ServerResponse::Response::ERROR_QUOTA;   // the payload is not read: the connection is closed after the response.
+		if (size <= PACKET_SIZE - c.request.sizeWithoutPayload() && SmallFileStore::accepts(size))
+		{
+			// the acknowledgment waits for the container flush without holding a pool thread.
+			c.disk.startDeferred(c.pool, [&c, size](SmallFileStore::Done done) { FileManager::fileStoreSmallAt(c.dir, c.filename, c.request.payload.m_payload, size, std::move(done)); });
+			if (!co_await c.disk.wait())
+			{
+				c.err << "user ID #" << +userID << ": Write to file " << c.filename << " failed." << std::endl;
+				(void)co_await c.disk.run(c.pool, [&]() { RequestOps::abandonBackup(c.dir, c.filename, prior, false, c.err); return true; });
+				co_return ServerResponse::Response::ERROR_GENERIC;
+			}
+			(void)co_await c.disk.run(c.pool, [&]() { RequestOps::backedUp(c.request, c.dir, c.filename, prior, c.err); return true; });
+			co_return ServerResponse::Response::SUCCESS_BACKUP_DELETE;
+		}
+		FileManager::StorageFile fs;
+		if (!co_await c.disk.run(c.pool, [&]() { return FileManager::fileOpenAt(c.dir, c.filename, fs, true); }))
+		{
+			c.err << "user ID #" << +userID << ": File " << c.filename << " failed to open." << std::endl;
+			(void)co_await c.disk.run(c.pool, [&]() { RequestOps::abandonBackup(c.dir, c.filename, prior, true, c.err); return true; });
+			co_return ServerResponse::Response::ERROR_GENERIC;
+		}
+		uint32_t bytes = PACKET_SIZE - c.request.sizeWithoutPayload();
+		if (size < bytes)
+			bytes = size;
+		bool ok = co_await c.disk.run(c.pool, [&]() { return FileManager::fileWrite(fs, c.request.payload.m_payload, bytes); });
+
+		std::vector<uint8_t> batches[2] = { std::vector<uint8_t>(ASYNC_BATCH_FRAMES * PACKET_SIZE), std::vector<uint8_t>(ASYNC_BATCH_FRAMES * PACKET_SIZE) };
+		int current = 0;
+		Connection::RateWatchdog watchdog;
+		Scheduler::Transfer transfer(userID, Scheduler::classOf(c.request.header.m_op));
+		Tracing::StageTimer receiveStage(c.trace, "receive");
+		while (ok && bytes < size)
+		{
+			uint32_t frames = (size - bytes + PACKET_SIZE - 1) / PACKET_SIZE;
+			if (frames > ASYNC_BATCH_FRAMES)
+				frames = ASYNC_BATCH_FRAMES;
+			co_await pace(transfer, frames * PACKET_SIZE);   // rate limits: the client waits in its socket buffer.
+			const auto start = std::chrono::steady_clock::now();
+			receiveStage.begin();
+			const bool received = co_await readFrames(c.sock, c.deadline, batches[current].data(), frames * PACKET_SIZE);
+			receiveStage.end();
+			if (!received)
+			{
+				c.err << "user ID #" << +userID << ": receive file data from socket failed." << std::endl;
+				ok = false;
+				break;
+			}
+			BackupPipeline::recordNetwork(BackupPipeline::elapsedNanos(start));
+			if (!watchdog.progress(frames * PACKET_SIZE, std::chrono::steady_clock::now() - start))
+			{
+				c.err << "user ID #" << +userID << ": client below minimum transfer rate, backup of " << c.filename << " aborted." << std::endl;
+				ok = false;
+				break;
+			}
+			if (c.disk.pending() && !co_await c.disk.wait())
+			{
+				ok = false;
+				break;
+			}
+			uint32_t length = frames * PACKET_SIZE;
+			if (length > size - bytes)
+				length = size - bytes;
+			const uint8_t* data = batches[current].data();
+			// the scheduler slot is held for the write only: pool threads never wait on each other.
+			c.disk.start(c.pool, [&fs, &transfer, data, length]()
+			{
+				const Scheduler::Transfer::Io io(transfer, length);
+				return FileManager::fileWrite(fs, data, length);
+			});
+			current ^= 1;
+			bytes += length;
+		}
+		if (c.disk.pending() && !co_await c.disk.wait())   // always drained: the write references fs and the batch.
+			ok = false;
+		const bool closed = co_await c.disk.run(c.pool, [&]() { return FileManager::fileClose(fs); });
+		if (!ok || !closed)
+		{
+			c.err << "user ID #" << +userID << ": Write to file " << c.filename << " failed." << std::endl;
+			(void)co_await c.disk.run(c.pool, [&]() { RequestOps::abandonBackup(c.dir, c.filename, prior, true, c.err); return true; });
+			co_return ServerResponse::Response::ERROR_GENERIC;
+		}
+		uint16_t status = ServerResponse::Response::ERROR_GENERIC;
+		(void)co_await c.disk.run(c.pool, [&]() { status = RequestOps::commitBackup(c.request, c.dir, c.filename, prior, c.err); return true; });
+		co_return status;
+	}
+
+	/**
+	   @brief send the file, reading the next batch from disk while the current one is sent.
+	 */
+	inline awaitable<uint16_t> restore(Context& c)
+	{
+		const uint32_t userID = c.request.header.m_userID;
+		FileManager::StorageFile fs;
+		uint32_t fileSize = 0;
+		if (!co_await c.disk.run(c.pool, [&]() { return FileManager::fileOpenAt(c.dir, c.path, fs) && ((fileSize = FileManager::fileSize(fs)) > 0); }))
+		{
+			c.err << "user ID #" << +userID << ": File " << c.filename << " failed to open or is empty." << std::endl;
+			(void)co_await c.disk.run(c.pool, [&]() { return FileManager::fileClose(fs); });
+			co_return ServerResponse::Response::ERROR_GENERIC;
+		}
+		uint32_t bytes = PACKET_SIZE - frameHeaderSize(c.filename);
+		if (fileSize < bytes)
+			bytes = fileSize;
+		std::vector<uint8_t> batches[2] = { std::vector<uint8_t>(ASYNC_BATCH_FRAMES * PACKET_SIZE), std::vector<uint8_t>(ASYNC_BATCH_FRAMES * PACKET_SIZE) };
+		bool ok = co_await c.disk.run(c.pool, [&]() { return FileManager::fileRead(fs, batches[0].data(), bytes); });
+		if (!ok)
+		{
+			c.err << "user ID #" << +userID << ": File " << c.filename << " reading failed." << std::endl;
+			(void)co_await c.disk.run(c.pool, [&]() { return FileManager::fileClose(fs); });
+			co_return ServerResponse::Response::ERROR_GENERIC;
+		}
+
+		Connection::Cork cork(c.sock);   // header and body frames leave in full segments.
+		ok = co_await sendHeader(c, ServerResponse::Response::SUCCESS_RESTORE, c.filename, fileSize, batches[0].data());
+		Scheduler::Transfer transfer(userID, Scheduler::classOf(c.request.header.m_op));
+		auto readBatch = [&](const int index, const uint32_t frames)
+		{
+			uint8_t* data = batches[index].data();
+			c.disk.start(c.pool, [&fs, &transfer, data, frames]()
+			{
+				const Scheduler::Transfer::Io io(transfer, frames * PACKET_SIZE);
+				return FileManager::fileRead(fs, data, frames * PACKET_SIZE);   // zero-filled past the end.
+			});
+		};
+		auto framesFrom = [fileSize](const uint32_t offset)
+		{
+			const uint32_t frames = (fileSize - offset + PACKET_SIZE - 1) / PACKET_SIZE;
+			return (frames > ASYNC_BATCH_FRAMES) ? ASYNC_BATCH_FRAMES : frames;
+		};
+
+		int current = 0;
+		if (ok && bytes < fileSize)
+			readBatch(current, framesFrom(bytes));
+		Connection::RateWatchdog watchdog;
+		Tracing::StageTimer sendStage(c.trace, "send");
+		while (ok && bytes < fileSize)
+		{
+			const uint32_t frames = framesFrom(bytes);
+			if (!co_await c.disk.wait())
+			{
+				ok = false;
+				break;
+			}
+			const uint32_t next = bytes + frames * PACKET_SIZE;
+			if (next < fileSize)
+				readBatch(current ^ 1, framesFrom(next));
+			co_await pace(transfer, frames * PACKET_SIZE);
+			const auto start = std::chrono::steady_clock::now();
+			sendStage.begin();
+			ok = co_await writeFrames(c.sock, c.deadline, batches[current].data(), frames * PACKET_SIZE);
+			sendStage.end();
+			if (ok && !watchdog.progress(frames * PACKET_SIZE, std::chrono::steady_clock::now() - start))
+			{
+				c.err << "user ID #" << +userID << ": client below minimum transfer rate, restore of " << c.filename << " aborted." << std::endl;
+				ok = false;
+			}
+			current ^= 1;
+			bytes = next;
+		}
+		if (c.disk.pending())
+			(void)co_await c.disk.wait();   // always drained: the read references fs and the batch.
+		cork.release();
+		(void)co_await c.disk.run(c.pool, [&]() { return FileManager::fileClose(fs); });
+		if (!ok)
+		{
+			c.err << "Payload data failure for user ID #" << +userID << std::endl;
+			co_return ServerResponse::Response::ERROR_GENERIC;
+		}
+		Metrics::instance().addBytesOut(c.request.header.m_op, fileSize);
+		co_return ServerResponse::Response::SUCCESS_RESTORE;
+	}
+
+	/**
+	   @brief send lines, '\n' terminated, as a SUCCESS_DIR payload under `name`.
+	 */
+	inline awaitable<uint16_t> sendLines(Context& c, const std::string& name, const std::vector<std::string>& lines)
+	{
+		std::string payload;
+		for (const auto& line : lines)
+		{
+			payload += line;
+			payload += '\n';
+		}
+		uint32_t first = PACKET_SIZE - frameHeaderSize(name);
+		if (payload.size() < first)
+			first = static_cast<uint32_t>(payload.size());
+		const auto* data = reinterpret_cast<const uint8_t*>(payload.data());
+		const Tracing::Span sendSpan(c.trace, "send");
+		Connection::Cork cork(c.sock);
+		bool ok = co_await sendHeader(c, ServerResponse::Response::SUCCESS_DIR, name, static_cast<uint32_t>(payload.size()), data);
+		if (ok && payload.size() > first)
+		{
+			std::vector<uint8_t> rest(((payload.size() - first + PACKET_SIZE - 1) / PACKET_SIZE) * PACKET_SIZE, 0);
+			memcpy(rest.data(), data + first, payload.size() - first);
+			ok = co_await writeFrames(c.sock, c.deadline, rest.data(), rest.size());
+		}
+		if (!ok)
+		{
+			c.err << "Payload data failure for user ID #" << +c.request.header.m_userID << std::endl;
+			co_return ServerResponse::Response::ERROR_GENERIC;
+		}
+		Metrics::instance().addBytesOut(c.request.header.m_op, payload.size());
+		co_return ServerResponse::Response::SUCCESS_DIR;
+	}
+
+	/**
+	   @brief send the user's file names under a random 32 character name.
+	 */
+	inline awaitable<uint16_t> list(Context& c)
+	{
+		std::vector<std::string> files;
+		uint16_t status = ServerResponse::Response::ERROR_GENERIC;
+		(void)co_await c.disk.run(c.pool, [&]() { status = RequestOps::listFiles(c.request, c.dir.folder, files, c.err); return true; });
+		if (status != ServerResponse::Response::SUCCESS_DIR)
+			co_return status;
+		co_return co_await sendLines(c, ServerRequestFuncs::randString(32), files);
+	}
+
+	/**
+	   @brief send a file's versions, "<id> <size>" per line, under the file's name.
+	 */
+	inline awaitable<uint16_t> versions(Context& c)
+	{
+		std::vector<std::string> lines;
+		uint16_t status = ServerResponse::Response::ERROR_GENERIC;
+		(void)co_await c.disk.run(c.pool, [&]() { status = RequestOps::versions(c.request, c.dir, c.filename, lines, c.err); return true; });
+		if (status != ServerResponse::Response::SUCCESS_DIR)
+			co_return status;
+		co_return co_await sendLines(c, c.filename, lines);
+	}
+
+
+	/**
+	   @brief remove or stat every file matching the request's prefix or glob, one result line per file, under the pattern.
+	 */
+	inline awaitable<uint16_t> bulk(Context& c)
+	{
+		std::vector<std::string> lines;
+		uint16_t status = ServerResponse::Response::ERROR_GENERIC;
+		(void)co_await c.disk.run(c.pool, [&]() { status = RequestOps::matching(c.request, c.dir, c.filename, lines, c.err); return true; });
+		if (status != ServerResponse::Response::SUCCESS_DIR)
+			co_return status;
+		co_return co_await sendLines(c, c.filename, lines);
+	}
+
+
+	/**
+	   @brief send the user's usage and quotas, one QuotaManager::Ledger::line(), from the counters.
+	 */
+	inline awaitable<uint16_t> usage(Context& c)
+	{
+		std::vector<std::string> lines;
+		(void)co_await c.disk.run(c.pool, [&]() { (void)RequestOps::usage(c.dir, lines); return true; });
+		co_return co_await sendLines(c, std::string(), lines);
+	}
+
+
+	/**
+	   @brief answer whether the claimed content is stored under the filename, linking identical content if the user has it (ContentIndex).
+	 */
+	inline awaitable<uint16_t> precheck(Context& c)
+	{
+		uint16_t status = ServerResponse::Response::ERROR_GENERIC;
+		(void)co_await c.disk.run(c.pool, [&]() { status = RequestOps::precheck(c.request, c.dir, c.filename, c.err); return true; });   // may hash or copy files.
+		co_return status;
+	}
+
+
+	/**
+	   @brief validate the request against the user's directory (on the I/O pool), then run its handler.
+	   @return response status.
+	 */
+	inline awaitable<uint16_t> dispatch(boost::asio::ip::tcp::socket& sock, Deadline& deadline, const Tracing::Trace& trace, const Request& request, bool& responded, std::string& parsedFileName, std::stringstream& err)
+	{
+		const uint32_t userID = request.header.m_userID;
+		const uint8_t op = request.header.m_op;
+		if (userID == 0)
+		{
+			err << "Invalid User ID #" << +userID << std::endl;
+			co_return ServerResponse::Response::ERROR_GENERIC;
+		}
+		const bool versioned = (op == Request::EOp::CLI_FILE_VERSIONS || op == Request::EOp::CLI_FILE_RESTORE_VERSION);
+		const bool patterned = (op == Request::EOp::CLI_FILE_REMOVE_MATCHING || op == Request::EOp::CLI_FILE_STAT_MATCHING);   // the name is a pattern.
+		const bool named = versioned || patterned || (op == Request::EOp::CLI_FILE_BACKUP || op == Request::EOp::CLI_FILE_RESTORE || op == Request::EOp::CLI_FILE_REMOVE || op == Request::EOp::CLI_FILE_PRECHECK);
+		if (named && (!FileManager::parseFilename(request.nameLen, request.filename, parsedFileName) || VersionStore::reserved(parsedFileName)
+			|| (patterned && !FileMatcher::validPattern(parsedFileName, request.nameLen))))
+		{
+			err << "Request Error for user ID #" << +userID << ": Invalid filename!" << std::endl;
+			co_return ServerResponse::Response::ERROR_GENERIC;
+		}
+
+		Tracing::Span leaseSpan(trace, "lock_wait");
+		const StorageRoots::UserLease lease(userID, co_await leaseUser(userID), std::adopt_lock);   // pins the user's storage root until the request is done.
+		leaseSpan.end();
+		Offload disk(co_await boost::asio::this_coro::executor, trace);
+		DirectoryCache::Handle dir;
+		std::string path(parsedFileName);
+		uint16_t status = 0;   // 0: valid.
+		(void)co_await disk.run(lease.pool(), [&]()
+		{
+			const Tracing::Span validationSpan("validation");
+			dir = DirectoryCache::get(userID, lease.folder(), op == Request::EOp::CLI_FILE_BACKUP || op == Request::EOp::CLI_FILE_PRECHECK);
+			if (versioned)
+			{
+				// the live file may be gone already: only the versions count. the listing handler reports a file without any.
+				if (op == Request::EOp::CLI_FILE_RESTORE_VERSION)
+				{
+					const uint16_t found = RequestOps::findVersion(request, *dir, parsedFileName, path, err);
+					if (found != ServerResponse::Response::SUCCESS_RESTORE)
+						status = found;
+				}
+			}
+			else if ((op == Request::EOp::CLI_FILE_RESTORE || op == Request::EOp::CLI_FILE_REMOVE || op == Request::EOp::CLI_FILE_LIST) && !FileManager::userHasFilesAt(*dir))
+				status = ServerResponse::Response::ERROR_NO_FILES;
+			else if ((op == Request::EOp::CLI_FILE_RESTORE || op == Request::EOp::CLI_FILE_REMOVE) && !FileManager::fileExistsAt(*dir, parsedFileName))
+				status = ServerResponse::Response::ERROR_NOT_EXIST;
+			return true;
+		});
+		if (status != 0)
+		{
+			err << "Request Error for user ID #" << +userID << ": validation failed with status " << status << std::endl;
+			co_return status;
+		}
+
+		Context c{ sock, deadline, request, *dir, parsedFileName, path, lease.pool(), disk, trace, err };
+		switch (op)
+		{
+		case Request::EOp::CLI_FILE_BACKUP:
+			status = co_await backup(c);
+			break;
+		case Request::EOp::CLI_FILE_RESTORE:
+		case Request::EOp::CLI_FILE_RESTORE_VERSION:
+			status = co_await restore(c);
+			break;
+		case Request::EOp::CLI_FILE_VERSIONS:
+			status = co_await versions(c);
+			break;
+		case Request::EOp::CLI_FILE_REMOVE:
+			(void)co_await disk.run(c.pool, [&]() { status = RequestOps::remove(request, *dir, parsedFileName, err); return true; });
+			break;
+		case Request::EOp::CLI_FILE_LIST:
+			status = co_await list(c);
+			break;
+		case Request::EOp::CLI_FILE_REMOVE_MATCHING:
+		case Request::EOp::CLI_FILE_STAT_MATCHING:
+			status = co_await bulk(c);
+			break;
+		case Request::EOp::CLI_USAGE:
+			status = co_await usage(c);
+			break;
+		case Request::EOp::CLI_FILE_PRECHECK:
+			status = co_await precheck(c);
+			break;
+		default:
+			err << "Request Error for user ID #" << +userID << ": Invalid request code: " << +op << std::endl;
+			status = ServerResponse::Response::ERROR_GENERIC;
+			break;
+		}
+		responded = c.responded;
+		co_return status;
+	}
+
+	/**
+	   @brief serve one connection: one request, one response, then close.
+	   @param ticket the connection's admission, released when the coroutine ends.
+	 */
+	inline awaitable<void> connection(boost::asio::ip::tcp::socket sock, std::unique_ptr<Connection::Ticket> ticket)
+	{
+		const Metrics::ConnectionGauge gauge;
+		Tracing::Trace trace;   // the coroutine's request: spans name it explicitly.
+		Tracing::RequestScope traced(trace);
+		Deadline deadline(sock);
+		std::stringstream err;
+		uint8_t frame[PACKET_SIZE] = {};
+		Tracing::Span receiveSpan(trace, "receive");
+		if (!co_await readFrames(sock, deadline, frame, PACKET_SIZE))
+			co_return;
+		receiveSpan.end();
+		const auto start = std::chrono::steady_clock::now();
+		Tracing::Span parseSpan(trace, "parse");
+		const std::unique_ptr<Request, void (*)(Request*)> request(ServerRequestFuncs::deserializeRequest(frame, PACKET_SIZE), &ServerRequestFuncs::destroy);
+		parseSpan.end();
+		if (request == nullptr)
+			co_return;
+		const uint32_t userID = request->header.m_userID;
+		traced.setUser(userID);
+		if (userID != 0)
+		{
+			const Tracing::Span lockSpan(trace, "lock_wait");
+			co_await lockUser(userID);
+		}
+
+		bool responded = false;
+		std::string parsedFileName;
+		const uint16_t status = co_await dispatch(sock, deadline, trace, *request, responded, parsedFileName, err);
+		if (!responded)
+		{
+			const Tracing::Span sendSpan(trace, "send");
+			ServerResponse::Response response;
+			response.status = status;
+			if (!parsedFileName.empty())
+			{
+				response.nameLen = static_cast<uint16_t>(parsedFileName.size());
+				response.filename = reinterpret_cast<uint8_t*>(parsedFileName.data());
+			}
+			memset(frame, 0, PACKET_SIZE);
+			ServerResponseFuncs::serializeResponse(response, frame);
+			response.filename = nullptr;   // not owned.
+			if (!co_await writeFrames(sock, deadline, frame, PACKET_SIZE))
+				err << "Response sending on socket failed!" << std::endl;
+			else if (status == ServerResponse::Response::ERROR_QUOTA)
+				co_await drain(sock);   // the backup's payload was not read.
+		}
+		if (userID != 0)
+			UserLocks::instance().unlock(userID);
+		Metrics::instance().recordRequest(request->header.m_op, status, Metrics::elapsedMicros(start));
+		RequestOps::capture(*request, start, status);
+		boost::system::error_code ignored;
+		sock.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+		sock.close(ignored);
+		if (err.rdbuf()->in_avail() > 0)
+			std::cerr << err.str();
+	}
+
+	/**
+	   @brief accept forever, one coroutine per connection on its own strand.
+	 */
+	inline awaitable<void> listener(boost::asio::ip::tcp::acceptor& acceptor)
+	{
+		while (true)
+		{
+			boost::system::error_code error;
+			boost::asio::ip::tcp::socket sock(boost::asio::make_strand(acceptor.get_executor()));
+			co_await acceptor.async_accept(sock, boost::asio::redirect_error(use_awaitable, error));
+			if (error)
+				continue;
+			auto ticket = std::make_unique<Connection::Ticket>();
+			if (!ticket->admitted())
+			{
+				Connection::reject(sock, SERVER_VERSION, ServerResponse::Response::ERROR_GENERIC, PACKET_SIZE);
+				continue;
+			}
+			Connection::applyOptions(sock);
+			const auto executor = sock.get_executor();
+			boost::asio::co_spawn(executor, connection(std::move(sock), std::move(ticket)), boost::asio::detached);
+		}
+	}
+
+}
+
+#endif
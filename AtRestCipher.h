@@ -0,0 +1,652 @@
+/**
+  @AtRestCipher authenticated encryption of stored files, in large chunks.
+  Each user has its own key, derived with HKDF-SHA256 from the server master key. A sealed
+  file is a header followed by independently sealed chunks of AT_REST_CHUNK plaintext
+  bytes, each followed by its 16 byte tag:
+      header  "BSVRSEAL", uint8 format, uint8 cipher, uint16 0, uint32 chunk size, uint64 file ID
+      chunk i nonce = file ID | uint32 i, AAD = header | uint8 final
+  Chunks are sealed whole as the stream fills them (one cipher call per chunk, not per
+  frame), and any chunk can be opened on its own, so reads can start anywhere in a file.
+  The last chunk is sealed as final: a file cut at a chunk boundary fails authentication.
+  AES-256-GCM is used where the CPU has AES instructions, ChaCha20-Poly1305 otherwise; the
+  cipher is recorded per file. Files without a valid header are read as plaintext, so stores
+  written before encryption was turned on stay readable. A file whose header is valid but
+  whose first chunk, whose AAD covers the header, does not authenticate (corrupt, cut, or
+  sealed under another master key) is not read at all: it is never served as plaintext.
+  Strict mode (BACKUPSVR_AT_REST_STRICT=1) refuses to read any file that is not sealed.
+  A key file that is set but missing, unreadable or malformed is an error: the server does
+  not start (Server::serve checks Keys::configured()) rather than store plaintext.
+  Configuration: BACKUPSVR_AT_REST_KEY (file holding the 32 byte master key, raw or hex;
+                 encryption is off without it), BACKUPSVR_AT_REST_CIPHER (aes-256-gcm | chacha20-poly1305),
+                 BACKUPSVR_AT_REST_STRICT.
+ */
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+
+#if defined(_WIN32)
+#define HAVE_AT_REST_CIPHER 0
+#else
+#define HAVE_AT_REST_CIPHER 1
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define AT_REST_CHUNK  (64 * 1024)         // plaintext bytes per sealed chunk.
+#define AT_REST_TAG  16
+#define AT_REST_KEY  32
+#define AT_REST_HEADER  24
+#define AT_REST_FORMAT  1
+#define AT_REST_KEY_ENV  "BACKUPSVR_AT_REST_KEY"
+#define AT_REST_CIPHER_ENV  "BACKUPSVR_AT_REST_CIPHER"
+#define AT_REST_STRICT_ENV  "BACKUPSVR_AT_REST_STRICT"
+
+namespace AtRestCipher {
+
+	enum ECipher : uint8_t
+	{
+		AES_256_GCM = 1,
+		CHACHA20_POLY1305 = 2
+	};
+
+	inline const char* cipherName(const ECipher cipher)
+	{
+		return (cipher == AES_256_GCM) ? "aes-256-gcm" : "chacha20-poly1305";
+	}
+
+	inline const EVP_CIPHER* evpCipher(const uint8_t cipher)
+	{
+		switch (cipher)
+		{
+		case AES_256_GCM: return EVP_aes_256_gcm();
+		case CHACHA20_POLY1305: return EVP_chacha20_poly1305();
+		default: return nullptr;
+		}
+	}
+
+	/**
+	   @brief AES-GCM with AES instructions, ChaCha20-Poly1305 (faster in software) without.
+	 */
+	inline ECipher preferredCipher()
+	{
+		const char* configured = getenv(AT_REST_CIPHER_ENV);
+		if (configured != nullptr && strcmp(configured, "aes-256-gcm") == 0)
+			return AES_256_GCM;
+		if (configured != nullptr && strcmp(configured, "chacha20-poly1305") == 0)
+			return CHACHA20_POLY1305;
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+		return __builtin_cpu_supports("aes") ? AES_256_GCM : CHACHA20_POLY1305;
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+		return AES_256_GCM;
+#else
+		return CHACHA20_POLY1305;
+#endif
+	}
+
+	struct Stats
+	{
+		std::atomic<uint64_t> sealedChunks{ 0 };
+		std::atomic<uint64_t> openedChunks{ 0 };
+		std::atomic<uint64_t> authFailures{ 0 };
+		std::atomic<uint64_t> plainReads{ 0 };      // unsealed files read as plaintext.
+		std::atomic<uint64_t> plainRejected{ 0 };   // unsealed files refused in strict mode.
+	};
+
+	inline Stats& stats()
+	{
+		static Stats s;
+		return s;
+	}
+
+	using Key = std::vector<uint8_t>;
+
+
+	/**
+	   Master key and the per user keys derived from it.
+	 */
+	class Keys
+	{
+	public:
+		static Keys& instance()
+		{
+			static Keys keys;
+			return keys;
+		}
+
+		bool enabled()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return !_master.empty();
+		}
+
+		/**
+		   @brief only sealed files may be read (BACKUPSVR_AT_REST_STRICT=1).
+		 */
+		bool strict() const { return _strict; }
+
+		/**
+		   @brief was the configured key file usable? encryption silently off would store plaintext.
+		   @return false, with the reason in err, if BACKUPSVR_AT_REST_KEY is set but unusable.
+		 */
+		bool configured(std::stringstream& err) const
+		{
+			if (_error.empty())
+				return true;
+			err << "AtRestCipher: " << _error << std::endl;
+			return false;
+		}
+
+		/**
+		   @brief replace the master key (e.g. tools and benchmarks). forgets derived keys.
+		   @return false unless the key is AT_REST_KEY bytes.
+		 */
+		bool setMasterKey(const Key& master)
+		{
+			if (master.size() != AT_REST_KEY)
+				return false;
+			std::lock_guard<std::mutex> lock(_mutex);
+			_master = master;
+			_users.clear();
+			return true;
+		}
+
+		/**
+		   @brief the user's key: HKDF-SHA256(master, salt "backupsvr at rest", info "user <id>").
+		   @return false if encryption is off or derivation failed.
+		 */
+		bool userKey(const uint32_t userID, Key& key)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (_master.empty())
+				return false;
+			const auto it = _users.find(userID);
+			if (it != _users.end())
+			{
+				key = it->second;
+				return true;
+			}
+			if (!derive(userID, key))
+				return false;
+			_users[userID] = key;
+			return true;
+		}
+
+		Keys(const Keys&) = delete;
+		Keys& operator=(const Keys&) = delete;
+
+	private:
+		Keys() : _strict(false)
+		{
+			const char* strict = getenv(AT_REST_STRICT_ENV);
+			_strict = (strict != nullptr && atoi(strict) != 0);
+			const char* path = getenv(AT_REST_KEY_ENV);
+			if (path == nullptr || *path == '\0')
+			{
+				if (_strict)
+					_error = std::string(AT_REST_STRICT_ENV) + " is set without " + AT_REST_KEY_ENV + ".";
+				return;
+			}
+			std::ifstream in(path, std::ios::binary);
+			if (!in)
+			{
+				_error = std::string("key file ") + path + " could not be opened: " + strerror(errno) + ".";
+				return;
+			}
+			const std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+			if (in.bad())
+			{
+				_error = std::string("key file ") + path + " could not be read.";
+				return;
+			}
+			Key master;
+			if (text.size() == AT_REST_KEY)
+				master.assign(text.begin(), text.end());
+			else if (text.size() >= AT_REST_KEY * 2 && text.find_first_not_of("0123456789abcdefABCDEF") >= AT_REST_KEY * 2)
+			{
+				for (size_t i = 0; i < AT_REST_KEY; ++i)
+					master.push_back(static_cast<uint8_t>(strtoul(text.substr(i * 2, 2).c_str(), nullptr, 16)));
+			}
+			if (master.size() == AT_REST_KEY)
+				_master = master;
+			else
+				_error = std::string("key file ") + path + " holds neither " + std::to_string(AT_REST_KEY) + " raw bytes nor " + std::to_string(AT_REST_KEY * 2) + " hex digits.";
+		}
+
+		bool derive(const uint32_t userID, Key& key) const
+		{
+			static const char salt[] = "backupsvr at rest";
+			const std::string info = "user " + std::to_string(userID);
+			key.assign(AT_REST_KEY, 0);
+			size_t length = key.size();
+			EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+			const bool ok = ctx != nullptr
+				&& EVP_PKEY_derive_init(ctx) > 0
+				&& EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) > 0
+				&& EVP_PKEY_CTX_set1_hkdf_salt(ctx, reinterpret_cast<const unsigned char*>(salt), static_cast<int>(sizeof(salt) - 1)) > 0
+				&& EVP_PKEY_CTX_set1_hkdf_key(ctx, _master.data(), static_cast<int>(_master.size())) > 0
+				&& EVP_PKEY_CTX_add1_hkdf_info(ctx, reinterpret_cast<const unsigned char*>(info.data()), static_cast<int>(info.size())) > 0
+				&& EVP_PKEY_derive(ctx, key.data(), &length) > 0
+				&& length == key.size();
+			EVP_PKEY_CTX_free(ctx);
+			return ok;
+		}
+
+		std::mutex _mutex;
+		Key _master;
+		std::unordered_map<uint32_t, Key> _users;
+		bool _strict;
+		std::string _error;   // why the configured key is unusable.
+	};
+
+	inline bool enabled()
+	{
+		return Keys::instance().enabled();
+	}
+
+
+	/**
+	   One chunk cipher: a key and a reusable EVP context.
+	 */
+	class Sealer
+	{
+	public:
+		Sealer() : _ctx(EVP_CIPHER_CTX_new()), _cipher(0) {}
+		~Sealer() { EVP_CIPHER_CTX_free(_ctx); }
+		Sealer(const Sealer&) = delete;
+		Sealer& operator=(const Sealer&) = delete;
+
+		void setKey(const Key& key, const uint8_t cipher)
+		{
+			_key = key;
+			_cipher = cipher;
+		}
+
+		/**
+		   @brief encrypt `length` bytes in place and write the tag after them.
+		 */
+		bool seal(uint8_t* data, const uint32_t length, const uint8_t (&nonce)[12], const uint8_t* aad, const uint32_t aadLength)
+		{
+			int out = 0;
+			const bool ok = _ctx != nullptr
+				&& EVP_EncryptInit_ex(_ctx, evpCipher(_cipher), nullptr, _key.data(), nonce) == 1
+				&& EVP_EncryptUpdate(_ctx, nullptr, &out, aad, static_cast<int>(aadLength)) == 1
+				&& (length == 0 || EVP_EncryptUpdate(_ctx, data, &out, data, static_cast<int>(length)) == 1)
+				&& EVP_EncryptFinal_ex(_ctx, data + length, &out) == 1
+				&& EVP_CIPHER_CTX_ctrl(_ctx, EVP_CTRL_AEAD_GET_TAG, AT_REST_TAG, data + length) == 1;
+			if (ok)
+				stats().sealedChunks.fetch_add(1, std::memory_order_relaxed);
+			return ok;
+		}
+
+		/**
+		   @brief check the tag following `length` bytes and decrypt them in place.
+		 */
+		bool open(uint8_t* data, const uint32_t length, const uint8_t (&nonce)[12], const uint8_t* aad, const uint32_t aadLength)
+		{
+			int out = 0;
+			const bool ok = _ctx != nullptr
+				&& EVP_DecryptInit_ex(_ctx, evpCipher(_cipher), nullptr, _key.data(), nonce) == 1
+				&& EVP_DecryptUpdate(_ctx, nullptr, &out, aad, static_cast<int>(aadLength)) == 1
+				&& (length == 0 || EVP_DecryptUpdate(_ctx, data, &out, data, static_cast<int>(length)) == 1)
+				&& EVP_CIPHER_CTX_ctrl(_ctx, EVP_CTRL_AEAD_SET_TAG, AT_REST_TAG, data + length) == 1
+				&& EVP_DecryptFinal_ex(_ctx, data + length, &out) == 1;
+			if (ok)
+				stats().openedChunks.fetch_add(1, std::memory_order_relaxed);
+			else
+				stats().authFailures.fetch_add(1, std::memory_order_relaxed);
+			return ok;
+		}
+
+	private:
+		EVP_CIPHER_CTX* _ctx;
+		uint8_t _cipher;
+		Key _key;
+	};
+
+
+#if HAVE_AT_REST_CIPHER
+	/**
+	   @brief does the header, of a file of `stored` bytes, look like one we wrote? only File::open
+	          authenticates it; this check alone is enough for sizes, and decides plaintext or sealed.
+	 */
+	inline bool sealedHeader(const uint8_t* header, const uint64_t stored)
+	{
+		uint32_t chunkSize = 0;
+		memcpy(&chunkSize, header + 12, sizeof(chunkSize));
+		if (stored < AT_REST_HEADER + AT_REST_TAG || memcmp(header, "BSVRSEAL", 8) != 0 || header[8] != AT_REST_FORMAT || evpCipher(header[9]) == nullptr
+			|| header[10] != 0 || header[11] != 0 || chunkSize == 0 || chunkSize > 64 * AT_REST_CHUNK)
+			return false;
+		const uint64_t sealed = stored - AT_REST_HEADER;
+		const uint64_t chunks = (sealed + chunkSize + AT_REST_TAG - 1) / (chunkSize + AT_REST_TAG);
+		return sealed >= chunks * AT_REST_TAG;
+	}
+
+
+	/**
+	   A sealed file on a descriptor: written sequentially, read sequentially or at any offset.
+	   Takes ownership of the descriptor.
+	 */
+	class File
+	{
+	public:
+		File() : _fd(-1), _write(false), _plain(false), _chunkSize(AT_REST_CHUNK), _offset(0), _size(0), _chunk(UINT64_MAX), _chunkLength(0), _readPos(0) {}
+		~File() { (void)close(); }
+		File(const File&) = delete;
+		File& operator=(const File&) = delete;
+
+		bool isOpen() const { return _fd >= 0; }
+		bool plain() const { return _plain; }
+		int fd() const { return _fd; }
+
+		/**
+		   @brief start a new sealed file on an empty, writable descriptor. the descriptor is
+		          owned (and closed) by the File even if this fails.
+		   @param cipher 0: preferredCipher().
+		 */
+		bool create(const int fd, const uint32_t userID, uint8_t cipher = 0)
+		{
+			if (fd < 0)
+				return false;
+			_fd = fd;
+			Key key;
+			if (cipher == 0)
+				cipher = preferredCipher();
+			if (!Keys::instance().userKey(userID, key) || evpCipher(cipher) == nullptr)
+				return false;
+			_sealer.setKey(key, cipher);
+			memcpy(_header, "BSVRSEAL", 8);
+			_header[8] = AT_REST_FORMAT;
+			_header[9] = cipher;
+			_header[10] = 0;
+			_header[11] = 0;
+			const uint32_t chunkSize = AT_REST_CHUNK;
+			memcpy(_header + 12, &chunkSize, sizeof(chunkSize));
+			if (RAND_bytes(_header + 16, 8) != 1 || !writeAll(_header, AT_REST_HEADER, 0))
+				return false;
+			_chunkSize = chunkSize;
+			_buffer.resize(_chunkSize + AT_REST_TAG);
+			_chunkLength = 0;
+			_chunk = 0;
+			_offset = AT_REST_HEADER;
+			_write = true;
+			return true;
+		}
+
+		/**
+		   @brief open an existing file for reading. a file without a valid header is read as plaintext,
+		          unless strict; a file with one fails if its first chunk does not authenticate.
+		          the descriptor is owned by the File even if this fails.
+		 */
+		bool open(const int fd, const uint32_t userID)
+		{
+			if (fd < 0)
+				return false;
+			_fd = fd;
+			_write = false;
+			struct stat st;
+			if (::fstat(fd, &st) != 0)
+				return false;
+			const auto rawSize = static_cast<uint64_t>(st.st_size);
+			Key key;
+			const bool sealed = rawSize >= AT_REST_HEADER && readAll(_header, AT_REST_HEADER, 0) && sealedHeader(_header, rawSize);
+			if (sealed)
+			{
+				if (!Keys::instance().userKey(userID, key))
+					return false;
+				memcpy(&_chunkSize, _header + 12, sizeof(_chunkSize));
+				_sealer.setKey(key, _header[9]);
+				_buffer.resize(_chunkSize + AT_REST_TAG);
+				const uint64_t stored = rawSize - AT_REST_HEADER;
+				_chunks = (stored + _chunkSize + AT_REST_TAG - 1) / (_chunkSize + AT_REST_TAG);
+				_size = stored - _chunks * AT_REST_TAG;
+				return loadChunk(0);   // the header is in every chunk's AAD: a damaged file, or another key, fails here.
+			}
+			if (Keys::instance().strict())
+			{
+				stats().plainRejected.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			stats().plainReads.fetch_add(1, std::memory_order_relaxed);
+			_plain = true;
+			_size = rawSize;
+			_chunk = UINT64_MAX;
+			return true;
+		}
+
+		/**
+		   @return plaintext size.
+		 */
+		uint64_t size() const { return _write ? (_chunk * _chunkSize + _chunkLength) : _size; }
+
+		bool write(const uint8_t* data, uint32_t length)
+		{
+			if (!_write)
+				return false;
+			while (length > 0)
+			{
+				if (_chunkLength == _chunkSize && !flushChunk(false))
+					return false;   // a full chunk is sealed once more data shows it is not the last.
+				uint32_t part = _chunkSize - _chunkLength;
+				if (part > length)
+					part = length;
+				memcpy(_buffer.data() + _chunkLength, data, part);
+				_chunkLength += part;
+				data += part;
+				length -= part;
+			}
+			return true;
+		}
+
+		/**
+		   @brief read the next bytes. past the end the buffer is zero-filled, as FileManager::fileRead.
+		 */
+		bool read(uint8_t* data, const uint32_t length)
+		{
+			if (!readAt(_readPos, data, length))
+				return false;
+			_readPos += length;
+			return true;
+		}
+
+		/**
+		   @brief read at a plaintext offset. opens only the chunks covering the range.
+		 */
+		bool readAt(const uint64_t offset, uint8_t* data, uint32_t length)
+		{
+			if (_write || _fd < 0)
+				return false;
+			uint64_t position = offset;
+			while (length > 0)
+			{
+				if (position >= _size)
+				{
+					memset(data, 0, length);
+					return true;
+				}
+				uint32_t part = 0;
+				if (_plain)
+				{
+					part = static_cast<uint32_t>(std::min<uint64_t>(length, _size - position));
+					if (!readAll(data, part, position))
+						return false;
+				}
+				else
+				{
+					const uint64_t chunk = position / _chunkSize;
+					if (chunk != _chunk && !loadChunk(chunk))
+						return false;
+					const auto within = static_cast<uint32_t>(position - chunk * _chunkSize);
+					part = std::min<uint32_t>(length, _chunkLength - within);
+					memcpy(data, _buffer.data() + within, part);
+				}
+				data += part;
+				length -= part;
+				position += part;
+			}
+			return true;
+		}
+
+		/**
+		   @brief seal the last chunk (when writing) and close the descriptor.
+		 */
+		bool close()
+		{
+			if (_fd < 0)
+				return true;
+			const bool sealed = !_write || flushChunk(true);
+			const bool closed = (::close(_fd) == 0);
+			_fd = -1;
+			_write = false;
+			return sealed && closed;
+		}
+
+		bool sync()
+		{
+			return _fd >= 0 && ::fdatasync(_fd) == 0;
+		}
+
+	private:
+		void nonce(const uint64_t chunk, uint8_t (&out)[12]) const
+		{
+			const auto index = static_cast<uint32_t>(chunk);
+			memcpy(out, _header + 16, 8);
+			memcpy(out + 8, &index, sizeof(index));
+		}
+
+		void aad(const bool final, uint8_t (&out)[AT_REST_HEADER + 1]) const
+		{
+			memcpy(out, _header, AT_REST_HEADER);
+			out[AT_REST_HEADER] = final ? 1 : 0;
+		}
+
+		bool flushChunk(const bool final)
+		{
+			uint8_t iv[12];
+			uint8_t extra[AT_REST_HEADER + 1];
+			nonce(_chunk, iv);
+			aad(final, extra);
+			if (!_sealer.seal(_buffer.data(), _chunkLength, iv, extra, sizeof(extra)) || !writeAll(_buffer.data(), _chunkLength + AT_REST_TAG, _offset))
+				return false;
+			_offset += _chunkLength + AT_REST_TAG;
+			if (!final)
+			{
+				++_chunk;
+				_chunkLength = 0;
+			}
+			return true;
+		}
+
+		bool loadChunk(const uint64_t chunk)
+		{
+			const uint64_t start = AT_REST_HEADER + chunk * (_chunkSize + AT_REST_TAG);
+			const bool final = (chunk + 1 == _chunks);
+			const uint32_t length = final ? static_cast<uint32_t>(_size - chunk * _chunkSize) : _chunkSize;
+			uint8_t iv[12];
+			uint8_t extra[AT_REST_HEADER + 1];
+			nonce(chunk, iv);
+			aad(final, extra);
+			_chunk = UINT64_MAX;
+			if (!readAll(_buffer.data(), length + AT_REST_TAG, start) || !_sealer.open(_buffer.data(), length, iv, extra, sizeof(extra)))
+				return false;
+			_chunk = chunk;
+			_chunkLength = length;
+			return true;
+		}
+
+		bool writeAll(const uint8_t* data, const uint32_t length, const uint64_t offset)
+		{
+			uint32_t done = 0;
+			while (done < length)
+			{
+				const ssize_t res = ::pwrite(_fd, data + done, length - done, static_cast<off_t>(offset + done));
+				if (res < 0 && errno == EINTR)
+					continue;
+				if (res <= 0)
+					return false;
+				done += static_cast<uint32_t>(res);
+			}
+			return true;
+		}
+
+		bool readAll(uint8_t* data, const uint32_t length, const uint64_t offset)
+		{
+			uint32_t done = 0;
+			while (done < length)
+			{
+				const ssize_t res = ::pread(_fd, data + done, length - done, static_cast<off_t>(offset + done));
+				if (res < 0 && errno == EINTR)
+					continue;
+				if (res <= 0)
+					return false;
+				done += static_cast<uint32_t>(res);
+			}
+			return true;
+		}
+
+		int _fd;
+		bool _write;
+		bool _plain;
+		uint8_t _header[AT_REST_HEADER] = {};
+		uint32_t _chunkSize;
+		uint64_t _chunks = 0;     // reading: chunks in the file.
+		uint64_t _offset;         // writing: file offset of the next chunk.
+		uint64_t _size;           // reading: plaintext size.
+		uint64_t _chunk;          // chunk held in _buffer (writing: the one being filled).
+		uint32_t _chunkLength;
+		uint64_t _readPos;
+		std::vector<uint8_t> _buffer;
+		Sealer _sealer;
+	};
+
+	/**
+	   @brief plaintext size of a sealed file from its header and its stored size.
+	   @return false if the sizes do not add up.
+	 */
+	inline bool sealedSize(const uint8_t* header, const uint64_t stored, uint64_t& size)
+	{
+		uint32_t chunkSize = 0;
+		memcpy(&chunkSize, header + 12, sizeof(chunkSize));
+		const uint64_t sealed = stored - AT_REST_HEADER;
+		const uint64_t chunks = (chunkSize == 0) ? 0 : (sealed + chunkSize + AT_REST_TAG - 1) / (chunkSize + AT_REST_TAG);
+		const bool ok = (chunks != 0 && sealed >= chunks * AT_REST_TAG);
+		size = ok ? sealed - chunks * AT_REST_TAG : 0;
+		return ok;
+	}
+
+	/**
+	   @brief plaintext size of a stored file, sealed or not, without opening any chunk.
+	   @return false if the file cannot be read.
+	 */
+	inline bool plainSize(const std::string& path, uint64_t& size)
+	{
+		const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		uint8_t header[AT_REST_HEADER];
+		bool ok = (::fstat(fd, &st) == 0);
+		size = ok ? static_cast<uint64_t>(st.st_size) : 0;
+		if (ok && size >= AT_REST_HEADER && ::pread(fd, header, AT_REST_HEADER, 0) == AT_REST_HEADER && sealedHeader(header, size))
+			ok = sealedSize(header, size, size);
+		(void)::close(fd);
+		return ok;
+	}
+#endif
+
+}
@@ -0,0 +1,351 @@
+/**
+  @BackupPipeline write-behind pipeline for file backups.
+  The network stage receives packets straight into slots of a bounded ring,
+  while the disk stage drains full slots to storage. With an executor (the storage root's
+  I/O pool) every filled slot is one posted task, so a worker is never held while the
+  backup waits on its client and concurrent backups on a root take turns. Without one the
+  disk stage runs on its own thread. The network stage only blocks (backpressure) once
+  every slot of the ring is waiting for the disk.
+  Configuration: BACKUPSVR_PIPELINE_SLOTS (slots per backup ring, each PIPELINE_SLOT_SIZE bytes).
+ */
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ProtocolCodec.h"
+
+#define PIPELINE_RING_SLOTS  64           // default number of slots in a backup ring.
+#define PIPELINE_PACKETS_PER_SLOT  16     // packets gathered into one slot before it is handed to disk.
+#define PIPELINE_SLOT_SIZE  (PIPELINE_PACKETS_PER_SLOT * PACKET_SIZE)
+#define PIPELINE_SLOTS_ENV  "BACKUPSVR_PIPELINE_SLOTS"
+
+namespace BackupPipeline {
+
+	/**
+	   Global pipeline counters. Latencies are accumulated in nanoseconds.
+	 */
+	struct Stats
+	{
+		std::atomic<uint64_t> networkOps{ 0 };        // packets received by the network stage.
+		std::atomic<uint64_t> networkNanos{ 0 };      // time spent in socket receive.
+		std::atomic<uint64_t> diskOps{ 0 };           // slots written by the disk stage.
+		std::atomic<uint64_t> diskNanos{ 0 };         // time spent in storage writes.
+		std::atomic<uint64_t> diskBytes{ 0 };         // bytes written by the disk stage.
+		std::atomic<uint64_t> backpressureWaits{ 0 }; // times the network stage found the ring full.
+		std::atomic<uint64_t> backpressureNanos{ 0 }; // time the network stage waited for a free slot.
+		std::atomic<uint64_t> maxOccupancy{ 0 };      // highest number of filled slots observed.
+	};
+
+	inline Stats& stats()
+	{
+		static Stats s;
+		return s;
+	}
+
+	inline std::atomic<size_t>& ringSlotsSetting()
+	{
+		static std::atomic<size_t> slots{ []()
+		{
+			const char* env = getenv(PIPELINE_SLOTS_ENV);
+			return (env != nullptr && atoi(env) > 0) ? std::max<size_t>(2, static_cast<size_t>(atoi(env))) : static_cast<size_t>(PIPELINE_RING_SLOTS);
+		}() };
+		return slots;
+	}
+
+	/**
+	   @brief ring size used by pipelines created from now on.
+	 */
+	inline size_t ringSlots()
+	{
+		return ringSlotsSetting().load(std::memory_order_relaxed);
+	}
+
+	/**
+	   @brief change the ring size of future pipelines. existing pipelines are not affected.
+	   @param slots number of slots. at least 2 (one filling, one draining).
+	 */
+	inline void setRingSlots(const size_t slots)
+	{
+		ringSlotsSetting().store(slots < 2 ? 2 : slots, std::memory_order_relaxed);
+	}
+
+	inline uint64_t elapsedNanos(const std::chrono::steady_clock::time_point& start)
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+	}
+
+	/**
+	   @brief account time spent by the network stage receiving one packet.
+	 */
+	inline void recordNetwork(const uint64_t nanos)
+	{
+		stats().networkOps.fetch_add(1, std::memory_order_relaxed);
+		stats().networkNanos.fetch_add(nanos, std::memory_order_relaxed);
+	}
+
+
+	struct Slot
+	{
+		uint8_t data[PIPELINE_SLOT_SIZE];
+		uint32_t length;
+		Slot() : length(0) {}
+	};
+
+
+	/**
+	   A single backup's pipeline. One producer (the request thread) and one consumer (the disk stage).
+	   The writer is called only from the disk stage, in order, never from two tasks at once.
+	 */
+	class Pipeline
+	{
+	public:
+		using Writer = std::function<bool(const uint8_t*, uint32_t)>;
+		using Executor = std::function<void(std::function<void()>)>;
+
+		explicit Pipeline(Writer writer, Executor executor = Executor(), const size_t slots = ringSlots())
+			: _writer(std::move(writer)), _executor(std::move(executor)), _ring(slots < 2 ? 2 : slots), _head(0), _tail(0), _filled(0),
+			  _closed(false), _failed(false), _draining(false), _current(nullptr)
+		{
+			if (!_executor)
+			{
+				_draining = true;
+				_thread = std::thread([this] { while (drainOne(true)) {} idle(); });
+			}
+		}
+
+		~Pipeline()
+		{
+			cancel();
+		}
+
+		Pipeline(const Pipeline&) = delete;
+		Pipeline& operator=(const Pipeline&) = delete;
+
+		/**
+		   @brief reserve room for `length` bytes in the slot being filled. blocks while the ring is full.
+		   @param length bytes about to be produced. should not exceed PIPELINE_SLOT_SIZE.
+		   @return pointer to write into. nullptr if the disk stage failed or the pipeline was cancelled.
+		 */
+		uint8_t* reserve(const uint32_t length)
+		{
+			if (_current != nullptr && (_current->length + length) > PIPELINE_SLOT_SIZE)
+				publish();
+			if (_current == nullptr && !acquire())
+				return nullptr;
+			return _current->data + _current->length;
+		}
+
+		/**
+		   @brief mark `length` bytes of the last reservation as valid data.
+		 */
+		void produced(const uint32_t length)
+		{
+			if (_current != nullptr)
+				_current->length += length;
+		}
+
+		/**
+		   @brief copy bytes into the pipeline.
+		   @return false if the disk stage failed.
+		 */
+		bool push(const uint8_t* data, uint32_t length)
+		{
+			while (length > 0)
+			{
+				const uint32_t chunk = (length < PACKET_SIZE) ? length : PACKET_SIZE;
+				uint8_t* dst = reserve(chunk);
+				if (dst == nullptr)
+					return false;
+				memcpy(dst, data, chunk);
+				produced(chunk);
+				data += chunk;
+				length -= chunk;
+			}
+			return true;
+		}
+
+		/**
+		   @brief flush the partially filled slot and wait until the disk stage drained the ring.
+		   @return true if every byte was written successfully.
+		 */
+		bool finish()
+		{
+			if (_current != nullptr)
+				publish();
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_closed = true;
+			}
+			_notEmpty.notify_one();
+			wait();
+			return !_failed;
+		}
+
+		/**
+		   @brief stop the disk stage without writing pending slots.
+		 */
+		void cancel()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_closed = true;
+				_failed = true;
+			}
+			_notEmpty.notify_one();
+			_notFull.notify_one();
+			wait();
+		}
+
+		size_t occupancy()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _filled;
+		}
+
+		size_t capacity() const { return _ring.size(); }
+
+	private:
+		/**
+		   wait until no disk stage task is queued or running.
+		 */
+		void wait()
+		{
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_idle.wait(lock, [this] { return !_draining; });
+			}
+			if (_thread.joinable())
+				_thread.join();
+		}
+
+		void idle()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_draining = false;
+			_idle.notify_all();
+		}
+
+		bool acquire()
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			if (_filled == _ring.size())
+			{
+				stats().backpressureWaits.fetch_add(1, std::memory_order_relaxed);
+				const auto start = std::chrono::steady_clock::now();
+				_notFull.wait(lock, [this] { return _filled < _ring.size() || _failed; });
+				stats().backpressureNanos.fetch_add(elapsedNanos(start), std::memory_order_relaxed);
+			}
+			if (_failed)
+				return false;
+			_current = &_ring[_head];
+			_current->length = 0;
+			return true;
+		}
+
+		void publish()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_head = (_head + 1) % _ring.size();
+				++_filled;
+				uint64_t seen = stats().maxOccupancy.load(std::memory_order_relaxed);
+				while (_filled > seen && !stats().maxOccupancy.compare_exchange_weak(seen, _filled, std::memory_order_relaxed)) {}
+			}
+			_current = nullptr;
+			_notEmpty.notify_one();
+			schedule();
+		}
+
+		/**
+		   post a disk stage task unless one is already queued or running.
+		 */
+		void schedule()
+		{
+			if (!_executor)
+				return;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				if (_draining || _filled == 0 || _failed)
+					return;
+				_draining = true;
+			}
+			_executor([this] { step(); });
+		}
+
+		/**
+		   one disk stage task: write a single slot, then requeue behind the other work of the pool.
+		 */
+		void step()
+		{
+			const bool written = drainOne(false);
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				if (!written || _filled == 0 || _failed)
+				{
+					_draining = false;
+					_idle.notify_all();
+					return;
+				}
+			}
+			_executor([this] { step(); });
+		}
+
+		/**
+		   disk stage: write the oldest filled slot.
+		   @param block wait for a slot until the ring is closed (own thread mode).
+		   @return false once nothing is left to write or a write failed.
+		 */
+		bool drainOne(const bool block)
+		{
+			Slot* slot = nullptr;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				if (block)
+					_notEmpty.wait(lock, [this] { return _filled > 0 || _closed; });
+				if (_failed || _filled == 0)
+					return false;
+				slot = &_ring[_tail];
+			}
+			const auto start = std::chrono::steady_clock::now();
+			const bool written = (slot->length == 0) || _writer(slot->data, slot->length);
+			stats().diskOps.fetch_add(1, std::memory_order_relaxed);
+			stats().diskNanos.fetch_add(elapsedNanos(start), std::memory_order_relaxed);
+			stats().diskBytes.fetch_add(slot->length, std::memory_order_relaxed);
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				if (!written)
+					_failed = true;
+				_tail = (_tail + 1) % _ring.size();
+				--_filled;
+			}
+			_notFull.notify_one();
+			return written;
+		}
+
+		Writer _writer;
+		Executor _executor;
+		std::vector<Slot> _ring;
+		size_t _head;      // next slot the network stage fills.
+		size_t _tail;      // next slot the disk stage drains.
+		size_t _filled;    // slots published and not yet drained.
+		bool _closed;
+		bool _failed;
+		bool _draining;    // a disk stage task is queued or running.
+		Slot* _current;    // slot being filled by the network stage. owned by the producer.
+		std::mutex _mutex;
+		std::condition_variable _notEmpty;
+		std::condition_variable _notFull;
+		std::condition_variable _idle;   // signalled when _draining drops.
+		std::thread _thread;             // disk stage when no executor was given.
+	};
+
+}
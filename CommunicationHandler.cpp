@@ -4,8 +4,24 @@
 #include "ServerRequest.h"
 #include "ServerResponse.h"
 #include <boost/asio.hpp>
+#include "BackupPipeline.h"
+#include "Metrics.h"
+#include "Tracing.h"
+#include "Scheduler.h"
+#include "Connection.h"
+#include "TrafficCapture.h"
+#include "VersionStore.h"
+#include "ReplicationLog.h"
+#include "AtRestCipher.h"
+#include "SmallFileStore.h"
+#include "MetadataSnapshot.h"
+#include "SpaceReclaimer.h"
+#include "TieringManager.h"
+#include "QuotaManager.h"
+#include "ContentIndex.h"
+#include "RequestOps.h"
+#include "ProtocolCodec.h"
 using boost::asio::ip::tcp;
-#define PACKET_SIZE  1024
 
 
 namespace CommunicationHandler {
@@ -15,9 +31,7 @@ namespace CommunicationHandler {
 		try
 		{
 			memset(buffer, 0, PACKET_SIZE);  // reset array before copying.
-			sock.non_blocking(false);             // make sure socket is blocking.
-			(void)boost::asio::read(sock, boost::asio::buffer(buffer, PACKET_SIZE));
-			return true;
+			return Connection::readFull(sock, buffer, PACKET_SIZE);   // gives up at the I/O deadline.
 		}
 		catch (boost::system::system_error&)
 		{
@@ -25,8 +39,229 @@ namespace CommunicationHandler {
 		}
 	}
 
+	/**
+	   @brief start the metrics endpoint and add the storage subsystems' series. runs once.
+	          /trace dumps the sampled request spans, /trace/sample?rate=R changes the sampling rate.
+	 */
+	void initMetrics()
+	{
+		static std::once_flag once;
+		std::call_once(once, []()
+		{
+			Metrics::instance().addCollector([](std::ostream& out)
+			{
+				const BackupPipeline::Stats& pipeline = BackupPipeline::stats();
+				out << "# TYPE backupsvr_pipeline_ring_slots gauge\n";
+				out << "backupsvr_pipeline_ring_slots " << BackupPipeline::ringSlots() << "\n";
+				out << "# TYPE backupsvr_pipeline_stage_seconds_total counter\n";
+				out << "backupsvr_pipeline_stage_seconds_total{stage=\"network\"} " << (pipeline.networkNanos.load() / 1e9) << "\n";
+				out << "backupsvr_pipeline_stage_seconds_total{stage=\"disk\"} " << (pipeline.diskNanos.load() / 1e9) << "\n";
+				out << "backupsvr_pipeline_stage_seconds_total{stage=\"backpressure\"} " << (pipeline.backpressureNanos.load() / 1e9) << "\n";
+				out << "# TYPE backupsvr_pipeline_stage_ops_total counter\n";
+				out << "backupsvr_pipeline_stage_ops_total{stage=\"network\"} " << pipeline.networkOps.load() << "\n";
+				out << "backupsvr_pipeline_stage_ops_total{stage=\"disk\"} " << pipeline.diskOps.load() << "\n";
+				out << "# TYPE backupsvr_pipeline_disk_bytes_total counter\n";
+				out << "backupsvr_pipeline_disk_bytes_total " << pipeline.diskBytes.load() << "\n";
+				out << "# TYPE backupsvr_pipeline_max_occupancy gauge\n";
+				out << "backupsvr_pipeline_max_occupancy " << pipeline.maxOccupancy.load() << "\n";
+				out << "# TYPE backupsvr_pipeline_backpressure_waits_total counter\n";
+				out << "backupsvr_pipeline_backpressure_waits_total " << pipeline.backpressureWaits.load() << "\n";
+				out << "# TYPE backupsvr_dircache_lookups_total counter\n";
+				out << "backupsvr_dircache_lookups_total{result=\"hit\"} " << DirectoryCache::Cache::instance().hits() << "\n";
+				out << "backupsvr_dircache_lookups_total{result=\"miss\"} " << DirectoryCache::Cache::instance().misses() << "\n";
+				out << "# TYPE backupsvr_uring_open_fallbacks_total counter\n";
+				out << "backupsvr_uring_open_fallbacks_total " << UringStorage::fallbacks().load() << "\n";
+				out << "# TYPE backupsvr_storage_io_queue gauge\n";
+				StorageRoots::Manager& roots = StorageRoots::instance();
+				for (size_t i = 0; i < roots.rootsCount(); ++i)
+					out << "backupsvr_storage_io_queue{root=\"" << roots.rootPath(i) << "\"} " << roots.rootPool(i).queued() << "\n";
+				const Scheduler::Stats& scheduler = Scheduler::instance().stats();
+				out << "# TYPE backupsvr_scheduler_quanta_in_flight gauge\n";
+				out << "backupsvr_scheduler_quanta_in_flight " << Scheduler::instance().inFlight() << "\n";
+				out << "# TYPE backupsvr_scheduler_quanta_waiting gauge\n";
+				out << "backupsvr_scheduler_quanta_waiting " << Scheduler::instance().waiting() << "\n";
+				out << "# TYPE backupsvr_scheduler_grants_total counter\n";
+				out << "backupsvr_scheduler_grants_total{queued=\"false\"} " << (scheduler.grants.load() - scheduler.queuedGrants.load()) << "\n";
+				out << "backupsvr_scheduler_grants_total{queued=\"true\"} " << scheduler.queuedGrants.load() << "\n";
+				out << "# TYPE backupsvr_scheduler_wait_seconds_total counter\n";
+				out << "backupsvr_scheduler_wait_seconds_total{reason=\"fair_queue\"} " << (scheduler.queueNanos.load() / 1e9) << "\n";
+				out << "backupsvr_scheduler_wait_seconds_total{reason=\"rate_limit\"} " << (scheduler.throttleNanos.load() / 1e9) << "\n";
+				out << "# TYPE backupsvr_scheduler_bytes_total counter\n";
+				out << "backupsvr_scheduler_bytes_total{class=\"interactive\"} " << scheduler.bytes[Scheduler::INTERACTIVE].load() << "\n";
+				out << "backupsvr_scheduler_bytes_total{class=\"bulk\"} " << scheduler.bytes[Scheduler::BULK].load() << "\n";
+				const Connection::Stats& connections = Connection::stats();
+				out << "# TYPE backupsvr_connection_aborts_total counter\n";
+				out << "backupsvr_connection_aborts_total{reason=\"io_timeout\"} " << connections.timeouts.load() << "\n";
+				out << "backupsvr_connection_aborts_total{reason=\"slow_client\"} " << connections.slowClients.load() << "\n";
+				out << "backupsvr_connection_aborts_total{reason=\"over_capacity\"} " << connections.rejected.load() << "\n";
+				const VersionStore::Stats& versions = VersionStore::stats();
+				out << "# TYPE backupsvr_versions_created_total counter\n";
+				out << "backupsvr_versions_created_total{storage=\"reflink\"} " << versions.reflinked.load() << "\n";
+				out << "backupsvr_versions_created_total{storage=\"shared\"} " << versions.shared.load() << "\n";
+				out << "backupsvr_versions_created_total{storage=\"copy\"} " << versions.copied.load() << "\n";
+				out << "# TYPE backupsvr_versions_pruned_total counter\n";
+				out << "backupsvr_versions_pruned_total " << versions.pruned.load() << "\n";
+				out << "# TYPE backupsvr_versions_failed_total counter\n";
+				out << "backupsvr_versions_failed_total " << versions.failed.load() << "\n";
+				const ReplicationLog::Log& replication = ReplicationLog::instance();
+				if (replication.enabled())
+				{
+					const ReplicationLog::Stats& shipping = replication.stats();
+					out << "# TYPE backupsvr_replication_backlog_records gauge\n";
+					out << "backupsvr_replication_backlog_records " << replication.backlog() << "\n";
+					out << "# TYPE backupsvr_replication_lag_seconds gauge\n";
+					out << "backupsvr_replication_lag_seconds " << replication.lagSeconds() << "\n";
+					out << "# TYPE backupsvr_replication_records_total counter\n";
+					out << "backupsvr_replication_records_total{result=\"shipped\"} " << shipping.shipped.load() << "\n";
+					out << "backupsvr_replication_records_total{result=\"coalesced\"} " << shipping.coalesced.load() << "\n";
+					out << "backupsvr_replication_records_total{result=\"skipped\"} " << shipping.skipped.load() << "\n";
+					out << "backupsvr_replication_records_total{result=\"log_error\"} " << shipping.logErrors.load() << "\n";
+					out << "# TYPE backupsvr_replication_retries_total counter\n";
+					out << "backupsvr_replication_retries_total " << shipping.retries.load() << "\n";
+				}
+				const SmallFileStore::Stats& small = SmallFileStore::stats();
+				out << "# TYPE backupsvr_small_files_stored_total counter\n";
+				out << "backupsvr_small_files_stored_total " << small.stored.load() << "\n";
+				out << "# TYPE backupsvr_small_file_flushes_total counter\n";
+				out << "backupsvr_small_file_flushes_total{result=\"ok\"} " << small.flushes.load() << "\n";
+				out << "backupsvr_small_file_flushes_total{result=\"error\"} " << small.flushErrors.load() << "\n";
+				out << "# TYPE backupsvr_small_files_flushed_total counter\n";
+				out << "backupsvr_small_files_flushed_total " << small.flushedFiles.load() << "\n";
+				out << "# TYPE backupsvr_small_file_compactions_total counter\n";
+				out << "backupsvr_small_file_compactions_total " << small.compactions.load() << "\n";
+				out << "# TYPE backupsvr_small_file_pending_bytes gauge\n";
+				out << "backupsvr_small_file_pending_bytes " << small.pendingBytes.load() << "\n";
+				if (AtRestCipher::enabled())
+				{
+					const AtRestCipher::Stats& sealing = AtRestCipher::stats();
+					out << "# TYPE backupsvr_at_rest_chunks_total counter\n";
+					out << "backupsvr_at_rest_chunks_total{op=\"seal\"} " << sealing.sealedChunks.load() << "\n";
+					out << "backupsvr_at_rest_chunks_total{op=\"open\"} " << sealing.openedChunks.load() << "\n";
+					out << "# TYPE backupsvr_at_rest_auth_failures_total counter\n";
+					out << "backupsvr_at_rest_auth_failures_total " << sealing.authFailures.load() << "\n";
+					out << "# TYPE backupsvr_at_rest_plain_files_total counter\n";
+					out << "backupsvr_at_rest_plain_files_total{result=\"read\"} " << sealing.plainReads.load() << "\n";
+					out << "backupsvr_at_rest_plain_files_total{result=\"rejected\"} " << sealing.plainRejected.load() << "\n";
+				}
+				if (MetadataSnapshot::instance().enabled())
+				{
+					const MetadataSnapshot::Stats& index = MetadataSnapshot::stats();
+					out << "# TYPE backupsvr_metadata_ready gauge\n";
+					out << "backupsvr_metadata_ready " << (MetadataSnapshot::instance().ready() ? 1 : 0) << "\n";
+					out << "# TYPE backupsvr_metadata_ready_seconds gauge\n";
+					out << "backupsvr_metadata_ready_seconds " << index.readyNs.load() / 1e9 << "\n";
+					out << "# TYPE backupsvr_metadata_snapshots_total counter\n";
+					out << "backupsvr_metadata_snapshots_total{result=\"ok\"} " << index.snapshots.load() << "\n";
+					out << "backupsvr_metadata_snapshots_total{result=\"error\"} " << index.snapshotErrors.load() << "\n";
+					out << "# TYPE backupsvr_metadata_snapshot_seconds gauge\n";
+					out << "backupsvr_metadata_snapshot_seconds " << index.snapshotNs.load() / 1e9 << "\n";
+					out << "# TYPE backupsvr_metadata_snapshot_files gauge\n";
+					out << "backupsvr_metadata_snapshot_files " << index.files.load() << "\n";
+					out << "# TYPE backupsvr_metadata_rescans_total counter\n";
+					out << "backupsvr_metadata_rescans_total " << index.rescans.load() << "\n";
+					out << "# TYPE backupsvr_metadata_log_records gauge\n";
+					out << "backupsvr_metadata_log_records " << index.logRecords.load() << "\n";
+					out << "# TYPE backupsvr_metadata_log_errors_total counter\n";
+					out << "backupsvr_metadata_log_errors_total " << index.logErrors.load() << "\n";
+				}
+				if (SpaceReclaimer::instance().enabled())
+				{
+					const SpaceReclaimer::Stats& reclaim = SpaceReclaimer::stats();
+					out << "# TYPE backupsvr_trash_discarded_total counter\n";
+					out << "backupsvr_trash_discarded_total " << reclaim.discarded.load() << "\n";
+					out << "# TYPE backupsvr_trash_backlog_files gauge\n";
+					out << "backupsvr_trash_backlog_files " << reclaim.backlogFiles.load() << "\n";
+					out << "# TYPE backupsvr_trash_backlog_bytes gauge\n";
+					out << "backupsvr_trash_backlog_bytes " << reclaim.backlogBytes.load() << "\n";
+					out << "# TYPE backupsvr_trash_reclaimed_files_total counter\n";
+					out << "backupsvr_trash_reclaimed_files_total " << reclaim.reclaimedFiles.load() << "\n";
+					out << "# TYPE backupsvr_trash_reclaimed_bytes_total counter\n";
+					out << "backupsvr_trash_reclaimed_bytes_total " << reclaim.reclaimedBytes.load() << "\n";
+					out << "# TYPE backupsvr_trash_errors_total counter\n";
+					out << "backupsvr_trash_errors_total " << reclaim.errors.load() << "\n";
+				}
+				if (TieringManager::instance().enabled())
+				{
+					const TieringManager::Stats& tier = TieringManager::stats();
+					out << "# TYPE backupsvr_tier_migrated_files_total counter\n";
+					out << "backupsvr_tier_migrated_files_total " << tier.migratedFiles.load() << "\n";
+					out << "# TYPE backupsvr_tier_migrated_bytes_total counter\n";
+					out << "backupsvr_tier_migrated_bytes_total " << tier.migratedBytes.load() << "\n";
+					out << "# TYPE backupsvr_tier_packed_bytes_total counter\n";
+					out << "backupsvr_tier_packed_bytes_total " << tier.packedBytes.load() << "\n";
+					out << "# TYPE backupsvr_tier_promoted_files_total counter\n";
+					out << "backupsvr_tier_promoted_files_total " << tier.promotedFiles.load() << "\n";
+					out << "# TYPE backupsvr_tier_promoted_bytes_total counter\n";
+					out << "backupsvr_tier_promoted_bytes_total " << tier.promotedBytes.load() << "\n";
+					out << "# TYPE backupsvr_tier_deferred_total counter\n";
+					out << "backupsvr_tier_deferred_total " << tier.deferred.load() << "\n";
+					out << "# TYPE backupsvr_tier_errors_total counter\n";
+					out << "backupsvr_tier_errors_total " << tier.errors.load() << "\n";
+					out << "# TYPE backupsvr_tier_compacted_packs_total counter\n";
+					out << "backupsvr_tier_compacted_packs_total " << tier.compactedPacks.load() << "\n";
+					out << "# TYPE backupsvr_tier_throttled_seconds_total counter\n";
+					out << "backupsvr_tier_throttled_seconds_total " << static_cast<double>(tier.throttledNs.load()) / 1e9 << "\n";
+					out << "# TYPE backupsvr_tier_cold_files gauge\n";
+					out << "backupsvr_tier_cold_files " << tier.coldFiles.load() << "\n";
+					out << "# TYPE backupsvr_tier_cold_bytes gauge\n";
+					out << "backupsvr_tier_cold_bytes " << tier.coldBytes.load() << "\n";
+				}
+				{
+					const QuotaManager::Stats& quota = QuotaManager::stats();
+					out << "# TYPE backupsvr_quota_rejected_total counter\n";
+					out << "backupsvr_quota_rejected_total " << quota.rejected.load() << "\n";
+					out << "# TYPE backupsvr_quota_accounts gauge\n";
+					out << "backupsvr_quota_accounts " << quota.accounts.load() << "\n";
+					out << "# TYPE backupsvr_quota_seed_scans_total counter\n";
+					out << "backupsvr_quota_seed_scans_total " << quota.scans.load() << "\n";
+				}
+				{
+					const ContentIndex::Stats& content = ContentIndex::stats();
+					out << "# TYPE backupsvr_precheck_total counter\n";
+					out << "backupsvr_precheck_total{result=\"present\"} " << content.present.load() << "\n";
+					out << "backupsvr_precheck_total{result=\"linked\"} " << content.linked.load() << "\n";
+					out << "backupsvr_precheck_total{result=\"send\"} " << content.sent.load() << "\n";
+					out << "# TYPE backupsvr_precheck_linked_bytes_total counter\n";
+					out << "backupsvr_precheck_linked_bytes_total " << content.linkedBytes.load() << "\n";
+					out << "# TYPE backupsvr_content_hashed_files_total counter\n";
+					out << "backupsvr_content_hashed_files_total " << content.hashed.load() << "\n";
+					out << "# TYPE backupsvr_content_hashed_bytes_total counter\n";
+					out << "backupsvr_content_hashed_bytes_total " << content.hashedBytes.load() << "\n";
+					out << "# TYPE backupsvr_content_index_entries gauge\n";
+					out << "backupsvr_content_index_entries " << content.entries.load() << "\n";
+					out << "# TYPE backupsvr_content_index_evicted_total counter\n";
+					out << "backupsvr_content_index_evicted_total " << content.evicted.load() << "\n";
+					out << "# TYPE backupsvr_precheck_deferred_total counter\n";
+					out << "backupsvr_precheck_deferred_total " << content.deferred.load() << "\n";
+					out << "# TYPE backupsvr_content_hash_backlog gauge\n";
+					out << "backupsvr_content_hash_backlog " << content.backlog.load() << "\n";
+				}
+				if (TrafficCapture::instance().enabled())
+				{
+					out << "# TYPE backupsvr_capture_records_total counter\n";
+					out << "backupsvr_capture_records_total " << TrafficCapture::instance().records() << "\n";
+					out << "# TYPE backupsvr_capture_dropped_total counter\n";
+					out << "backupsvr_capture_dropped_total " << TrafficCapture::instance().dropped() << "\n";
+				}
+			});
+			Metrics::instance().addEndpoint("/trace", [](const std::string&) { return Tracing::chromeTrace(); });
+			Metrics::instance().addEndpoint("/trace/sample", [](const std::string& query)
+			{
+				if (query.rfind("rate=", 0) == 0)
+					Tracing::setSampleRate(atof(query.c_str() + 5));
+				std::ostringstream out;
+				out << "{\"rate\":" << Tracing::sampleRate() << "}\n";
+				return out.str();
+			});
+			Metrics::ensureExporter();
+		});
+	}
+
 	bool handleSocketFromThread(boost::asio::ip::tcp::socket& sock, std::stringstream& err)
 	{
+		initMetrics();
+		const Metrics::ConnectionGauge connection;
+		Tracing::RequestScope trace;    // connection accepted: sampling decided here.
 		try
 		{
 			uint8_t buffer[PACKET_SIZE];
@@ -34,21 +269,45 @@ namespace CommunicationHandler {
 			ServerResponse::Response* response = nullptr;  // allocated in handleRequest()
 			bool responseSent = false;      // response was sent ?
 
+			Tracing::Span receiveSpan("receive");
 			if (!(receive(sock, buffer)))
 			{
 				err << "CServerLogic::handleSocketFromThread: Failed to receive first message from socket!" << std::endl;
 				return false;
 			}
+			receiveSpan.end();
+			const auto start = std::chrono::steady_clock::now();
+			Tracing::Span parseSpan("parse");
 			request = ServerRequestFuncs::deserializeRequest(buffer, PACKET_SIZE);
-			while (ServerRequestFuncs::lock(*request) == false)  // If server is handling already exact user's ID request
+			parseSpan.end();
+			trace.setUser(request->header.m_userID);
+			Tracing::Span lockSpan("lock_wait");
+			if (ServerRequestFuncs::lock(*request) == false)
 			{
-				std::this_thread::sleep_for(std::chrono::seconds(3));
+				Metrics::instance().lockContended.fetch_add(1, std::memory_order_relaxed);
+				const auto waitStart = std::chrono::steady_clock::now();
+				while (ServerRequestFuncs::lock(*request) == false)  // If server is handling already exact user's ID request
+				{
+					std::this_thread::sleep_for(std::chrono::seconds(3));
+				}
+				Metrics::instance().lockWait.record(Metrics::elapsedMicros(waitStart));
 			}
+			lockSpan.end();
 			const bool success = ServerRequestFuncs::handleRequest(*request, response, responseSent, sock, err);
 
+			// response may already be released when the action sent it itself. only its leading status went out.
+			uint16_t status = ServerResponse::Response::ERROR_GENERIC;
+			if (!responseSent)
+				status = response->status;
+			else if (request->header.m_op == Request::EOp::CLI_FILE_RESTORE || request->header.m_op == Request::EOp::CLI_FILE_RESTORE_VERSION)
+				status = ServerResponse::Response::SUCCESS_RESTORE;
+			else if (success)
+				status = ServerResponse::Response::SUCCESS_DIR;   // listings: files, versions, matches, usage.
+
 			// Free allocated memory.
 			if (!responseSent)
 			{
+				Tracing::Span sendSpan("send");
 				serializeResponse(*response, buffer);
 				if (!CommunicationHandler::send(sock, buffer))
 				{
@@ -56,9 +315,15 @@ namespace CommunicationHandler {
 					destroy(response);
 					return false;
 				}
+				sendSpan.end();
 				destroy(response);
+				const Tracing::Span closeSpan("close");
+				if (status == ServerResponse::Response::ERROR_QUOTA)
+					Connection::drain(sock);   // the backup's payload was not read.
 				sock.close();
 			}
+			Metrics::instance().recordRequest(request->header.m_op, status, Metrics::elapsedMicros(start));
+			RequestOps::capture(*request, start, status);
 
 			unlock(*request);  // release lock on user id
 			destroy(request);
@@ -92,10 +357,7 @@ namespace CommunicationHandler {
 	{
 		try
 		{
-			sock.non_blocking(false);  // make sure socket is blocking.
-			boost::system::error_code error;
-			(void)boost::asio::write(sock, boost::asio::buffer(buffer, PACKET_SIZE), error);
-			return true;
+			return Connection::writeFull(sock, buffer, PACKET_SIZE);   // gives up at the I/O deadline.
 		}
 		catch (boost::system::system_error&)
 		{
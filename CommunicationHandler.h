@@ -6,11 +6,11 @@
 
 #pragma once
 #include <boost/asio/ip/tcp.hpp>
+#include "ProtocolCodec.h"
 #include "ServerRequest.cpp"
 
 class CommunicationHandler
 {
-    #define PACKET_SIZE  1024
  
 
 public:
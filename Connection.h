@@ -0,0 +1,357 @@
+/**
+  @Connection deadlines, slow-client protection and admission control for client sockets.
+  Socket reads and writes wait with poll() against a deadline instead of blocking in
+  boost::asio::read/write (which ignore SO_RCVTIMEO), so a stalled client releases its
+  handler thread after the I/O timeout. Transfer loops feed a RateWatchdog with the time
+  spent on the network; a client moving less than the minimum rate after a grace period
+  is dropped. Admission caps concurrent connections; connections over the cap are
+  rejected at once with ERROR_GENERIC.
+  Accepted sockets get the configured TCP options; Cork batches a response header and
+  its body frames into full segments.
+  Configuration: BACKUPSVR_IO_TIMEOUT_MS, BACKUPSVR_MIN_RATE (bytes/s, 0 = off),
+                 BACKUPSVR_MAX_CONNECTIONS, BACKUPSVR_TCP_NODELAY (0/1), BACKUPSVR_TCP_CORK (0/1),
+                 BACKUPSVR_SNDBUF / BACKUPSVR_RCVBUF (bytes, 0 = kernel default).
+ */
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <boost/asio.hpp>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#define CONNECTION_POLL  WSAPoll
+#else
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#define CONNECTION_POLL  ::poll
+#endif
+
+#define CONNECTION_IO_TIMEOUT_MS  30000      // max time to move one frame.
+#define CONNECTION_MIN_RATE  (16 * 1024)     // bytes/s a transfer must sustain after the grace period.
+#define CONNECTION_RATE_GRACE_MS  5000
+#define CONNECTION_MAX  1024                 // concurrent connections.
+#define CONNECTION_REJECT_TIMEOUT_MS  100    // the rejection frame fits the empty send buffer.
+#define CONNECTION_DRAIN_MS  1000            // max time spent discarding the rest of a refused request.
+#define CONNECTION_DRAIN_BYTES  (4 * 1024 * 1024)
+#define CONNECTION_IO_TIMEOUT_ENV  "BACKUPSVR_IO_TIMEOUT_MS"
+#define CONNECTION_MIN_RATE_ENV  "BACKUPSVR_MIN_RATE"
+#define CONNECTION_MAX_ENV  "BACKUPSVR_MAX_CONNECTIONS"
+#define CONNECTION_NODELAY_ENV  "BACKUPSVR_TCP_NODELAY"
+#define CONNECTION_CORK_ENV  "BACKUPSVR_TCP_CORK"
+#define CONNECTION_SNDBUF_ENV  "BACKUPSVR_SNDBUF"
+#define CONNECTION_RCVBUF_ENV  "BACKUPSVR_RCVBUF"
+
+namespace Connection {
+
+	struct Limits
+	{
+		std::chrono::milliseconds ioTimeout{ CONNECTION_IO_TIMEOUT_MS };
+		uint64_t minRate = CONNECTION_MIN_RATE;
+		std::chrono::milliseconds rateGrace{ CONNECTION_RATE_GRACE_MS };
+		uint32_t maxConnections = CONNECTION_MAX;
+		bool noDelay = true;       // frames are sent whole: no need to wait for more data.
+		bool cork = true;          // Linux only.
+		int sendBuffer = 0;
+		int receiveBuffer = 0;
+	};
+
+	inline const Limits& limits()
+	{
+		static const Limits configured = []()
+		{
+			Limits l;
+			const char* timeout = getenv(CONNECTION_IO_TIMEOUT_ENV);
+			const char* rate = getenv(CONNECTION_MIN_RATE_ENV);
+			const char* max = getenv(CONNECTION_MAX_ENV);
+			if (timeout != nullptr && atoi(timeout) > 0)
+				l.ioTimeout = std::chrono::milliseconds(atoi(timeout));
+			if (rate != nullptr)
+				l.minRate = strtoull(rate, nullptr, 10);
+			if (max != nullptr && atoi(max) > 0)
+				l.maxConnections = static_cast<uint32_t>(atoi(max));
+			const char* noDelay = getenv(CONNECTION_NODELAY_ENV);
+			const char* cork = getenv(CONNECTION_CORK_ENV);
+			const char* sendBuffer = getenv(CONNECTION_SNDBUF_ENV);
+			const char* receiveBuffer = getenv(CONNECTION_RCVBUF_ENV);
+			if (noDelay != nullptr)
+				l.noDelay = (atoi(noDelay) != 0);
+			if (cork != nullptr)
+				l.cork = (atoi(cork) != 0);
+			if (sendBuffer != nullptr)
+				l.sendBuffer = atoi(sendBuffer);
+			if (receiveBuffer != nullptr)
+				l.receiveBuffer = atoi(receiveBuffer);
+			return l;
+		}();
+		return configured;
+	}
+
+	struct Stats
+	{
+		std::atomic<uint64_t> timeouts{ 0 };      // frames not moved before their deadline.
+		std::atomic<uint64_t> slowClients{ 0 };   // transfers dropped by the rate watchdog.
+		std::atomic<uint64_t> rejected{ 0 };      // connections refused over the cap.
+	};
+
+	inline Stats& stats()
+	{
+		static Stats s;
+		return s;
+	}
+
+	/**
+	   @brief wait until the socket is readable / writable.
+	   @return false on timeout or poll error.
+	 */
+	inline bool waitReady(boost::asio::ip::tcp::socket& sock, const bool write, const std::chrono::steady_clock::time_point deadline)
+	{
+		const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		if (left.count() <= 0)
+			return false;
+		pollfd fd{};
+		fd.fd = sock.native_handle();
+		fd.events = write ? POLLOUT : POLLIN;
+		return CONNECTION_POLL(&fd, 1, static_cast<int>(left.count())) > 0;
+	}
+
+	/**
+	   @brief move exactly `length` bytes, giving up at the deadline.
+	   @param timeout time allowed for the whole transfer.
+	   @return false on timeout, EOF or socket error.
+	 */
+	inline bool transfer(boost::asio::ip::tcp::socket& sock, uint8_t* data, const size_t length, const bool write, const std::chrono::milliseconds timeout)
+	{
+		const auto deadline = std::chrono::steady_clock::now() + timeout;
+		boost::system::error_code error;
+		sock.non_blocking(true, error);
+		if (error)
+			return false;
+		size_t done = 0;
+		while (done < length)
+		{
+			const size_t n = write ? sock.write_some(boost::asio::buffer(data + done, length - done), error)
+				: sock.read_some(boost::asio::buffer(data + done, length - done), error);
+			done += n;
+			if (error == boost::asio::error::would_block || error == boost::asio::error::try_again)
+			{
+				if (!waitReady(sock, write, deadline))
+				{
+					stats().timeouts.fetch_add(1, std::memory_order_relaxed);
+					return false;
+				}
+			}
+			else if (error)
+				return false;   // includes eof.
+		}
+		return true;
+	}
+
+	inline bool readFull(boost::asio::ip::tcp::socket& sock, void* data, const size_t length)
+	{
+		return transfer(sock, static_cast<uint8_t*>(data), length, false, limits().ioTimeout);
+	}
+
+	inline bool writeFull(boost::asio::ip::tcp::socket& sock, const void* data, const size_t length, const std::chrono::milliseconds timeout = limits().ioTimeout)
+	{
+		return transfer(sock, static_cast<uint8_t*>(const_cast<void*>(data)), length, true, timeout);
+	}
+
+
+	/**
+	   @brief apply the configured TCP options to an accepted socket. failures are ignored.
+	 */
+	inline void applyOptions(boost::asio::ip::tcp::socket& sock)
+	{
+		const Limits& l = limits();
+		boost::system::error_code error;
+		sock.set_option(boost::asio::ip::tcp::no_delay(l.noDelay), error);
+		if (l.sendBuffer > 0)
+			sock.set_option(boost::asio::socket_base::send_buffer_size(l.sendBuffer), error);
+		if (l.receiveBuffer > 0)
+			sock.set_option(boost::asio::socket_base::receive_buffer_size(l.receiveBuffer), error);
+	}
+
+	/**
+	   RAII TCP_CORK: frames sent while corked leave as full segments, the rest when uncorked.
+	   no-op where TCP_CORK does not exist or when disabled.
+	 */
+	class Cork
+	{
+	public:
+		explicit Cork(boost::asio::ip::tcp::socket& sock) : _sock(sock), _corked(false)
+		{
+#if defined(TCP_CORK)
+			if (limits().cork)
+				_corked = set(1);
+#endif
+		}
+
+		~Cork() { release(); }
+
+		void release()
+		{
+#if defined(TCP_CORK)
+			if (_corked && _sock.is_open())   // a closed descriptor may already be reused.
+				(void)set(0);
+#endif
+			_corked = false;
+		}
+
+		Cork(const Cork&) = delete;
+		Cork& operator=(const Cork&) = delete;
+
+	private:
+#if defined(TCP_CORK)
+		bool set(const int value)
+		{
+			return ::setsockopt(_sock.native_handle(), IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) == 0;
+		}
+#endif
+
+		boost::asio::ip::tcp::socket& _sock;
+		bool _corked;
+	};
+
+
+	/**
+	   Minimum transfer rate check. Only time spent on the socket counts, so scheduler and
+	   disk waits are not held against the client.
+	 */
+	class RateWatchdog
+	{
+	public:
+		RateWatchdog() : _bytes(0), _spent(0) {}
+
+		/**
+		   @brief account one socket operation.
+		   @return false if the client is below the minimum rate after the grace period.
+		 */
+		bool progress(const uint64_t bytes, const std::chrono::steady_clock::duration spent)
+		{
+			_bytes += bytes;
+			_spent += spent;
+			const Limits& l = limits();
+			if (l.minRate == 0 || _spent < l.rateGrace)
+				return true;
+			const double seconds = std::chrono::duration<double>(_spent).count();
+			if (static_cast<double>(_bytes) / seconds >= static_cast<double>(l.minRate))
+				return true;
+			stats().slowClients.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+	private:
+		uint64_t _bytes;
+		std::chrono::steady_clock::duration _spent;
+	};
+
+
+	/**
+	   Global cap on concurrent connections.
+	 */
+	class Admission
+	{
+	public:
+		static Admission& instance()
+		{
+			static Admission admission;
+			return admission;
+		}
+
+		bool tryEnter()
+		{
+			uint32_t active = _active.load(std::memory_order_relaxed);
+			do
+			{
+				if (active >= limits().maxConnections)
+				{
+					stats().rejected.fetch_add(1, std::memory_order_relaxed);
+					return false;
+				}
+			} while (!_active.compare_exchange_weak(active, active + 1, std::memory_order_acq_rel));
+			return true;
+		}
+
+		void leave()
+		{
+			_active.fetch_sub(1, std::memory_order_acq_rel);
+		}
+
+		uint32_t active() const { return _active.load(std::memory_order_relaxed); }
+
+		Admission(const Admission&) = delete;
+		Admission& operator=(const Admission&) = delete;
+
+	private:
+		Admission() : _active(0) {}
+		std::atomic<uint32_t> _active;
+	};
+
+	/**
+	   RAII admission of one connection. admitted() is false when over the cap.
+	 */
+	class Ticket
+	{
+	public:
+		Ticket() : _admitted(Admission::instance().tryEnter()) {}
+		~Ticket()
+		{
+			if (_admitted)
+				Admission::instance().leave();
+		}
+		bool admitted() const { return _admitted; }
+
+		Ticket(const Ticket&) = delete;
+		Ticket& operator=(const Ticket&) = delete;
+
+	private:
+		bool _admitted;
+	};
+
+	/**
+	   @brief answer an over-capacity connection with ERROR_GENERIC without reading its request.
+	          only version and status are valid in that response.
+	 */
+	inline void reject(boost::asio::ip::tcp::socket& sock, const uint8_t version, const uint16_t status, const size_t packetSize)
+	{
+		uint8_t frame[4096] = {};
+		memcpy(frame, &version, sizeof(version));
+		memcpy(frame + sizeof(version), &status, sizeof(status));
+		(void)writeFull(sock, frame, (packetSize < sizeof(frame)) ? packetSize : sizeof(frame), std::chrono::milliseconds(CONNECTION_REJECT_TIMEOUT_MS));
+		boost::system::error_code error;
+		sock.close(error);
+	}
+
+	/**
+	   @brief after the response to a request refused before its payload was read (e.g. ERROR_QUOTA):
+	          shut the send side down and discard what the client still sends, until it closes or
+	          the drain limits. closing with unread data resets the connection, which can destroy
+	          the response before the client reads it.
+	 */
+	inline void drain(boost::asio::ip::tcp::socket& sock)
+	{
+		boost::system::error_code error;
+		sock.shutdown(boost::asio::ip::tcp::socket::shutdown_send, error);
+		sock.non_blocking(true, error);
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(CONNECTION_DRAIN_MS);
+		uint8_t discard[16 * 1024];
+		size_t discarded = 0;
+		while (!error && discarded < CONNECTION_DRAIN_BYTES)
+		{
+			discarded += sock.read_some(boost::asio::buffer(discard), error);
+			if (error == boost::asio::error::would_block || error == boost::asio::error::try_again)
+			{
+				error.clear();
+				if (!waitReady(sock, false, deadline))
+					break;
+			}
+		}
+	}
+
+}
@@ -0,0 +1,646 @@
+/**
+  @ContentIndex upload-skip precheck by content hash (CLI_FILE_PRECHECK).
+  Before a backup, a client sends the file's size and SHA-256. If the named file already holds
+  that content the answer is SUCCESS_ALREADY_STORED and nothing is uploaded. Otherwise, if
+  identical content is stored under another name, it is linked under the requested one (a
+  reflink or copy, never a hard link: backups rewrite files in place) and the answer is the
+  same; only unknown content is answered SUCCESS_SEND_CONTENT, and the client backs it up.
+  Digests are of the plaintext as restored. They are computed by the server from its own
+  copy, never taken from a client. A precheck hashes the file it asks about inline only up to
+  CONTENT_INLINE_HASH_BYTES; a larger file that is not indexed yet is answered as unknown and
+  queued for the hasher, as is a backup that followed a "send" answer. The hasher is one
+  background thread, off the request and the user's I/O pool, that reads at a limited rate
+  and skips users being migrated. The index keeps the last digest of each file with the
+  file's size and mtime and is trusted only while those match; small files (no mtime) are
+  hashed again, which is cheap. It lives in memory and is bounded: the oldest entries are
+  dropped first, and it refills as files are prechecked.
+  By default only a user's own files are linked. The global scope also links other users'
+  content (re-encrypted for the new owner when encryption at rest is on); note that it tells
+  a user whether anybody stores a given content.
+  Configuration: BACKUPSVR_CONTENT_SCOPE (user | global), BACKUPSVR_CONTENT_INDEX_ENTRIES,
+                 BACKUPSVR_CONTENT_HASH_BYTES_PER_S.
+ */
+
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <openssl/evp.h>
+#include "AtRestCipher.h"
+#include "DirectoryCache.h"
+#include "FileManager.h"
+#include "MetadataSnapshot.h"
+#include "ProtocolCodec.h"
+#include "QuotaManager.h"
+#include "SmallFileStore.h"
+#include "StorageEvents.h"
+#include "StorageRoots.h"
+#include "TieringManager.h"
+#include "VersionStore.h"
+
+#define CONTENT_SCOPE_ENV  "BACKUPSVR_CONTENT_SCOPE"
+#define CONTENT_INDEX_ENTRIES_ENV  "BACKUPSVR_CONTENT_INDEX_ENTRIES"
+#define CONTENT_HASH_BYTES_PER_S_ENV  "BACKUPSVR_CONTENT_HASH_BYTES_PER_S"
+#define CONTENT_INDEX_ENTRIES  1000000        // files whose digest is kept.
+#define CONTENT_PER_DIGEST  8                 // files kept per digest, newest first.
+#define CONTENT_DIGEST_SIZE  32               // SHA-256.
+#define CONTENT_PRECHECK_PAYLOAD  (sizeof(uint64_t) + CONTENT_DIGEST_SIZE)   // uint64 size, digest.
+#define CONTENT_READ_CHUNK  (1024 * 1024)
+#define CONTENT_INLINE_HASH_BYTES  (4ull * 1024 * 1024)   // larger files are hashed by the hasher, not by a precheck.
+#define CONTENT_HASH_BYTES_PER_S  (64ull * 1024 * 1024)  // read rate of the hasher.
+
+namespace ContentIndex {
+
+	using Digest = std::array<uint8_t, CONTENT_DIGEST_SIZE>;
+
+	struct Config
+	{
+		bool global = false;   // link other users' content too.
+		size_t entries = CONTENT_INDEX_ENTRIES;
+		uint64_t hashBytesPerSecond = CONTENT_HASH_BYTES_PER_S;
+	};
+
+	inline const Config& config()
+	{
+		static const Config configured = []()
+		{
+			Config c;
+			const char* scope = getenv(CONTENT_SCOPE_ENV);
+			const char* entries = getenv(CONTENT_INDEX_ENTRIES_ENV);
+			const char* rate = getenv(CONTENT_HASH_BYTES_PER_S_ENV);
+			c.global = (scope != nullptr && strcmp(scope, "global") == 0);
+			if (entries != nullptr && strtoull(entries, nullptr, 10) > 0)
+				c.entries = static_cast<size_t>(strtoull(entries, nullptr, 10));
+			if (rate != nullptr && strtoull(rate, nullptr, 10) > 0)
+				c.hashBytesPerSecond = strtoull(rate, nullptr, 10);
+			return c;
+		}();
+		return configured;
+	}
+
+	struct Stats
+	{
+		std::atomic<uint64_t> present{ 0 };       // prechecks of files that already held the content.
+		std::atomic<uint64_t> linked{ 0 };        // prechecks answered by linking identical content.
+		std::atomic<uint64_t> linkedBytes{ 0 };   // uploads saved by linking.
+		std::atomic<uint64_t> sent{ 0 };          // prechecks answered "send".
+		std::atomic<uint64_t> hashed{ 0 };        // files hashed.
+		std::atomic<uint64_t> hashedBytes{ 0 };
+		std::atomic<uint64_t> entries{ 0 };       // files in the index.
+		std::atomic<uint64_t> evicted{ 0 };
+		std::atomic<uint64_t> deferred{ 0 };      // prechecks that left a large file to the hasher.
+		std::atomic<uint64_t> backlog{ 0 };       // files waiting for the hasher.
+	};
+
+	inline Stats& stats()
+	{
+		static Stats s;
+		return s;
+	}
+
+	/**
+	   What a precheck says the client's file is.
+	 */
+	struct Claim
+	{
+		uint64_t size = 0;
+		Digest digest{};
+	};
+
+	/**
+	   @brief read a precheck payload: uint64 size in the request's byte order, then the SHA-256.
+	   @return false if the payload is short or not all in the request frame.
+	 */
+	inline bool parseClaim(const Request& request, Claim& claim)
+	{
+		if (request.payload.m_payload == nullptr || request.payload.m_size < CONTENT_PRECHECK_PAYLOAD || PACKET_SIZE - request.sizeWithoutPayload() < CONTENT_PRECHECK_PAYLOAD)
+			return false;
+		const uint8_t* payload = request.payload.m_payload;
+		claim.size = ProtocolCodec::forVersion(request.header.m_version, [payload](auto codec) { return codec.template load<uint64_t>(payload); });
+		memcpy(claim.digest.data(), payload + sizeof(uint64_t), claim.digest.size());
+		return true;
+	}
+
+	inline bool hashData(const uint8_t* data, const size_t length, Digest& digest)
+	{
+		unsigned int length32 = 0;
+		return EVP_Digest(data, length, digest.data(), &length32, EVP_sha256(), nullptr) == 1 && length32 == digest.size();
+	}
+
+	/**
+	   @brief open a user file for reading as a restore would, without promoting it if it is cold:
+	          a cold file is extracted to a staged name (TieringManager::extractStaged) and read there.
+	   @param staged set to the staged name, for closeInPlace(); empty if the file was not cold.
+	 */
+	inline bool openInPlace(const DirectoryCache::Directory& dir, const std::string& name, FileManager::StorageFile& fs, std::string& staged)
+	{
+		staged.clear();
+		if (!TieringManager::instance().contains(dir.userID, name))
+			return FileManager::fileOpenAt(dir, name, fs);
+		if (!TieringManager::instance().extractStaged(dir, name, staged))
+			return false;
+		if (FileManager::fileOpenAt(dir, staged, fs))
+			return true;
+		std::error_code error;
+		(void)std::filesystem::remove(dir.folder + staged, error);
+		return false;
+	}
+
+	inline void closeInPlace(const DirectoryCache::Directory& dir, FileManager::StorageFile& fs, const std::string& staged)
+	{
+		(void)FileManager::fileClose(fs);
+		std::error_code error;
+		if (!staged.empty())
+			(void)std::filesystem::remove(dir.folder + staged, error);
+	}
+
+	/**
+	   @brief SHA-256 of a user file's content, read as a restore reads it. a cold file is read in place, not promoted.
+	   @param size set to the bytes hashed.
+	   @param pace if set, called before each chunk is read; hashing stops when it returns false.
+	 */
+	inline bool hashFile(const DirectoryCache::Directory& dir, const std::string& name, Digest& digest, uint64_t& size, const std::function<bool(uint64_t)>& pace = nullptr)
+	{
+		FileManager::StorageFile fs;
+		std::string staged;
+		if (!openInPlace(dir, name, fs, staged))
+			return false;
+		const uint64_t total = FileManager::fileSize(fs);
+		std::vector<uint8_t> buffer(static_cast<size_t>((total < CONTENT_READ_CHUNK) ? total : CONTENT_READ_CHUNK));
+		EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+		bool ok = (ctx != nullptr && EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) == 1);
+		uint64_t done = 0;
+		while (ok && done < total)
+		{
+			const uint32_t chunk = static_cast<uint32_t>((total - done < buffer.size()) ? total - done : buffer.size());
+			ok = (!pace || pace(chunk)) && FileManager::fileRead(fs, buffer.data(), chunk) && EVP_DigestUpdate(ctx, buffer.data(), chunk) == 1;
+			done += chunk;
+		}
+		unsigned int length = 0;
+		ok = ok && EVP_DigestFinal_ex(ctx, digest.data(), &length) == 1 && length == digest.size();
+		EVP_MD_CTX_free(ctx);
+		closeInPlace(dir, fs, staged);
+		size = total;
+		if (ok)
+		{
+			stats().hashed.fetch_add(1, std::memory_order_relaxed);
+			stats().hashedBytes.fetch_add(total, std::memory_order_relaxed);
+		}
+		return ok;
+	}
+
+	/**
+	   A file last hashed to a digest.
+	 */
+	struct Location
+	{
+		uint32_t userID = 0;
+		std::string name;
+	};
+
+
+	class Index
+	{
+	public:
+		static Index& instance()
+		{
+			static Index index;
+			return index;
+		}
+
+		/**
+		   @brief digest of a user file: the indexed one while the file is unchanged, else hashed now.
+		          a file larger than CONTENT_INLINE_HASH_BYTES is not hashed here: it is queued for
+		          the hasher, and reported unknown until the hasher has indexed it.
+		   @param meta the file's current size and mtime (MetadataSnapshot::statFile).
+		 */
+		bool digestOf(const DirectoryCache::Directory& dir, const std::string& name, const MetadataSnapshot::FileMeta& meta, Digest& digest)
+		{
+			if (meta.mtimeNs != 0 && cached(dir.userID, name, meta, digest))
+				return true;
+			if (meta.size > CONTENT_INLINE_HASH_BYTES)
+			{
+				stats().deferred.fetch_add(1, std::memory_order_relaxed);
+				queue(dir.userID, name);
+				return false;
+			}
+			uint64_t size = 0;
+			if (!hashFile(dir, name, digest, size) || size != meta.size)
+				return false;
+			record(dir.userID, name, meta, digest);
+			return true;
+		}
+
+		/**
+		   @return the files last hashed to `digest`, newest first: the user's own only, unless the
+		           scope is global. they may have changed since.
+		 */
+		std::vector<Location> candidates(const uint32_t userID, const Digest& digest)
+		{
+			std::vector<Location> found;
+			std::lock_guard<std::mutex> lock(_mutex);
+			const auto it = _digests.find(text(digest));
+			if (it == _digests.end())
+				return found;
+			for (auto key = it->second.rbegin(); key != it->second.rend(); ++key)
+			{
+				Location location;
+				memcpy(&location.userID, key->data(), sizeof(location.userID));
+				if (location.userID != userID && !config().global)
+					continue;
+				location.name = key->substr(sizeof(location.userID));
+				found.push_back(std::move(location));
+			}
+			return found;
+		}
+
+		/**
+		   @brief remember a file's digest, as of the file's size and mtime in `meta`.
+		 */
+		void record(const uint32_t userID, const std::string& name, const MetadataSnapshot::FileMeta& meta, const Digest& digest)
+		{
+			const std::string id = key(userID, name);
+			std::lock_guard<std::mutex> lock(_mutex);
+			auto found = _files.find(id);
+			if (found != _files.end())
+				unlink(id, found->second.digest);
+			else
+				found = _files.emplace(id, Entry()).first;
+			found->second.digest = digest;
+			found->second.meta = meta;
+			found->second.seq = ++_seq;
+			_order.emplace_back(id, _seq);
+			std::vector<std::string>& keys = _digests[text(digest)];
+			keys.push_back(id);
+			if (keys.size() > CONTENT_PER_DIGEST)
+				keys.erase(keys.begin());
+			const size_t capacity = config().entries;
+			while (!_order.empty() && (_files.size() > capacity || _order.size() > 2 * capacity))
+			{
+				const auto oldest = _files.find(_order.front().first);
+				if (oldest != _files.end() && oldest->second.seq == _order.front().second)
+				{
+					unlink(oldest->first, oldest->second.digest);
+					_files.erase(oldest);
+					stats().evicted.fetch_add(1, std::memory_order_relaxed);
+				}
+				_order.pop_front();
+			}
+			stats().entries.store(_files.size(), std::memory_order_relaxed);
+		}
+
+		/**
+		   @brief a precheck answered "send": hash the file once its backup is done.
+		 */
+		void announce(const uint32_t userID, const std::string& name)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (_announced.size() < config().entries)
+				_announced.insert(key(userID, name));
+		}
+
+		/**
+		   @brief a backup completed: queue it for the hasher if a precheck announced it.
+		 */
+		void backedUp(const uint32_t userID, const std::string& name)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				if (_announced.erase(key(userID, name)) == 0)
+					return;
+			}
+			queue(userID, name);
+		}
+
+		~Index()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_hashMutex);
+				_stopping = true;
+			}
+			_wake.notify_all();
+			if (_hasher.joinable())
+				_hasher.join();
+		}
+
+		Index(const Index&) = delete;
+		Index& operator=(const Index&) = delete;
+
+	private:
+		struct Entry
+		{
+			Digest digest{};
+			MetadataSnapshot::FileMeta meta;
+			uint64_t seq = 0;
+		};
+
+		Index()
+		{
+			(void)stats();
+			(void)StorageRoots::instance();   // constructed first, so it outlives the hasher.
+			_hasher = std::thread(&Index::run, this);
+		}
+
+		static std::string key(const uint32_t userID, const std::string& name)
+		{
+			std::string id(sizeof(userID), '\0');
+			memcpy(&id[0], &userID, sizeof(userID));
+			return id + name;
+		}
+
+		static std::string text(const Digest& digest)
+		{
+			return std::string(reinterpret_cast<const char*>(digest.data()), digest.size());
+		}
+
+		bool cached(const uint32_t userID, const std::string& name, const MetadataSnapshot::FileMeta& meta, Digest& digest)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			const auto it = _files.find(key(userID, name));
+			if (it == _files.end() || it->second.meta.size != meta.size || it->second.meta.mtimeNs != meta.mtimeNs)
+				return false;
+			digest = it->second.digest;
+			return true;
+		}
+
+		/**
+		   @brief drop a file from its digest's list. _mutex is held.
+		 */
+		void unlink(const std::string& id, const Digest& digest)
+		{
+			const auto it = _digests.find(text(digest));
+			if (it == _digests.end())
+				return;
+			std::vector<std::string>& keys = it->second;
+			for (auto k = keys.begin(); k != keys.end(); ++k)
+			{
+				if (*k == id)
+				{
+					keys.erase(k);
+					break;
+				}
+			}
+			if (keys.empty())
+				_digests.erase(it);
+		}
+
+		/**
+		   @brief queue a file for the hasher, once. the queue is bounded like the index.
+		 */
+		void queue(const uint32_t userID, const std::string& name)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_hashMutex);
+				if (_queued.size() >= config().entries || !_queued.insert(key(userID, name)).second)
+					return;
+				_queue.emplace_back(userID, name);
+				stats().backlog.store(_queue.size(), std::memory_order_relaxed);
+			}
+			_wake.notify_one();
+		}
+
+		/**
+		   @brief wait until the hasher's rate allows `bytes` more read bytes.
+		   @return false if the index is stopping.
+		 */
+		bool pace(const uint64_t bytes)
+		{
+			const auto cost = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::duration<double>(static_cast<double>(bytes) / static_cast<double>(config().hashBytesPerSecond)));
+			std::unique_lock<std::mutex> lock(_hashMutex);
+			if (_wake.wait_until(lock, _next, [this] { return _stopping; }))
+				return false;
+			_next = std::max(_next, std::chrono::steady_clock::now()) + cost;
+			return true;
+		}
+
+		/**
+		   @brief hash a file without the user lock: kept only if the file did not change meanwhile.
+		          a user being migrated is skipped; its next precheck queues the file again.
+		 */
+		void learn(const uint32_t userID, const std::string& name)
+		{
+			std::string folder;
+			if (!StorageRoots::instance().tryAcquire(userID, folder))
+				return;
+			const StorageRoots::UserLease lease(userID, std::move(folder), std::adopt_lock);
+			const DirectoryCache::Handle dir = DirectoryCache::get(userID, lease.folder(), false);
+			MetadataSnapshot::FileMeta before;
+			MetadataSnapshot::FileMeta after;
+			Digest digest;
+			uint64_t size = 0;
+			if (!MetadataSnapshot::statFile(dir->folder, name, before) || !hashFile(*dir, name, digest, size, [this](const uint64_t bytes) { return pace(bytes); }) || size != before.size)
+				return;
+			if (MetadataSnapshot::statFile(dir->folder, name, after) && after.size == before.size && after.mtimeNs == before.mtimeNs)
+				record(userID, name, before, digest);
+		}
+
+		void run()
+		{
+			std::unique_lock<std::mutex> lock(_hashMutex);
+			while (true)
+			{
+				_wake.wait(lock, [this] { return _stopping || !_queue.empty(); });
+				if (_stopping)
+					break;
+				const std::pair<uint32_t, std::string> item = _queue.front();
+				_queue.pop_front();
+				_queued.erase(key(item.first, item.second));   // a change while it is hashed queues it again.
+				stats().backlog.store(_queue.size(), std::memory_order_relaxed);
+				lock.unlock();
+				learn(item.first, item.second);
+				lock.lock();
+			}
+		}
+
+		std::mutex _mutex;
+		std::unordered_map<std::string, Entry> _files;                     // user ID and name -> last digest.
+		std::unordered_map<std::string, std::vector<std::string>> _digests; // digest -> files, newest last.
+		std::deque<std::pair<std::string, uint64_t>> _order;                // eviction order; stale when re-recorded.
+		std::unordered_set<std::string> _announced;
+		uint64_t _seq = 0;
+
+		std::mutex _hashMutex;                                              // the hasher's queue and rate.
+		std::condition_variable _wake;
+		std::deque<std::pair<uint32_t, std::string>> _queue;               // files waiting for the hasher.
+		std::unordered_set<std::string> _queued;                           // their keys.
+		std::chrono::steady_clock::time_point _next;                        // when the rate allows the next read.
+		bool _stopping = false;
+		std::thread _hasher;                                                // last member: joined first.
+	};
+
+	inline Index& instance()
+	{
+		return Index::instance();
+	}
+
+
+	enum EPrecheck
+	{
+		PRECHECK_STORED = 0,    // the file already holds the content.
+		PRECHECK_LINKED = 1,    // identical content was linked under the name.
+		PRECHECK_SEND = 2,      // content not found: the client backs the file up.
+		PRECHECK_REFUSED = 3,   // linking would exceed the user's quota.
+		PRECHECK_FAILED = 4
+	};
+
+	/**
+	   @brief copy `source` of `from` to `name` of `dir`: a small file through the container,
+	          otherwise staged in the user's server owned staging entry and renamed over the name.
+	   @param verify hash the copy: the source is not under the user lock.
+	 */
+	inline bool copy(const DirectoryCache::Directory& from, const std::string& source, const DirectoryCache::Directory& dir, const std::string& name, const Claim& claim, const bool verify, std::stringstream& err)
+	{
+		Digest digest;
+		std::vector<uint8_t> data;
+		if (SmallFileStore::instance().get(from, source, data))
+		{
+			if (data.size() != claim.size || !hashData(data.data(), data.size(), digest) || digest != claim.digest)
+				return false;
+			if (SmallFileStore::accepts(static_cast<uint32_t>(claim.size)))
+				return FileManager::fileStoreSmallAt(dir, name, data.data(), static_cast<uint32_t>(claim.size));
+		}
+		std::error_code error;
+		const std::string staged = dir.folder + DIRECTORY_STAGING_ENTRY;
+		(void)std::filesystem::create_directories(dir.folder, error);
+		bool copied = false;
+		if (!data.empty())
+		{
+			FileManager::StorageFile out;
+			if (FileManager::fileOpenAt(dir, DIRECTORY_STAGING_ENTRY, out, true))
+			{
+				copied = FileManager::fileWrite(out, data.data(), static_cast<uint32_t>(data.size()));
+				copied = FileManager::fileClose(out) && copied;
+			}
+		}
+		else if (from.userID == dir.userID || !AtRestCipher::enabled())
+		{
+			bool reflinked = false;   // sealed files are bound to the user's key, not to their name.
+			copied = TieringManager::instance().extract(from, source, staged) || VersionStore::cloneFile(from.folder + source, staged, reflinked);   // a cold source is read in place, not promoted.
+		}
+		else
+		{
+			FileManager::StorageFile in;
+			std::string stagedSource;
+			if (openInPlace(from, source, in, stagedSource))
+			{
+				const uint32_t total = FileManager::fileSize(in);
+				FileManager::StorageFile out;
+				if (total == claim.size && FileManager::fileOpenAt(dir, DIRECTORY_STAGING_ENTRY, out, true))
+				{
+					std::vector<uint8_t> buffer((total < CONTENT_READ_CHUNK) ? total : CONTENT_READ_CHUNK);
+					uint32_t done = 0;
+					copied = true;
+					while (copied && done < total)
+					{
+						const uint32_t chunk = (total - done < buffer.size()) ? total - done : static_cast<uint32_t>(buffer.size());
+						copied = FileManager::fileRead(in, buffer.data(), chunk) && FileManager::fileWrite(out, buffer.data(), chunk);
+						done += chunk;
+					}
+					copied = FileManager::fileClose(out) && copied;
+				}
+				closeInPlace(from, in, stagedSource);
+			}
+		}
+		uint64_t size = 0;
+		if (copied && verify)
+			copied = hashFile(dir, DIRECTORY_STAGING_ENTRY, digest, size) && size == claim.size && digest == claim.digest;
+		if (copied)
+		{
+			const std::string target = dir.folder + name;
+			(void)SmallFileStore::instance().remove(dir, name);
+			(void)TieringManager::instance().remove(dir, name);   // else its cold entry would shadow the new content.
+			(void)std::filesystem::create_directories(std::filesystem::path(target).parent_path(), error);
+			std::filesystem::rename(staged, target, error);
+			copied = !error;
+		}
+		if (!copied)
+		{
+			err << "user ID #" << +dir.userID << ": content of " << name << " could not be linked from user ID #" << +from.userID << " " << source << std::endl;
+			std::filesystem::remove(staged, error);
+		}
+		return copied;
+	}
+
+	/**
+	   @brief link a file that was hashed to the claimed content under `name`, once it is verified.
+	   @return PRECHECK_SEND if the file no longer holds the content or could not be copied.
+	 */
+	inline EPrecheck link(const DirectoryCache::Directory& dir, const std::string& name, const Location& source, const Claim& claim, std::stringstream& err)
+	{
+		const bool own = (source.userID == dir.userID);
+		std::unique_ptr<StorageRoots::UserLease> lease;   // another user's root, pinned while it is read.
+		DirectoryCache::Handle other;
+		if (!own)
+		{
+			lease = std::make_unique<StorageRoots::UserLease>(source.userID);
+			other = DirectoryCache::get(source.userID, lease->folder(), false);
+		}
+		const DirectoryCache::Directory& from = own ? dir : *other;
+		MetadataSnapshot::FileMeta meta;
+		Digest digest;
+		if (!MetadataSnapshot::statFile(from.folder, source.name, meta) || meta.size != claim.size || !instance().digestOf(from, source.name, meta, digest) || digest != claim.digest)
+			return PRECHECK_SEND;   // changed or gone since it was hashed.
+
+		const QuotaManager::Prior prior = QuotaManager::instance().prior(dir, name);
+		if (!QuotaManager::instance().admit(dir, prior, claim.size, err))
+			return PRECHECK_REFUSED;
+		if (!copy(from, source.name, dir, name, claim, !own, err))
+			return PRECHECK_SEND;
+		MetadataSnapshot::FileMeta stored;
+		if (MetadataSnapshot::statFile(dir.folder, name, stored) && stored.mtimeNs != 0)
+			(void)VersionStore::snapshot(dir, name, err);   // regular files are versioned, as by a backup. a failure only warns.
+		StorageEvents::onCommitted(dir, name, prior, claim.size, err);
+		if (stored.size == claim.size)
+			instance().record(dir.userID, name, stored, claim.digest);
+		stats().linked.fetch_add(1, std::memory_order_relaxed);
+		stats().linkedBytes.fetch_add(claim.size, std::memory_order_relaxed);
+		return PRECHECK_LINKED;
+	}
+
+	/**
+	   @brief answer a precheck of the user's file `name`. the user lock is held.
+	 */
+	inline EPrecheck precheck(const DirectoryCache::Directory& dir, const std::string& name, const Claim& claim, std::stringstream& err)
+	{
+		MetadataSnapshot::FileMeta meta;
+		Digest digest;
+		if (MetadataSnapshot::statFile(dir.folder, name, meta) && meta.size == claim.size && instance().digestOf(dir, name, meta, digest) && digest == claim.digest)
+		{
+			stats().present.fetch_add(1, std::memory_order_relaxed);
+			return PRECHECK_STORED;
+		}
+		if (claim.size <= UINT32_MAX)
+		{
+			for (const Location& source : instance().candidates(dir.userID, claim.digest))
+			{
+				if (source.userID == dir.userID && source.name == name)
+					continue;   // checked above.
+				const EPrecheck linked = link(dir, name, source, claim, err);
+				if (linked != PRECHECK_SEND)
+					return linked;
+			}
+		}
+		instance().announce(dir.userID, name);
+		stats().sent.fetch_add(1, std::memory_order_relaxed);
+		return PRECHECK_SEND;
+	}
+
+}
@@ -0,0 +1,275 @@
+/**
+  @DirectoryCache bounded LRU cache of open per-user directory descriptors.
+  File operations of a request are resolved relative to the user's directory with
+  openat/fstatat/unlinkat, so the user's path is not rebuilt and walked for every
+  operation, and the directory is only created (mkdir) on a cache miss.
+  On platforms without openat the handle only carries the folder path and FileManager
+  falls back to path based calls.
+ */
+
+#pragma once
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#if defined(_WIN32)
+#define HAVE_OPENAT 0
+#else
+#define HAVE_OPENAT 1
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define DIRECTORY_CACHE_SIZE  1024   // max cached user directories (open descriptors).
+#define DIRECTORY_VERSIONS_ENTRY  ".versions"   // server owned (VersionStore), not a user file.
+#define DIRECTORY_SMALL_FILES_ENTRY  ".smallfiles"   // server owned (SmallFileStore).
+#define DIRECTORY_STAGING_ENTRY  ".linking"   // server owned (ContentIndex): content being linked under a new name.
+#define DIRECTORY_PROMOTING_ENTRY  ".promoting"   // server owned (TieringManager): cold files being restored to the hot tier.
+
+namespace DirectoryCache {
+
+	struct Directory
+	{
+		uint32_t userID;
+		std::string folder;   // user's folder path, ends with '/'.
+		int fd;               // -1 when not opened (no openat support or folder missing).
+		Directory(const uint32_t id, const std::string& path, const int dirfd) : userID(id), folder(path), fd(dirfd) {}
+		~Directory()
+		{
+#if HAVE_OPENAT
+			if (fd >= 0)
+				(void)::close(fd);
+#endif
+		}
+		Directory(const Directory&) = delete;
+		Directory& operator=(const Directory&) = delete;
+	};
+
+	/**
+	   shared so that an evicted directory stays open until the last request using it is done.
+	 */
+	using Handle = std::shared_ptr<const Directory>;
+
+
+	class Cache
+	{
+	public:
+		static Cache& instance()
+		{
+			static Cache cache;
+			return cache;
+		}
+
+		/**
+		   @brief get the user's directory handle.
+		   @param userID the user.
+		   @param folder the user's folder as resolved by the storage roots. a cached handle of another folder is replaced.
+		   @param create create the folder if it does not exist.
+		   @return handle. its fd is -1 if the folder does not exist (and create is false) or cannot be opened.
+		 */
+		Handle get(const uint32_t userID, const std::string& folder, const bool create)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				const auto it = _entries.find(userID);
+				if (it != _entries.end() && it->second.first->folder == folder)
+				{
+					_lru.splice(_lru.begin(), _lru, it->second.second);
+					_hits.fetch_add(1, std::memory_order_relaxed);
+					return it->second.first;
+				}
+			}
+			_misses.fetch_add(1, std::memory_order_relaxed);
+			const int fd = openFolder(folder, create);
+			auto handle = std::make_shared<const Directory>(userID, folder, fd);
+			if (fd < 0)
+				return handle;   // do not cache missing folders. another request may create it.
+
+			std::lock_guard<std::mutex> lock(_mutex);
+			const auto it = _entries.find(userID);
+			if (it != _entries.end())
+			{
+				_lru.erase(it->second.second);
+				_entries.erase(it);
+			}
+			_lru.push_front(userID);
+			_entries.emplace(userID, std::make_pair(handle, _lru.begin()));
+			while (_entries.size() > DIRECTORY_CACHE_SIZE)
+			{
+				_entries.erase(_lru.back());
+				_lru.pop_back();
+			}
+			return handle;
+		}
+
+		/**
+		   @brief drop a user's cached directory, e.g. after its folder was removed or moved.
+		 */
+		void invalidate(const uint32_t userID)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			const auto it = _entries.find(userID);
+			if (it == _entries.end())
+				return;
+			_lru.erase(it->second.second);
+			_entries.erase(it);
+		}
+
+		size_t size()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _entries.size();
+		}
+
+		uint64_t hits() const { return _hits.load(std::memory_order_relaxed); }
+		uint64_t misses() const { return _misses.load(std::memory_order_relaxed); }
+
+		Cache(const Cache&) = delete;
+		Cache& operator=(const Cache&) = delete;
+
+	private:
+		Cache() : _hits(0), _misses(0) {}
+
+		static int openFolder(const std::string& folder, const bool create)
+		{
+#if HAVE_OPENAT
+			const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+			int fd = ::open(folder.c_str(), flags);
+			if (fd >= 0 || !create || errno != ENOENT)
+				return fd;
+			try
+			{
+				(void)std::filesystem::create_directories(folder);
+			}
+			catch (std::exception&)
+			{
+				return -1;
+			}
+			fd = ::open(folder.c_str(), flags);
+			return fd;
+#else
+			if (create)
+			{
+				try
+				{
+					(void)std::filesystem::create_directories(folder);
+				}
+				catch (std::exception&)
+				{
+				}
+			}
+			return -1;
+#endif
+		}
+
+		std::mutex _mutex;
+		std::list<uint32_t> _lru;   // most recently used first.
+		std::unordered_map<uint32_t, std::pair<Handle, std::list<uint32_t>::iterator>> _entries;
+		std::atomic<uint64_t> _hits;
+		std::atomic<uint64_t> _misses;
+	};
+
+	inline Handle get(const uint32_t userID, const std::string& folder, const bool create)
+	{
+		return Cache::instance().get(userID, folder, create);
+	}
+
+	/**
+	   @brief is a user directory entry owned by the server? such entries are not user files.
+	 */
+	inline bool serverEntry(const char* name)
+	{
+		return strcmp(name, DIRECTORY_VERSIONS_ENTRY) == 0 || strcmp(name, DIRECTORY_SMALL_FILES_ENTRY) == 0 || strcmp(name, DIRECTORY_STAGING_ENTRY) == 0 || strcmp(name, DIRECTORY_PROMOTING_ENTRY) == 0;
+	}
+
+
+#if HAVE_OPENAT
+	/**
+	   @brief create the missing intermediate directories of a nested name ("a/b/c") with mkdirat.
+	 */
+	inline bool makeParentsAt(const Directory& dir, const std::string& name)
+	{
+		size_t pos = 0;
+		while ((pos = name.find('/', pos + 1)) != std::string::npos)
+		{
+			const std::string parent = name.substr(0, pos);
+			if (::mkdirat(dir.fd, parent.c_str(), 0755) != 0 && errno != EEXIST)
+				return false;
+		}
+		return true;
+	}
+
+	/**
+	   @brief open a file relative to a user's directory. For a writable open of a nested
+	          name, missing intermediate directories are created.
+	   @return fd, or -1 (errno set).
+	 */
+	inline int openAt(const Directory& dir, const std::string& name, const int flags, const mode_t mode = 0644)
+	{
+		const int fd = ::openat(dir.fd, name.c_str(), flags | O_CLOEXEC, mode);
+		if (fd >= 0 || errno != ENOENT || (flags & O_CREAT) == 0 || name.find('/') == std::string::npos)
+			return fd;
+		if (!makeParentsAt(dir, name))
+			return -1;
+		return ::openat(dir.fd, name.c_str(), flags | O_CLOEXEC, mode);
+	}
+
+	/**
+	   @brief is there a regular file with this name in the user's directory?
+	 */
+	inline bool existsAt(const Directory& dir, const std::string& name)
+	{
+		struct stat st;
+		return (dir.fd >= 0) && (::fstatat(dir.fd, name.c_str(), &st, 0) == 0) && S_ISREG(st.st_mode);
+	}
+
+	inline bool statAt(const Directory& dir, const std::string& name, struct stat& st)
+	{
+		return (dir.fd >= 0) && (::fstatat(dir.fd, name.c_str(), &st, 0) == 0);
+	}
+
+	inline bool removeAt(const Directory& dir, const std::string& name)
+	{
+		return (dir.fd >= 0) && (::unlinkat(dir.fd, name.c_str(), 0) == 0);
+	}
+
+	/**
+	   @brief does the directory hold any entry? stops at the first entry instead of listing everything.
+	 */
+	inline bool hasEntries(const Directory& dir)
+	{
+		if (dir.fd < 0)
+			return false;
+		const int fd = ::openat(dir.fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+		DIR* stream = ::fdopendir(fd);
+		if (stream == nullptr)
+		{
+			(void)::close(fd);
+			return false;
+		}
+		bool found = false;
+		while (const dirent* entry = ::readdir(stream))
+		{
+			if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 && !serverEntry(entry->d_name))
+			{
+				found = true;
+				break;
+			}
+		}
+		(void)::closedir(stream);
+		return found;
+	}
+#endif
+
+}
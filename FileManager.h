@@ -9,11 +9,17 @@
 #include "ServerRequest.h"
 #include "ServerResponse.h"
 #include <filesystem>
+#include <future>
+#include "UringStorage.h"
+#include "StorageRoots.h"
+#include "DirectoryCache.h"
+#include "AtRestCipher.h"
+#include "SmallFileStore.h"
+#include "SpaceReclaimer.h"
+#include "TieringManager.h"
 
 namespace FileManager {
 
-#define BACKUP_FOLDER  "c:/backupsvr/"
-
 	bool fileOpen(const std::string& filepath, std::fstream& fs, bool write)
 	{
 		try
@@ -120,10 +126,364 @@ namespace FileManager {
 		}
 	}
 
+#define POSIX_BUFFER_SIZE  (64 * 1024)
+
+	/**
+	   Descriptor based file, used for files opened relative to a cached user directory
+	   when io_uring is not enabled. Small writes are gathered and reads served from a buffer.
+	 */
+	struct PosixFile
+	{
+		int fd;
+		bool write;
+		std::vector<uint8_t> buf;
+		uint32_t bufLen;      // valid bytes in buf.
+		uint32_t bufPos;      // read position in buf.
+		PosixFile() : fd(-1), write(false), bufLen(0), bufPos(0) {}
+	};
+
+	/**
+	   A small file (SmallFileStore) opened for reading: its content, read from memory.
+	 */
+	struct SmallFile
+	{
+		std::vector<uint8_t> data;
+		uint32_t pos;
+		SmallFile() : pos(0) {}
+	};
+
+	/**
+	   A file opened by FileManager. A small file read from the user's container is held in
+	   memory. Sealed (AtRestCipher) when opened relative to a user directory with encryption
+	   at rest enabled. Otherwise backed by the io_uring engine when it is enabled, by a
+	   descriptor when opened relative to a user directory, by std::fstream.
+	 */
+	struct StorageFile
+	{
+		enum EBackend { FSTREAM, URING, POSIX, SEALED, SMALL };
+		std::fstream fs;
+		UringStorage::File uring;
+		PosixFile posix;
+		SmallFile small;
+#if HAVE_AT_REST_CIPHER
+		AtRestCipher::File sealed;
+#endif
+		EBackend backend;
+		StorageFile() : backend(FSTREAM) {}
+	};
+
+	/**
+	   @brief open a storage file for read/write. Create folders in filepath if do not exist.
+	   @param filepath the file's filepath to open.
+	   @param file storage file which will be opened with the filepath.
+	   @param write open file for writing?
+	   @return true if opened successfully. false otherwise.
+	 */
+	bool fileOpen(const std::string& filepath, StorageFile& file, bool write = false)
+	{
+		file.backend = UringStorage::enabled() ? StorageFile::URING : StorageFile::FSTREAM;
+		if (file.backend == StorageFile::FSTREAM)
+			return fileOpen(filepath, file.fs, write);
+		try
+		{
+			if (filepath.empty())
+				return false;
+			(void)create_directories(std::filesystem::path(filepath).parent_path());
+			if (UringStorage::open(filepath, file.uring, write))
+				return true;
+			if (errno == ENOENT || errno == EACCES)
+				return false;   // the file's own answer: fstream would give the same.
+			UringStorage::fallbacks().fetch_add(1, std::memory_order_relaxed);
+			file.backend = StorageFile::FSTREAM;
+			return fileOpen(filepath, file.fs, write);
+		}
+		catch (std::exception&)
+		{
+			return false;
+		}
+	}
+
+	/**
+	   @brief open a storage file relative to a user's directory. no path walk, no mkdir of the user folder.
+	   @param dir the user's cached directory.
+	   @param filename file name within the directory.
+	   @param file storage file which will be opened.
+	   @param write open file for writing?
+	   @return true if opened successfully. false otherwise.
+	 */
+	bool fileOpenAt(const DirectoryCache::Directory& dir, const std::string& filename, StorageFile& file, bool write = false)
+	{
+		if (write)
+			(void)TieringManager::instance().remove(dir, filename);   // a small entry stays until the new file is stored: fileReplacedAt().
+		else if (SmallFileStore::instance().get(dir, filename, file.small.data))
+		{
+			file.backend = StorageFile::SMALL;
+			file.small.pos = 0;
+			return true;
+		}
+		else if (!TieringManager::instance().accessed(dir, filename))
+			return false;   // cold, and could not be brought back.
+#if HAVE_AT_REST_CIPHER
+		if (AtRestCipher::enabled() && !filename.empty())
+		{
+			const int flags = write ? (O_WRONLY | O_CREAT | O_TRUNC) : O_RDONLY;
+			int fd = -1;
+			if (dir.fd >= 0)
+				fd = DirectoryCache::openAt(dir, filename, flags);
+			else
+			{
+				const std::string filepath = dir.folder + filename;
+				std::error_code error;
+				if (write)
+					(void)create_directories(std::filesystem::path(filepath).parent_path(), error);
+				fd = ::open(filepath.c_str(), flags | O_CLOEXEC, 0644);
+			}
+			if (fd < 0)
+				return false;
+			file.backend = StorageFile::SEALED;
+			return write ? file.sealed.create(fd, dir.userID) : file.sealed.open(fd, dir.userID);
+		}
+#endif
+#if HAVE_OPENAT
+		if (dir.fd < 0 || filename.empty())
+			return fileOpen(dir.folder + filename, file, write);
+		if (UringStorage::enabled())
+		{
+			file.backend = StorageFile::URING;
+			if (UringStorage::open(filename, file.uring, write, dir.fd))
+				return true;
+			if (errno == ENOENT && write && filename.find('/') != std::string::npos && DirectoryCache::makeParentsAt(dir, filename)
+				&& UringStorage::open(filename, file.uring, write, dir.fd))
+				return true;
+			if (errno == ENOENT || errno == EACCES)
+				return false;   // the file's own answer: the POSIX path would give the same.
+			UringStorage::fallbacks().fetch_add(1, std::memory_order_relaxed);   // a ring error (full fixed file table, ...): POSIX below.
+		}
+		file.backend = StorageFile::POSIX;
+		file.posix.fd = DirectoryCache::openAt(dir, filename, write ? (O_WRONLY | O_CREAT | O_TRUNC) : O_RDONLY);
+		if (file.posix.fd < 0)
+			return false;
+		file.posix.write = write;
+		file.posix.buf.resize(POSIX_BUFFER_SIZE);
+		file.posix.bufLen = 0;
+		file.posix.bufPos = 0;
+		return true;
+#else
+		return fileOpen(dir.folder + filename, file, write);
+#endif
+	}
+
+#if HAVE_OPENAT
+	bool posixFlush(PosixFile& f)
+	{
+		uint32_t done = 0;
+		while (done < f.bufLen)
+		{
+			const ssize_t res = ::write(f.fd, f.buf.data() + done, f.bufLen - done);
+			if (res < 0 && errno == EINTR)
+				continue;
+			if (res <= 0)
+				return false;
+			done += static_cast<uint32_t>(res);
+		}
+		f.bufLen = 0;
+		return true;
+	}
+#endif
+
+	/**
+	   @brief close storage file. pending writes are flushed first.
+	 */
+	bool fileClose(StorageFile& file)
+	{
+		switch (file.backend)
+		{
+		case StorageFile::URING:
+			return UringStorage::close(file.uring);
+#if HAVE_OPENAT
+		case StorageFile::POSIX:
+		{
+			if (file.posix.fd < 0)
+				return true;
+			const bool flushed = !file.posix.write || posixFlush(file.posix);
+			const bool closed = (::close(file.posix.fd) == 0);
+			file.posix.fd = -1;
+			return flushed && closed;
+		}
+#endif
+#if HAVE_AT_REST_CIPHER
+		case StorageFile::SEALED:
+			return file.sealed.close();
+#endif
+		case StorageFile::SMALL:
+			file.small.data.clear();
+			return true;
+		default:
+			return fileClose(file.fs);
+		}
+	}
+
+	bool fileWrite(StorageFile& file, const uint8_t* const data, const uint32_t bytes)
+	{
+		if (file.backend == StorageFile::FSTREAM)
+			return fileWrite(file.fs, data, bytes);
+		if (data == nullptr || bytes == 0)
+			return false;
+		if (file.backend == StorageFile::URING)
+			return UringStorage::write(file.uring, data, bytes);
+		if (file.backend == StorageFile::SMALL)
+			return false;   // opened for reading only.
+#if HAVE_AT_REST_CIPHER
+		if (file.backend == StorageFile::SEALED)
+			return file.sealed.write(data, bytes);
+#endif
+#if HAVE_OPENAT
+		PosixFile& f = file.posix;
+		if (f.bufLen + bytes > f.buf.size() && !posixFlush(f))
+			return false;
+		if (bytes >= f.buf.size())  // large chunk (e.g. a pipeline slot). write through.
+		{
+			uint32_t done = 0;
+			while (done < bytes)
+			{
+				const ssize_t res = ::write(f.fd, data + done, bytes - done);
+				if (res < 0 && errno == EINTR)
+					continue;
+				if (res <= 0)
+					return false;
+				done += static_cast<uint32_t>(res);
+			}
+			return true;
+		}
+		memcpy(f.buf.data() + f.bufLen, data, bytes);
+		f.bufLen += bytes;
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	/**
+	   @brief read bytes. like fstream::read, a read past end of file is zero-filled and is not an error.
+	 */
+	bool fileRead(StorageFile& file, uint8_t* const data, uint32_t bytes)
+	{
+		if (file.backend == StorageFile::FSTREAM)
+			return fileRead(file.fs, data, bytes);
+		if (data == nullptr || bytes == 0)
+			return false;
+		if (file.backend == StorageFile::URING)
+			return UringStorage::read(file.uring, data, bytes);
+		if (file.backend == StorageFile::SMALL)
+		{
+			SmallFile& f = file.small;
+			const uint32_t left = static_cast<uint32_t>(f.data.size()) - f.pos;
+			const uint32_t chunk = (bytes < left) ? bytes : left;
+			memcpy(data, f.data.data() + f.pos, chunk);
+			memset(data + chunk, 0, bytes - chunk);
+			f.pos += chunk;
+			return true;
+		}
+#if HAVE_AT_REST_CIPHER
+		if (file.backend == StorageFile::SEALED)
+			return file.sealed.read(data, bytes);
+#endif
+#if HAVE_OPENAT
+		PosixFile& f = file.posix;
+		uint8_t* dst = data;
+		while (bytes > 0)
+		{
+			if (f.bufPos == f.bufLen)
+			{
+				const ssize_t res = ::read(f.fd, f.buf.data(), f.buf.size());
+				if (res < 0 && errno == EINTR)
+					continue;
+				if (res < 0)
+					return false;
+				f.bufPos = 0;
+				f.bufLen = static_cast<uint32_t>(res);
+				if (res == 0)
+				{
+					memset(dst, 0, bytes);
+					return true;
+				}
+			}
+			uint32_t chunk = f.bufLen - f.bufPos;
+			if (chunk > bytes)
+				chunk = bytes;
+			memcpy(dst, f.buf.data() + f.bufPos, chunk);
+			f.bufPos += chunk;
+			dst += chunk;
+			bytes -= chunk;
+		}
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	uint32_t fileSize(StorageFile& file)
+	{
+		uint64_t size = 0;
+		switch (file.backend)
+		{
+		case StorageFile::URING:
+			size = UringStorage::Engine::instance().size(file.uring.file);
+			break;
+#if HAVE_OPENAT
+		case StorageFile::POSIX:
+		{
+			struct stat st;
+			if (::fstat(file.posix.fd, &st) == 0)
+				size = static_cast<uint64_t>(st.st_size);
+			break;
+		}
+#endif
+#if HAVE_AT_REST_CIPHER
+		case StorageFile::SEALED:
+			size = file.sealed.size();
+			break;
+#endif
+		case StorageFile::SMALL:
+			size = file.small.data.size();
+			break;
+		default:
+			return fileSize(file.fs);
+		}
+		if (size > UINT32_MAX)    // do not support more than uint32 max size files. (up to 4GB).
+			return 0;
+		return static_cast<uint32_t>(size);
+	}
+
+	/**
+	   @brief flush written data to the device.
+	 */
+	bool fileSync(StorageFile& file)
+	{
+		switch (file.backend)
+		{
+		case StorageFile::URING:
+			return UringStorage::sync(file.uring);
+#if HAVE_OPENAT
+		case StorageFile::POSIX:
+			return posixFlush(file.posix) && (::fsync(file.posix.fd) == 0);
+#endif
+#if HAVE_AT_REST_CIPHER
+		case StorageFile::SEALED:
+			return file.sealed.sync();   // sealed chunks are written as they fill.
+#endif
+		case StorageFile::SMALL:
+			return true;
+		default:
+			file.fs.flush();
+			return !file.fs.fail();
+		}
+	}
+
 	/**
 	   @brief Retrieve a list of file names given a folder path.
 	   @param folderPath the folder to read from
-	   @param filesList the list to append the file names to.
+	   @param filesList the list to append the file names to. server owned entries are skipped.
 	   @return false if error occurred. true, if filesList valid.
 	 */
 	bool getFilesList(std::string& folderPath, std::set<std::string>& filesList)
@@ -132,8 +492,12 @@ namespace FileManager {
 		{
 			for (const auto& entry : std::filesystem::directory_iterator(folderPath))
 			{
-				filesList.insert(entry.path().filename().string());
+				const std::string name = entry.path().filename().string();
+				if (!DirectoryCache::serverEntry(name.c_str()))
+					filesList.insert(name);
 			}
+			SmallFileStore::instance().names(folderPath, filesList);
+			TieringManager::instance().names(folderPath, filesList);
 			return true;
 		}
 		catch (std::exception&)
@@ -184,6 +548,104 @@ namespace FileManager {
 		}
 	}
 
+	/**
+	   @brief Check if file exists within a user's directory. a single fstatat, nothing is opened.
+	   @param dir the user's cached directory.
+	   @param filename file name within the directory.
+	   @return true if file exists.
+	 */
+	bool fileExistsAt(const DirectoryCache::Directory& dir, const std::string& filename)
+	{
+		if (SmallFileStore::instance().contains(dir, filename) || TieringManager::instance().contains(dir.userID, filename))
+			return true;
+#if HAVE_OPENAT
+		if (dir.fd >= 0)
+			return !filename.empty() && DirectoryCache::existsAt(dir, filename);
+#endif
+		return fileExists(dir.folder + filename);
+	}
+
+	/**
+	   @brief drop the regular file of a name, if there is one. freed in the background where possible.
+	 */
+	void discardRegularAt(const DirectoryCache::Directory& dir, const std::string& filename)
+	{
+		if (SpaceReclaimer::instance().discard(dir, filename))
+			return;
+#if HAVE_OPENAT
+		if (dir.fd >= 0 && DirectoryCache::existsAt(dir, filename))
+			(void)DirectoryCache::removeAt(dir, filename);
+		else if (dir.fd < 0 && fileExists(dir.folder + filename))
+			(void)fileRemove(dir.folder + filename);
+#else
+		if (fileExists(dir.folder + filename))
+			(void)fileRemove(dir.folder + filename);
+#endif
+	}
+
+	/**
+	   @brief Removes a file within a user's directory.
+	   @param dir the user's cached directory.
+	   @param filename file name within the directory.
+	   @return true if successfully removed the file. False, otherwise.
+	 */
+	bool fileRemoveAt(const DirectoryCache::Directory& dir, const std::string& filename)
+	{
+		if (SmallFileStore::instance().remove(dir, filename))
+		{
+			discardRegularAt(dir, filename);   // left by an overwrite that failed, if any.
+			return true;
+		}
+		if (TieringManager::instance().remove(dir, filename))
+		{
+			discardRegularAt(dir, filename);   // a hot copy left by a crash between a move and its cleanup, if any.
+			return true;
+		}
+		if (SpaceReclaimer::instance().discard(dir, filename))
+			return true;   // freed in the background.
+#if HAVE_OPENAT
+		if (dir.fd >= 0)
+			return !filename.empty() && DirectoryCache::removeAt(dir, filename);
+#endif
+		return fileRemove(dir.folder + filename);
+	}
+
+	/**
+	   @brief a regular file was written and closed under the name: drop the small entry it replaces.
+	 */
+	void fileReplacedAt(const DirectoryCache::Directory& dir, const std::string& filename)
+	{
+		(void)SmallFileStore::instance().remove(dir, filename);
+	}
+
+	/**
+	   @brief store a small file in the user's container (SmallFileStore) instead of a file of
+	          its own. a regular file of the same name is replaced once the small file is stored.
+	   @param dir outlives `done`.
+	   @param done called once the file is as durable as configured.
+	 */
+	void fileStoreSmallAt(const DirectoryCache::Directory& dir, const std::string& filename, const uint8_t* data, const uint32_t bytes, SmallFileStore::Done done)
+	{
+		(void)TieringManager::instance().remove(dir, filename);
+		SmallFileStore::instance().put(dir, filename, data, bytes, [&dir, filename, done = std::move(done)](const bool stored)
+		{
+			if (stored)
+				discardRegularAt(dir, filename);   // a failed backup leaves the old file.
+			done(stored);
+		});
+	}
+
+	/**
+	   @brief store a small file and wait until it is as durable as configured.
+	 */
+	bool fileStoreSmallAt(const DirectoryCache::Directory& dir, const std::string& filename, const uint8_t* data, const uint32_t bytes)
+	{
+		std::promise<bool> stored;
+		std::future<bool> result = stored.get_future();
+		fileStoreSmallAt(dir, filename, data, bytes, [&stored](const bool ok) { stored.set_value(ok); });
+		return result.get();
+	}
+
 
 
 	/**
@@ -230,9 +692,7 @@ namespace FileManager {
 	{
 		if (userID == 0)
 			return false;
-		std::stringstream ss;
-		ss << BACKUP_FOLDER << userID;
-		auto userFolder = ss.str();
+		auto userFolder = StorageRoots::instance().userFolder(userID);
 		std::set<std::string> userFiles;
 
 		if (!FileManager::getFilesList(userFolder, userFiles))
@@ -240,5 +700,18 @@ namespace FileManager {
 		return (!userFiles.empty());
 	}
 
+	/**
+	   @brief does the user have any file? stops at the first directory entry.
+	   @param dir the user's cached directory.
+	 */
+	bool userHasFilesAt(const DirectoryCache::Directory& dir)
+	{
+#if HAVE_OPENAT
+		if (dir.fd >= 0)
+			return DirectoryCache::hasEntries(dir) || SmallFileStore::instance().hasFiles(dir) || TieringManager::instance().hasFiles(dir.userID);
+#endif
+		return userHasFiles(dir.userID);
+	}
+
 
 }
\ No newline at end of file
@@ -0,0 +1,204 @@
+/**
+  @FileMatcher selection of a user's files by name pattern, for the bulk requests
+  (CLI_FILE_REMOVE_MATCHING, CLI_FILE_STAT_MATCHING).
+  A pattern with none of * ? [ \ is a prefix: it selects every file whose name starts with it.
+  Otherwise it is a glob over the whole name: * matches any run of characters, '/' included,
+  ? one character, [abc] [a-z] [!abc] one of a set, and \ escapes the next character.
+  Files are looked up in the metadata index from the pattern's literal prefix on, so the work
+  follows the matches rather than the user's file count; while the index is not ready the
+  user's folder is walked instead.
+ */
+
+#pragma once
+#include <cstdint>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "DirectoryCache.h"
+#include "FileManager.h"
+#include "MetadataSnapshot.h"
+#include "QuotaManager.h"
+#include "StorageEvents.h"
+
+namespace FileMatcher {
+
+	struct Match
+	{
+		std::string name;
+		MetadataSnapshot::FileMeta meta;
+	};
+
+	/**
+	   @brief is the parsed pattern usable: not empty, and all of the `nameLen` bytes the client
+	          sent? a name holding a NUL parses short, down to "", which as a prefix selects every file.
+	 */
+	inline bool validPattern(const std::string& pattern, const uint16_t nameLen)
+	{
+		return !pattern.empty() && pattern.size() == nameLen;
+	}
+
+	inline bool isGlob(const std::string& pattern)
+	{
+		return pattern.find_first_of("*?[\\") != std::string::npos;
+	}
+
+	/**
+	   @brief the part of a pattern every match starts with.
+	 */
+	inline std::string literalPrefix(const std::string& pattern)
+	{
+		return pattern.substr(0, pattern.find_first_of("*?[\\"));
+	}
+
+	/**
+	   @brief match a bracket expression at pattern[p] ('[' included) against c.
+	   @return position after the expression, or npos if it does not match (or is not closed).
+	 */
+	inline size_t matchSet(const std::string& pattern, size_t p, const char c)
+	{
+		++p;
+		const bool negated = (p < pattern.size() && (pattern[p] == '!' || pattern[p] == '^'));
+		if (negated)
+			++p;
+		bool found = false;
+		bool first = true;
+		while (p < pattern.size() && (pattern[p] != ']' || first))
+		{
+			first = false;
+			char low = pattern[p];
+			if (low == '\\' && p + 1 < pattern.size())
+				low = pattern[++p];
+			char high = low;
+			if (p + 2 < pattern.size() && pattern[p + 1] == '-' && pattern[p + 2] != ']')
+			{
+				high = pattern[p + 2];
+				p += 2;
+			}
+			found = found || (low <= c && c <= high);
+			++p;
+		}
+		if (p >= pattern.size() || found == negated)
+			return std::string::npos;
+		return p + 1;
+	}
+
+	/**
+	   @brief glob match of a whole name. a '*' backtracks to the last star only, so the cost is
+	          at most the product of the lengths.
+	 */
+	inline bool globMatch(const std::string& pattern, const std::string& name)
+	{
+		size_t p = 0;
+		size_t n = 0;
+		size_t starP = std::string::npos;
+		size_t starN = 0;
+		while (n < name.size())
+		{
+			size_t next = std::string::npos;
+			if (p < pattern.size())
+			{
+				switch (pattern[p])
+				{
+				case '*':
+					starP = ++p;
+					starN = n;
+					continue;
+				case '?':
+					next = p + 1;
+					break;
+				case '[':
+					next = matchSet(pattern, p, name[n]);
+					break;
+				case '\\':
+					if (p + 1 < pattern.size() && pattern[p + 1] == name[n])
+						next = p + 2;
+					break;
+				default:
+					if (pattern[p] == name[n])
+						next = p + 1;
+					break;
+				}
+			}
+			if (next != std::string::npos)
+			{
+				p = next;
+				++n;
+			}
+			else if (starP != std::string::npos)
+			{
+				p = starP;
+				n = ++starN;
+			}
+			else
+				return false;
+		}
+		while (p < pattern.size() && pattern[p] == '*')
+			++p;
+		return p == pattern.size();
+	}
+
+	inline bool matches(const std::string& pattern, const std::string& name)
+	{
+		return isGlob(pattern) ? globMatch(pattern, name) : name.compare(0, pattern.size(), pattern) == 0;
+	}
+
+	/**
+	   @brief the user's files matching a pattern, in name order.
+	   @return false if the user's files could not be read.
+	 */
+	inline bool find(const DirectoryCache::Directory& dir, const std::string& pattern, std::vector<Match>& found)
+	{
+		const std::string prefix = literalPrefix(pattern);
+		std::vector<std::pair<std::string, MetadataSnapshot::FileMeta>> candidates;
+		if (!MetadataSnapshot::instance().match(dir.userID, prefix, candidates))
+		{
+			std::map<std::string, MetadataSnapshot::FileMeta> files;
+			if (!MetadataSnapshot::scanFolder(dir.folder, files))
+				return false;
+			for (auto it = files.lower_bound(prefix); it != files.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+				candidates.emplace_back(it->first, it->second);
+		}
+		for (auto& candidate : candidates)
+		{
+			if (matches(pattern, candidate.first))
+				found.push_back(Match{ std::move(candidate.first), candidate.second });
+		}
+		return true;
+	}
+
+	/**
+	   @brief "<size> <mtime (ns since epoch, 0 if unknown)> <name>" per file.
+	 */
+	inline std::vector<std::string> statLines(const std::vector<Match>& found)
+	{
+		std::vector<std::string> lines;
+		lines.reserve(found.size());
+		for (const auto& match : found)
+			lines.push_back(std::to_string(match.meta.size) + " " + std::to_string(match.meta.mtimeNs) + " " + match.name);
+		return lines;
+	}
+
+	/**
+	   @brief remove matched files one by one, as CLI_FILE_REMOVE does.
+	   @return "<status> <name>" per file: SUCCESS_BACKUP_DELETE, or ERROR_GENERIC if it could not be removed.
+	 */
+	inline std::vector<std::string> removeAll(const uint32_t userID, const DirectoryCache::Directory& dir, const std::vector<Match>& found, std::stringstream& err)
+	{
+		std::vector<std::string> lines;
+		lines.reserve(found.size());
+		for (const auto& match : found)
+		{
+			const QuotaManager::Prior prior = QuotaManager::instance().prior(dir, match.name);
+			const bool removed = FileManager::fileRemoveAt(dir, match.name);
+			if (removed)
+				StorageEvents::onRemoved(dir, match.name, prior, err);
+			else
+				err << "Request Error for user ID #" << +userID << ": deletion of " << match.name << " failed!" << std::endl;
+			lines.push_back(std::to_string(removed ? ServerResponse::Response::SUCCESS_BACKUP_DELETE : ServerResponse::Response::ERROR_GENERIC) + " " + match.name);
+		}
+		return lines;
+	}
+
+}
@@ -0,0 +1,293 @@
+/**
+  @LoadGenerator end-to-end load generator speaking the server's wire format.
+  Drives a configurable mix of backup/restore/remove/list requests from concurrent
+  clients against a running server and reports throughput and latency percentiles per
+  operation. Named scenarios fix every knob, so runs against different server builds on
+  the same machine are comparable.
+
+  usage: LoadGenerator [--scenario=NAME] [--host=127.0.0.1] [--port=8080] [--threads=N]
+                       [--users=N] [--files=N] [--sizes=512,64K,1M,1G] [--duration=SEC]
+                       [--mix=backup:40,restore:40,remove:10,list:10] [--no-prepare]
+ */
+
+#include "ProtocolClient.h"
+#include "Metrics.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+	enum EMixOp { MIX_BACKUP, MIX_RESTORE, MIX_REMOVE, MIX_LIST, MIX_OPS };
+	const char* mixNames[MIX_OPS] = { "backup", "restore", "remove", "list" };
+
+	struct Options
+	{
+		std::string scenario = "mixed";
+		std::string host = "127.0.0.1";
+		uint16_t port = 8080;
+		uint32_t threads = 16;
+		uint32_t users = 100;
+		uint32_t files = 16;                    // distinct filenames per user.
+		std::vector<uint32_t> sizes{ 1024, 64 * 1024, 1024 * 1024 };
+		uint32_t weights[MIX_OPS] = { 40, 40, 10, 10 };
+		uint32_t duration = 30;                 // seconds.
+		bool prepare = true;                    // back up every (user, file) before measuring.
+	};
+
+	struct OpStats
+	{
+		std::atomic<uint64_t> ok{ 0 };
+		std::atomic<uint64_t> misses{ 0 };       // ERROR_NOT_EXIST / ERROR_NO_FILES: expected with removes in the mix.
+		std::atomic<uint64_t> errors{ 0 };       // connection failures and other statuses.
+		std::atomic<uint64_t> bytes{ 0 };
+		Metrics::Histogram latency;              // microseconds.
+	};
+
+	uint32_t parseSize(const std::string& text)
+	{
+		double value = atof(text.c_str());
+		switch (text.empty() ? ' ' : text.back())
+		{
+		case 'K': case 'k': value *= 1024; break;
+		case 'M': case 'm': value *= 1024 * 1024; break;
+		case 'G': case 'g': value *= 1024.0 * 1024 * 1024; break;
+		default: break;
+		}
+		return (value >= UINT32_MAX) ? UINT32_MAX : static_cast<uint32_t>(value);
+	}
+
+	/**
+	   @brief apply a named scenario. explicit options given after it override its values.
+	 */
+	bool applyScenario(const std::string& name, Options& options)
+	{
+		const std::map<std::string, std::function<void(Options&)>> scenarios = {
+			{ "small-backup", [](Options& o) { o.threads = 32; o.users = 1000; o.sizes = { 512 }; o.weights[MIX_BACKUP] = 100; o.weights[MIX_RESTORE] = o.weights[MIX_REMOVE] = o.weights[MIX_LIST] = 0; o.prepare = false; } },
+			{ "large-backup", [](Options& o) { o.threads = 4; o.users = 4; o.files = 2; o.sizes = { 256u * 1024 * 1024 }; o.weights[MIX_BACKUP] = 100; o.weights[MIX_RESTORE] = o.weights[MIX_REMOVE] = o.weights[MIX_LIST] = 0; o.prepare = false; } },
+			{ "restore-heavy", [](Options& o) { o.threads = 16; o.users = 50; o.sizes = { 1024 * 1024 }; o.weights[MIX_BACKUP] = 10; o.weights[MIX_RESTORE] = 90; o.weights[MIX_REMOVE] = o.weights[MIX_LIST] = 0; } },
+			{ "list-heavy", [](Options& o) { o.threads = 16; o.users = 50; o.files = 256; o.sizes = { 128 }; o.weights[MIX_BACKUP] = 10; o.weights[MIX_LIST] = 90; o.weights[MIX_RESTORE] = o.weights[MIX_REMOVE] = 0; } },
+			{ "mixed", [](Options& o) { o.threads = 16; o.users = 100; o.sizes = { 1024, 64 * 1024, 1024 * 1024 }; o.weights[MIX_BACKUP] = 40; o.weights[MIX_RESTORE] = 40; o.weights[MIX_REMOVE] = 10; o.weights[MIX_LIST] = 10; } },
+		};
+		const auto it = scenarios.find(name);
+		if (it == scenarios.end())
+			return false;
+		options.scenario = name;
+		it->second(options);
+		return true;
+	}
+
+	bool parseOptions(int argc, char* argv[], Options& options)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string arg(argv[i]);
+			if (arg.rfind("--scenario=", 0) == 0 && !applyScenario(arg.substr(11), options))
+			{
+				fprintf(stderr, "unknown scenario %s\n", arg.substr(11).c_str());
+				return false;
+			}
+		}
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string arg(argv[i]);
+			const size_t eq = arg.find('=');
+			const std::string key = arg.substr(0, eq);
+			const std::string value = (eq == std::string::npos) ? "" : arg.substr(eq + 1);
+			if (key == "--scenario")
+				continue;
+			else if (key == "--host")
+				options.host = value;
+			else if (key == "--port")
+				options.port = static_cast<uint16_t>(atoi(value.c_str()));
+			else if (key == "--threads")
+				options.threads = static_cast<uint32_t>(atoi(value.c_str()));
+			else if (key == "--users")
+				options.users = static_cast<uint32_t>(atoi(value.c_str()));
+			else if (key == "--files")
+				options.files = static_cast<uint32_t>(atoi(value.c_str()));
+			else if (key == "--duration")
+				options.duration = static_cast<uint32_t>(atoi(value.c_str()));
+			else if (key == "--no-prepare")
+				options.prepare = false;
+			else if (key == "--sizes")
+			{
+				options.sizes.clear();
+				std::stringstream list(value);
+				std::string size;
+				while (std::getline(list, size, ','))
+					options.sizes.push_back(parseSize(size));
+			}
+			else if (key == "--mix")
+			{
+				for (auto& weight : options.weights)
+					weight = 0;
+				std::stringstream list(value);
+				std::string entry;
+				while (std::getline(list, entry, ','))
+				{
+					const size_t colon = entry.find(':');
+					for (int op = 0; op < MIX_OPS; ++op)
+					{
+						if (entry.substr(0, colon) == mixNames[op])
+							options.weights[op] = static_cast<uint32_t>(atoi(entry.substr(colon + 1).c_str()));
+					}
+				}
+			}
+			else
+			{
+				fprintf(stderr, "unknown option %s\n", arg.c_str());
+				return false;
+			}
+		}
+		return !options.sizes.empty() && options.threads > 0 && options.users > 0 && options.files > 0;
+	}
+
+	std::string fileName(const uint32_t file)
+	{
+		return "load_" + std::to_string(file) + ".bin";
+	}
+
+	/**
+	   a file keeps the same size during a run, so restores move what backups wrote.
+	 */
+	uint32_t fileSize(const Options& options, const uint32_t file)
+	{
+		return options.sizes[file % options.sizes.size()];
+	}
+
+	void runWorker(const Options& options, const boost::asio::ip::tcp::endpoint& server, const std::vector<uint8_t>& pattern,
+		OpStats (&stats)[MIX_OPS], const std::chrono::steady_clock::time_point deadline, const uint32_t seed)
+	{
+		boost::asio::io_context io;
+		ProtocolClient::Client client(io, server);
+		std::mt19937 random(seed);
+		uint32_t totalWeight = 0;
+		for (const uint32_t weight : options.weights)
+			totalWeight += weight;
+		while (std::chrono::steady_clock::now() < deadline)
+		{
+			uint32_t pick = random() % totalWeight;
+			int op = 0;
+			while (pick >= options.weights[op])
+				pick -= options.weights[op++];
+			const uint32_t userID = 1 + (random() % options.users);
+			const uint32_t file = random() % options.files;
+			ProtocolClient::Reply reply;
+			bool ok = false;
+			const auto start = std::chrono::steady_clock::now();
+			switch (op)
+			{
+			case MIX_BACKUP: ok = client.backup(userID, fileName(file), fileSize(options, file), pattern, reply); break;
+			case MIX_RESTORE: ok = client.restore(userID, fileName(file), reply); break;
+			case MIX_REMOVE: ok = client.remove(userID, fileName(file), reply); break;
+			default: ok = client.list(userID, reply); break;
+			}
+			stats[op].latency.record(Metrics::elapsedMicros(start));
+			if (!ok)
+				stats[op].errors.fetch_add(1, std::memory_order_relaxed);
+			else if (reply.status == ProtocolClient::ERROR_NOT_EXIST || reply.status == ProtocolClient::ERROR_NO_FILES)
+				stats[op].misses.fetch_add(1, std::memory_order_relaxed);
+			else if (reply.status == ProtocolClient::ERROR_GENERIC)
+				stats[op].errors.fetch_add(1, std::memory_order_relaxed);
+			else
+			{
+				stats[op].ok.fetch_add(1, std::memory_order_relaxed);
+				stats[op].bytes.fetch_add((op == MIX_BACKUP) ? fileSize(options, file) : reply.received, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	/**
+	   @brief back up every (user, file) once so restores and removes hit existing files.
+	 */
+	bool prepare(const Options& options, const boost::asio::ip::tcp::endpoint& server, const std::vector<uint8_t>& pattern)
+	{
+		std::atomic<uint32_t> next{ 0 };
+		std::atomic<uint32_t> failures{ 0 };
+		std::vector<std::thread> workers;
+		const uint32_t total = options.users * options.files;
+		for (uint32_t t = 0; t < options.threads; ++t)
+		{
+			workers.emplace_back([&]()
+			{
+				boost::asio::io_context io;
+				ProtocolClient::Client client(io, server);
+				for (uint32_t i = next++; i < total; i = next++)
+				{
+					ProtocolClient::Reply reply;
+					const uint32_t file = i % options.files;
+					if (!client.backup(1 + (i / options.files), fileName(file), fileSize(options, file), pattern, reply) || reply.status != ProtocolClient::SUCCESS_BACKUP_DELETE)
+						++failures;
+				}
+			});
+		}
+		for (auto& worker : workers)
+			worker.join();
+		return failures == 0;
+	}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	applyScenario(options.scenario, options);
+	if (!parseOptions(argc, argv, options))
+	{
+		printf("usage: %s [--scenario=small-backup|large-backup|restore-heavy|list-heavy|mixed] [--host=H] [--port=P] [--threads=N]\n"
+			"          [--users=N] [--files=N] [--sizes=512,64K,1M,1G] [--duration=SEC] [--mix=backup:40,restore:40,remove:10,list:10] [--no-prepare]\n", argv[0]);
+		return 1;
+	}
+	uint32_t totalWeight = 0;
+	for (const uint32_t weight : options.weights)
+		totalWeight += weight;
+	if (totalWeight == 0)
+	{
+		printf("empty mix\n");
+		return 1;
+	}
+
+	const boost::asio::ip::tcp::endpoint server(boost::asio::ip::make_address(options.host), options.port);
+	std::vector<uint8_t> pattern(1024 * 1024 + 7);   // odd length: consecutive packets differ.
+	std::mt19937 random(42);
+	for (auto& byte : pattern)
+		byte = static_cast<uint8_t>(random());
+
+	printf("scenario %s: %u threads, %u users x %u files, %zu sizes, %u s\n", options.scenario.c_str(), options.threads, options.users, options.files, options.sizes.size(), options.duration);
+	const bool needsFiles = options.weights[MIX_RESTORE] > 0 || options.weights[MIX_REMOVE] > 0 || options.weights[MIX_LIST] > 0;
+	if (options.prepare && needsFiles && !prepare(options, server, pattern))
+		printf("warning: some files failed to back up during preparation\n");
+
+	OpStats stats[MIX_OPS];
+	const auto start = std::chrono::steady_clock::now();
+	const auto deadline = start + std::chrono::seconds(options.duration);
+	std::vector<std::thread> workers;
+	for (uint32_t t = 0; t < options.threads; ++t)
+		workers.emplace_back([&, t]() { runWorker(options, server, pattern, stats, deadline, 1000 + t); });
+	for (auto& worker : workers)
+		worker.join();
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("%-8s %10s %8s %8s %10s %10s %10s %10s %10s\n", "op", "ok", "miss", "errors", "ops/s", "MB/s", "p50 ms", "p99 ms", "p999 ms");
+	for (int op = 0; op < MIX_OPS; ++op)
+	{
+		const OpStats& s = stats[op];
+		if (s.latency.count() == 0)
+			continue;
+		printf("%-8s %10llu %8llu %8llu %10.1f %10.2f %10.3f %10.3f %10.3f\n", mixNames[op],
+			static_cast<unsigned long long>(s.ok.load()), static_cast<unsigned long long>(s.misses.load()), static_cast<unsigned long long>(s.errors.load()),
+			static_cast<double>(s.latency.count()) / seconds, static_cast<double>(s.bytes.load()) / (1024.0 * 1024.0) / seconds,
+			s.latency.quantile(0.5) / 1000.0, s.latency.quantile(0.99) / 1000.0, s.latency.quantile(0.999) / 1000.0);
+	}
+	return 0;
+}
@@ -0,0 +1,1161 @@
+/**
+  @MetadataSnapshot persistent index of the users' files (name, size, modification time).
+  Building an index from the directories means walking every user folder on every root, which
+  takes long on big trees. The index is instead written periodically to a snapshot file laid out
+  flat, so that at startup it is mmapped and used as is:
+      header   "BSVRMETA", format, header CRC, sequence, creation time, counts, region CRCs. 64 bytes.
+      files    32 bytes per file: name offset, name length, size, mtime (ns). by user, then by name.
+      users    32 bytes per user: user ID, first file, file count, bytes. by user ID.
+      names    the names, unterminated.
+  Integers are in host order. Checksums are CRC32C, with the SSE4.2 instruction when the CPU has it.
+  Changes since the snapshot are kept in memory on top of it and appended to a change log
+  (<snapshot>.log) under increasing sequence numbers. At startup the snapshot's header is
+  checked, the log replayed over it and lookups are served at once; the regions are verified
+  in the background. The snapshot is rewritten when the interval passes or the log grows past
+  its limit: the mapped snapshot and the changes are merged into a new file that replaces the
+  old one by rename, and the log is cut to the changes made meanwhile.
+  The roots are walked only when the snapshot is missing or corrupt, in the background. Until
+  then lookups answer "not ready" and callers read the directories.
+  Configuration: BACKUPSVR_METADATA (0 disables), BACKUPSVR_METADATA_SNAPSHOT (path),
+                 BACKUPSVR_METADATA_INTERVAL_S, BACKUPSVR_METADATA_LOG_MAX (records).
+ */
+
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "StorageRoots.h"
+#include "DirectoryCache.h"
+#include "AtRestCipher.h"
+#include "SmallFileStore.h"
+#include "TieringManager.h"
+
+#if defined(_WIN32)
+#define HAVE_METADATA_SNAPSHOT 0
+#else
+#define HAVE_METADATA_SNAPSHOT 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_CRC32C_SSE42 1
+#include <nmmintrin.h>
+#else
+#define HAVE_CRC32C_SSE42 0
+#endif
+
+#define METADATA_SNAPSHOT_FILE  "metadata.snapshot"
+#define METADATA_INTERVAL_S  300
+#define METADATA_LOG_MAX  1000000             // change log records that start a snapshot before the interval ends.
+#define METADATA_FORMAT  1
+#define METADATA_HEADER  64
+#define METADATA_RECORD  32                   // file and user records.
+#define METADATA_LOG_RECORD  39               // change log record without the name.
+#define METADATA_MAX_NAME  (8 * 1024)         // names are at most FILENAME_MAX.
+#define METADATA_WRITE_BUFFER  (1024 * 1024)
+#define METADATA_ENV  "BACKUPSVR_METADATA"
+#define METADATA_SNAPSHOT_ENV  "BACKUPSVR_METADATA_SNAPSHOT"
+#define METADATA_INTERVAL_ENV  "BACKUPSVR_METADATA_INTERVAL_S"
+#define METADATA_LOG_MAX_ENV  "BACKUPSVR_METADATA_LOG_MAX"
+
+namespace MetadataSnapshot {
+
+	inline uint32_t crc32cSoftware(uint32_t crc, const uint8_t* data, size_t length)
+	{
+		static const std::array<uint32_t, 256> table = []()
+		{
+			std::array<uint32_t, 256> t{};
+			for (uint32_t i = 0; i < t.size(); ++i)
+			{
+				uint32_t c = i;
+				for (int bit = 0; bit < 8; ++bit)
+					c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : (c >> 1);
+				t[i] = c;
+			}
+			return t;
+		}();
+		for (; length > 0; ++data, --length)
+			crc = table[(crc ^ *data) & 0xFF] ^ (crc >> 8);
+		return crc;
+	}
+
+#if HAVE_CRC32C_SSE42
+	__attribute__((target("sse4.2"))) inline uint32_t crc32cHardware(uint32_t crc, const uint8_t* data, size_t length)
+	{
+#if defined(__x86_64__)
+		for (; length >= sizeof(uint64_t); data += sizeof(uint64_t), length -= sizeof(uint64_t))
+		{
+			uint64_t word = 0;
+			memcpy(&word, data, sizeof(word));
+			crc = static_cast<uint32_t>(_mm_crc32_u64(crc, word));
+		}
+#endif
+		for (; length > 0; ++data, --length)
+			crc = _mm_crc32_u8(crc, *data);
+		return crc;
+	}
+#endif
+
+	/**
+	   @brief CRC32C (Castagnoli) of a buffer.
+	   @param crc the CRC of the preceding bytes, to checksum a region in pieces.
+	 */
+	inline uint32_t crc32c(const void* data, const size_t length, const uint32_t crc = 0)
+	{
+		const auto* bytes = static_cast<const uint8_t*>(data);
+#if HAVE_CRC32C_SSE42
+		static const bool hardware = __builtin_cpu_supports("sse4.2");
+		if (hardware)
+			return ~crc32cHardware(~crc, bytes, length);
+#endif
+		return ~crc32cSoftware(~crc, bytes, length);
+	}
+
+	struct Config
+	{
+		bool enabled = true;
+		std::string path = METADATA_SNAPSHOT_FILE;
+		std::chrono::seconds interval{ METADATA_INTERVAL_S };
+		uint64_t logMax = METADATA_LOG_MAX;
+	};
+
+	inline const Config& config()
+	{
+		static const Config configured = []()
+		{
+			Config c;
+			const char* enabled = getenv(METADATA_ENV);
+			const char* path = getenv(METADATA_SNAPSHOT_ENV);
+			const char* interval = getenv(METADATA_INTERVAL_ENV);
+			const char* logMax = getenv(METADATA_LOG_MAX_ENV);
+			if (enabled != nullptr)
+				c.enabled = (atoi(enabled) != 0);
+			if (path != nullptr && *path != '\0')
+				c.path = path;
+			if (interval != nullptr && atoi(interval) > 0)
+				c.interval = std::chrono::seconds(atoi(interval));
+			if (logMax != nullptr && atoll(logMax) > 0)
+				c.logMax = static_cast<uint64_t>(atoll(logMax));
+			return c;
+		}();
+		return configured;
+	}
+
+	struct Stats
+	{
+		std::atomic<uint64_t> snapshots{ 0 };        // snapshots written.
+		std::atomic<uint64_t> snapshotErrors{ 0 };
+		std::atomic<uint64_t> rescans{ 0 };          // walks of the roots, for a missing or corrupt snapshot.
+		std::atomic<uint64_t> replayed{ 0 };         // change log records applied at startup.
+		std::atomic<uint64_t> logRecords{ 0 };       // changes not in the snapshot yet.
+		std::atomic<uint64_t> logErrors{ 0 };
+		std::atomic<uint64_t> files{ 0 };            // files in the current snapshot.
+		std::atomic<uint64_t> readyNs{ 0 };          // from startup until lookups were served.
+		std::atomic<uint64_t> snapshotNs{ 0 };       // duration of the last snapshot write.
+	};
+
+	inline Stats& stats()
+	{
+		static Stats s;
+		return s;
+	}
+
+	struct FileMeta
+	{
+		uint64_t size = 0;
+		uint64_t mtimeNs = 0;   // 0 if unknown (small files found by a rescan).
+	};
+
+	struct Usage
+	{
+		uint64_t files = 0;
+		uint64_t bytes = 0;
+	};
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t format;
+		uint32_t headerCrc;     // of the header with this field 0.
+		uint64_t sequence;      // last change included.
+		uint64_t createdNs;
+		uint64_t files;
+		uint64_t nameBytes;
+		uint32_t users;
+		uint32_t filesCrc;
+		uint32_t usersCrc;
+		uint32_t namesCrc;
+	};
+
+	struct FileRecord
+	{
+		uint64_t nameOffset;
+		uint32_t nameLen;
+		uint32_t reserved;
+		uint64_t size;
+		uint64_t mtimeNs;
+	};
+
+	struct UserRecord
+	{
+		uint32_t userID;
+		uint32_t reserved;
+		uint64_t firstFile;
+		uint64_t fileCount;
+		uint64_t bytes;
+	};
+
+	static_assert(sizeof(Header) == METADATA_HEADER && sizeof(FileRecord) == METADATA_RECORD && sizeof(UserRecord) == METADATA_RECORD, "snapshot layout");
+
+	struct Change
+	{
+		uint64_t sequence = 0;
+		bool removed = false;
+		FileMeta meta;
+	};
+
+	using UserChanges = std::map<std::string, Change>;
+	using Changes = std::map<uint32_t, UserChanges>;
+
+	enum EOp : uint8_t { BACKUP = 1, REMOVE = 2 };
+
+	inline uint64_t nowNs()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+	}
+
+	template <typename T>
+	void put(std::string& out, const T& value)
+	{
+		out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+	}
+
+	/**
+	   Change log record: uint32 length of the rest, uint32 CRC32C of the rest, uint64 sequence,
+	   uint8 op, uint32 user ID, uint64 size, uint64 mtime (ns), uint16 name length, name.
+	 */
+	inline std::string encodeChange(const uint32_t userID, const std::string& name, const Change& change)
+	{
+		std::string body;
+		put(body, change.sequence);
+		put(body, static_cast<uint8_t>(change.removed ? REMOVE : BACKUP));
+		put(body, userID);
+		put(body, change.meta.size);
+		put(body, change.meta.mtimeNs);
+		put(body, static_cast<uint16_t>(name.size()));
+		body += name;
+		std::string out;
+		put(out, static_cast<uint32_t>(body.size()));
+		put(out, crc32c(body.data(), body.size()));
+		return out + body;
+	}
+
+	/**
+	   @brief decode one change log record.
+	   @return bytes used, 0 if `length` bytes do not hold a whole valid record.
+	 */
+	inline size_t decodeChange(const uint8_t* data, const size_t length, uint32_t& userID, std::string& name, Change& change)
+	{
+		uint32_t bodyLength = 0;
+		uint32_t crc = 0;
+		if (length < METADATA_LOG_RECORD)
+			return 0;
+		memcpy(&bodyLength, data, sizeof(bodyLength));
+		memcpy(&crc, data + 4, sizeof(crc));
+		if (bodyLength < METADATA_LOG_RECORD - 8 || bodyLength > METADATA_LOG_RECORD - 8 + METADATA_MAX_NAME || length - 8 < bodyLength
+			|| crc32c(data + 8, bodyLength) != crc)
+			return 0;
+		const uint8_t* p = data + 8;
+		uint16_t nameLen = 0;
+		memcpy(&change.sequence, p, sizeof(change.sequence));
+		change.removed = (p[8] == REMOVE);
+		memcpy(&userID, p + 9, sizeof(userID));
+		memcpy(&change.meta.size, p + 13, sizeof(change.meta.size));
+		memcpy(&change.meta.mtimeNs, p + 21, sizeof(change.meta.mtimeNs));
+		memcpy(&nameLen, p + 29, sizeof(nameLen));
+		if (METADATA_LOG_RECORD - 8u + nameLen != bodyLength)
+			return 0;
+		name.assign(reinterpret_cast<const char*>(p + 31), nameLen);
+		return 8 + bodyLength;
+	}
+
+	/**
+	   @brief size (the content's, not the sealed file's) and mtime of a stored regular file.
+	   @return false if there is no regular file at `path`.
+	 */
+	inline bool statPath(const std::string& path, FileMeta& meta)
+	{
+#if HAVE_METADATA_SNAPSHOT
+		struct stat st;
+		if (::lstat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+			return false;
+		meta.size = static_cast<uint64_t>(st.st_size);
+		meta.mtimeNs = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ull + static_cast<uint64_t>(st.st_mtim.tv_nsec);
+#else
+		namespace fs = std::filesystem;
+		std::error_code error;
+		if (!fs::is_regular_file(fs::symlink_status(path, error)))
+			return false;
+		meta.size = static_cast<uint64_t>(fs::file_size(path, error));
+#endif
+#if HAVE_AT_REST_CIPHER
+		if (AtRestCipher::enabled())
+			(void)AtRestCipher::plainSize(path, meta.size);
+#endif
+		return true;
+	}
+
+	/**
+	   @brief one user file, looked up on disk: the small file container and the cold tier first,
+	          as FileManager does.
+	   @return false if the user has no such file.
+	 */
+	inline bool statFile(const std::string& folder, const std::string& name, FileMeta& meta)
+	{
+		if (SmallFileStore::instance().size(folder, name, meta.size))
+			return true;
+		if (TieringManager::instance().stat(TieringManager::Manager::userOf(folder), name, meta.size, meta.mtimeNs))
+			return true;
+		return !name.empty() && statPath(folder + name, meta);
+	}
+
+	/**
+	   @brief read a user folder's files from the directories, the small file container and the cold tier.
+	   @param folder the user's folder, "<root>/<userID>/".
+	   @return false if the walk failed.
+	 */
+	inline bool scanFolder(const std::string& folder, std::map<std::string, FileMeta>& files)
+	{
+		namespace fs = std::filesystem;
+		std::error_code error;
+		fs::recursive_directory_iterator it(folder, fs::directory_options::skip_permission_denied, error);
+		for (const fs::recursive_directory_iterator end; !error && it != end; it.increment(error))
+		{
+			const std::string path = it->path().string();
+			if (it.depth() == 0 && DirectoryCache::serverEntry(it->path().filename().string().c_str()))
+			{
+				it.disable_recursion_pending();
+				continue;
+			}
+			FileMeta meta;
+			if (statPath(path, meta))
+				files[path.substr(folder.size())] = meta;
+		}
+		if (error && error != std::errc::no_such_file_or_directory)
+			return false;
+		std::map<std::string, uint64_t> small;
+		SmallFileStore::instance().sizes(folder, small);
+		for (const auto& file : small)
+			files[file.first].size = file.second;
+		std::vector<std::pair<std::string, TieringManager::Entry>> cold;
+		TieringManager::instance().files(folder, cold);
+		for (const auto& file : cold)
+			files[file.first] = FileMeta{ file.second.size, file.second.mtimeNs };
+		return true;
+	}
+
+#if HAVE_METADATA_SNAPSHOT
+	inline bool readAll(const int fd, void* data, const size_t length, const uint64_t offset)
+	{
+		size_t done = 0;
+		while (done < length)
+		{
+			const ssize_t res = ::pread(fd, static_cast<uint8_t*>(data) + done, length - done, static_cast<off_t>(offset + done));
+			if (res < 0 && errno == EINTR)
+				continue;
+			if (res <= 0)
+				return false;
+			done += static_cast<size_t>(res);
+		}
+		return true;
+	}
+
+	inline bool writeAll(const int fd, const void* data, const size_t length, const uint64_t offset)
+	{
+		size_t done = 0;
+		while (done < length)
+		{
+			const ssize_t res = ::pwrite(fd, static_cast<const uint8_t*>(data) + done, length - done, static_cast<off_t>(offset + done));
+			if (res < 0 && errno == EINTR)
+				continue;
+			if (res <= 0)
+				return false;
+			done += static_cast<size_t>(res);
+		}
+		return true;
+	}
+
+
+	/**
+	   A snapshot mapped read only. Lookups stay inside the mapping even if the regions are
+	   corrupt, so it is used before verify() has read it all.
+	 */
+	class Mapping
+	{
+	public:
+		Mapping() : _data(nullptr), _length(0), _header(), _files(nullptr), _users(nullptr), _names(nullptr) {}
+
+		~Mapping()
+		{
+			if (_data != nullptr)
+				(void)::munmap(const_cast<uint8_t*>(_data), _length);
+		}
+
+		Mapping(const Mapping&) = delete;
+		Mapping& operator=(const Mapping&) = delete;
+
+		/**
+		   @brief map a snapshot and check its header and size. the regions are not read.
+		 */
+		bool open(const std::string& path)
+		{
+			const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+				return false;
+			struct stat st;
+			if (::fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < METADATA_HEADER)
+			{
+				(void)::close(fd);
+				return false;
+			}
+			void* data = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+			(void)::close(fd);
+			if (data == MAP_FAILED)
+				return false;
+			_data = static_cast<const uint8_t*>(data);
+			_length = static_cast<size_t>(st.st_size);
+			memcpy(&_header, _data, sizeof(_header));
+			Header check = _header;
+			check.headerCrc = 0;
+			if (memcmp(_header.magic, "BSVRMETA", 8) != 0 || _header.format != METADATA_FORMAT || crc32c(&check, sizeof(check)) != _header.headerCrc)
+				return false;
+			if (_header.files > _length / METADATA_RECORD || _header.users > _length / METADATA_RECORD
+				|| METADATA_HEADER + (_header.files + _header.users) * METADATA_RECORD + _header.nameBytes != _length)
+				return false;
+			_files = reinterpret_cast<const FileRecord*>(_data + METADATA_HEADER);
+			_users = reinterpret_cast<const UserRecord*>(_files + _header.files);
+			_names = reinterpret_cast<const char*>(_users + _header.users);
+			return true;
+		}
+
+		/**
+		   @brief check the regions against their checksums. reads the whole file.
+		 */
+		bool verify() const
+		{
+			return crc32c(_files, _header.files * METADATA_RECORD) == _header.filesCrc
+				&& crc32c(_users, _header.users * METADATA_RECORD) == _header.usersCrc
+				&& crc32c(_names, _header.nameBytes) == _header.namesCrc;
+		}
+
+		const Header& header() const { return _header; }
+		uint64_t userCount() const { return _header.users; }
+		const UserRecord& userAt(const uint64_t index) const { return _users[index]; }
+
+		bool valid(const UserRecord& user) const
+		{
+			return user.firstFile <= _header.files && user.fileCount <= _header.files - user.firstFile;
+		}
+
+		/**
+		   @return the user's record, nullptr if the snapshot has no files of the user.
+		 */
+		const UserRecord* user(const uint32_t userID) const
+		{
+			const UserRecord* end = _users + _header.users;
+			const UserRecord* it = std::lower_bound(_users, end, userID, [](const UserRecord& u, const uint32_t id) { return u.userID < id; });
+			return (it != end && it->userID == userID && valid(*it)) ? it : nullptr;
+		}
+
+		const FileRecord* files(const UserRecord& user) const { return _files + user.firstFile; }
+
+		std::string_view name(const FileRecord& file) const
+		{
+			if (file.nameOffset > _header.nameBytes || file.nameLen > _header.nameBytes - file.nameOffset)
+				return std::string_view();
+			return std::string_view(_names + file.nameOffset, file.nameLen);
+		}
+
+		/**
+		   @return the user's file of that name, nullptr if none.
+		 */
+		const FileRecord* find(const UserRecord& user, const std::string_view name) const
+		{
+			const FileRecord* begin = files(user);
+			const FileRecord* end = begin + user.fileCount;
+			const FileRecord* it = std::lower_bound(begin, end, name, [this](const FileRecord& f, const std::string_view n) { return this->name(f) < n; });
+			return (it != end && this->name(*it) == name) ? it : nullptr;
+		}
+
+	private:
+		const uint8_t* _data;
+		size_t _length;
+		Header _header;
+		const FileRecord* _files;
+		const UserRecord* _users;
+		const char* _names;
+	};
+
+
+	/**
+	   Writes a snapshot: the file records go in place after the header and the names to a side
+	   file, which is appended after the user records once the counts are known.
+	   Files are added in (user ID, name) order.
+	 */
+	class Writer
+	{
+	public:
+		Writer() : _out(-1), _names(-1), _filesEnd(METADATA_HEADER), _namesWritten(0), _nameBytes(0), _fileCount(0), _filesCrc(0), _namesCrc(0) {}
+
+		~Writer()
+		{
+			discard();
+		}
+
+		Writer(const Writer&) = delete;
+		Writer& operator=(const Writer&) = delete;
+
+		bool begin(const std::string& path)
+		{
+			_path = path;
+			_out = ::open(pendingPath().c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			_names = ::open(namesPath().c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			return _out >= 0 && _names >= 0;
+		}
+
+		bool add(const uint32_t userID, const std::string_view name, const FileMeta& meta)
+		{
+			if (_users.empty() || _users.back().userID != userID)
+			{
+				UserRecord user{};
+				user.userID = userID;
+				user.firstFile = _fileCount;
+				_users.push_back(user);
+			}
+			_users.back().fileCount += 1;
+			_users.back().bytes += meta.size;
+			FileRecord file{};
+			file.nameOffset = _nameBytes;
+			file.nameLen = static_cast<uint32_t>(name.size());
+			file.size = meta.size;
+			file.mtimeNs = meta.mtimeNs;
+			_fileCount += 1;
+			_nameBytes += name.size();
+			return append(_out, _fileBuffer, &file, sizeof(file), _filesEnd, _filesCrc)
+				&& append(_names, _nameBuffer, name.data(), name.size(), _namesWritten, _namesCrc);
+		}
+
+		/**
+		   @brief write the user records, the names and the header, sync, and replace the snapshot by rename.
+		   @param sequence the last change the snapshot includes.
+		 */
+		bool finish(const uint64_t sequence)
+		{
+			if (!drain(_out, _fileBuffer, _filesEnd, _filesCrc) || !drain(_names, _nameBuffer, _namesWritten, _namesCrc))
+				return false;
+			const uint64_t usersBytes = _users.size() * sizeof(UserRecord);
+			if (!writeAll(_out, _users.data(), usersBytes, _filesEnd))
+				return false;
+			std::vector<uint8_t> chunk(METADATA_WRITE_BUFFER);
+			for (uint64_t done = 0; done < _nameBytes; done += chunk.size())
+			{
+				const size_t length = static_cast<size_t>(std::min<uint64_t>(chunk.size(), _nameBytes - done));
+				if (!readAll(_names, chunk.data(), length, done) || !writeAll(_out, chunk.data(), length, _filesEnd + usersBytes + done))
+					return false;
+			}
+			Header header{};
+			memcpy(header.magic, "BSVRMETA", 8);
+			header.format = METADATA_FORMAT;
+			header.sequence = sequence;
+			header.createdNs = nowNs();
+			header.users = static_cast<uint32_t>(_users.size());
+			header.files = _fileCount;
+			header.nameBytes = _nameBytes;
+			header.filesCrc = _filesCrc;
+			header.usersCrc = crc32c(_users.data(), usersBytes);
+			header.namesCrc = _namesCrc;
+			header.headerCrc = crc32c(&header, sizeof(header));
+			if (!writeAll(_out, &header, sizeof(header), 0) || ::fdatasync(_out) != 0)
+				return false;
+			(void)::close(_out);
+			_out = -1;
+			if (::rename(pendingPath().c_str(), _path.c_str()) != 0)
+				return false;
+			discard();
+			return true;
+		}
+
+	private:
+		std::string pendingPath() const { return _path + ".tmp"; }
+		std::string namesPath() const { return _path + ".names.tmp"; }
+
+		static bool append(const int fd, std::vector<uint8_t>& buffer, const void* data, const size_t length, uint64_t& offset, uint32_t& crc)
+		{
+			const auto* bytes = static_cast<const uint8_t*>(data);
+			buffer.insert(buffer.end(), bytes, bytes + length);
+			return buffer.size() < METADATA_WRITE_BUFFER || drain(fd, buffer, offset, crc);
+		}
+
+		static bool drain(const int fd, std::vector<uint8_t>& buffer, uint64_t& offset, uint32_t& crc)
+		{
+			if (!writeAll(fd, buffer.data(), buffer.size(), offset))
+				return false;
+			crc = crc32c(buffer.data(), buffer.size(), crc);
+			offset += buffer.size();
+			buffer.clear();
+			return true;
+		}
+
+		void discard()
+		{
+			if (_out >= 0)
+				(void)::close(_out);
+			if (_names >= 0)
+				(void)::close(_names);
+			_out = -1;
+			_names = -1;
+			if (!_path.empty())
+			{
+				(void)::unlink(pendingPath().c_str());
+				(void)::unlink(namesPath().c_str());
+			}
+		}
+
+		std::string _path;
+		int _out;
+		int _names;
+		uint64_t _filesEnd;
+		uint64_t _namesWritten;
+		uint64_t _nameBytes;
+		uint64_t _fileCount;
+		uint32_t _filesCrc;
+		uint32_t _namesCrc;
+		std::vector<uint8_t> _fileBuffer;
+		std::vector<uint8_t> _nameBuffer;
+		std::vector<UserRecord> _users;
+	};
+
+	/**
+	   @brief walk one user's files in name order: the snapshot's with the changes applied.
+	   @param user the user's snapshot record, nullptr if it has none.
+	   @param changes the user's changes, nullptr if none.
+	   @param emit called with (name, meta) per file. returning false stops the walk.
+	   @param from the walk starts at the first name not less than this.
+	   @return false if emit stopped it.
+	 */
+	template <typename Emit>
+	bool mergeFiles(const Mapping* base, const UserRecord* user, const UserChanges* changes, Emit emit, const std::string& from = std::string())
+	{
+		static const UserChanges none;
+		const FileRecord* file = (user != nullptr) ? base->files(*user) : nullptr;
+		const FileRecord* filesEnd = (user != nullptr) ? file + user->fileCount : nullptr;
+		if (!from.empty() && file != nullptr)
+			file = std::lower_bound(file, filesEnd, std::string_view(from), [base](const FileRecord& f, const std::string_view n) { return base->name(f) < n; });
+		if (changes == nullptr)
+			changes = &none;
+		auto change = changes->lower_bound(from);
+		while (file != filesEnd || change != changes->end())
+		{
+			if (file != filesEnd && (change == changes->end() || base->name(*file) < std::string_view(change->first)))
+			{
+				FileMeta meta;
+				meta.size = file->size;
+				meta.mtimeNs = file->mtimeNs;
+				if (!emit(base->name(*file), meta))
+					return false;
+				++file;
+				continue;
+			}
+			if (file != filesEnd && base->name(*file) == change->first)
+				++file;   // replaced or removed.
+			if (!change->second.removed && !emit(std::string_view(change->first), change->second.meta))
+				return false;
+			++change;
+		}
+		return true;
+	}
+
+
+	class Index
+	{
+	public:
+		static Index& instance()
+		{
+			static Index index;
+			return index;
+		}
+
+		bool enabled() const { return _enabled; }
+
+		/**
+		   @brief are lookups answered? false until a missing or corrupt snapshot was rebuilt.
+		 */
+		bool ready() const { return _ready.load(std::memory_order_acquire); }
+
+		void backedUp(const uint32_t userID, const std::string& name, const uint64_t size)
+		{
+			Change change;
+			change.meta.size = size;
+			change.meta.mtimeNs = nowNs();
+			record(userID, name, change);
+		}
+
+		void removed(const uint32_t userID, const std::string& name)
+		{
+			Change change;
+			change.removed = true;
+			record(userID, name, change);
+		}
+
+		/**
+		   @brief add the user's file names to a listing. nested names add their first component, as directories do.
+		   @return false if the index is not ready. the caller lists the directories then.
+		 */
+		bool list(const uint32_t userID, std::set<std::string>& files)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (!ready())
+				return false;
+			(void)mergeFiles(_base.get(), (_base != nullptr) ? _base->user(userID) : nullptr, changesOf(userID), [&files](const std::string_view name, const FileMeta&)
+			{
+				files.insert(std::string(name.substr(0, name.find('/'))));
+				return true;
+			});
+			return true;
+		}
+
+		/**
+		   @brief the user's files whose names start with `prefix`, in name order. costs the matches, not the user's file count.
+		   @return false if the index is not ready.
+		 */
+		bool match(const uint32_t userID, const std::string& prefix, std::vector<std::pair<std::string, FileMeta>>& files)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (!ready())
+				return false;
+			(void)mergeFiles(_base.get(), (_base != nullptr) ? _base->user(userID) : nullptr, changesOf(userID), [&files, &prefix](const std::string_view name, const FileMeta& meta)
+			{
+				if (name.compare(0, prefix.size(), prefix) != 0)
+					return false;   // past the names with the prefix.
+				files.emplace_back(std::string(name), meta);
+				return true;
+			}, prefix);
+			return true;
+		}
+
+		/**
+		   @return false if the index is not ready or has no such file.
+		 */
+		bool find(const uint32_t userID, const std::string& name, FileMeta& meta)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (!ready())
+				return false;
+			const UserChanges* changes = changesOf(userID);
+			if (changes != nullptr)
+			{
+				const auto change = changes->find(name);
+				if (change != changes->end())
+				{
+					meta = change->second.meta;
+					return !change->second.removed;
+				}
+			}
+			const UserRecord* user = (_base != nullptr) ? _base->user(userID) : nullptr;
+			const FileRecord* file = (user != nullptr) ? _base->find(*user, name) : nullptr;
+			if (file == nullptr)
+				return false;
+			meta.size = file->size;
+			meta.mtimeNs = file->mtimeNs;
+			return true;
+		}
+
+		/**
+		   @brief the user's file count and bytes: the snapshot's totals corrected by the changes.
+		   @return false if the index is not ready.
+		 */
+		bool usage(const uint32_t userID, Usage& usage)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (!ready())
+				return false;
+			const UserRecord* user = (_base != nullptr) ? _base->user(userID) : nullptr;
+			usage = Usage();
+			if (user != nullptr)
+			{
+				usage.files = user->fileCount;
+				usage.bytes = user->bytes;
+			}
+			const UserChanges* changes = changesOf(userID);
+			if (changes == nullptr)
+				return true;
+			for (const auto& change : *changes)
+			{
+				const FileRecord* file = (user != nullptr) ? _base->find(*user, change.first) : nullptr;
+				if (file != nullptr)
+				{
+					usage.files -= 1;
+					usage.bytes -= file->size;
+				}
+				if (!change.second.removed)
+				{
+					usage.files += 1;
+					usage.bytes += change.second.meta.size;
+				}
+			}
+			return true;
+		}
+
+		~Index()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stopping = true;
+			}
+			_wake.notify_all();
+			if (_writer.joinable())
+				_writer.join();
+			if (_log != nullptr)
+				fclose(_log);
+		}
+
+		Index(const Index&) = delete;
+		Index& operator=(const Index&) = delete;
+
+	private:
+		Index() : _enabled(false), _ready(false), _log(nullptr), _sequence(0), _logRecords(0), _due(false), _stopping(false)
+		{
+			const Config& c = config();
+			(void)stats();
+			(void)StorageRoots::instance();   // constructed first, so they outlive the writer.
+			(void)SmallFileStore::instance();
+			if (!c.enabled)
+				return;
+			_started = std::chrono::steady_clock::now();
+			auto base = std::make_shared<Mapping>();
+			if (base->open(c.path))
+			{
+				_base = base;
+				_sequence = base->header().sequence;
+				replay();
+				stats().files.store(base->header().files, std::memory_order_relaxed);
+				markReady();
+			}
+			else
+			{
+				std::error_code error;
+				std::filesystem::resize_file(logPath(), 0, error);   // stale without its snapshot. the walk covers it.
+			}
+			_log = fopen(logPath().c_str(), "ab");
+			_enabled = true;
+			_writer = std::thread(&Index::run, this);
+		}
+
+		std::string logPath() const { return config().path + ".log"; }
+
+		// callers hold _mutex.
+		const UserChanges* changesOf(const uint32_t userID) const
+		{
+			const auto it = _changes.find(userID);
+			return (it != _changes.end()) ? &it->second : nullptr;
+		}
+
+		void markReady()
+		{
+			if (!_ready.exchange(true, std::memory_order_acq_rel))
+				stats().readyNs.store(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _started).count()), std::memory_order_relaxed);
+		}
+
+		void record(const uint32_t userID, const std::string& name, Change change)
+		{
+			if (!_enabled)
+				return;
+			bool due = false;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				change.sequence = ++_sequence;
+				_changes[userID][name] = change;
+				const std::string bytes = encodeChange(userID, name, change);
+				if (_log == nullptr || fwrite(bytes.data(), 1, bytes.size(), _log) != bytes.size() || fflush(_log) != 0)
+					stats().logErrors.fetch_add(1, std::memory_order_relaxed);   // still in memory: lost only if the server stops before the next snapshot.
+				_logRecords += 1;
+				stats().logRecords.store(_logRecords, std::memory_order_relaxed);
+				due = (_logRecords >= config().logMax && !_due);
+				_due = _due || due;
+			}
+			if (due)
+				_wake.notify_one();
+		}
+
+		/**
+		   @brief apply the change log left by the previous run over the snapshot. a record torn by a crash is cut off.
+		 */
+		void replay()
+		{
+			std::error_code error;
+			const auto size = std::filesystem::file_size(logPath(), error);
+			if (error)
+				return;
+			std::vector<uint8_t> log(static_cast<size_t>(size));
+			FILE* in = fopen(logPath().c_str(), "rb");
+			const bool read = (in != nullptr) && fread(log.data(), 1, log.size(), in) == log.size();
+			if (in != nullptr)
+				fclose(in);
+			if (!read)
+				return;
+			size_t pos = 0;
+			uint32_t userID = 0;
+			std::string name;
+			Change change;
+			while (pos < log.size())
+			{
+				const size_t used = decodeChange(log.data() + pos, log.size() - pos, userID, name, change);
+				if (used == 0)
+					break;
+				pos += used;
+				if (change.sequence <= _base->header().sequence)
+					continue;   // already in the snapshot: the log was not cut before a restart.
+				_changes[userID][name] = change;
+				_sequence = std::max(_sequence, change.sequence);
+				_logRecords += 1;
+				stats().replayed.fetch_add(1, std::memory_order_relaxed);
+			}
+			stats().logRecords.store(_logRecords, std::memory_order_relaxed);
+			if (pos < log.size())
+				std::filesystem::resize_file(logPath(), pos, error);
+		}
+
+		/**
+		   @brief replace the change log by the changes the snapshot does not include. callers hold _mutex.
+		 */
+		void rewriteLog()
+		{
+			const std::string pending = logPath() + ".tmp";
+			FILE* out = fopen(pending.c_str(), "wb");
+			bool ok = (out != nullptr);
+			uint64_t records = 0;
+			for (const auto& user : _changes)
+			{
+				for (const auto& change : user.second)
+				{
+					const std::string bytes = encodeChange(user.first, change.first, change.second);
+					ok = ok && fwrite(bytes.data(), 1, bytes.size(), out) == bytes.size();
+					records += 1;
+				}
+			}
+			ok = ok && fflush(out) == 0 && ::fdatasync(fileno(out)) == 0;
+			if (out != nullptr)
+				fclose(out);
+			if (!ok || ::rename(pending.c_str(), logPath().c_str()) != 0)
+			{
+				(void)::unlink(pending.c_str());   // the old log stays. its extra records are skipped by sequence.
+				stats().logErrors.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			if (_log != nullptr)
+				fclose(_log);
+			_log = fopen(logPath().c_str(), "ab");
+			_logRecords = records;
+			stats().logRecords.store(_logRecords, std::memory_order_relaxed);
+		}
+
+		/**
+		   @brief add every user folder's files to a new snapshot, from the directories and the small file containers.
+		 */
+		bool scan(Writer& writer)
+		{
+			namespace fs = std::filesystem;
+			std::map<uint32_t, std::vector<std::string>> folders;   // a user being migrated has a folder on two roots.
+			StorageRoots::Manager& roots = StorageRoots::instance();
+			for (size_t r = 0; r < roots.rootsCount(); ++r)
+			{
+				const std::string root = roots.rootPath(r);
+				std::error_code error;
+				for (fs::directory_iterator it(root, error), end; !error && it != end; it.increment(error))
+				{
+					const std::string name = it->path().filename().string();
+					char* nameEnd = nullptr;
+					const unsigned long id = strtoul(name.c_str(), &nameEnd, 10);
+					if (nameEnd == name.c_str() || *nameEnd != '\0' || id == 0 || id > UINT32_MAX || !it->is_directory(error))
+						continue;
+					folders[static_cast<uint32_t>(id)].push_back(root + name + "/");
+				}
+			}
+			for (const auto& user : folders)
+			{
+				std::map<std::string, FileMeta> files;
+				for (const auto& folder : user.second)
+				{
+					if (!scanFolder(folder, files))
+						return false;
+				}
+				for (const auto& file : files)
+				{
+					if (!writer.add(user.first, file.first, file.second))
+						return false;
+				}
+			}
+			return true;
+		}
+
+		/**
+		   @brief write a new snapshot: the current one merged with the changes, or the roots walked.
+		 */
+		bool snapshot(const bool rescan)
+		{
+			const auto started = std::chrono::steady_clock::now();
+			std::shared_ptr<const Mapping> base;
+			Changes frozen;
+			uint64_t covered = 0;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				if (!rescan && _changes.empty())
+					return true;
+				base = _base;
+				covered = _sequence;   // a walk sees every change made before it started.
+				if (!rescan)
+					frozen = _changes;
+			}
+			Writer writer;
+			bool ok = writer.begin(config().path) && (rescan ? scan(writer) : merge(writer, *base, frozen)) && writer.finish(covered);
+			auto mapping = std::make_shared<Mapping>();
+			ok = ok && mapping->open(config().path);
+			if (!ok)
+			{
+				stats().snapshotErrors.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_base = mapping;
+				for (auto user = _changes.begin(); user != _changes.end();)
+				{
+					for (auto change = user->second.begin(); change != user->second.end();)
+						change = (change->second.sequence <= covered) ? user->second.erase(change) : std::next(change);
+					user = user->second.empty() ? _changes.erase(user) : std::next(user);
+				}
+				rewriteLog();
+			}
+			markReady();
+			stats().snapshots.fetch_add(1, std::memory_order_relaxed);
+			if (rescan)
+				stats().rescans.fetch_add(1, std::memory_order_relaxed);
+			stats().files.store(mapping->header().files, std::memory_order_relaxed);
+			stats().snapshotNs.store(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count()), std::memory_order_relaxed);
+			return true;
+		}
+
+		static bool merge(Writer& writer, const Mapping& base, const Changes& changes)
+		{
+			uint64_t u = 0;
+			auto c = changes.begin();
+			while (u < base.userCount() || c != changes.end())
+			{
+				const UserRecord* user = nullptr;
+				const UserChanges* userChanges = nullptr;
+				uint32_t userID = 0;
+				if (u < base.userCount() && (c == changes.end() || base.userAt(u).userID <= c->first))
+				{
+					user = &base.userAt(u++);
+					userID = user->userID;
+					if (!base.valid(*user))
+						return false;
+				}
+				if (c != changes.end() && (user == nullptr || c->first == userID))
+				{
+					userChanges = &c->second;
+					userID = c->first;
+					++c;
+				}
+				if (!mergeFiles(&base, user, userChanges, [&writer, userID](const std::string_view name, const FileMeta& meta) { return writer.add(userID, name, meta); }))
+					return false;
+			}
+			return true;
+		}
+
+		void run()
+		{
+			if (_base != nullptr && !_base->verify())   // only this thread replaces _base.
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_ready.store(false, std::memory_order_release);
+				_base.reset();
+			}
+			if (_base == nullptr)
+				(void)snapshot(true);
+			std::unique_lock<std::mutex> lock(_mutex);
+			while (!_stopping)
+			{
+				(void)_wake.wait_for(lock, config().interval, [this] { return _due || _stopping; });
+				if (_stopping)
+					break;
+				_due = false;
+				const bool rescan = (_base == nullptr);   // the walk failed before.
+				lock.unlock();
+				(void)snapshot(rescan);
+				lock.lock();
+			}
+		}
+
+		bool _enabled;
+		std::atomic<bool> _ready;
+		std::chrono::steady_clock::time_point _started;
+		std::mutex _mutex;
+		std::shared_ptr<const Mapping> _base;   // the current snapshot. nullptr until one is loaded or written.
+		Changes _changes;                       // since the snapshot. win over it.
+		FILE* _log;
+		uint64_t _sequence;
+		uint64_t _logRecords;
+		std::condition_variable _wake;
+		bool _due;                              // the log is full: snapshot before the interval ends.
+		bool _stopping;
+		std::thread _writer;
+	};
+#else
+	/**
+	   No snapshot without mmap: never ready, callers read the directories.
+	 */
+	class Index
+	{
+	public:
+		static Index& instance()
+		{
+			static Index index;
+			return index;
+		}
+
+		bool enabled() const { return false; }
+		bool ready() const { return false; }
+		void backedUp(const uint32_t, const std::string&, const uint64_t) {}
+		void removed(const uint32_t, const std::string&) {}
+		bool list(const uint32_t, std::set<std::string>&) { return false; }
+		bool match(const uint32_t, const std::string&, std::vector<std::pair<std::string, FileMeta>>&) { return false; }
+		bool find(const uint32_t, const std::string&, FileMeta&) { return false; }
+		bool usage(const uint32_t, Usage&) { return false; }
+	};
+#endif
+
+	inline Index& instance()
+	{
+		return Index::instance();
+	}
+
+}
@@ -0,0 +1,421 @@
+/**
+  @Metrics lock-free server metrics exposed in Prometheus text format on a loopback port.
+  Hot path recording is a handful of relaxed atomic increments: per operation a request
+  counter, byte counters and a log-linear (HDR style) latency histogram, per response status
+  a counter, plus connection and user-lock contention gauges. Other subsystems add their own
+  series through collectors, called only when the endpoint is scraped.
+ */
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+
+#define METRICS_PORT  9464                     // default Prometheus endpoint port, loopback only.
+#define METRICS_PORT_ENV  "BACKUPSVR_METRICS_PORT"   // "0" disables the endpoint.
+#define HISTOGRAM_SUB_BUCKET_BITS  3           // 8 sub buckets per power of two: <= 12.5% relative error.
+#define METRICS_READ_TIMEOUT_MS  2000          // a scraper silent for longer is dropped.
+
+namespace Metrics {
+
+	inline unsigned log2Floor(uint64_t value)
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		return 63u - static_cast<unsigned>(__builtin_clzll(value));
+#else
+		unsigned result = 0;
+		while (value >>= 1)
+			++result;
+		return result;
+#endif
+	}
+
+
+	/**
+	   Log-linear histogram of non negative integer values (microseconds for latencies).
+	 */
+	class Histogram
+	{
+	public:
+		static constexpr uint64_t SUB_BUCKETS = (1u << HISTOGRAM_SUB_BUCKET_BITS);
+		static constexpr size_t BUCKETS = (64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+		Histogram() : _count(0), _sum(0)
+		{
+			for (auto& bucket : _buckets)
+				bucket.store(0, std::memory_order_relaxed);
+		}
+
+		void record(const uint64_t value)
+		{
+			_buckets[index(value)].fetch_add(1, std::memory_order_relaxed);
+			_count.fetch_add(1, std::memory_order_relaxed);
+			_sum.fetch_add(value, std::memory_order_relaxed);
+		}
+
+		uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+		uint64_t sum() const { return _sum.load(std::memory_order_relaxed); }
+
+		/**
+		   @brief value at quantile q (0..1). upper bound of the bucket holding it.
+		 */
+		uint64_t quantile(const double q) const
+		{
+			std::vector<uint64_t> counts(BUCKETS);
+			uint64_t total = 0;
+			for (size_t i = 0; i < BUCKETS; ++i)
+			{
+				counts[i] = _buckets[i].load(std::memory_order_relaxed);
+				total += counts[i];
+			}
+			if (total == 0)
+				return 0;
+			auto rank = static_cast<uint64_t>(q * static_cast<double>(total));
+			if (rank >= total)
+				rank = total - 1;
+			uint64_t seen = 0;
+			for (size_t i = 0; i < BUCKETS; ++i)
+			{
+				seen += counts[i];
+				if (seen > rank)
+					return upperBound(i);
+			}
+			return upperBound(BUCKETS - 1);
+		}
+
+		static size_t index(const uint64_t value)
+		{
+			if (value < SUB_BUCKETS)
+				return static_cast<size_t>(value);
+			const unsigned exponent = log2Floor(value);
+			const uint64_t mantissa = (value >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+			return static_cast<size_t>((exponent - HISTOGRAM_SUB_BUCKET_BITS + 1) * SUB_BUCKETS + mantissa);
+		}
+
+		static uint64_t upperBound(const size_t index)
+		{
+			if (index < SUB_BUCKETS)
+				return index;
+			const unsigned exponent = static_cast<unsigned>(index / SUB_BUCKETS) + HISTOGRAM_SUB_BUCKET_BITS - 1;
+			const uint64_t mantissa = index % SUB_BUCKETS;
+			const uint64_t width = 1ULL << (exponent - HISTOGRAM_SUB_BUCKET_BITS);
+			return ((SUB_BUCKETS + mantissa) * width) + width - 1;
+		}
+
+	private:
+		std::atomic<uint64_t> _buckets[BUCKETS];
+		std::atomic<uint64_t> _count;
+		std::atomic<uint64_t> _sum;
+	};
+
+
+	struct OpMetrics
+	{
+		std::atomic<uint64_t> requests{ 0 };
+		std::atomic<uint64_t> bytesIn{ 0 };    // payload bytes received from clients.
+		std::atomic<uint64_t> bytesOut{ 0 };   // payload bytes sent to clients.
+		Histogram latency;                     // microseconds, first packet received -> request done.
+	};
+
+	/**
+	   Operation slots. Request::EOp values are mapped by opSlot().
+	 */
+	enum EOpSlot { OP_BACKUP, OP_RESTORE, OP_REMOVE, OP_LIST, OP_VERSIONS, OP_RESTORE_VERSION, OP_REMOVE_MATCHING, OP_STAT_MATCHING, OP_USAGE, OP_PRECHECK, OP_OTHER, OP_SLOTS };
+
+	/**
+	   Status slots. Response::EStatus values are mapped by statusSlot().
+	 */
+	enum EStatusSlot { ST_SUCCESS_RESTORE, ST_SUCCESS_DIR, ST_SUCCESS_BACKUP_DELETE, ST_SUCCESS_ALREADY_STORED, ST_SUCCESS_SEND_CONTENT, ST_ERROR_NOT_EXIST, ST_ERROR_NO_FILES, ST_ERROR_GENERIC, ST_ERROR_QUOTA, ST_OTHER, ST_SLOTS };
+
+	inline EOpSlot opSlot(const uint8_t op)
+	{
+		switch (op)
+		{
+		case 100: return OP_BACKUP;
+		case 200: return OP_RESTORE;
+		case 201: return OP_REMOVE;
+		case 202: return OP_LIST;
+		case 203: return OP_VERSIONS;
+		case 204: return OP_RESTORE_VERSION;
+		case 205: return OP_REMOVE_MATCHING;
+		case 206: return OP_STAT_MATCHING;
+		case 207: return OP_USAGE;
+		case 208: return OP_PRECHECK;
+		default: return OP_OTHER;
+		}
+	}
+
+	inline EStatusSlot statusSlot(const uint16_t status)
+	{
+		switch (status)
+		{
+		case 210: return ST_SUCCESS_RESTORE;
+		case 211: return ST_SUCCESS_DIR;
+		case 212: return ST_SUCCESS_BACKUP_DELETE;
+		case 213: return ST_SUCCESS_ALREADY_STORED;
+		case 214: return ST_SUCCESS_SEND_CONTENT;
+		case 1001: return ST_ERROR_NOT_EXIST;
+		case 1002: return ST_ERROR_NO_FILES;
+		case 1003: return ST_ERROR_GENERIC;
+		case 1004: return ST_ERROR_QUOTA;
+		default: return ST_OTHER;
+		}
+	}
+
+	inline const char* opName(const size_t slot)
+	{
+		static const char* names[OP_SLOTS] = { "backup", "restore", "remove", "list", "versions", "restore_version", "remove_matching", "stat_matching", "usage", "precheck", "other" };
+		return names[slot];
+	}
+
+	inline const char* statusName(const size_t slot)
+	{
+		static const char* names[ST_SLOTS] = { "SUCCESS_RESTORE", "SUCCESS_DIR", "SUCCESS_BACKUP_DELETE", "SUCCESS_ALREADY_STORED", "SUCCESS_SEND_CONTENT", "ERROR_NOT_EXIST", "ERROR_NO_FILES", "ERROR_GENERIC", "ERROR_QUOTA", "OTHER" };
+		return names[slot];
+	}
+
+
+	class Registry
+	{
+	public:
+		using Collector = std::function<void(std::ostream&)>;
+		using Endpoint = std::function<std::string(const std::string&)>;   // query string -> response body.
+
+		static Registry& instance()
+		{
+			static Registry registry;
+			return registry;
+		}
+
+		OpMetrics ops[OP_SLOTS];
+		std::atomic<uint64_t> statuses[ST_SLOTS];
+		std::atomic<int64_t> activeConnections{ 0 };
+		std::atomic<uint64_t> connections{ 0 };
+		std::atomic<uint64_t> lockContended{ 0 };   // lock attempts that found the user busy.
+		Histogram lockWait;                         // microseconds spent waiting for a busy user.
+
+		void recordRequest(const uint8_t op, const uint16_t status, const uint64_t micros)
+		{
+			OpMetrics& m = ops[opSlot(op)];
+			m.requests.fetch_add(1, std::memory_order_relaxed);
+			m.latency.record(micros);
+			statuses[statusSlot(status)].fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void addBytesIn(const uint8_t op, const uint64_t bytes) { ops[opSlot(op)].bytesIn.fetch_add(bytes, std::memory_order_relaxed); }
+		void addBytesOut(const uint8_t op, const uint64_t bytes) { ops[opSlot(op)].bytesOut.fetch_add(bytes, std::memory_order_relaxed); }
+
+		/**
+		   @brief add series rendered by another subsystem. called on every scrape.
+		 */
+		void addCollector(Collector collector)
+		{
+			std::lock_guard<std::mutex> lock(_collectorsMutex);
+			_collectors.push_back(std::move(collector));
+		}
+
+		/**
+		   @brief serve another path on the exporter port, e.g. a debug dump.
+		 */
+		void addEndpoint(const std::string& path, Endpoint endpoint)
+		{
+			std::lock_guard<std::mutex> lock(_collectorsMutex);
+			_endpoints.emplace_back(path, std::move(endpoint));
+		}
+
+		/**
+		   @brief body for a request path. false if no endpoint matches (the metrics are served then).
+		 */
+		bool serve(const std::string& path, const std::string& query, std::string& body)
+		{
+			Endpoint endpoint;
+			{
+				std::lock_guard<std::mutex> lock(_collectorsMutex);
+				for (const auto& entry : _endpoints)
+				{
+					if (entry.first == path)
+						endpoint = entry.second;
+				}
+			}
+			if (!endpoint)
+				return false;
+			body = endpoint(query);
+			return true;
+		}
+
+		/**
+		   @brief render every metric in Prometheus text exposition format.
+		 */
+		std::string render()
+		{
+			std::ostringstream out;
+			out << "# TYPE backupsvr_requests_total counter\n";
+			for (size_t i = 0; i < OP_SLOTS; ++i)
+				out << "backupsvr_requests_total{op=\"" << opName(i) << "\"} " << ops[i].requests.load(std::memory_order_relaxed) << "\n";
+			out << "# TYPE backupsvr_bytes_received_total counter\n";
+			for (size_t i = 0; i < OP_SLOTS; ++i)
+				out << "backupsvr_bytes_received_total{op=\"" << opName(i) << "\"} " << ops[i].bytesIn.load(std::memory_order_relaxed) << "\n";
+			out << "# TYPE backupsvr_bytes_sent_total counter\n";
+			for (size_t i = 0; i < OP_SLOTS; ++i)
+				out << "backupsvr_bytes_sent_total{op=\"" << opName(i) << "\"} " << ops[i].bytesOut.load(std::memory_order_relaxed) << "\n";
+			out << "# TYPE backupsvr_request_latency_seconds summary\n";
+			for (size_t i = 0; i < OP_SLOTS; ++i)
+				renderSummary(out, "backupsvr_request_latency_seconds", std::string("op=\"") + opName(i) + "\"", ops[i].latency);
+			out << "# TYPE backupsvr_responses_total counter\n";
+			for (size_t i = 0; i < ST_SLOTS; ++i)
+				out << "backupsvr_responses_total{status=\"" << statusName(i) << "\"} " << statuses[i].load(std::memory_order_relaxed) << "\n";
+			out << "# TYPE backupsvr_active_connections gauge\n";
+			out << "backupsvr_active_connections " << activeConnections.load(std::memory_order_relaxed) << "\n";
+			out << "# TYPE backupsvr_connections_total counter\n";
+			out << "backupsvr_connections_total " << connections.load(std::memory_order_relaxed) << "\n";
+			out << "# TYPE backupsvr_user_lock_contended_total counter\n";
+			out << "backupsvr_user_lock_contended_total " << lockContended.load(std::memory_order_relaxed) << "\n";
+			out << "# TYPE backupsvr_user_lock_wait_seconds summary\n";
+			renderSummary(out, "backupsvr_user_lock_wait_seconds", "", lockWait);
+
+			std::lock_guard<std::mutex> lock(_collectorsMutex);
+			for (const auto& collector : _collectors)
+				collector(out);
+			return out.str();
+		}
+
+		Registry(const Registry&) = delete;
+		Registry& operator=(const Registry&) = delete;
+
+	private:
+		Registry()
+		{
+			for (auto& status : statuses)
+				status.store(0, std::memory_order_relaxed);
+		}
+
+		static void renderSummary(std::ostream& out, const std::string& name, const std::string& labels, const Histogram& histogram)
+		{
+			const std::string sep = labels.empty() ? "" : ",";
+			const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+			for (const double q : quantiles)
+				out << name << "{" << labels << sep << "quantile=\"" << q << "\"} " << (static_cast<double>(histogram.quantile(q)) / 1e6) << "\n";
+			const std::string braces = labels.empty() ? "" : ("{" + labels + "}");
+			out << name << "_sum" << braces << " " << (static_cast<double>(histogram.sum()) / 1e6) << "\n";
+			out << name << "_count" << braces << " " << histogram.count() << "\n";
+		}
+
+		std::mutex _collectorsMutex;
+		std::vector<Collector> _collectors;
+		std::vector<std::pair<std::string, Endpoint>> _endpoints;
+	};
+
+	inline Registry& instance()
+	{
+		return Registry::instance();
+	}
+
+	inline uint64_t elapsedMicros(const std::chrono::steady_clock::time_point& start)
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+	}
+
+
+	/**
+	   RAII active connection gauge.
+	 */
+	class ConnectionGauge
+	{
+	public:
+		ConnectionGauge()
+		{
+			instance().connections.fetch_add(1, std::memory_order_relaxed);
+			instance().activeConnections.fetch_add(1, std::memory_order_relaxed);
+		}
+		~ConnectionGauge() { instance().activeConnections.fetch_sub(1, std::memory_order_relaxed); }
+		ConnectionGauge(const ConnectionGauge&) = delete;
+		ConnectionGauge& operator=(const ConnectionGauge&) = delete;
+	};
+
+
+	/**
+	   @brief serve the Prometheus endpoint on 127.0.0.1:port from a background thread.
+	          every accepted connection gets one plain HTTP/1.0 response and is closed.
+	          a connection that sends no request within METRICS_READ_TIMEOUT_MS is closed unanswered.
+	          paths registered with addEndpoint() are served by their endpoint, any other path gets the metrics.
+	 */
+	inline void startExporter(const uint16_t port)
+	{
+		std::thread([port]()
+		{
+			try
+			{
+				using boost::asio::ip::tcp;
+				boost::asio::io_context io;
+				tcp::acceptor acceptor(io, tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), port));
+				while (true)
+				{
+					tcp::socket sock(io);
+					acceptor.accept(sock);
+					boost::system::error_code ec;
+					char request[1024];
+					size_t length = 0;
+					bool received = false;
+					sock.async_read_some(boost::asio::buffer(request), [&](const boost::system::error_code& error, const size_t n)
+					{
+						ec = error;
+						length = n;
+						received = true;
+					});
+					io.restart();
+					io.run_for(std::chrono::milliseconds(METRICS_READ_TIMEOUT_MS));
+					if (!received)
+					{
+						sock.close(ec);   // aborts the read. run once more to retire its handler.
+						io.restart();
+						io.run();
+						continue;
+					}
+					std::string target;   // "GET <target> HTTP/1.x"
+					std::istringstream line(std::string(request, ec ? 0 : length));
+					line >> target >> target;
+					const size_t question = target.find('?');
+					const std::string path = target.substr(0, question);
+					const std::string query = (question == std::string::npos) ? "" : target.substr(question + 1);
+					std::string body;
+					const bool custom = instance().serve(path, query, body);
+					if (!custom)
+						body = instance().render();
+					std::ostringstream response;
+					response << "HTTP/1.0 200 OK\r\nContent-Type: " << (custom ? "application/json" : "text/plain; version=0.0.4")
+						<< "\r\nContent-Length: " << body.size() << "\r\n\r\n" << body;
+					(void)boost::asio::write(sock, boost::asio::buffer(response.str()), ec);
+					sock.close(ec);
+				}
+			}
+			catch (std::exception&)
+			{
+				// port in use or network failure. metrics stay available through render().
+			}
+		}).detach();
+	}
+
+	/**
+	   @brief start the endpoint once, on METRICS_PORT or BACKUPSVR_METRICS_PORT.
+	 */
+	inline void ensureExporter()
+	{
+		static std::once_flag once;
+		std::call_once(once, []()
+		{
+			const char* env = getenv(METRICS_PORT_ENV);
+			const int port = (env != nullptr) ? atoi(env) : METRICS_PORT;
+			if (port > 0 && port <= 65535)
+				startExporter(static_cast<uint16_t>(port));
+		});
+	}
+
+}
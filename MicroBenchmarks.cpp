@@ -0,0 +1,232 @@
+/**
+  @MicroBenchmarks Google Benchmark suite for the per-request codec and filesystem primitives.
+  The request path's wrappers (ServerRequestFuncs, ServerResponseFuncs, FileManager) build
+  only inside the server, whose sources include each other; this tool links none of them and
+  measures what they run: the frame codec (ProtocolCodec) and the per-user directory lookups
+  (DirectoryCache) behind every request.
+  Every benchmark reports allocs/op, counted by the global operator new below, next to
+  its time, so allocation regressions in the request path show up in isolation.
+  Directory benchmarks run on folders of 10 to 1M empty files. The folders are created
+  once under the scratch directory and reused by later runs.
+  usage: MicroBenchmarks [--benchmark_filter=REGEX] [google benchmark flags]
+         scratch directory: $BACKUPSVR_BENCH_DIR, default <temp>/backupsvr_microbench
+  build: g++ -std=c++20 -O2 -I. MicroBenchmarks.cpp -o MicroBenchmarks -lbenchmark -lpthread
+ */
+
+#include "DirectoryCache.h"
+#include "ProtocolCodec.h"
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <string>
+
+#define BENCH_DIR_ENV  "BACKUPSVR_BENCH_DIR"
+
+namespace {
+
+	std::atomic<uint64_t> allocations{ 0 };
+
+	/**
+	   @brief report the allocations made since `before` as a per iteration average.
+	 */
+	void reportAllocations(benchmark::State& state, const uint64_t before)
+	{
+		state.counters["allocs/op"] = benchmark::Counter(static_cast<double>(allocations.load(std::memory_order_relaxed) - before), benchmark::Counter::kAvgIterations);
+	}
+
+	std::string scratchFolder()
+	{
+		const char* env = getenv(BENCH_DIR_ENV);
+		std::string folder = (env != nullptr) ? env : (std::filesystem::temp_directory_path() / "backupsvr_microbench").string();
+		if (!folder.empty() && folder.back() != '/' && folder.back() != '\\')
+			folder += '/';
+		return folder;
+	}
+
+	/**
+	   @brief folder of `entries` empty files, named as the user ID `entries` under the scratch root.
+	          a marker next to the folder records that it is complete.
+	 */
+	std::string entriesFolder(const uint32_t entries)
+	{
+		const std::string folder = scratchFolder() + std::to_string(entries) + "/";
+		const std::string marker = scratchFolder() + std::to_string(entries) + ".done";
+		if (std::filesystem::exists(marker))
+			return folder;
+		std::filesystem::create_directories(folder);
+		for (uint32_t i = 0; i < entries; ++i)
+			std::ofstream(folder + "file_" + std::to_string(i) + ".bin");
+		std::ofstream(marker) << entries;
+		return folder;
+	}
+
+	std::string filenameOf(const uint16_t length)
+	{
+		std::string name(length, 'a');
+		if (length > 4)
+			name.replace(length - 4, 4, ".bin");
+		return name;
+	}
+
+	using Codec = ProtocolCodec::Codec<ProtocolCodec::Current>;
+	const uint8_t opBackup = 100;   // Request::EOp::CLI_FILE_BACKUP.
+
+	// Codec. filename length x payload bytes announced in the frame.
+
+	/**
+	   the frame decode of ServerRequestFuncs::deserializeRequest.
+	 */
+	void BM_decodeRequest(benchmark::State& state)
+	{
+		const std::string filename = filenameOf(static_cast<uint16_t>(state.range(0)));
+		uint8_t buffer[PACKET_SIZE];
+		memset(buffer, 'p', PACKET_SIZE);
+		(void)Codec::encodeRequest(buffer, 1234, opBackup, reinterpret_cast<const uint8_t*>(filename.data()), static_cast<uint16_t>(filename.size()), static_cast<uint32_t>(state.range(1)), nullptr);
+		const uint64_t before = allocations.load(std::memory_order_relaxed);
+		for (auto _ : state)
+		{
+			ProtocolCodec::RequestFields fields;
+			benchmark::DoNotOptimize(Codec::decodeRequest(buffer, PACKET_SIZE, fields));
+			benchmark::DoNotOptimize(fields);
+		}
+		reportAllocations(state, before);
+	}
+	BENCHMARK(BM_decodeRequest)->ArgsProduct({ { 8, 64, 255 }, { 0, 512, PACKET_SIZE } });
+
+	/**
+	   all of ServerResponseFuncs::serializeResponse.
+	 */
+	void BM_encodeResponse(benchmark::State& state)
+	{
+		const std::string filename = filenameOf(static_cast<uint16_t>(state.range(0)));
+		const std::string payload(static_cast<size_t>(state.range(1)), 'p');
+		uint8_t buffer[PACKET_SIZE];
+		const uint64_t before = allocations.load(std::memory_order_relaxed);
+		for (auto _ : state)
+		{
+			benchmark::DoNotOptimize(Codec::encodeResponse(buffer, 210, reinterpret_cast<const uint8_t*>(filename.data()), static_cast<uint16_t>(filename.size()),
+				static_cast<uint32_t>(payload.size()), reinterpret_cast<const uint8_t*>(payload.data())));
+			benchmark::ClobberMemory();
+		}
+		reportAllocations(state, before);
+	}
+	BENCHMARK(BM_encodeResponse)->ArgsProduct({ { 8, 64, 255 }, { 0, 512, 1 << 20 } });
+
+	void BM_serverEntry(benchmark::State& state)
+	{
+		const std::string filename = filenameOf(static_cast<uint16_t>(state.range(0)));
+		const uint64_t before = allocations.load(std::memory_order_relaxed);
+		for (auto _ : state)
+		{
+			benchmark::DoNotOptimize(DirectoryCache::serverEntry(filename.c_str()));
+		}
+		reportAllocations(state, before);
+	}
+	BENCHMARK(BM_serverEntry)->Arg(8)->Arg(64)->Arg(255);
+
+	// Filesystem. directory entries.
+
+	/**
+	   the cached user directory every request resolves its files against.
+	 */
+	void BM_directoryGet(benchmark::State& state)
+	{
+		const auto userID = static_cast<uint32_t>(state.range(0));
+		const std::string folder = entriesFolder(userID);
+		(void)DirectoryCache::get(userID, folder, false);
+		const uint64_t before = allocations.load(std::memory_order_relaxed);
+		for (auto _ : state)
+		{
+			benchmark::DoNotOptimize(DirectoryCache::get(userID, folder, false));
+		}
+		reportAllocations(state, before);
+	}
+	BENCHMARK(BM_directoryGet)->Arg(10);
+
+#if HAVE_OPENAT
+	/**
+	   the directory scan of FileManager::userHasFilesAt: stops at the first user entry.
+	 */
+	void BM_hasEntries(benchmark::State& state)
+	{
+		const auto userID = static_cast<uint32_t>(state.range(0));
+		const DirectoryCache::Handle dir = DirectoryCache::get(userID, entriesFolder(userID), false);
+		const uint64_t before = allocations.load(std::memory_order_relaxed);
+		for (auto _ : state)
+		{
+			benchmark::DoNotOptimize(DirectoryCache::hasEntries(*dir));
+		}
+		reportAllocations(state, before);
+	}
+	BENCHMARK(BM_hasEntries)->RangeMultiplier(10)->Range(10, 1000000)->Unit(benchmark::kMicrosecond);
+#endif
+
+	/**
+	   the directory walk of FileManager::getFilesList, server entries skipped.
+	 */
+	void BM_listEntries(benchmark::State& state)
+	{
+		const std::string folder = entriesFolder(static_cast<uint32_t>(state.range(0)));
+		const uint64_t before = allocations.load(std::memory_order_relaxed);
+		for (auto _ : state)
+		{
+			uint64_t names = 0;
+			for (const auto& entry : std::filesystem::directory_iterator(folder))
+				names += DirectoryCache::serverEntry(entry.path().filename().string().c_str()) ? 0 : 1;
+			benchmark::DoNotOptimize(names);
+		}
+		reportAllocations(state, before);
+		state.SetItemsProcessed(state.iterations() * state.range(0));
+	}
+	BENCHMARK(BM_listEntries)->RangeMultiplier(10)->Range(10, 1000000)->Unit(benchmark::kMicrosecond);
+
+}
+
+
+void* operator new(const size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* ptr = std::malloc(size ? size : 1))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void* operator new[](const size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+	std::free(ptr);
+}
+
+
+int main(int argc, char* argv[])
+{
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv))
+		return 1;
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	return 0;
+}
@@ -0,0 +1,330 @@
+/**
+  @ProtocolClient client side of the backup server wire format, for tools and benchmarks.
+  Requests and responses travel in fixed PACKET_SIZE frames. The first request frame holds
+  the header (user ID, version, op), name length, filename and payload size followed by the
+  first payload bytes; the rest of the payload follows in whole frames. Responses use the
+  same layout with version, status, name length, filename, payload size.
+  Frames are encoded and decoded by ProtocolCodec, in the current protocol version.
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include "ProtocolCodec.h"
+
+namespace ProtocolClient {
+
+	enum EOp
+	{
+		CLI_FILE_BACKUP = 100,
+		CLI_FILE_RESTORE = 200,
+		CLI_FILE_REMOVE = 201,
+		CLI_FILE_LIST = 202,
+		CLI_FILE_VERSIONS = 203,
+		CLI_FILE_RESTORE_VERSION = 204,
+		CLI_FILE_REMOVE_MATCHING = 205,
+		CLI_FILE_STAT_MATCHING = 206,
+		CLI_USAGE = 207,
+		CLI_FILE_PRECHECK = 208
+	};
+
+	enum EStatus
+	{
+		SUCCESS_RESTORE = 210,
+		SUCCESS_DIR = 211,
+		SUCCESS_BACKUP_DELETE = 212,
+		SUCCESS_ALREADY_STORED = 213,
+		SUCCESS_SEND_CONTENT = 214,
+		ERROR_NOT_EXIST = 1001,
+		ERROR_NO_FILES = 1002,
+		ERROR_GENERIC = 1003,
+		ERROR_QUOTA = 1004
+	};
+
+	using Codec = ProtocolCodec::Codec<ProtocolCodec::Current>;
+
+	using Digest = uint8_t[32];   // SHA-256 of a file's content, for prechecks.
+
+	struct Reply
+	{
+		uint8_t version = 0;
+		uint16_t status = 0;
+		std::string filename;
+		uint32_t size = 0;          // announced payload size.
+		uint64_t received = 0;      // payload bytes actually received.
+		std::string payload;        // kept only when requested (e.g. file listing).
+	};
+
+	/**
+	   @brief encode the first request frame.
+	   @return payload bytes that fit in the first frame.
+	 */
+	inline uint32_t encodeRequest(uint8_t (&frame)[PACKET_SIZE], const uint32_t userID, const uint8_t op, const std::string& filename, const uint32_t size, const uint8_t* payload)
+	{
+		memset(frame, 0, PACKET_SIZE);
+		return Codec::encodeRequest(frame, userID, op, reinterpret_cast<const uint8_t*>(filename.data()), static_cast<uint16_t>(filename.size()), size, payload);
+	}
+
+	/**
+	   @brief decode a response header frame.
+	   @return offset of the first payload byte within the frame. 0 if the frame is malformed.
+	 */
+	inline uint32_t decodeResponse(const uint8_t (&frame)[PACKET_SIZE], Reply& reply)
+	{
+		const uint8_t* name = nullptr;
+		uint16_t nameLen = 0;
+		const uint32_t offset = Codec::decodeResponse(frame, reply.version, reply.status, name, nameLen, reply.size);
+		if (offset != 0)
+			reply.filename.assign(reinterpret_cast<const char*>(name), nameLen);
+		return offset;
+	}
+
+
+	/**
+	   One request on its own connection, as the server closes the socket after responding.
+	 */
+	class Client
+	{
+	public:
+		Client(boost::asio::io_context& io, const boost::asio::ip::tcp::endpoint& server) : _io(io), _server(server) {}
+
+		/**
+		   @brief back up `size` bytes. the payload is read cyclically from `pattern`.
+		 */
+		bool backup(const uint32_t userID, const std::string& filename, const uint32_t size, const std::vector<uint8_t>& pattern, Reply& reply)
+		{
+			size_t offset = 0;
+			return backupFrom(userID, filename, size, [&pattern, &offset](uint8_t* data, const uint32_t length)
+			{
+				fill(data, length, pattern, offset);
+				offset += length;
+				return true;
+			}, reply);
+		}
+
+		/**
+		   Payload source: fill `length` bytes, the next ones of the payload.
+		 */
+		using Source = std::function<bool(uint8_t* data, uint32_t length)>;
+
+		/**
+		   @brief back up `size` bytes read in order from `source`.
+		 */
+		bool backupFrom(const uint32_t userID, const std::string& filename, const uint32_t size, const Source& source, Reply& reply)
+		{
+			try
+			{
+				boost::asio::ip::tcp::socket sock(_io);
+				sock.connect(_server);
+				uint8_t frame[PACKET_SIZE];
+				std::vector<uint8_t> first(PACKET_SIZE, 0);
+				if (!source(first.data(), Codec::firstPayload(Codec::requestOverhead(static_cast<uint32_t>(filename.size())), size)))
+					return false;
+				uint64_t sent = encodeRequest(frame, userID, CLI_FILE_BACKUP, filename, size, first.data());
+				boost::asio::write(sock, boost::asio::buffer(frame, PACKET_SIZE));
+				while (sent < size && sock.available() == 0)   // a response before the payload is done is a rejection (e.g. ERROR_QUOTA).
+				{
+					const uint32_t length = (size - sent < PACKET_SIZE) ? static_cast<uint32_t>(size - sent) : PACKET_SIZE;
+					memset(frame, 0, PACKET_SIZE);
+					if (!source(frame, length))
+						return false;
+					boost::asio::write(sock, boost::asio::buffer(frame, PACKET_SIZE));
+					sent += PACKET_SIZE;
+				}
+				return readReply(sock, reply, false);
+			}
+			catch (std::exception&)
+			{
+				return false;
+			}
+		}
+
+		bool restore(const uint32_t userID, const std::string& filename, Reply& reply)
+		{
+			return simple(userID, CLI_FILE_RESTORE, filename, reply, false);
+		}
+
+		bool remove(const uint32_t userID, const std::string& filename, Reply& reply)
+		{
+			return simple(userID, CLI_FILE_REMOVE, filename, reply, false);
+		}
+
+		bool list(const uint32_t userID, Reply& reply)
+		{
+			return simple(userID, CLI_FILE_LIST, "", reply, true);
+		}
+
+		/**
+		   @brief list a file's versions: "<id> <size>" lines in reply.payload, oldest first.
+		 */
+		bool versions(const uint32_t userID, const std::string& filename, Reply& reply)
+		{
+			return simple(userID, CLI_FILE_VERSIONS, filename, reply, true);
+		}
+
+		/**
+		   @brief remove every file matching a prefix or glob: "<status> <name>" lines in reply.payload.
+		 */
+		bool removeMatching(const uint32_t userID, const std::string& pattern, Reply& reply)
+		{
+			return simple(userID, CLI_FILE_REMOVE_MATCHING, pattern, reply, true);
+		}
+
+		/**
+		   @brief stat every file matching a prefix or glob: "<size> <mtime ns> <name>" lines in reply.payload.
+		 */
+		bool statMatching(const uint32_t userID, const std::string& pattern, Reply& reply)
+		{
+			return simple(userID, CLI_FILE_STAT_MATCHING, pattern, reply, true);
+		}
+
+		/**
+		   @brief the user's usage: "<bytes> <files> <quota bytes> <quota files>" in reply.payload, quotas 0 if unlimited.
+		 */
+		bool usage(const uint32_t userID, Reply& reply)
+		{
+			return simple(userID, CLI_USAGE, "", reply, true);
+		}
+
+		/**
+		   @brief ask whether the content is stored under `filename` already: SUCCESS_ALREADY_STORED
+		          (nothing to send; identical content may have been linked), or SUCCESS_SEND_CONTENT.
+		 */
+		bool precheck(const uint32_t userID, const std::string& filename, const uint64_t size, const Digest& digest, Reply& reply)
+		{
+			try
+			{
+				boost::asio::ip::tcp::socket sock(_io);
+				sock.connect(_server);
+				uint8_t payload[sizeof(size) + sizeof(Digest)];
+				Codec::store<uint64_t>(payload, size);
+				memcpy(payload + sizeof(size), digest, sizeof(Digest));
+				uint8_t frame[PACKET_SIZE];
+				(void)encodeRequest(frame, userID, CLI_FILE_PRECHECK, filename, sizeof(payload), payload);
+				boost::asio::write(sock, boost::asio::buffer(frame, PACKET_SIZE));
+				return readReply(sock, reply, false);
+			}
+			catch (std::exception&)
+			{
+				return false;
+			}
+		}
+
+		/**
+		   @brief precheck, then back up `size` bytes from `source` only if the server asks for them.
+		   @param sent set when the content was sent.
+		 */
+		bool backupUnlessStored(const uint32_t userID, const std::string& filename, const uint32_t size, const Digest& digest, const Source& source, Reply& reply, bool& sent)
+		{
+			sent = false;
+			if (!precheck(userID, filename, size, digest, reply))
+				return false;
+			if (reply.status != SUCCESS_SEND_CONTENT)
+				return reply.status == SUCCESS_ALREADY_STORED;
+			sent = true;
+			return backupFrom(userID, filename, size, source, reply);
+		}
+
+		/**
+		   @brief restore the version current at `at` (ns since the epoch, or a version id). 0: newest.
+		 */
+		bool restoreVersion(const uint32_t userID, const std::string& filename, const uint64_t at, Reply& reply)
+		{
+			try
+			{
+				boost::asio::ip::tcp::socket sock(_io);
+				sock.connect(_server);
+				uint8_t frame[PACKET_SIZE];
+				(void)encodeRequest(frame, userID, CLI_FILE_RESTORE_VERSION, filename, sizeof(at), reinterpret_cast<const uint8_t*>(&at));
+				boost::asio::write(sock, boost::asio::buffer(frame, PACKET_SIZE));
+				return readReply(sock, reply, false);
+			}
+			catch (std::exception&)
+			{
+				return false;
+			}
+		}
+
+		/**
+		   @brief any request without a client payload.
+		   @param keepPayload store the response payload in reply.payload.
+		 */
+		bool simple(const uint32_t userID, const uint8_t op, const std::string& filename, Reply& reply, const bool keepPayload)
+		{
+			try
+			{
+				boost::asio::ip::tcp::socket sock(_io);
+				sock.connect(_server);
+				uint8_t frame[PACKET_SIZE];
+				(void)encodeRequest(frame, userID, op, filename, 0, nullptr);
+				boost::asio::write(sock, boost::asio::buffer(frame, PACKET_SIZE));
+				return readReply(sock, reply, keepPayload);
+			}
+			catch (std::exception&)
+			{
+				return false;
+			}
+		}
+
+	private:
+		static void fill(uint8_t* dst, const uint32_t length, const std::vector<uint8_t>& pattern, const size_t offset)
+		{
+			if (pattern.empty())
+			{
+				memset(dst, 0, length);
+				return;
+			}
+			uint32_t done = 0;
+			while (done < length)
+			{
+				const size_t pos = (offset + done) % pattern.size();
+				size_t chunk = pattern.size() - pos;
+				if (chunk > length - done)
+					chunk = length - done;
+				memcpy(dst + done, pattern.data() + pos, chunk);
+				done += static_cast<uint32_t>(chunk);
+			}
+		}
+
+		/**
+		   read the response frame and every payload frame that follows it.
+		 */
+		static bool readReply(boost::asio::ip::tcp::socket& sock, Reply& reply, const bool keepPayload)
+		{
+			uint8_t frame[PACKET_SIZE];
+			boost::asio::read(sock, boost::asio::buffer(frame, PACKET_SIZE));
+			reply.payload.clear();
+			reply.received = 0;
+			const uint32_t offset = decodeResponse(frame, reply);
+			if (offset == 0)
+				return false;
+			if (reply.status != SUCCESS_RESTORE && reply.status != SUCCESS_DIR)
+				return true;   // no payload.
+			uint32_t chunk = PACKET_SIZE - offset;
+			if (reply.size < chunk)
+				chunk = reply.size;
+			reply.received = chunk;
+			if (keepPayload)
+				reply.payload.assign(reinterpret_cast<const char*>(frame + offset), chunk);
+			while (reply.received < reply.size)
+			{
+				boost::asio::read(sock, boost::asio::buffer(frame, PACKET_SIZE));
+				chunk = PACKET_SIZE;
+				if (reply.size - reply.received < chunk)
+					chunk = static_cast<uint32_t>(reply.size - reply.received);
+				if (keepPayload)
+					reply.payload.append(reinterpret_cast<const char*>(frame), chunk);
+				reply.received += chunk;
+			}
+			return true;
+		}
+
+		boost::asio::io_context& _io;
+		boost::asio::ip::tcp::endpoint _server;
+	};
+
+}
@@ -0,0 +1,256 @@
+/**
+  @ProtocolCodec wire layout of the request and response frames, described once per protocol
+  version at compile time.
+  A Layout fixes a version's frame size, byte order and field offsets; Codec<Layout> derives
+  its encoders and decoders from them: every offset and size is a constant, and fields are
+  written as one expression over their bytes in the layout's order, which compilers merge
+  into a single plain or byte-swapped access. The routines inline to straight-line code.
+  The versions served are listed in forVersion(), which picks one by the request's version
+  byte. That byte is at the same offset in every version; a version that is not listed is
+  read as the current one, since the version is not verified (requirement from forum).
+  PACKET_SIZE, the frame size the server's transfer loops move, is defined here only.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+#define PACKET_SIZE  1024
+
+namespace ProtocolCodec {
+
+	enum EByteOrder
+	{
+		ORDER_LITTLE = 0,
+		ORDER_BIG = 1
+	};
+
+	const uint32_t VERSION_OFFSET = 4;   // of the version byte in a request frame, in every version.
+
+	/**
+	   A request frame: user ID, version, op, name length, name, payload size, first payload bytes.
+	   A response frame: version, status, name length, name, payload size, first payload bytes.
+	   The rest of a payload follows in whole frames.
+	 */
+	template <uint8_t Version, uint32_t PacketSize, EByteOrder Order>
+	struct Layout
+	{
+		static constexpr uint8_t version = Version;
+		static constexpr uint32_t packetSize = PacketSize;
+		static constexpr EByteOrder order = Order;
+
+		static constexpr uint32_t REQUEST_USER = 0;
+		static constexpr uint32_t REQUEST_VERSION = VERSION_OFFSET;
+		static constexpr uint32_t REQUEST_OP = 5;
+		static constexpr uint32_t REQUEST_NAME_LEN = 6;
+		static constexpr uint32_t REQUEST_NAME = 8;
+		static constexpr uint32_t REQUEST_FIXED = REQUEST_NAME + sizeof(uint32_t);   // fields around the name.
+
+		static constexpr uint32_t RESPONSE_VERSION = 0;
+		static constexpr uint32_t RESPONSE_STATUS = 1;
+		static constexpr uint32_t RESPONSE_NAME_LEN = 3;
+		static constexpr uint32_t RESPONSE_NAME = 5;
+		static constexpr uint32_t RESPONSE_FIXED = RESPONSE_NAME + sizeof(uint32_t);
+
+		static_assert(PacketSize > REQUEST_FIXED && PacketSize > RESPONSE_FIXED, "a frame holds the fixed fields");
+	};
+
+	using V1 = Layout<1, PACKET_SIZE, ORDER_LITTLE>;
+	using Current = V1;   // spoken by the server's responses and by ProtocolClient.
+
+	/**
+	   Fields of a request's first frame. name and payload point into the frame.
+	 */
+	struct RequestFields
+	{
+		uint32_t userID = 0;
+		uint8_t version = 0;
+		uint8_t op = 0;
+		uint16_t nameLen = 0;
+		const uint8_t* name = nullptr;
+		uint32_t size = 0;                  // whole payload size.
+		const uint8_t* payload = nullptr;
+		uint32_t first = 0;                 // payload bytes in this frame.
+	};
+
+	/**
+	   How much of a request frame was decoded, as deserializeRequest() keeps it.
+	 */
+	enum EDecoded
+	{
+		DECODED_NONE = 0,       // shorter than the header.
+		DECODED_HEADER = 1,     // user ID, version, op.
+		DECODED_NAME_LEN = 2,   // and the name length, which is 0 or does not fit the frame.
+		DECODED_NAME = 3,       // and the name.
+		DECODED_SIZE = 4        // and the payload size, with `first` payload bytes if it is not 0.
+	};
+
+	template <class L>
+	struct Codec
+	{
+		using Layout = L;
+
+		/**
+		   @brief bit position, in a T, of the field's byte `i`.
+		 */
+		template <typename T>
+		static constexpr size_t shift(const size_t i)
+		{
+			return 8 * ((L::order == ORDER_LITTLE) ? i : sizeof(T) - 1 - i);
+		}
+
+		template <typename T, size_t... I>
+		static void storeBytes(uint8_t* at, const T value, std::index_sequence<I...>)
+		{
+			((at[I] = static_cast<uint8_t>(value >> shift<T>(I))), ...);
+		}
+
+		template <typename T, size_t... I>
+		static T loadBytes(const uint8_t* at, std::index_sequence<I...>)
+		{
+			return static_cast<T>(((static_cast<T>(at[I]) << shift<T>(I)) | ...));
+		}
+
+		template <typename T>
+		static void store(uint8_t* at, const T value)
+		{
+			storeBytes<T>(at, value, std::make_index_sequence<sizeof(T)>());
+		}
+
+		template <typename T>
+		static T load(const uint8_t* at)
+		{
+			return loadBytes<T>(at, std::make_index_sequence<sizeof(T)>());
+		}
+
+		static constexpr uint32_t requestOverhead(const uint32_t nameLen) { return L::REQUEST_FIXED + nameLen; }
+		static constexpr uint32_t responseOverhead(const uint32_t nameLen) { return L::RESPONSE_FIXED + nameLen; }
+
+		/**
+		   @return payload bytes that fit in a first frame after `overhead` bytes of fields.
+		 */
+		static constexpr uint32_t firstPayload(const uint32_t overhead, const uint32_t size)
+		{
+			const uint32_t room = (overhead < L::packetSize) ? L::packetSize - overhead : 0;
+			return (size < room) ? size : room;
+		}
+
+		/**
+		   @brief write a request's first frame. a name longer than the frame allows is cut.
+		   @return payload bytes copied into the frame.
+		 */
+		static uint32_t encodeRequest(uint8_t* frame, const uint32_t userID, const uint8_t op, const uint8_t* name, const uint16_t nameLen, const uint32_t size, const uint8_t* payload)
+		{
+			const uint16_t len = static_cast<uint16_t>((nameLen < L::packetSize - L::REQUEST_FIXED) ? nameLen : L::packetSize - L::REQUEST_FIXED);
+			const uint32_t first = (payload != nullptr) ? firstPayload(requestOverhead(len), size) : 0;
+			store<uint32_t>(frame + L::REQUEST_USER, userID);
+			store<uint8_t>(frame + L::REQUEST_VERSION, L::version);
+			store<uint8_t>(frame + L::REQUEST_OP, op);
+			store<uint16_t>(frame + L::REQUEST_NAME_LEN, len);
+			if (len != 0)
+				memcpy(frame + L::REQUEST_NAME, name, len);
+			store<uint32_t>(frame + L::REQUEST_NAME + len, size);
+			if (first != 0)
+				memcpy(frame + requestOverhead(len), payload, first);
+			return first;
+		}
+
+		/**
+		   @brief read the first `length` bytes of a request frame.
+		 */
+		static EDecoded decodeRequest(const uint8_t* frame, const uint32_t length, RequestFields& fields)
+		{
+			const uint32_t limit = (length < L::packetSize) ? length : L::packetSize;
+			if (limit < L::REQUEST_NAME_LEN)
+				return DECODED_NONE;
+			fields.userID = load<uint32_t>(frame + L::REQUEST_USER);
+			fields.version = load<uint8_t>(frame + L::REQUEST_VERSION);
+			fields.op = load<uint8_t>(frame + L::REQUEST_OP);
+			if (limit < L::REQUEST_NAME)
+				return DECODED_HEADER;
+			fields.nameLen = load<uint16_t>(frame + L::REQUEST_NAME_LEN);
+			if (fields.nameLen == 0 || L::REQUEST_NAME + fields.nameLen > limit)
+				return DECODED_NAME_LEN;
+			fields.name = frame + L::REQUEST_NAME;
+			if (requestOverhead(fields.nameLen) > limit)
+				return DECODED_NAME;
+			fields.size = load<uint32_t>(frame + L::REQUEST_NAME + fields.nameLen);
+			fields.payload = frame + requestOverhead(fields.nameLen);
+			fields.first = (fields.size < limit - requestOverhead(fields.nameLen)) ? fields.size : limit - requestOverhead(fields.nameLen);
+			return DECODED_SIZE;
+		}
+
+		/**
+		   @brief write a response's first frame. a name longer than the frame allows is cut.
+		   @return payload bytes copied into the frame.
+		 */
+		static uint32_t encodeResponse(uint8_t* frame, const uint16_t status, const uint8_t* name, const uint16_t nameLen, const uint32_t size, const uint8_t* payload)
+		{
+			const uint16_t len = static_cast<uint16_t>((nameLen < L::packetSize - L::RESPONSE_FIXED) ? nameLen : L::packetSize - L::RESPONSE_FIXED);
+			const uint32_t first = (payload != nullptr) ? firstPayload(responseOverhead(len), size) : 0;
+			store<uint8_t>(frame + L::RESPONSE_VERSION, L::version);
+			store<uint16_t>(frame + L::RESPONSE_STATUS, status);
+			store<uint16_t>(frame + L::RESPONSE_NAME_LEN, len);
+			if (len != 0)
+				memcpy(frame + L::RESPONSE_NAME, name, len);
+			store<uint32_t>(frame + L::RESPONSE_NAME + len, size);
+			if (first != 0)
+				memcpy(frame + responseOverhead(len), payload, first);
+			return first;
+		}
+
+		/**
+		   @brief read a response's first frame.
+		   @return offset of the first payload byte. 0 if the name does not fit the frame.
+		 */
+		static uint32_t decodeResponse(const uint8_t* frame, uint8_t& version, uint16_t& status, const uint8_t*& name, uint16_t& nameLen, uint32_t& size)
+		{
+			version = load<uint8_t>(frame + L::RESPONSE_VERSION);
+			status = load<uint16_t>(frame + L::RESPONSE_STATUS);
+			nameLen = load<uint16_t>(frame + L::RESPONSE_NAME_LEN);
+			if (responseOverhead(nameLen) > L::packetSize)
+				return 0;
+			name = frame + L::RESPONSE_NAME;
+			size = load<uint32_t>(frame + L::RESPONSE_NAME + nameLen);
+			return responseOverhead(nameLen);
+		}
+	};
+
+	/**
+	   @brief call `f` with the Codec of the first layout whose version is `version`, or of the
+	          first layout when none is.
+	 */
+	template <class Default, class... Others, class F>
+	auto dispatch([[maybe_unused]] const uint8_t version, F&& f) -> decltype(f(Codec<Default>()))
+	{
+		static_assert(Default::packetSize == PACKET_SIZE && ((Others::packetSize == PACKET_SIZE) && ...), "the transfer loops move PACKET_SIZE frames in every version");
+		using Result = decltype(f(Codec<Default>()));
+		Result result{};
+		const bool other = ((version == Others::version && ((result = f(Codec<Others>())), true)) || ...);
+		if (!other)
+			result = f(Codec<Default>());
+		return result;
+	}
+
+	/**
+	   @brief the versions served: Current first, then any other layout a client may speak.
+	 */
+	template <class F>
+	auto forVersion(const uint8_t version, F&& f) -> decltype(f(Codec<Current>()))
+	{
+		return dispatch<Current>(version, std::forward<F>(f));
+	}
+
+	inline uint32_t requestOverhead(const uint8_t version, const uint16_t nameLen)
+	{
+		return forVersion(version, [nameLen](auto codec) { return codec.requestOverhead(nameLen); });
+	}
+
+	inline uint32_t responseOverhead(const uint8_t version, const uint16_t nameLen)
+	{
+		return forVersion(version, [nameLen](auto codec) { return codec.responseOverhead(nameLen); });
+	}
+
+}
@@ -0,0 +1,134 @@
+/**
+  @ProtocolCodecCheck equivalence check of ProtocolCodec against the frame layout it replaced.
+  The reference encoders below write every field with memcpy in host order, as the server
+  did before the codec. Random requests and responses (names of every length that fits,
+  small and huge payload sizes) are encoded both ways and must match byte for byte; each
+  request is then decoded back and must give the fields it was built from. A host that is
+  not little endian reports every frame, as the reference writes host order.
+  Exits with 1 if any frame differs, so it can gate a build.
+
+  usage: ProtocolCodecCheck [--iterations=200000] [--seed=1]
+ */
+
+#include "ProtocolCodec.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+	using Codec = ProtocolCodec::Codec<ProtocolCodec::Current>;
+
+	struct Options
+	{
+		uint64_t iterations = 200000;
+		uint32_t seed = 1;
+	};
+
+	/**
+	   @brief a response frame as the server wrote it before the codec.
+	 */
+	void referenceResponse(uint8_t* frame, const uint8_t version, const uint16_t status, const uint8_t* name, const uint16_t nameLen, const uint32_t size, const uint8_t* payload)
+	{
+		uint32_t first = PACKET_SIZE - (1 + 2 + 2 + nameLen + 4);
+		if (size < first)
+			first = size;
+		memcpy(frame, &version, 1);
+		memcpy(frame + 1, &status, 2);
+		memcpy(frame + 3, &nameLen, 2);
+		memcpy(frame + 5, name, nameLen);
+		memcpy(frame + 5 + nameLen, &size, 4);
+		memcpy(frame + 9 + nameLen, payload, first);
+	}
+
+	/**
+	   @brief a request frame as the client library wrote it before the codec.
+	 */
+	void referenceRequest(uint8_t* frame, const uint32_t userID, const uint8_t version, const uint8_t op, const uint8_t* name, const uint16_t nameLen, const uint32_t size, const uint8_t* payload)
+	{
+		uint32_t first = PACKET_SIZE - (4 + 1 + 1 + 2 + nameLen + 4);
+		if (size < first)
+			first = size;
+		memcpy(frame, &userID, 4);
+		memcpy(frame + 4, &version, 1);
+		memcpy(frame + 5, &op, 1);
+		memcpy(frame + 6, &nameLen, 2);
+		memcpy(frame + 8, name, nameLen);
+		memcpy(frame + 8 + nameLen, &size, 4);
+		memcpy(frame + 12 + nameLen, payload, first);
+	}
+
+	bool parse(const int argc, char** argv, Options& options)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string arg(argv[i]);
+			if (arg.rfind("--iterations=", 0) == 0)
+				options.iterations = strtoull(arg.c_str() + 13, nullptr, 10);
+			else if (arg.rfind("--seed=", 0) == 0)
+				options.seed = static_cast<uint32_t>(strtoul(arg.c_str() + 7, nullptr, 10));
+			else
+				return false;
+		}
+		return true;
+	}
+
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!parse(argc, argv, options))
+	{
+		fprintf(stderr, "usage: ProtocolCodecCheck [--iterations=200000] [--seed=1]\n");
+		return 2;
+	}
+	std::mt19937 rng(options.seed);
+	std::vector<uint8_t> name(PACKET_SIZE), payload(2 * PACKET_SIZE);
+	for (auto& byte : name)
+		byte = static_cast<uint8_t>(rng());
+	for (auto& byte : payload)
+		byte = static_cast<uint8_t>(rng());
+
+	const uint16_t longestRequestName = PACKET_SIZE - ProtocolCodec::Current::REQUEST_FIXED;
+	const uint16_t longestResponseName = PACKET_SIZE - ProtocolCodec::Current::RESPONSE_FIXED;
+	uint64_t requests = 0, responses = 0, decodes = 0;
+	for (uint64_t i = 0; i < options.iterations; ++i)
+	{
+		const uint32_t userID = rng();
+		const uint8_t op = static_cast<uint8_t>(rng());
+		const uint16_t status = static_cast<uint16_t>(rng());
+		const uint32_t size = (rng() % 3 == 0) ? rng() : rng() % (PACKET_SIZE + PACKET_SIZE / 2);   // huge, or around one frame.
+		uint8_t expected[PACKET_SIZE] = {}, actual[PACKET_SIZE] = {};
+
+		const uint16_t requestName = static_cast<uint16_t>(1 + rng() % longestRequestName);
+		referenceRequest(expected, userID, ProtocolCodec::Current::version, op, name.data(), requestName, size, payload.data());
+		(void)Codec::encodeRequest(actual, userID, op, name.data(), requestName, size, payload.data());
+		if (memcmp(expected, actual, PACKET_SIZE) != 0)
+			++requests;
+
+		ProtocolCodec::RequestFields fields;
+		const bool decoded = Codec::decodeRequest(expected, PACKET_SIZE, fields) == ProtocolCodec::DECODED_SIZE
+			&& fields.userID == userID && fields.version == ProtocolCodec::Current::version && fields.op == op
+			&& fields.nameLen == requestName && fields.name == expected + ProtocolCodec::Current::REQUEST_NAME && fields.size == size
+			&& fields.first == Codec::firstPayload(Codec::requestOverhead(requestName), size) && memcmp(fields.payload, payload.data(), fields.first) == 0;
+		if (!decoded)
+			++decodes;
+
+		const uint16_t responseName = static_cast<uint16_t>(rng() % (longestResponseName + 1));
+		memset(expected, 0, PACKET_SIZE);
+		memset(actual, 0, PACKET_SIZE);
+		referenceResponse(expected, ProtocolCodec::Current::version, status, name.data(), responseName, size, payload.data());
+		(void)Codec::encodeResponse(actual, status, name.data(), responseName, size, payload.data());
+		if (memcmp(expected, actual, PACKET_SIZE) != 0)
+			++responses;
+	}
+
+	printf("%llu frames of each kind: request mismatches %llu, response mismatches %llu, request decode failures %llu\n",
+		static_cast<unsigned long long>(options.iterations), static_cast<unsigned long long>(requests),
+		static_cast<unsigned long long>(responses), static_cast<unsigned long long>(decodes));
+	return (requests == 0 && responses == 0 && decodes == 0) ? 0 : 1;
+}
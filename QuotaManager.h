@@ -0,0 +1,326 @@
+/**
+  @QuotaManager per-user storage quotas and usage accounting.
+  Each user's live files and bytes (content sizes, as the client sent them) are kept in
+  counters that backups, overwrites and removes update as they complete, so neither enforcing
+  a quota nor answering CLI_USAGE walks the user's folder.
+  With versioning on, the bytes also count the user's retained versions (VersionStore), except
+  the newest version of a live file, which is that file. Overwriting a file therefore moves its
+  old content to the versions instead of freeing it, removing a file keeps its newest version
+  charged, and only retention frees version bytes.
+  A user's counters are seeded once, at the first request that needs them: from the metadata
+  index (MetadataSnapshot), or by walking the folder while the index is not ready, plus a walk
+  of the versions. Requests of one user are serialized by the user lock, so a user's counters
+  only move under that lock.
+  A backup is admitted before its payload is read: one whose declared size would take the
+  user past its byte or file quota (an overwrite counts the difference with the file it
+  replaces, without versioning) is answered ERROR_QUOTA and the connection is closed.
+  Configuration: BACKUPSVR_QUOTA_BYTES, BACKUPSVR_QUOTA_FILES (0 = unlimited),
+                 BACKUPSVR_USER_QUOTAS ("userID:bytes[/files];userID:bytes[/files]").
+ */
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include "DirectoryCache.h"
+#include "MetadataSnapshot.h"
+#include "VersionStore.h"
+
+#define QUOTA_BYTES_ENV  "BACKUPSVR_QUOTA_BYTES"
+#define QUOTA_FILES_ENV  "BACKUPSVR_QUOTA_FILES"
+#define QUOTA_USERS_ENV  "BACKUPSVR_USER_QUOTAS"
+
+namespace QuotaManager {
+
+	struct Limit
+	{
+		uint64_t bytes = 0;   // 0: unlimited.
+		uint64_t files = 0;
+	};
+
+	struct Config
+	{
+		Limit defaults;
+		std::map<uint32_t, Limit> users;   // overrides of the defaults.
+	};
+
+	inline const Config& config()
+	{
+		static const Config configured = []()
+		{
+			Config c;
+			const char* bytes = getenv(QUOTA_BYTES_ENV);
+			const char* files = getenv(QUOTA_FILES_ENV);
+			const char* users = getenv(QUOTA_USERS_ENV);
+			if (bytes != nullptr)
+				c.defaults.bytes = strtoull(bytes, nullptr, 10);
+			if (files != nullptr)
+				c.defaults.files = strtoull(files, nullptr, 10);
+			std::stringstream list(users != nullptr ? users : "");
+			std::string entry;
+			while (std::getline(list, entry, ';'))
+			{
+				const size_t colon = entry.find(':');
+				if (colon == std::string::npos)
+					continue;
+				Limit limit;
+				limit.bytes = strtoull(entry.c_str() + colon + 1, nullptr, 10);
+				const size_t slash = entry.find('/', colon);
+				if (slash != std::string::npos)
+					limit.files = strtoull(entry.c_str() + slash + 1, nullptr, 10);
+				c.users[static_cast<uint32_t>(strtoul(entry.c_str(), nullptr, 10))] = limit;
+			}
+			return c;
+		}();
+		return configured;
+	}
+
+	inline Limit limitOf(const uint32_t userID)
+	{
+		const Config& c = config();
+		const auto it = c.users.find(userID);
+		return (it == c.users.end()) ? c.defaults : it->second;
+	}
+
+	struct Stats
+	{
+		std::atomic<uint64_t> rejected{ 0 };    // backups refused up front.
+		std::atomic<uint64_t> accounts{ 0 };    // users whose counters are kept.
+		std::atomic<uint64_t> scans{ 0 };       // accounts seeded by walking the folder.
+	};
+
+	inline Stats& stats()
+	{
+		static Stats s;
+		return s;
+	}
+
+	/**
+	   The file a request replaces or removes, as it was before the request.
+	 */
+	struct Prior
+	{
+		bool existed = false;
+		uint64_t size = 0;
+		uint64_t versionBytes = 0;   // its versions' charged bytes (versionBytes()).
+	};
+
+	/**
+	   @brief bytes of a file's versions charged to the user: all of them, but the newest only
+	          once the live file is gone, as it is the live file until then.
+	 */
+	inline uint64_t versionBytes(const DirectoryCache::Directory& dir, const std::string& name, const bool live)
+	{
+		std::vector<VersionStore::Version> versions;
+		if (!VersionStore::retention().enabled || !VersionStore::list(dir, name, versions) || versions.empty())
+			return 0;
+		uint64_t bytes = 0;
+		for (const auto& version : versions)
+			bytes += version.size;
+		return live ? bytes - versions.back().size : bytes;
+	}
+
+	struct Usage
+	{
+		uint64_t bytes = 0;
+		uint64_t files = 0;
+		Limit limit;
+	};
+
+
+	class Ledger
+	{
+	public:
+		static Ledger& instance()
+		{
+			static Ledger ledger;
+			return ledger;
+		}
+
+		/**
+		   @brief look up a user file before it is replaced or removed: in the index, or on disk
+		          while the index is not ready.
+		 */
+		Prior prior(const DirectoryCache::Directory& dir, const std::string& name)
+		{
+			MetadataSnapshot::Index& index = MetadataSnapshot::instance();
+			const bool indexed = index.ready();
+			MetadataSnapshot::FileMeta meta;
+			Prior p;
+			p.existed = index.find(dir.userID, name, meta) || (!indexed && MetadataSnapshot::statFile(dir.folder, name, meta));
+			p.size = p.existed ? meta.size : 0;
+			p.versionBytes = versionBytes(dir, name, p.existed);
+			return p;
+		}
+
+		/**
+		   @brief check a backup against the user's quota before its payload is received.
+		   @param prior the file the backup replaces.
+		   @param size the backup's declared size.
+		   @return false if the backup would exceed the quota.
+		 */
+		bool admit(const DirectoryCache::Directory& dir, const Prior& prior, const uint64_t size, std::stringstream& err)
+		{
+			const Limit limit = limitOf(dir.userID);
+			if (limit.bytes == 0 && limit.files == 0)
+				return true;
+			const Account& account = seeded(dir);
+			const uint64_t held = account.bytes.load(std::memory_order_relaxed);
+			const uint64_t freed = VersionStore::retention().enabled ? 0 : prior.size;   // a versioned file's old content stays, as a version.
+			const uint64_t bytes = held - ((freed < held) ? freed : held) + size;
+			const uint64_t files = account.files.load(std::memory_order_relaxed) + (prior.existed ? 0 : 1);
+			if ((limit.bytes == 0 || bytes <= limit.bytes) && (limit.files == 0 || files <= limit.files))
+				return true;
+			stats().rejected.fetch_add(1, std::memory_order_relaxed);
+			err << "user ID #" << +dir.userID << ": backup of " << size << " bytes exceeds the quota (" << held << " of " << limit.bytes
+				<< " bytes, " << account.files.load(std::memory_order_relaxed) << " of " << limit.files << " files used)." << std::endl;
+			return false;
+		}
+
+		/**
+		   @brief a backup of `size` bytes replacing `prior` completed, and was versioned.
+		 */
+		void stored(const DirectoryCache::Directory& dir, const std::string& name, const Prior& prior, const uint64_t size)
+		{
+			Account* account = find(dir.userID);
+			if (account == nullptr)
+				return;   // not seeded yet: the seed will count the file.
+			account->bytes.fetch_add(size + versionBytes(dir, name, true), std::memory_order_relaxed);
+			release(account->bytes, (prior.existed ? prior.size : 0) + prior.versionBytes);
+			if (!prior.existed)
+				account->files.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		/**
+		   @brief the file `prior` was removed. its versions stay, and stay charged.
+		 */
+		void removed(const DirectoryCache::Directory& dir, const std::string& name, const Prior& prior)
+		{
+			Account* account = prior.existed ? find(dir.userID) : nullptr;
+			if (account == nullptr)
+				return;
+			account->bytes.fetch_add(versionBytes(dir, name, false), std::memory_order_relaxed);
+			release(account->bytes, prior.size + prior.versionBytes);
+			release(account->files, 1);
+		}
+
+		Usage usage(const DirectoryCache::Directory& dir)
+		{
+			const Account& account = seeded(dir);
+			Usage u;
+			u.bytes = account.bytes.load(std::memory_order_relaxed);
+			u.files = account.files.load(std::memory_order_relaxed);
+			u.limit = limitOf(dir.userID);
+			return u;
+		}
+
+		/**
+		   @brief "<bytes> <files> <quota bytes> <quota files>", quotas 0 if unlimited.
+		 */
+		static std::string line(const Usage& u)
+		{
+			return std::to_string(u.bytes) + " " + std::to_string(u.files) + " " + std::to_string(u.limit.bytes) + " " + std::to_string(u.limit.files);
+		}
+
+		Ledger(const Ledger&) = delete;
+		Ledger& operator=(const Ledger&) = delete;
+
+	private:
+		struct Account
+		{
+			std::atomic<uint64_t> bytes{ 0 };
+			std::atomic<uint64_t> files{ 0 };
+		};
+
+		Ledger() = default;
+
+		static void release(std::atomic<uint64_t>& counter, const uint64_t amount)
+		{
+			uint64_t current = counter.load(std::memory_order_relaxed);
+			while (!counter.compare_exchange_weak(current, (current > amount) ? current - amount : 0, std::memory_order_relaxed))
+			{
+			}
+		}
+
+		/**
+		   @return the charged bytes of all the user's versions: one walk of the versions tree.
+		 */
+		static uint64_t seedVersions(const DirectoryCache::Directory& dir)
+		{
+			namespace fs = std::filesystem;
+			if (!VersionStore::retention().enabled)
+				return 0;
+			const fs::path root(dir.folder + VERSIONS_DIR);
+			uint64_t bytes = 0;
+			std::error_code error;
+			fs::recursive_directory_iterator it(root, fs::directory_options::skip_permission_denied, error);
+			for (const fs::recursive_directory_iterator end; !error && it != end; it.increment(error))
+			{
+				if (!it->is_directory(error))
+					continue;
+				const std::string name = it->path().lexically_relative(root).generic_string();   // a folder of versions, or of nested names.
+				MetadataSnapshot::FileMeta meta;
+				bytes += versionBytes(dir, name, MetadataSnapshot::statFile(dir.folder, name, meta));
+			}
+			return bytes;
+		}
+
+		Account* find(const uint32_t userID)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			const auto it = _accounts.find(userID);
+			return (it == _accounts.end()) ? nullptr : it->second.get();
+		}
+
+		/**
+		   @return the user's account, seeded first if this is the first request that needs it.
+		 */
+		Account& seeded(const DirectoryCache::Directory& dir)
+		{
+			Account* account = find(dir.userID);
+			if (account != nullptr)
+				return *account;
+			auto created = std::make_unique<Account>();
+			MetadataSnapshot::Usage usage;
+			if (MetadataSnapshot::instance().usage(dir.userID, usage))
+			{
+				created->bytes = usage.bytes;
+				created->files = usage.files;
+			}
+			else
+			{
+				std::map<std::string, MetadataSnapshot::FileMeta> files;
+				(void)MetadataSnapshot::scanFolder(dir.folder, files);
+				for (const auto& file : files)
+					created->bytes += file.second.size;
+				created->files = files.size();
+				stats().scans.fetch_add(1, std::memory_order_relaxed);
+			}
+			created->bytes += seedVersions(dir);
+			std::lock_guard<std::mutex> lock(_mutex);
+			auto& slot = _accounts[dir.userID];
+			if (slot == nullptr)
+			{
+				slot = std::move(created);
+				stats().accounts.fetch_add(1, std::memory_order_relaxed);
+			}
+			return *slot;
+		}
+
+		std::mutex _mutex;
+		std::unordered_map<uint32_t, std::unique_ptr<Account>> _accounts;   // never erased: references stay valid.
+	};
+
+	inline Ledger& instance()
+	{
+		return Ledger::instance();
+	}
+
+}
@@ -0,0 +1,610 @@
+/**
+  @ReplicationLog asynchronous replication of committed backups and removes to a mirror server.
+  A request that changed a user's files appends a record (op, user, filename) to an ordered
+  on-disk log once it succeeded; the client is answered without waiting for the mirror.
+  Appending only queues the record: a writer thread writes whatever has queued and
+  fdatasyncs it as one group, so a request never waits on the log's disk and a crash loses
+  at most the group being written.
+  A streamer thread ships the log to the mirror over the ordinary client protocol: a
+  backup record sends the file's current content (its newest version when versioning is
+  on, as versions never change under the reader), a remove record sends a remove. The
+  streamer holds the user's StorageRoots lease while it reads, so the folder cannot move
+  under it, and takes a Scheduler slot per read like any other transfer.
+  A record the mirror refuses is retried alone, with backoff, and skipped after
+  REPLICATION_MAX_REJECTS refusals; the records before it are not shipped again.
+  Records are shipped in batches: a record waits at most the batch window for others to
+  join it, and repeated records of one file within a batch are shipped once.
+  The shipped position is kept in a cursor file next to the log, so after a mirror outage
+  or a restart the streamer resumes where it stopped, retrying with backoff meanwhile.
+  Once everything is shipped the log is truncated.
+  Configuration: BACKUPSVR_MIRROR ("host:port", replication is off without it),
+                 BACKUPSVR_REPL_LOG (log path), BACKUPSVR_REPL_BATCH_MS.
+ */
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include "ProtocolClient.h"
+#include "Scheduler.h"
+#include "StorageRoots.h"
+#include "DirectoryCache.h"
+#include "VersionStore.h"
+#include "AtRestCipher.h"
+#include "SmallFileStore.h"
+#include "TieringManager.h"
+
+#define REPLICATION_LOG_FILE  "replication.log"
+#define REPLICATION_BATCH  256                 // records per batch.
+#define REPLICATION_BATCH_MS  200              // longest a record waits for a batch to fill.
+#define REPLICATION_RETRY_MIN_MS  100
+#define REPLICATION_RETRY_MAX_MS  5000
+#define REPLICATION_MAX_REJECTS  5             // a record the mirror keeps refusing is skipped.
+#define REPLICATION_MAX_RECORD  (8 * 1024)   // names are at most FILENAME_MAX.
+#define REPLICATION_RECORD_GUESS  64         // typical record size, for read sizing.
+#define REPLICATION_MIRROR_ENV  "BACKUPSVR_MIRROR"
+#define REPLICATION_LOG_ENV  "BACKUPSVR_REPL_LOG"
+#define REPLICATION_BATCH_ENV  "BACKUPSVR_REPL_BATCH_MS"
+
+namespace ReplicationLog {
+
+	enum EOp : uint8_t
+	{
+		BACKUP = 100,   // Request::EOp::CLI_FILE_BACKUP.
+		REMOVE = 201    // Request::EOp::CLI_FILE_REMOVE.
+	};
+
+	/**
+	   Log record: uint32 length of the rest, uint64 time (ns since epoch), uint8 op,
+	   uint32 user ID, uint16 name length, name.
+	 */
+	struct Record
+	{
+		uint64_t timeNs = 0;
+		uint8_t op = 0;
+		uint32_t userID = 0;
+		std::string filename;
+	};
+
+	struct Stats
+	{
+		std::atomic<uint64_t> appended{ 0 };
+		std::atomic<uint64_t> shipped{ 0 };
+		std::atomic<uint64_t> coalesced{ 0 };    // records made redundant by a later one of the same file.
+		std::atomic<uint64_t> retries{ 0 };      // batches retried after a mirror failure, records after a refusal.
+		std::atomic<uint64_t> skipped{ 0 };      // records the mirror refused REPLICATION_MAX_REJECTS times.
+		std::atomic<uint64_t> logErrors{ 0 };    // records that could not be appended.
+		std::atomic<uint64_t> oldestPendingNs{ 0 };   // time of the oldest unshipped record, 0 if none.
+	};
+
+	template <typename T>
+	void put(std::string& out, const T& value)
+	{
+		out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+	}
+
+	inline std::string encode(const Record& record)
+	{
+		std::string body;
+		put(body, record.timeNs);
+		put(body, record.op);
+		put(body, record.userID);
+		put(body, static_cast<uint16_t>(record.filename.size()));
+		body += record.filename;
+		std::string out;
+		put(out, static_cast<uint32_t>(body.size()));
+		return out + body;
+	}
+
+	/**
+	   @brief decode one record.
+	   @return bytes used, 0 if `length` bytes do not hold a whole valid record.
+	 */
+	inline size_t decode(const uint8_t* data, const size_t length, Record& record)
+	{
+		uint32_t bodyLength = 0;
+		const size_t fixed = sizeof(record.timeNs) + sizeof(record.op) + sizeof(record.userID) + sizeof(uint16_t);
+		if (length < sizeof(bodyLength))
+			return 0;
+		memcpy(&bodyLength, data, sizeof(bodyLength));
+		if (bodyLength < fixed || bodyLength > REPLICATION_MAX_RECORD || length - sizeof(bodyLength) < bodyLength)
+			return 0;
+		const uint8_t* ptr = data + sizeof(bodyLength);
+		uint16_t nameLen = 0;
+		memcpy(&record.timeNs, ptr, sizeof(record.timeNs));
+		ptr += sizeof(record.timeNs);
+		memcpy(&record.op, ptr, sizeof(record.op));
+		ptr += sizeof(record.op);
+		memcpy(&record.userID, ptr, sizeof(record.userID));
+		ptr += sizeof(record.userID);
+		memcpy(&nameLen, ptr, sizeof(nameLen));
+		ptr += sizeof(nameLen);
+		if (fixed + nameLen != bodyLength)
+			return 0;
+		record.filename.assign(reinterpret_cast<const char*>(ptr), nameLen);
+		return sizeof(bodyLength) + bodyLength;
+	}
+
+	inline uint64_t nowNs()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+	}
+
+
+	class Log
+	{
+	public:
+		static Log& instance()
+		{
+			static Log log;
+			return log;
+		}
+
+		bool enabled() const { return _enabled; }
+		const Stats& stats() const { return _stats; }
+		const std::string& mirror() const { return _mirror; }
+
+		uint64_t backlog() const
+		{
+			return _stats.appended.load(std::memory_order_relaxed) - _stats.shipped.load(std::memory_order_relaxed) - _stats.coalesced.load(std::memory_order_relaxed) - _stats.skipped.load(std::memory_order_relaxed);
+		}
+
+		/**
+		   @brief age of the oldest record not yet on the mirror.
+		 */
+		double lagSeconds() const
+		{
+			const uint64_t oldest = _stats.oldestPendingNs.load(std::memory_order_relaxed);
+			const uint64_t now = nowNs();
+			return (oldest == 0 || now < oldest) ? 0 : static_cast<double>(now - oldest) / 1e9;
+		}
+
+		/**
+		   @brief append a committed change. waits neither for the disk nor for the mirror.
+		   @return false if the log is unusable (the mirror will miss the change). a failed
+		           write of a queued record is counted in logErrors.
+		 */
+		bool append(const uint8_t op, const uint32_t userID, const std::string& filename, std::stringstream& err)
+		{
+			if (!_enabled)
+				return true;
+			Record record;
+			record.timeNs = nowNs();
+			record.op = op;
+			record.userID = userID;
+			record.filename = filename;
+			const std::string bytes = encode(record);
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				if (_file == nullptr)
+				{
+					_stats.logErrors.fetch_add(1, std::memory_order_relaxed);
+					err << "user ID #" << +userID << ": replication log append of " << filename << " failed." << std::endl;
+					return false;
+				}
+				_queued += bytes;
+				++_queuedRecords;
+				uint64_t none = 0;
+				(void)_stats.oldestPendingNs.compare_exchange_strong(none, record.timeNs, std::memory_order_relaxed);
+			}
+			_stats.appended.fetch_add(1, std::memory_order_relaxed);
+			_wake.notify_one();
+			return true;
+		}
+
+		~Log()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stopping = true;
+			}
+			_wake.notify_all();
+			_appended.notify_all();
+			if (_writer.joinable())
+				_writer.join();   // writes what is still queued.
+			if (_streamer.joinable())
+				_streamer.join();
+			if (_file != nullptr)
+				fclose(_file);
+		}
+
+		Log(const Log&) = delete;
+		Log& operator=(const Log&) = delete;
+
+	private:
+		Log() : _enabled(false), _file(nullptr), _end(0), _cursor(0), _queuedRecords(0), _batchWindow(REPLICATION_BATCH_MS), _stopping(false)
+		{
+			const char* mirror = getenv(REPLICATION_MIRROR_ENV);
+			if (mirror == nullptr || *mirror == '\0')
+				return;
+			_mirror = mirror;
+			const char* path = getenv(REPLICATION_LOG_ENV);
+			_path = (path != nullptr && *path != '\0') ? path : REPLICATION_LOG_FILE;
+			const char* batch = getenv(REPLICATION_BATCH_ENV);
+			if (batch != nullptr && atoi(batch) >= 0)
+				_batchWindow = std::chrono::milliseconds(atoi(batch));
+			std::error_code error;
+			_end = std::filesystem::exists(_path, error) ? static_cast<uint64_t>(std::filesystem::file_size(_path, error)) : 0;
+			_cursor = loadCursor();
+			if (_cursor > _end)
+				_cursor = 0;   // the log was replaced.
+			const uint64_t valid = countPending();
+			if (valid < _end)
+			{
+				std::filesystem::resize_file(_path, valid, error);   // a record torn by a crash.
+				_end = valid;
+			}
+			_file = fopen(_path.c_str(), "ab");
+			if (_file == nullptr)
+				return;
+			_enabled = true;
+			_writer = std::thread(&Log::write, this);
+			_streamer = std::thread(&Log::stream, this);
+		}
+
+		/**
+		   @brief the writer thread: write and fdatasync everything queued as one group, then
+		   hand it to the streamer. a failed group is cut off the log, so no torn record stays.
+		 */
+		void write()
+		{
+			std::string group;
+			while (true)
+			{
+				size_t records = 0;
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					_wake.wait(lock, [this] { return _stopping || !_queued.empty(); });
+					if (_queued.empty())
+						return;   // stopping, and all written.
+					group.swap(_queued);
+					records = _queuedRecords;
+					_queued.clear();
+					_queuedRecords = 0;
+				}
+				std::lock_guard<std::mutex> writing(_writeMutex);   // advance() may not reopen the file meanwhile.
+				const bool written = (_file != nullptr && fwrite(group.data(), 1, group.size(), _file) == group.size() && fflush(_file) == 0 && fdatasync(fileno(_file)) == 0);
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					if (written)
+						_end += group.size();
+					else
+					{
+						if (_file != nullptr)
+						{
+							clearerr(_file);
+							(void)ftruncate(fileno(_file), static_cast<off_t>(_end));
+						}
+						_stats.logErrors.fetch_add(records, std::memory_order_relaxed);
+						_stats.appended.fetch_sub(records, std::memory_order_relaxed);
+						if (_end == _cursor && _queued.empty())
+							_stats.oldestPendingNs.store(0, std::memory_order_relaxed);
+					}
+				}
+				if (written)
+					_appended.notify_one();
+			}
+		}
+
+		std::string cursorPath() const { return _path + ".cursor"; }
+
+		uint64_t loadCursor() const
+		{
+			std::ifstream in(cursorPath());
+			uint64_t cursor = 0;
+			return (in >> cursor) ? cursor : 0;
+		}
+
+		bool saveCursor(const uint64_t cursor) const
+		{
+			const std::string pending = cursorPath() + ".tmp";
+			{
+				std::ofstream out(pending, std::ios::trunc);
+				out << cursor << "\n";
+				if (!out.flush())
+					return false;
+			}
+			return std::rename(pending.c_str(), cursorPath().c_str()) == 0;
+		}
+
+		/**
+		   @brief unshipped records left by a previous run count as appended.
+		   @return end of the last whole record.
+		 */
+		uint64_t countPending()
+		{
+			std::vector<Record> records;
+			uint64_t offset = _cursor;
+			while (true)
+			{
+				uint64_t next = offset;
+				records.clear();
+				if (!read(offset, _end, REPLICATION_BATCH, records, next) || records.empty())
+					break;
+				if (offset == _cursor)
+					_stats.oldestPendingNs.store(records.front().timeNs, std::memory_order_relaxed);
+				_stats.appended.fetch_add(records.size(), std::memory_order_relaxed);
+				offset = next;
+			}
+			return offset;
+		}
+
+		/**
+		   @brief read up to `max` whole records of [offset, end).
+		   @param next offset after the last record read.
+		 */
+		bool read(const uint64_t offset, const uint64_t end, const size_t max, std::vector<Record>& records, uint64_t& next) const
+		{
+			next = offset;
+			if (offset >= end)
+				return true;
+			FILE* in = fopen(_path.c_str(), "rb");
+			if (in == nullptr)
+				return false;
+			// enough for `max` typical records and always for one of the largest.
+			std::vector<uint8_t> data(static_cast<size_t>(std::min<uint64_t>(end - offset, static_cast<uint64_t>(max) * REPLICATION_RECORD_GUESS + REPLICATION_MAX_RECORD)));
+			const bool ok = (fseek(in, static_cast<long>(offset), SEEK_SET) == 0);
+			const size_t length = ok ? fread(data.data(), 1, data.size(), in) : 0;
+			size_t used = 0;
+			while (ok && records.size() < max)
+			{
+				Record record;
+				const size_t n = decode(data.data() + used, length - used, record);
+				if (n == 0)
+					break;
+				records.push_back(std::move(record));
+				used += n;
+				next = offset + used;
+			}
+			fclose(in);
+			return ok;
+		}
+
+		/**
+		   @brief keep only the last record of each (user, file), in log order.
+		 */
+		static std::vector<Record> coalesce(const std::vector<Record>& records)
+		{
+			std::map<std::pair<uint32_t, std::string>, size_t> last;
+			for (size_t i = 0; i < records.size(); ++i)
+				last[std::make_pair(records[i].userID, records[i].filename)] = i;
+			std::vector<Record> batch;
+			for (size_t i = 0; i < records.size(); ++i)
+			{
+				if (last[std::make_pair(records[i].userID, records[i].filename)] == i)
+					batch.push_back(records[i]);
+			}
+			return batch;
+		}
+
+		enum EShip { SHIPPED, UNREACHABLE, REJECTED };
+
+		/**
+		   @brief apply one record on the mirror.
+		 */
+		EShip ship(ProtocolClient::Client& client, const Record& record) const
+		{
+			ProtocolClient::Reply reply;
+			if (record.op == REMOVE)
+			{
+				if (!client.remove(record.userID, record.filename, reply))
+					return UNREACHABLE;
+				const bool gone = (reply.status == ProtocolClient::SUCCESS_BACKUP_DELETE || reply.status == ProtocolClient::ERROR_NOT_EXIST || reply.status == ProtocolClient::ERROR_NO_FILES);
+				return gone ? SHIPPED : REJECTED;
+			}
+
+			const StorageRoots::UserLease lease(record.userID);   // the folder may not move while it is read.
+			const Scheduler::Transfer transfer(record.userID, Scheduler::BULK);
+			const std::string& folder = lease.folder();
+			std::string source = folder + record.filename;
+			const DirectoryCache::Handle dir = DirectoryCache::get(record.userID, folder, false);
+			VersionStore::Version version;
+			if (dir != nullptr && VersionStore::find(*dir, record.filename, 0, version))
+				source = folder + VersionStore::path(record.filename, version.id);
+			else if (dir != nullptr && !TieringManager::instance().accessed(*dir, record.filename))
+				return REJECTED;   // cold, and could not be read back.
+			std::vector<uint8_t> small;
+			bool isSmall = false;
+			{
+				const Scheduler::Transfer::Io io(transfer, SCHEDULER_QUANTUM);
+				isSmall = (dir != nullptr && SmallFileStore::instance().get(*dir, record.filename, small));
+			}
+			if (isSmall)
+			{
+				uint32_t sent = 0;
+				if (!client.backupFrom(record.userID, record.filename, static_cast<uint32_t>(small.size()), [&small, &sent](uint8_t* data, const uint32_t length)
+				{
+					const uint32_t part = std::min<uint32_t>(length, static_cast<uint32_t>(small.size()) - sent);
+					memcpy(data, small.data() + sent, part);
+					memset(data + part, 0, length - part);
+					sent += part;
+					return true;
+				}, reply))
+					return UNREACHABLE;
+				return (reply.status == ProtocolClient::SUCCESS_BACKUP_DELETE) ? SHIPPED : REJECTED;
+			}
+			AtRestCipher::File in;   // the mirror gets plaintext and seals it with its own key.
+			const int fd = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+				return SHIPPED;   // removed since: its remove record follows.
+			if (!in.open(fd, record.userID) || in.size() > UINT32_MAX)
+				return REJECTED;
+			const auto size = static_cast<uint32_t>(in.size());
+			const bool sent = client.backupFrom(record.userID, record.filename, size, [&in, &transfer](uint8_t* data, const uint32_t length)
+			{
+				const Scheduler::Transfer::Io io(transfer, length);
+				return in.read(data, length);
+			}, reply);
+			if (!sent)
+				return UNREACHABLE;
+			return (reply.status == ProtocolClient::SUCCESS_BACKUP_DELETE) ? SHIPPED : REJECTED;
+		}
+
+		bool mirrorEndpoint(boost::asio::io_context& io, boost::asio::ip::tcp::endpoint& endpoint) const
+		{
+			try
+			{
+				const size_t colon = _mirror.rfind(':');
+				if (colon == std::string::npos)
+					return false;
+				boost::asio::ip::tcp::resolver resolver(io);
+				const auto results = resolver.resolve(_mirror.substr(0, colon), _mirror.substr(colon + 1));
+				if (results.empty())
+					return false;
+				endpoint = results.begin()->endpoint();
+				return true;
+			}
+			catch (std::exception&)
+			{
+				return false;
+			}
+		}
+
+		/**
+		   @brief sleep for the backoff, or until stopping.
+		   @return false when stopping.
+		 */
+		bool backoff(std::chrono::milliseconds& delay)
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_appended.wait_for(lock, delay, [this] { return _stopping; });
+			delay = std::min(delay * 2, std::chrono::milliseconds(REPLICATION_RETRY_MAX_MS));
+			return !_stopping;
+		}
+
+		void stream()
+		{
+			boost::asio::io_context io;
+			boost::asio::ip::tcp::endpoint endpoint;
+			std::chrono::milliseconds delay(REPLICATION_RETRY_MIN_MS);
+			while (!mirrorEndpoint(io, endpoint))
+			{
+				if (!backoff(delay))
+					return;
+			}
+			ProtocolClient::Client client(io, endpoint);
+			while (true)
+			{
+				uint64_t end = 0;
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					_appended.wait(lock, [this] { return _stopping || _end > _cursor; });
+					if (_stopping)
+						return;
+					// let the batch fill, bounded by the window.
+					_appended.wait_for(lock, _batchWindow, [this] { return _stopping; });
+					end = _end;
+				}
+
+				std::vector<Record> records;
+				uint64_t next = _cursor;
+				if (!read(_cursor, end, REPLICATION_BATCH, records, next) || records.empty())
+				{
+					if (!backoff(delay))
+						return;
+					continue;
+				}
+				const std::vector<Record> batch = coalesce(records);
+				bool reachable = true;
+				size_t shipped = 0;
+				for (const auto& record : batch)
+				{
+					EShip result = ship(client, record);
+					for (uint32_t refused = 1; result == REJECTED && refused < REPLICATION_MAX_REJECTS; ++refused)
+					{
+						_stats.retries.fetch_add(1, std::memory_order_relaxed);
+						if (!backoff(delay))
+							return;
+						result = ship(client, record);   // this record only: the ones before it are on the mirror.
+					}
+					if (result == UNREACHABLE)
+					{
+						reachable = false;   // retried with the whole batch. shipping a record twice is harmless.
+						break;
+					}
+					if (result == REJECTED)
+						_stats.skipped.fetch_add(1, std::memory_order_relaxed);
+					else
+						++shipped;
+				}
+				if (!reachable)
+				{
+					_stats.retries.fetch_add(1, std::memory_order_relaxed);
+					if (!backoff(delay))
+						return;
+					continue;
+				}
+				delay = std::chrono::milliseconds(REPLICATION_RETRY_MIN_MS);
+				_stats.shipped.fetch_add(shipped, std::memory_order_relaxed);
+				_stats.coalesced.fetch_add(records.size() - batch.size(), std::memory_order_relaxed);
+				advance(next);
+			}
+		}
+
+		/**
+		   @brief move the cursor past shipped records. an all shipped log is truncated.
+		 */
+		void advance(const uint64_t next)
+		{
+			std::lock_guard<std::mutex> writing(_writeMutex);
+			std::lock_guard<std::mutex> lock(_mutex);
+			_cursor = next;
+			if (_cursor == _end && _file != nullptr)
+			{
+				FILE* truncated = freopen(_path.c_str(), "wb", _file);
+				_file = (truncated != nullptr) ? truncated : fopen(_path.c_str(), "ab");
+				_cursor = 0;
+				_end = 0;
+				_stats.oldestPendingNs.store(0, std::memory_order_relaxed);
+			}
+			else
+			{
+				std::vector<Record> first;
+				uint64_t ignored = 0;
+				if (read(_cursor, _end, 1, first, ignored) && !first.empty())
+					_stats.oldestPendingNs.store(first.front().timeNs, std::memory_order_relaxed);
+			}
+			(void)saveCursor(_cursor);
+		}
+
+		bool _enabled;
+		std::string _mirror;
+		std::string _path;
+		FILE* _file;
+		uint64_t _end;       // log size.
+		uint64_t _cursor;    // offset of the first unshipped record.
+		std::string _queued;         // appended records not yet written.
+		size_t _queuedRecords;
+		std::chrono::milliseconds _batchWindow;
+		bool _stopping;
+		std::mutex _mutex;
+		std::mutex _writeMutex;      // held while _file is written or reopened. taken before _mutex.
+		std::condition_variable _wake;       // records queued.
+		std::condition_variable _appended;   // records written, for the streamer.
+		std::thread _writer;
+		std::thread _streamer;
+		Stats _stats;
+	};
+
+	inline Log& instance()
+	{
+		return Log::instance();
+	}
+
+}
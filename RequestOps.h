@@ -0,0 +1,241 @@
+/**
+  @RequestOps the storage side of the request handlers, shared by the thread per connection
+  handlers (ServerActions) and the coroutine ones (AsyncServerActions).
+  Every step here blocks on storage and knows nothing of the socket: the thread handlers
+  call it inline, the coroutines run it on the user's storage root I/O pool. Each returns
+  the response status; the callers only move bytes between the socket and the storage.
+ */
+
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "ProtocolCodec.h"
+#include "ServerRequest.h"
+#include "ServerResponse.h"
+#include "FileManager.h"
+#include "Metrics.h"
+#include "Scheduler.h"
+#include "Tracing.h"
+#include "TrafficCapture.h"
+#include "VersionStore.h"
+#include "ReplicationLog.h"
+#include "MetadataSnapshot.h"
+#include "FileMatcher.h"
+#include "QuotaManager.h"
+#include "ContentIndex.h"
+#include "StorageEvents.h"
+
+namespace RequestOps {
+
+	/**
+	   @brief quota admission of a backup.
+	   @param prior set to what the name holds now, for backedUp().
+	   @return false if the backup would exceed the user's quota.
+	 */
+	inline bool admitBackup(const DirectoryCache::Directory& dir, const std::string& name, const uint32_t size, QuotaManager::Prior& prior, std::stringstream& err)
+	{
+		prior = QuotaManager::instance().prior(dir, name);
+		return QuotaManager::instance().admit(dir, prior, size, err);
+	}
+
+	/**
+	   @brief account a stored backup: StorageEvents, then the content index and metrics.
+	 */
+	inline void backedUp(const Request& request, const DirectoryCache::Directory& dir, const std::string& name, const QuotaManager::Prior& prior, std::stringstream& err)
+	{
+		const uint32_t size = request.payload.m_size;
+		StorageEvents::onCommitted(dir, name, prior, size, err);
+		ContentIndex::instance().backedUp(request.header.m_userID, name);
+		Metrics::instance().addBytesIn(request.header.m_op, size);
+	}
+
+	/**
+	   @brief version the live file just written and closed, then account it.
+	   the backup succeeds without its version if that cannot be created: the file is stored, err carries the warning.
+	 */
+	inline uint16_t commitBackup(const Request& request, const DirectoryCache::Directory& dir, const std::string& name, const QuotaManager::Prior& prior, std::stringstream& err)
+	{
+		const Tracing::Span versionSpan("storage_io");
+		FileManager::fileReplacedAt(dir, name);
+		(void)VersionStore::snapshot(dir, name, err);
+		backedUp(request, dir, name, prior, err);
+		return ServerResponse::Response::SUCCESS_BACKUP_DELETE;
+	}
+
+	/**
+	   @brief reconcile a backup that failed after it touched the name.
+	   @param truncated whether a regular file was opened for it: its partial content is dropped,
+	          the content it replaced is already gone.
+	   the prior file, if nothing holds the name any more (truncated, or a cold copy dropped), is accounted as removed.
+	 */
+	inline void abandonBackup(const DirectoryCache::Directory& dir, const std::string& name, const QuotaManager::Prior& prior, const bool truncated, std::stringstream& err)
+	{
+		const Tracing::Span abandonSpan("storage_io");
+		if (truncated)
+			FileManager::discardRegularAt(dir, name);
+		if (prior.existed && !FileManager::fileExistsAt(dir, name))
+			StorageEvents::onRemoved(dir, name, prior, err);
+	}
+
+	inline uint16_t remove(const Request& request, const DirectoryCache::Directory& dir, const std::string& name, std::stringstream& err)
+	{
+		const Tracing::Span removeSpan("storage_io");
+		const uint32_t userID = request.header.m_userID;
+		const QuotaManager::Prior prior = QuotaManager::instance().prior(dir, name);
+		if (!FileManager::fileRemoveAt(dir, name))
+		{
+			err << "Request Error for user ID #" << +userID << ": File deletion failed!" << std::endl;
+			return ServerResponse::Response::ERROR_GENERIC;
+		}
+		StorageEvents::onRemoved(dir, name, prior, err);
+		return ServerResponse::Response::SUCCESS_BACKUP_DELETE;
+	}
+
+	/**
+	   @brief the user's file names. the walk is paced by the Scheduler like any other read.
+	 */
+	inline uint16_t listFiles(const Request& request, const std::string& folder, std::vector<std::string>& lines, std::stringstream& err)
+	{
+		const uint32_t userID = request.header.m_userID;
+		std::set<std::string> files;
+		std::string userFolder(folder);
+		const Scheduler::Transfer transfer(userID, Scheduler::classOf(request.header.m_op));
+		bool listed = false;
+		{
+			const Scheduler::Transfer::Io io(transfer, SCHEDULER_QUANTUM);   // a directory walk is one disk read.
+			const Tracing::Span scanSpan("storage_io");
+			listed = MetadataSnapshot::instance().list(userID, files) || FileManager::getFilesList(userFolder, files);
+		}
+		if (!listed)
+		{
+			err << "Request Error for user ID #" << +userID << ": FILE_DIR generic failure." << std::endl;
+			return ServerResponse::Response::ERROR_GENERIC;  // can be only generic error. empty files were validated before.
+		}
+		lines.assign(files.begin(), files.end());
+		return ServerResponse::Response::SUCCESS_DIR;
+	}
+
+	/**
+	   @brief a file's versions, "<id> <size>" per line, oldest first.
+	 */
+	inline uint16_t versions(const Request& request, const DirectoryCache::Directory& dir, const std::string& name, std::vector<std::string>& lines, std::stringstream& err)
+	{
+		std::vector<VersionStore::Version> found;
+		const Tracing::Span scanSpan("storage_io");
+		if (!VersionStore::list(dir, name, found))
+		{
+			err << "Request Error for user ID #" << +request.header.m_userID << ": versions of " << name << " could not be listed." << std::endl;
+			return ServerResponse::Response::ERROR_GENERIC;
+		}
+		if (found.empty())
+		{
+			err << "Request Error for user ID #" << +request.header.m_userID << ": File " << name << " has no versions." << std::endl;
+			return ServerResponse::Response::ERROR_NOT_EXIST;
+		}
+		lines = VersionStore::listing(found);
+		return ServerResponse::Response::SUCCESS_DIR;
+	}
+
+	/**
+	   @brief the stored path of the version current at the requested time (payload: uint64 ns since epoch, 0 = newest).
+	 */
+	inline uint16_t findVersion(const Request& request, const DirectoryCache::Directory& dir, const std::string& name, std::string& path, std::stringstream& err)
+	{
+		uint64_t at = 0;
+		if (request.payload.m_size >= sizeof(at))
+		{
+			if (request.payload.m_payload == nullptr || PACKET_SIZE - request.sizeWithoutPayload() < sizeof(at))   // only the first frame's payload is read.
+			{
+				err << "Request Error for user ID #" << +request.header.m_userID << ": version time of " << name << " does not fit the first frame." << std::endl;
+				return ServerResponse::Response::ERROR_GENERIC;
+			}
+			memcpy(&at, request.payload.m_payload, sizeof(at));
+		}
+		VersionStore::Version version;
+		if (!VersionStore::find(dir, name, at, version))
+		{
+			err << "Request Error for user ID #" << +request.header.m_userID << ": File " << name << " has no version at " << at << std::endl;
+			return ServerResponse::Response::ERROR_NOT_EXIST;
+		}
+		path = VersionStore::path(name, version.id);
+		return ServerResponse::Response::SUCCESS_RESTORE;
+	}
+
+	/**
+	   @brief remove or stat every file matching the pattern, one result line per file.
+	 */
+	inline uint16_t matching(const Request& request, const DirectoryCache::Directory& dir, const std::string& pattern, std::vector<std::string>& lines, std::stringstream& err)
+	{
+		const uint32_t userID = request.header.m_userID;
+		std::vector<FileMatcher::Match> found;
+		const Tracing::Span scanSpan("storage_io");
+		if (!FileMatcher::find(dir, pattern, found))
+		{
+			err << "Request Error for user ID #" << +userID << ": files matching " << pattern << " could not be listed." << std::endl;
+			return ServerResponse::Response::ERROR_GENERIC;
+		}
+		if (found.empty())
+		{
+			err << "Request Error for user ID #" << +userID << ": no file matches " << pattern << std::endl;
+			return ServerResponse::Response::ERROR_NOT_EXIST;
+		}
+		lines = (request.header.m_op == Request::EOp::CLI_FILE_STAT_MATCHING) ? FileMatcher::statLines(found) : FileMatcher::removeAll(userID, dir, found, err);
+		return ServerResponse::Response::SUCCESS_DIR;
+	}
+
+	/**
+	   @brief the user's usage and quotas, one QuotaManager::Ledger::line(), from the counters.
+	 */
+	inline uint16_t usage(const DirectoryCache::Directory& dir, std::vector<std::string>& lines)
+	{
+		lines.assign(1, QuotaManager::Ledger::line(QuotaManager::instance().usage(dir)));   // seeding may walk the folder.
+		return ServerResponse::Response::SUCCESS_DIR;
+	}
+
+	/**
+	   @brief whether the claimed content is stored under the filename, linking identical content if the user has it (ContentIndex).
+	 */
+	inline uint16_t precheck(const Request& request, const DirectoryCache::Directory& dir, const std::string& name, std::stringstream& err)
+	{
+		ContentIndex::Claim claim;
+		if (!ContentIndex::parseClaim(request, claim))
+		{
+			err << "Request Error for user ID #" << +request.header.m_userID << ": precheck of " << name << " without size and digest." << std::endl;
+			return ServerResponse::Response::ERROR_GENERIC;
+		}
+		const Tracing::Span hashSpan("storage_io");
+		switch (ContentIndex::precheck(dir, name, claim, err))
+		{
+		case ContentIndex::PRECHECK_STORED:
+		case ContentIndex::PRECHECK_LINKED:
+			return ServerResponse::Response::SUCCESS_ALREADY_STORED;
+		case ContentIndex::PRECHECK_SEND:
+			return ServerResponse::Response::SUCCESS_SEND_CONTENT;
+		case ContentIndex::PRECHECK_REFUSED:
+			return ServerResponse::Response::ERROR_QUOTA;
+		default:
+			return ServerResponse::Response::ERROR_GENERIC;
+		}
+	}
+
+	/**
+	   @brief append the handled request to the traffic capture. no-op while capture is off.
+	   @param arrival when the request's first frame was received.
+	 */
+	inline void capture(const Request& request, const std::chrono::steady_clock::time_point& arrival, const uint16_t status)
+	{
+		if (!TrafficCapture::instance().enabled())
+			return;
+		uint32_t firstPayload = PACKET_SIZE - request.sizeWithoutPayload();
+		if (request.payload.m_size < firstPayload)
+			firstPayload = request.payload.m_size;
+		TrafficCapture::instance().record(arrival, request.header.m_userID, request.header.m_version, request.header.m_op, status,
+			request.filename, request.nameLen, request.payload.m_size, request.payload.m_payload, (request.payload.m_payload != nullptr) ? firstPayload : 0);
+	}
+
+}
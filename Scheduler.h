@@ -0,0 +1,329 @@
+/**
+  @Scheduler fair sharing of transfer bandwidth between users.
+  Transfers move data in quanta of SCHEDULER_QUANTUM bytes and at most `slots` disk reads
+  or writes are in flight at once. A slot is held only around the disk operation itself,
+  never while a transfer waits on its client or its ring, so a slow client or disk cannot
+  pin slots other roots need. When transfers contend for slots, waiting quanta are granted in
+  self-clocked weighted fair queuing order: each user's quanta carry virtual finish tags
+  advancing by bytes / (user weight * op class weight), so a user with a huge restore
+  gets its share, not the disks. Interactive ops (restore, list) weigh more than bulk
+  backups. Before queuing, a quantum also passes a per user and a global token bucket
+  (bytes per second; 0 = unlimited).
+  Configuration: BACKUPSVR_SCHED_SLOTS, BACKUPSVR_USER_RATE, BACKUPSVR_GLOBAL_RATE,
+                 BACKUPSVR_USER_WEIGHTS ("userID:weight;userID:weight").
+ */
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#define SCHEDULER_QUANTUM  (64 * 1024)     // bytes granted at a time.
+#define SCHEDULER_SLOTS  16                // quanta in flight at once.
+#define SCHEDULER_BURST_SECONDS  0.25      // token bucket depth, in seconds of rate.
+#define SCHEDULER_INTERACTIVE_WEIGHT  4
+#define SCHEDULER_BULK_WEIGHT  1
+#define SCHEDULER_MAX_BUCKETS  4096        // idle per user buckets are pruned beyond this.
+#define SCHEDULER_SLOTS_ENV  "BACKUPSVR_SCHED_SLOTS"
+#define SCHEDULER_USER_RATE_ENV  "BACKUPSVR_USER_RATE"
+#define SCHEDULER_GLOBAL_RATE_ENV  "BACKUPSVR_GLOBAL_RATE"
+#define SCHEDULER_USER_WEIGHTS_ENV  "BACKUPSVR_USER_WEIGHTS"
+
+namespace Scheduler {
+
+	enum EClass
+	{
+		INTERACTIVE = 0,   // restore, list: a user is waiting on the result.
+		BULK = 1           // backup.
+	};
+
+	inline EClass classOf(const uint8_t op)
+	{
+		return (op == 100) ? BULK : INTERACTIVE;   // CLI_FILE_BACKUP.
+	}
+
+	struct Stats
+	{
+		std::atomic<uint64_t> grants{ 0 };
+		std::atomic<uint64_t> queuedGrants{ 0 };      // grants that had to wait for a slot.
+		std::atomic<uint64_t> queueNanos{ 0 };
+		std::atomic<uint64_t> throttled{ 0 };         // quanta delayed by a token bucket.
+		std::atomic<uint64_t> throttleNanos{ 0 };
+		std::atomic<uint64_t> bytes[2] = { { 0 }, { 0 } };  // per class.
+	};
+
+
+	/**
+	   Token bucket in its virtual scheduling form (GCRA): one "theoretical arrival time"
+	   instead of a token count and a refill timer.
+	 */
+	class TokenBucket
+	{
+	public:
+		/**
+		   @brief take `bytes` tokens.
+		   @return how long the caller must wait before using them. 0 if within the burst.
+		 */
+		std::chrono::nanoseconds reserve(const uint64_t bytes, const uint64_t rate, const std::chrono::steady_clock::time_point now)
+		{
+			if (rate == 0)
+				return std::chrono::nanoseconds(0);
+			const auto cost = std::chrono::nanoseconds(static_cast<uint64_t>(static_cast<double>(bytes) * 1e9 / static_cast<double>(rate)));
+			const auto burst = std::chrono::nanoseconds(static_cast<uint64_t>(SCHEDULER_BURST_SECONDS * 1e9));
+			if (_tat < now)
+				_tat = now;
+			_tat += cost;
+			const auto wait = _tat - now - burst;
+			return (wait.count() > 0) ? std::chrono::duration_cast<std::chrono::nanoseconds>(wait) : std::chrono::nanoseconds(0);
+		}
+
+		bool idle(const std::chrono::steady_clock::time_point now) const { return _tat <= now; }
+
+	private:
+		std::chrono::steady_clock::time_point _tat;
+	};
+
+
+	class Manager
+	{
+	public:
+		static Manager& instance()
+		{
+			static Manager manager;
+			return manager;
+		}
+
+		void setUserWeight(const uint32_t userID, const uint32_t weight)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_weights[userID] = (weight == 0) ? 1 : weight;
+		}
+
+		void setUserRate(const uint64_t bytesPerSecond) { _userRate.store(bytesPerSecond, std::memory_order_relaxed); }
+		void setGlobalRate(const uint64_t bytesPerSecond) { _globalRate.store(bytesPerSecond, std::memory_order_relaxed); }
+		uint64_t userRate() const { return _userRate.load(std::memory_order_relaxed); }
+		uint64_t globalRate() const { return _globalRate.load(std::memory_order_relaxed); }
+		uint32_t slots() const { return _slots; }
+		const Stats& stats() const { return _stats; }
+
+		size_t inFlight()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _inFlight;
+		}
+
+		size_t waiting()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _pending.size();
+		}
+
+		/**
+		   @brief wait for a slot in fair order, without the rate limits. pair with release().
+		 */
+		void grant(const uint32_t userID, const EClass opClass, const uint32_t bytes)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			std::unique_lock<std::mutex> lock(_mutex);
+			Flow& flow = _flows[userID];
+			const auto weight = static_cast<double>(weightLocked(userID)) * ((opClass == INTERACTIVE) ? SCHEDULER_INTERACTIVE_WEIGHT : SCHEDULER_BULK_WEIGHT);
+			const double startTag = std::max(_virtualTime, flow.finish);
+			flow.finish = startTag + static_cast<double>(bytes) / weight;
+			++flow.pending;
+			const Ticket ticket(flow.finish, _nextSeq++);
+			_pending.insert(ticket);
+			bool queued = false;
+			while (_inFlight >= _slots || *_pending.begin() != ticket)
+			{
+				queued = true;
+				_granted.wait(lock);
+			}
+			_pending.erase(_pending.begin());
+			++_inFlight;
+			_virtualTime = ticket.first;   // self-clocked: virtual time is the tag in service.
+			if (--flow.pending == 0 && flow.finish <= _virtualTime)
+				_flows.erase(userID);        // idle flows restart at the virtual time.
+			lock.unlock();
+			if (!_pending.empty())
+				_granted.notify_all();       // the next ticket may fit into a free slot too.
+
+			_stats.grants.fetch_add(1, std::memory_order_relaxed);
+			_stats.bytes[opClass].fetch_add(bytes, std::memory_order_relaxed);
+			if (queued)
+			{
+				_stats.queuedGrants.fetch_add(1, std::memory_order_relaxed);
+				_stats.queueNanos.fetch_add(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()), std::memory_order_relaxed);
+			}
+		}
+
+		void release()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				--_inFlight;
+			}
+			_granted.notify_all();
+		}
+
+		/**
+		   @brief take `bytes` from the user's and the global bucket, without waiting.
+		   @return how long the caller must wait before moving them. 0 if within the limits.
+		 */
+		std::chrono::nanoseconds reserve(const uint32_t userID, const uint32_t bytes)
+		{
+			const uint64_t userRate = _userRate.load(std::memory_order_relaxed);
+			const uint64_t globalRate = _globalRate.load(std::memory_order_relaxed);
+			if (userRate == 0 && globalRate == 0)
+				return std::chrono::nanoseconds(0);
+			const auto now = std::chrono::steady_clock::now();
+			std::chrono::nanoseconds wait(0);
+			{
+				std::lock_guard<std::mutex> lock(_bucketsMutex);
+				if (userRate != 0)
+				{
+					if (_buckets.size() > SCHEDULER_MAX_BUCKETS)
+					{
+						for (auto it = _buckets.begin(); it != _buckets.end();)
+							it = it->second.idle(now) ? _buckets.erase(it) : std::next(it);
+					}
+					wait = _buckets[userID].reserve(bytes, userRate, now);
+				}
+				wait = std::max(wait, _global.reserve(bytes, globalRate, now));
+			}
+			if (wait.count() <= 0)
+				return std::chrono::nanoseconds(0);
+			_stats.throttled.fetch_add(1, std::memory_order_relaxed);
+			_stats.throttleNanos.fetch_add(static_cast<uint64_t>(wait.count()), std::memory_order_relaxed);
+			return wait;
+		}
+
+		Manager(const Manager&) = delete;
+		Manager& operator=(const Manager&) = delete;
+
+	private:
+		using Ticket = std::pair<double, uint64_t>;   // finish tag, arrival order.
+
+		struct Flow
+		{
+			double finish = 0;
+			uint32_t pending = 0;
+		};
+
+		Manager() : _slots(SCHEDULER_SLOTS), _inFlight(0), _virtualTime(0), _nextSeq(0), _userRate(0), _globalRate(0)
+		{
+			const char* slots = getenv(SCHEDULER_SLOTS_ENV);
+			const char* userRate = getenv(SCHEDULER_USER_RATE_ENV);
+			const char* globalRate = getenv(SCHEDULER_GLOBAL_RATE_ENV);
+			const char* weights = getenv(SCHEDULER_USER_WEIGHTS_ENV);
+			if (slots != nullptr && atoi(slots) > 0)
+				_slots = static_cast<uint32_t>(atoi(slots));
+			if (userRate != nullptr)
+				_userRate = strtoull(userRate, nullptr, 10);
+			if (globalRate != nullptr)
+				_globalRate = strtoull(globalRate, nullptr, 10);
+			std::stringstream list(weights != nullptr ? weights : "");
+			std::string entry;
+			while (std::getline(list, entry, ';'))
+			{
+				const size_t colon = entry.find(':');
+				if (colon != std::string::npos)
+					_weights[static_cast<uint32_t>(strtoul(entry.c_str(), nullptr, 10))] = std::max(1, atoi(entry.c_str() + colon + 1));
+			}
+		}
+
+		uint32_t weightLocked(const uint32_t userID) const
+		{
+			const auto it = _weights.find(userID);
+			return (it == _weights.end()) ? 1 : it->second;
+		}
+
+		uint32_t _slots;
+		std::mutex _mutex;
+		std::condition_variable _granted;
+		size_t _inFlight;
+		double _virtualTime;
+		uint64_t _nextSeq;
+		std::set<Ticket> _pending;
+		std::unordered_map<uint32_t, Flow> _flows;
+		std::map<uint32_t, uint32_t> _weights;
+		std::atomic<uint64_t> _userRate;
+		std::atomic<uint64_t> _globalRate;
+		std::mutex _bucketsMutex;
+		std::unordered_map<uint32_t, TokenBucket> _buckets;
+		TokenBucket _global;
+		Stats _stats;
+	};
+
+	inline Manager& instance()
+	{
+		return Manager::instance();
+	}
+
+
+	/**
+	   Pacing of one transfer. Call pace() before moving bytes over the network: it takes the
+	   rate limits a quantum at a time and never holds a slot. A coroutine calls delay() instead
+	   and waits out the result on a timer. Wrap each disk read or write in an Io, which holds
+	   a slot, granted in fair order, for that operation only.
+	 */
+	class Transfer
+	{
+	public:
+		Transfer(const uint32_t userID, const EClass opClass) : _userID(userID), _class(opClass), _left(0) {}
+
+		void pace(const uint32_t bytes)
+		{
+			const auto wait = delay(bytes);
+			if (wait.count() > 0)
+				std::this_thread::sleep_for(wait);
+		}
+
+		/**
+		   @brief pace() without the wait.
+		   @return how long to wait before moving `bytes`.
+		 */
+		std::chrono::nanoseconds delay(const uint32_t bytes)
+		{
+			if (bytes <= _left)
+			{
+				_left -= bytes;
+				return std::chrono::nanoseconds(0);
+			}
+			const uint32_t quantum = std::max<uint32_t>(bytes, SCHEDULER_QUANTUM);
+			_left = quantum - bytes;
+			return instance().reserve(_userID, quantum);
+		}
+
+		/**
+		   RAII scheduler slot around one disk operation of the transfer.
+		 */
+		class Io
+		{
+		public:
+			Io(const Transfer& transfer, const uint32_t bytes) { instance().grant(transfer._userID, transfer._class, bytes); }
+			~Io() { instance().release(); }
+			Io(const Io&) = delete;
+			Io& operator=(const Io&) = delete;
+		};
+
+		Transfer(const Transfer&) = delete;
+		Transfer& operator=(const Transfer&) = delete;
+
+	private:
+		uint32_t _userID;
+		EClass _class;
+		uint32_t _left;
+	};
+
+}
@@ -0,0 +1,264 @@
+/**
+  @Server accept loop of the backup server.
+  Listens with a bounded accept backlog and hands every admitted connection to its own
+  handler thread (handleSocketFromThread). Connections beyond the global cap are answered
+  with ERROR_GENERIC and closed on the accepting thread, without reading the request, so
+  overload costs one small write instead of a thread.
+  Sharded mode (BACKUPSVR_SHARDS = count, or "auto" for one per core) opens one SO_REUSEPORT
+  listening socket per shard, each with its own io_context and SERVER_SHARD_THREADS threads
+  pinned to the shard's core. The kernel spreads connections over the sockets and every
+  thread accepts and handles its connection itself, so there is no single accept queue
+  and no cross-thread handoff.
+  Async mode (BACKUPSVR_ASYNC=1, C++20 builds) serves every connection as a coroutine
+  (AsyncServerActions) on a fixed pool of BACKUPSVR_ASYNC_THREADS threads.
+ */
+
+#pragma once
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include "CommunicationHandler.cpp"
+#include "Connection.h"
+#include "AsyncServerActions.h"
+#include "ReplicationLog.h"
+#include "MetadataSnapshot.h"
+#include "SpaceReclaimer.h"
+#include "TieringManager.h"
+#include "AtRestCipher.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#define SERVER_PORT  8080
+#define SERVER_ACCEPT_BACKLOG  128                // pending, not yet accepted connections.
+#define SERVER_SHARD_THREADS  8                   // blocking handlers per shard.
+#define SERVER_BACKLOG_ENV  "BACKUPSVR_BACKLOG"
+#define SERVER_SHARDS_ENV  "BACKUPSVR_SHARDS"
+#define SERVER_SHARD_THREADS_ENV  "BACKUPSVR_SHARD_THREADS"
+#define SERVER_ASYNC_ENV  "BACKUPSVR_ASYNC"
+#define SERVER_ASYNC_THREADS_ENV  "BACKUPSVR_ASYNC_THREADS"
+
+namespace Server {
+
+	inline int backlog()
+	{
+		const char* env = getenv(SERVER_BACKLOG_ENV);
+		return (env != nullptr && atoi(env) > 0) ? atoi(env) : SERVER_ACCEPT_BACKLOG;
+	}
+
+	/**
+	   @brief open, bind and listen.
+	   @param reusePort share the port with the other shards' sockets (SO_REUSEPORT).
+	 */
+	inline bool listen(boost::asio::ip::tcp::acceptor& acceptor, const uint16_t port, const bool reusePort, std::stringstream& err)
+	{
+		try
+		{
+			const boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), port);
+			acceptor.open(endpoint.protocol());
+			acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+#if defined(SO_REUSEPORT)
+			if (reusePort)
+				acceptor.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#else
+			if (reusePort)
+			{
+				err << "Server: SO_REUSEPORT is not supported on this platform." << std::endl;
+				return false;
+			}
+#endif
+			acceptor.bind(endpoint);
+			acceptor.listen(backlog());
+			return true;
+		}
+		catch (std::exception& e)
+		{
+			err << "Server: failed to listen on port " << port << ": " << e.what() << std::endl;
+			return false;
+		}
+	}
+
+	/**
+	   @brief accept one connection. over the cap it is rejected here.
+	   @return admission ticket of an accepted connection, nullptr otherwise.
+	 */
+	inline std::unique_ptr<Connection::Ticket> accept(boost::asio::ip::tcp::acceptor& acceptor, boost::asio::ip::tcp::socket& sock)
+	{
+		boost::system::error_code error;
+		acceptor.accept(sock, error);
+		if (error)
+			return nullptr;   // e.g. the client reset before accept. keep serving.
+		auto ticket = std::make_unique<Connection::Ticket>();
+		if (!ticket->admitted())
+		{
+			Connection::reject(sock, SERVER_VERSION, ServerResponse::Response::ERROR_GENERIC, PACKET_SIZE);
+			return nullptr;
+		}
+		Connection::applyOptions(sock);
+		return ticket;
+	}
+
+	inline void handle(boost::asio::ip::tcp::socket& sock)
+	{
+		std::stringstream err;
+		if (!CommunicationHandler::handleSocketFromThread(sock, err))
+			std::cerr << err.str();
+	}
+
+	/**
+	   @brief accept connections forever, one handler thread per connection.
+	   @param port TCP port to listen on.
+	   @param err error output.
+	   @return false if the listening socket could not be set up.
+	 */
+	inline bool run(const uint16_t port, std::stringstream& err)
+	{
+		boost::asio::io_context io;
+		boost::asio::ip::tcp::acceptor acceptor(io);
+		if (!listen(acceptor, port, false, err))
+			return false;
+		while (true)
+		{
+			auto sock = std::make_unique<boost::asio::ip::tcp::socket>(io);
+			auto ticket = accept(acceptor, *sock);
+			if (ticket == nullptr)
+				continue;
+			std::thread([sock = std::move(sock), ticket = std::move(ticket)]() { handle(*sock); }).detach();
+		}
+	}
+
+	/**
+	   @brief pin the calling thread to one core. best effort, Linux only.
+	 */
+	inline void pinToCore(const unsigned core)
+	{
+#if defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(core, &set);
+		(void)pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+		(void)core;
+#endif
+	}
+
+	/**
+	   One SO_REUSEPORT listener with its own io_context and pinned threads.
+	 */
+	struct Shard
+	{
+		boost::asio::io_context io;
+		boost::asio::ip::tcp::acceptor acceptor;
+		unsigned core;
+		explicit Shard(const unsigned c) : acceptor(io), core(c) {}
+	};
+
+	/**
+	   @brief sharded accept: one SO_REUSEPORT socket per shard, connections handled on the
+	          accepting thread, which is pinned to the shard's core.
+	   @param shards number of shards. 0: one per core.
+	   @return false if a listening socket could not be set up.
+	 */
+	inline bool runSharded(const uint16_t port, unsigned shards, std::stringstream& err)
+	{
+		const unsigned cores = (std::thread::hardware_concurrency() == 0) ? 1 : std::thread::hardware_concurrency();
+		if (shards == 0)
+			shards = cores;
+		const char* threadsEnv = getenv(SERVER_SHARD_THREADS_ENV);
+		const unsigned threads = (threadsEnv != nullptr && atoi(threadsEnv) > 0) ? static_cast<unsigned>(atoi(threadsEnv)) : SERVER_SHARD_THREADS;
+
+		std::vector<std::unique_ptr<Shard>> all;
+		for (unsigned i = 0; i < shards; ++i)
+		{
+			all.push_back(std::make_unique<Shard>(i % cores));
+			if (!listen(all.back()->acceptor, port, true, err))
+				return false;
+		}
+		std::vector<std::thread> workers;
+		for (const auto& shard : all)
+		{
+			for (unsigned t = 0; t < threads; ++t)
+			{
+				workers.emplace_back([&shard]()
+				{
+					pinToCore(shard->core);
+					while (true)
+					{
+						boost::asio::ip::tcp::socket sock(shard->io);
+						const auto ticket = accept(shard->acceptor, sock);
+						if (ticket != nullptr)
+							handle(sock);
+					}
+				});
+			}
+		}
+		for (auto& worker : workers)
+			worker.join();
+		return true;
+	}
+
+#if HAVE_ASYNC_SERVER
+	/**
+	   @brief coroutine server: one io_context run by `threads` threads, a coroutine per connection.
+	   @param threads 0: one per core.
+	   @return false if the listening socket could not be set up.
+	 */
+	inline bool runAsync(const uint16_t port, unsigned threads, std::stringstream& err)
+	{
+		if (threads == 0)
+			threads = (std::thread::hardware_concurrency() == 0) ? 1 : std::thread::hardware_concurrency();
+		boost::asio::io_context io(static_cast<int>(threads));
+		boost::asio::ip::tcp::acceptor acceptor(io);
+		if (!listen(acceptor, port, false, err))
+			return false;
+		boost::asio::co_spawn(io, AsyncServerActions::listener(acceptor), boost::asio::detached);
+		std::vector<std::thread> workers;
+		for (unsigned t = 1; t < threads; ++t)
+			workers.emplace_back([&io]() { io.run(); });
+		io.run();
+		for (auto& worker : workers)
+			worker.join();
+		return true;
+	}
+#endif
+
+	/**
+	   @brief serve on the configured listener mode: async when BACKUPSVR_ASYNC=1, sharded
+	          when BACKUPSVR_SHARDS is set, thread per connection otherwise.
+	 */
+	inline bool serve(const uint16_t port, std::stringstream& err)
+	{
+		if (!AtRestCipher::Keys::instance().configured(err))
+			return false;   // a key was asked for: never fall back to storing plaintext.
+		(void)ReplicationLog::instance();   // resumes shipping a backlog left by the previous run.
+		(void)MetadataSnapshot::instance();   // maps the last snapshot. the roots are walked only if it is missing or corrupt.
+		(void)SpaceReclaimer::instance();   // frees what the previous run left in the trash.
+		(void)TieringManager::instance();   // starts moving cold files to the cold root, if one is set.
+		if (VersionStore::retention().enabled && SmallFileStore::config().enabled)
+			std::cerr << "Server: versioning is on (" VERSIONS_ENV "=1): small files are stored as regular files." << std::endl;
+		if (VersionStore::retention().enabled && !TieringManager::config().coldRoot.empty())
+			std::cerr << "Server: versioning is on (" VERSIONS_ENV "=1): " COLD_ROOT_ENV " is ignored, tiering is off." << std::endl;
+		const char* async = getenv(SERVER_ASYNC_ENV);
+		if (async != nullptr && atoi(async) != 0)
+		{
+#if HAVE_ASYNC_SERVER
+			const char* threads = getenv(SERVER_ASYNC_THREADS_ENV);
+			return runAsync(port, (threads != nullptr && atoi(threads) > 0) ? static_cast<unsigned>(atoi(threads)) : 0, err);
+#else
+			err << "Server: async mode needs a C++20 build with coroutine support." << std::endl;
+			return false;
+#endif
+		}
+		const char* shards = getenv(SERVER_SHARDS_ENV);
+		if (shards == nullptr || *shards == '\0')
+			return run(port, err);
+		return runSharded(port, (std::string(shards) == "auto") ? 0 : static_cast<unsigned>(atoi(shards)), err);
+	}
+
+}
@@ -2,6 +2,19 @@
 #include "ServerResponse.h"
 #include "ServerResponse.cpp"
 #include "CommunicationHandler.cpp"
+#include "BackupPipeline.h"
+#include "Metrics.h"
+#include "Scheduler.h"
+#include "Connection.h"
+#include "Tracing.h"
+#include "VersionStore.h"
+#include "SmallFileStore.h"
+#include "ReplicationLog.h"
+#include "MetadataSnapshot.h"
+#include "FileMatcher.h"
+#include "QuotaManager.h"
+#include "ContentIndex.h"
+#include "RequestOps.h"
 //using namespace ServerRequestFuncs;
 using namespace FileManager;
 using namespace CommunicationHandler;
@@ -9,74 +22,164 @@ using namespace ServerResponseFuncs;
 
 
 namespace ServerActions {
-	bool fileBackup(const Request& request, ServerResponse::Response*& response, boost::asio::ip::tcp::socket& sock, const std::string filepath, std::stringstream& err, std::string parsedFileName, uint8_t buffer[PACKET_SIZE])
+	/**
+	   @brief a backup whose payload came whole in the request frame: stored in the user's small file container.
+	 */
+	bool fileBackupSmall(const Request& request, ServerResponse::Response*& response, const DirectoryCache::Directory& dir, std::stringstream& err, const std::string& parsedFileName, const QuotaManager::Prior& prior)
 	{
-		std::fstream fs;
-		if (!FileManager::fileOpen(filepath, fs, true))
+		const Tracing::Span storeSpan("storage_io");
+		if (!FileManager::fileStoreSmallAt(dir, parsedFileName, request.payload.m_payload, request.payload.m_size))
+		{
+			err << "user ID #" << +request.header.m_userID << ": Write to file " << parsedFileName << " failed." << std::endl;
+			RequestOps::abandonBackup(dir, parsedFileName, prior, false, err);
+			return false;
+		}
+		RequestOps::backedUp(request, dir, parsedFileName, prior, err);
+		response->status = ServerResponse::Response::SUCCESS_BACKUP_DELETE;
+		return true;
+	}
+
+	bool fileBackup(const Request& request, ServerResponse::Response*& response, boost::asio::ip::tcp::socket& sock, const DirectoryCache::Directory& dir, std::stringstream& err, const std::string& parsedFileName, uint8_t buffer[PACKET_SIZE])
+	{
+		QuotaManager::Prior prior;
+		if (!RequestOps::admitBackup(dir, parsedFileName, request.payload.m_size, prior, err))
+		{
+			response->status = ServerResponse::Response::ERROR_QUOTA;   // the payload is not read: the socket is closed after the response.
+			return false;
+		}
+		if (request.payload.m_size <= PACKET_SIZE - request.sizeWithoutPayload() && SmallFileStore::accepts(request.payload.m_size))
+			return fileBackupSmall(request, response, dir, err, parsedFileName, prior);
+		FileManager::StorageFile fs;
+		Tracing::Span openSpan("storage_open");
+		if (!FileManager::fileOpenAt(dir, parsedFileName, fs, true))
 		{
 			err << "user ID #" << +request.header.m_userID << ": File " << parsedFileName << " failed to open." << std::endl;
+			RequestOps::abandonBackup(dir, parsedFileName, prior, true, err);
 			return false;
 		}
+		openSpan.end();
 		uint32_t bytes = (PACKET_SIZE - request.sizeWithoutPayload());
 		if (request.payload.m_size < bytes)
 			bytes = request.payload.m_size;
 		if (!FileManager::fileWrite(fs, request.payload.m_payload, bytes))
 		{
 			err << "user ID #" << +request.header.m_userID << ": Write to file " << parsedFileName << " failed." << std::endl;
-			fs.close();
+			FileManager::fileClose(fs);
+			RequestOps::abandonBackup(dir, parsedFileName, prior, true, err);
 			return false;
 		}
 
+		// network stage receives into the ring, disk stage drains it behind us.
+		// the disk stage runs on the I/O pool of the storage root holding this user,
+		// and holds a scheduler slot only while it writes.
+		const uint32_t userID = request.header.m_userID;
+		Scheduler::Transfer transfer(userID, Scheduler::classOf(request.header.m_op));
+		BackupPipeline::Pipeline pipeline([&fs, &transfer](const uint8_t* data, const uint32_t length)
+			{
+				const Scheduler::Transfer::Io io(transfer, length);
+				return FileManager::fileWrite(fs, data, length);
+			},
+			[userID](std::function<void()> task) { StorageRoots::instance().poolFor(userID).post(std::move(task)); });
+		Tracing::StageTimer ringWait("ring_wait");
+		Tracing::StageTimer receiveStage("receive");
+		Tracing::StageTimer scheduleWait("schedule_wait");
+		Connection::RateWatchdog watchdog;
 		while (bytes < request.payload.m_size)
 		{
-			if (!CommunicationHandler::receive(sock, buffer))
+			scheduleWait.begin();
+			transfer.pace(PACKET_SIZE);   // rate limits: the client waits in its socket buffer.
+			scheduleWait.end();
+			ringWait.begin();
+			uint8_t* slot = pipeline.reserve(PACKET_SIZE);
+			ringWait.end();
+			if (slot == nullptr)
+			{
+				err << "user ID #" << +request.header.m_userID << ": Write to file " << parsedFileName << " failed." << std::endl;
+				FileManager::fileClose(fs);
+				RequestOps::abandonBackup(dir, parsedFileName, prior, true, err);
+				return false;
+			}
+			const auto start = std::chrono::steady_clock::now();
+			receiveStage.begin();
+			const bool received = CommunicationHandler::receive(sock, slot);
+			receiveStage.end();
+			if (!received)
 			{
 				err << "user ID #" << +request.header.m_userID << ": receive file data from socket failed." << std::endl;
-				fs.close();
+				pipeline.cancel();
+				FileManager::fileClose(fs);
+				RequestOps::abandonBackup(dir, parsedFileName, prior, true, err);
 				return false;
 			}
-			uint32_t length = PACKET_SIZE;
-			if (bytes + PACKET_SIZE > request.payload.m_size)
-				length = request.payload.m_size - bytes;
-			if (!FileManager::fileWrite(fs, buffer, length))
+			BackupPipeline::recordNetwork(BackupPipeline::elapsedNanos(start));
+			if (!watchdog.progress(PACKET_SIZE, std::chrono::steady_clock::now() - start))
 			{
-				err << "user ID #" << +request.header.m_userID << ": Write to file " << parsedFileName << " failed." << std::endl;
-				fs.close();
+				err << "user ID #" << +request.header.m_userID << ": client below minimum transfer rate, backup of " << parsedFileName << " aborted." << std::endl;
+				pipeline.cancel();
+				FileManager::fileClose(fs);
+				RequestOps::abandonBackup(dir, parsedFileName, prior, true, err);
 				return false;
 			}
+			uint32_t length = PACKET_SIZE;
+			if (bytes + PACKET_SIZE > request.payload.m_size)
+				length = request.payload.m_size - bytes;
+			pipeline.produced(length);
 			bytes += length;
 		}
-		fs.close();
-		response->status = ServerResponse::Response::SUCCESS_BACKUP_DELETE;
-		return true;
+		ringWait.flush();
+		receiveStage.flush();
+		scheduleWait.flush();
+		const Tracing::Span drainSpan("storage_io");   // disk stage catching up with the network stage.
+		if (!pipeline.finish())
+		{
+			err << "user ID #" << +request.header.m_userID << ": Write to file " << parsedFileName << " failed." << std::endl;
+			FileManager::fileClose(fs);
+			RequestOps::abandonBackup(dir, parsedFileName, prior, true, err);
+			return false;
+		}
+		if (!FileManager::fileClose(fs))
+		{
+			err << "user ID #" << +request.header.m_userID << ": Write to file " << parsedFileName << " failed." << std::endl;
+			RequestOps::abandonBackup(dir, parsedFileName, prior, true, err);
+			return false;
+		}
+		response->status = RequestOps::commitBackup(request, dir, parsedFileName, prior, err);
+		return response->status == ServerResponse::Response::SUCCESS_BACKUP_DELETE;
 	}
 
 
 
 
 
-	bool fileRestore(const Request& request, ServerResponse::Response*& response, bool& responseSent, boost::asio::ip::tcp::socket& sock, const std::string filepath, std::stringstream& err, std::string parsedFileName, uint8_t buffer[PACKET_SIZE])
+	bool fileRestore(const Request& request, ServerResponse::Response*& response, bool& responseSent, boost::asio::ip::tcp::socket& sock, const DirectoryCache::Directory& dir, std::stringstream& err, const std::string& parsedFileName, uint8_t buffer[PACKET_SIZE])
 	{
-		std::fstream fs;
-		if (!FileManager::fileOpen(filepath, fs))
+		FileManager::StorageFile fs;
+		Tracing::Span openSpan("storage_open");
+		if (!FileManager::fileOpenAt(dir, parsedFileName, fs))
 		{
 			err << "user ID #" << +request.header.m_userID << ": File " << parsedFileName << " failed to open." << std::endl;
 			return false;
 		}
 		uint32_t fileSize = FileManager::fileSize(fs);
+		openSpan.end();
 		if (fileSize == 0)
 		{
 			err << "user ID #" << +request.header.m_userID << ": File " << parsedFileName << " has 0 zero." << std::endl;
-			fs.close();
+			FileManager::fileClose(fs);
 			return false;
 		}
 		response->payload.m_size = fileSize;
 		uint32_t bytes = (PACKET_SIZE - response->sizeWithoutPayload());
 		response->payload.m_payload = new uint8_t[bytes];
-		if (!FileManager::fileRead(fs, response->payload.m_payload, bytes))
+		Tracing::StageTimer storageStage("storage_io");
+		Tracing::StageTimer sendStage("send");
+		storageStage.begin();
+		const bool firstRead = FileManager::fileRead(fs, response->payload.m_payload, bytes);
+		storageStage.end();
+		if (!firstRead)
 		{
 			err << "user ID #" << +request.header.m_userID << ": File " << parsedFileName << " reading failed." << std::endl;
-			fs.close();
+			FileManager::fileClose(fs);
 			return false;
 		}
 
@@ -84,66 +187,100 @@ namespace ServerActions {
 		responseSent = true;
 		response->status = ServerResponse::Response::SUCCESS_RESTORE;
 		serializeResponse(*response, buffer);
-		if (!CommunicationHandler::send(sock, buffer))
+		Connection::Cork cork(sock);   // header and body frames leave in full segments.
+		sendStage.begin();
+		const bool firstSent = CommunicationHandler::send(sock, buffer);
+		sendStage.end();
+		if (!firstSent)
 		{
 			err << "Response sending on socket failed! user ID #" << +request.header.m_userID << std::endl;
-			fs.close();
+			FileManager::fileClose(fs);
 			sock.close();
 			return false;
 		}
 
+		// the file is read a quantum at a time, each read under its own scheduler slot.
+		// no slot is held while the packets of a quantum are sent.
+		Tracing::StageTimer scheduleWait("schedule_wait");
+		Scheduler::Transfer transfer(request.header.m_userID, Scheduler::classOf(request.header.m_op));
+		Connection::RateWatchdog watchdog;
+		std::vector<uint8_t> batch(SCHEDULER_QUANTUM);
+		uint32_t batchAt = 0;
+		uint32_t batchEnd = 0;
 		while (bytes < fileSize)
 		{
-			if (!FileManager::fileRead(fs, buffer, PACKET_SIZE) || !CommunicationHandler::send(sock, buffer))
+			bool read = true;
+			if (batchAt == batchEnd)
+			{
+				uint32_t length = ((fileSize - bytes + PACKET_SIZE - 1) / PACKET_SIZE) * PACKET_SIZE;
+				if (length > batch.size())
+					length = static_cast<uint32_t>(batch.size());
+				scheduleWait.begin();
+				transfer.pace(length);
+				const Scheduler::Transfer::Io io(transfer, length);
+				scheduleWait.end();
+				storageStage.begin();
+				read = FileManager::fileRead(fs, batch.data(), length);
+				storageStage.end();
+				batchAt = 0;
+				batchEnd = length;
+			}
+			const auto sendStart = std::chrono::steady_clock::now();
+			sendStage.begin();
+			const bool sent = read && CommunicationHandler::send(sock, batch.data() + batchAt);
+			sendStage.end();
+			batchAt += PACKET_SIZE;
+			if (!sent)
 			{
 				err << "Payload data failure for user ID #" << +request.header.m_userID << std::endl;
-				fs.close();
+				FileManager::fileClose(fs);
+				sock.close();
+				return false;
+			}
+			if (!watchdog.progress(PACKET_SIZE, std::chrono::steady_clock::now() - sendStart))
+			{
+				err << "user ID #" << +request.header.m_userID << ": client below minimum transfer rate, restore of " << parsedFileName << " aborted." << std::endl;
+				FileManager::fileClose(fs);
 				sock.close();
 				return false;
 			}
 			bytes += PACKET_SIZE;
 		}
 
+		cork.release();
+		Metrics::instance().addBytesOut(request.header.m_op, fileSize);
 		ServerResponseFuncs::destroy(response);
-		fs.close();
+		FileManager::fileClose(fs);
 		sock.close();
 		return true;
 	}
 
 
-	bool fileList(const Request& request, ServerResponse::Response*& response, bool& responseSent, boost::asio::ip::tcp::socket& sock, const std::string filepath, std::stringstream& err, std::string parsedFileName, uint8_t buffer[PACKET_SIZE], std::stringstream& userPathSS)
+	/**
+	   @brief send '\n' terminated lines as the response payload. frames follow the header frame
+	          when the lines exceed it. status and filename are set by the caller.
+	 */
+	template <typename Lines>
+	bool sendLines(const Request& request, ServerResponse::Response*& response, bool& responseSent, boost::asio::ip::tcp::socket& sock, std::stringstream& err, uint8_t buffer[PACKET_SIZE], const Lines& lines)
 	{
-		std::set<std::string> userFiles;
-		std::string userFolder(userPathSS.str());
-		if (!FileManager::getFilesList(userFolder, userFiles))
-		{
-			err << "Request Error for user ID #" << +request.header.m_userID << ": FILE_DIR generic failure." << std::endl;
-			response->status = ServerResponse::Response::ERROR_GENERIC;  // can be only generic error. empty files were validated before.
-			return false;
-		}
-		const size_t filenameLen = 32;  // random string length, as required.
-		response->filename = new uint8_t[filenameLen];
-		response->nameLen = filenameLen;
-		memcpy(response->filename, randString(filenameLen).c_str(), filenameLen);
-		response->status = ServerResponse::Response::SUCCESS_DIR;
-
 		// list's size calculation.
 		size_t listSize = 0;
-		for (const auto& fn : userFiles)
+		for (const auto& fn : lines)
 			listSize += fn.size() + 1;  // +1 for '\n' to represent filename ending.
-		response->payload.size = listSize;
+		response->payload.m_size = listSize;
 		auto const listPtr = new uint8_t[listSize];           // assumption: listSize will not exceed RAM. (mentioned in forum).
 		auto ptr = listPtr;
-		for (const auto& fn : userFiles)
+		for (const auto& fn : lines)
 		{
 			memcpy(ptr, fn.c_str(), fn.size());
 			ptr += fn.size();
 			*ptr = '\n';
 			ptr += 1;
 		}
+		Metrics::instance().addBytesOut(request.header.m_op, listSize);
 		if (response->sizeWithoutPayload() + listSize <= PACKET_SIZE)  // file names do not exceed PACKET_SIZE.
 		{
-			response->payload.payload = listPtr;  // will be de-allocated by outer logic.
+			response->payload.m_payload = listPtr;  // will be de-allocated by outer logic.
 			return true;
 		}
 
@@ -151,12 +288,14 @@ namespace ServerActions {
 		ptr = listPtr;
 		responseSent = true;  // specific sending logic. no need to send after function end.
 		uint32_t bytes = PACKET_SIZE - response->sizeWithoutPayload();  // leftover bytes
-		response->payload.payload = new uint8_t[bytes];
-		memcpy(response->payload.payload, ptr, bytes);
+		response->payload.m_payload = new uint8_t[bytes];
+		memcpy(response->payload.m_payload, ptr, bytes);
 		ptr += bytes;
 
 		// send first packet
+		const Tracing::Span sendSpan("send");
 		serializeResponse(*response, buffer);
+		Connection::Cork cork(sock);
 		if (!CommunicationHandler::send(sock, buffer))
 		{
 			err << "Response sending on socket failed! user ID #" << +request.header.m_userID << std::endl;
@@ -180,10 +319,80 @@ namespace ServerActions {
 			}
 		}
 
+		cork.release();
 		ServerResponseFuncs::destroy(response);
 		sock.close();
 		return true;
-	};
+	}
+
+
+	bool fileList(const Request& request, ServerResponse::Response*& response, bool& responseSent, boost::asio::ip::tcp::socket& sock, std::stringstream& err, uint8_t buffer[PACKET_SIZE], const std::string& userFolderPath)
+	{
+		std::vector<std::string> userFiles;
+		response->status = RequestOps::listFiles(request, userFolderPath, userFiles, err);
+		if (response->status != ServerResponse::Response::SUCCESS_DIR)
+			return false;
+		const size_t filenameLen = 32;  // random string length, as required.
+		response->filename = new uint8_t[filenameLen];
+		response->nameLen = filenameLen;
+		memcpy(response->filename, randString(filenameLen).c_str(), filenameLen);
 
+		return sendLines(request, response, responseSent, sock, err, buffer, userFiles);
+	}
+
+	/**
+	   @brief list a file's versions, "<id> <size>" per line, oldest first, under the file's name.
+	 */
+	bool fileVersions(const Request& request, ServerResponse::Response*& response, bool& responseSent, boost::asio::ip::tcp::socket& sock, const DirectoryCache::Directory& dir, std::stringstream& err, const std::string& parsedFileName, uint8_t buffer[PACKET_SIZE])
+	{
+		std::vector<std::string> lines;
+		response->status = RequestOps::versions(request, dir, parsedFileName, lines, err);
+		if (response->status != ServerResponse::Response::SUCCESS_DIR)
+			return false;
+		return sendLines(request, response, responseSent, sock, err, buffer, lines);
+	}
+
+	/**
+	   @brief remove or stat every file matching the request's prefix or glob, one result line per file.
+	 */
+	bool fileBulk(const Request& request, ServerResponse::Response*& response, bool& responseSent, boost::asio::ip::tcp::socket& sock, const DirectoryCache::Directory& dir, std::stringstream& err, const std::string& pattern, uint8_t buffer[PACKET_SIZE])
+	{
+		std::vector<std::string> lines;
+		response->status = RequestOps::matching(request, dir, pattern, lines, err);
+		if (response->status != ServerResponse::Response::SUCCESS_DIR)
+			return false;
+		return sendLines(request, response, responseSent, sock, err, buffer, lines);
+	}
+
+	/**
+	   @brief send the user's usage and quotas, one QuotaManager::Ledger::line(), from the counters.
+	 */
+	bool userUsage(const Request& request, ServerResponse::Response*& response, bool& responseSent, boost::asio::ip::tcp::socket& sock, const DirectoryCache::Directory& dir, std::stringstream& err, uint8_t buffer[PACKET_SIZE])
+	{
+		std::vector<std::string> lines;
+		response->status = RequestOps::usage(dir, lines);
+		return sendLines(request, response, responseSent, sock, err, buffer, lines);
+	}
+
+	/**
+	   @brief answer whether the claimed content is stored under the filename, linking identical content if the user has it (ContentIndex).
+	 */
+	bool filePrecheck(const Request& request, ServerResponse::Response*& response, const DirectoryCache::Directory& dir, std::stringstream& err, const std::string& parsedFileName)
+	{
+		response->status = RequestOps::precheck(request, dir, parsedFileName, err);
+		return response->status == ServerResponse::Response::SUCCESS_ALREADY_STORED || response->status == ServerResponse::Response::SUCCESS_SEND_CONTENT;
+	}
+
+	/**
+	   @brief restore the version of a file current at the requested time (payload: uint64 ns since epoch, 0 = newest).
+	 */
+	bool fileRestoreVersion(const Request& request, ServerResponse::Response*& response, bool& responseSent, boost::asio::ip::tcp::socket& sock, const DirectoryCache::Directory& dir, std::stringstream& err, const std::string& parsedFileName, uint8_t buffer[PACKET_SIZE])
+	{
+		std::string path;
+		response->status = RequestOps::findVersion(request, dir, parsedFileName, path, err);
+		if (response->status != ServerResponse::Response::SUCCESS_RESTORE)
+			return false;
+		return fileRestore(request, response, responseSent, sock, dir, err, path, buffer);
+	}
 
-}
\ No newline at end of file
+}
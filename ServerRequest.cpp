@@ -4,8 +4,7 @@
 #include <fstream>
 #include <thread>
 #include "ServerResponse.h"
-
-#define PACKET_SIZE  1024
+#include "ProtocolCodec.h"
 
 /**
    @brief generate a random string of given length.
@@ -20,52 +19,39 @@
 namespace ServerRequestFuncs {
 
 
+	/**
+	   @brief decode a request's first frame in the layout of its version (ProtocolCodec).
+	   @return nullptr if the frame is shorter than the header. fields missing from the frame are left empty.
+	 */
 	Request* deserializeRequest(const uint8_t* buffer, const uint32_t size)
 	{
-		uint32_t bytesRead = 0;
-		const uint8_t* ptr = buffer;
-		if (size < sizeof(Request::RequestHeader))
+		if (size <= ProtocolCodec::VERSION_OFFSET)
 			return nullptr; // invalid minimal size.
+		ProtocolCodec::RequestFields fields;
+		const ProtocolCodec::EDecoded decoded = ProtocolCodec::forVersion(buffer[ProtocolCodec::VERSION_OFFSET], [&](auto codec)
+		{
+			return codec.decodeRequest(buffer, size, fields);
+		});
+		if (decoded == ProtocolCodec::DECODED_NONE)
+			return nullptr;
 
 		auto const request = new Request;
-
-		// Fill minimal header
-		memcpy(request, ptr, sizeof(Request::RequestHeader));
-		bytesRead += sizeof(Request::RequestHeader);
-		ptr += sizeof(Request::RequestHeader);
-		if (bytesRead + sizeof(uint16_t) > size)
-			return request;  // return the request with minimal header.
-
-		// Copy name length
-		memcpy(&(request->nameLen), ptr, sizeof(uint16_t));
-		bytesRead += sizeof(uint16_t);
-		ptr += sizeof(uint16_t);
-		if ((request->nameLen == 0) || ((bytesRead + request->nameLen) > size))
-			return request;  // name length invalid.
-
-		request->filename = new uint8_t[request->nameLen + 1];
-		memcpy(request->filename, ptr, request->nameLen);
-		request->filename[request->nameLen] = '\0';
-		bytesRead += request->nameLen;
-		ptr += request->nameLen;
-
-		if (bytesRead + sizeof(uint32_t) > size)
-			return request;
-
-		// copy payload size
-		memcpy(&(request->payload.m_size), ptr, sizeof(uint32_t));
-		bytesRead += sizeof(uint32_t);
-		ptr += sizeof(uint32_t);
-		if (request->payload.m_size == 0)
-			return request;  // name length invalid.
-
-		// copy payload until size limit.
-		uint32_t leftover = size - bytesRead;
-		if (request->payload.m_size < leftover)
-			leftover = request->payload.m_size;
-		request->payload.m_payload = new uint8_t[leftover];
-		memcpy(request->payload.m_payload, ptr, leftover);
-
+		request->header.m_userID = fields.userID;
+		request->header.m_version = fields.version;
+		request->header.m_op = fields.op;
+		request->nameLen = fields.nameLen;   // kept when invalid: the name is then missing.
+		if (decoded >= ProtocolCodec::DECODED_NAME)
+		{
+			request->filename = new uint8_t[fields.nameLen + 1];
+			memcpy(request->filename, fields.name, fields.nameLen);
+			request->filename[fields.nameLen] = '\0';
+		}
+		if (decoded == ProtocolCodec::DECODED_SIZE && fields.size != 0)
+		{
+			request->payload.m_size = fields.size;
+			request->payload.m_payload = new uint8_t[fields.first];   // the first bytes only. the rest is received in frames.
+			memcpy(request->payload.m_payload, fields.payload, fields.first);
+		}
 		return request;
 	}
 
@@ -107,11 +93,74 @@ namespace ServerRequestFuncs {
 			response->status = ServerResponse::Response::ERROR_GENERIC;
 			return false;
 		}
+		Tracing::Span validationSpan("validation");
+		const StorageRoots::UserLease lease(request.header.m_userID);  // pins the user's storage root until the request is done.
+		const DirectoryCache::Handle userDir = DirectoryCache::get(request.header.m_userID, lease.folder(), request.header.m_op == Request::EOp::CLI_FILE_BACKUP || request.header.m_op == Request::EOp::CLI_FILE_PRECHECK);
+
+		// Versions are looked up by their own handlers: the live file may be gone already.
+		if (request.header.m_op == Request::EOp::CLI_FILE_VERSIONS || request.header.m_op == Request::EOp::CLI_FILE_RESTORE_VERSION)
+		{
+			std::string parsedFileName;
+			if (!parseFilename(request.nameLen, request.filename, parsedFileName) || VersionStore::reserved(parsedFileName))
+			{
+				err << "Request Error for user ID #" << +request.header.m_userID << ": Invalid filename!" << std::endl;
+				response->status = ServerResponse::Response::ERROR_GENERIC;
+				return false;
+			}
+			copyFilename(request, *response);
+			validationSpan.end();
+			response->status = ServerResponse::Response::ERROR_GENERIC;  // until proven otherwise..
+			uint8_t buffer[PACKET_SIZE];
+			if (request.header.m_op == Request::EOp::CLI_FILE_VERSIONS)
+				return ServerActions::fileVersions(request, response, responseSent, sock, *userDir, err, parsedFileName, buffer);
+			return ServerActions::fileRestoreVersion(request, response, responseSent, sock, *userDir, err, parsedFileName, buffer);
+		}
+
+		// Bulk requests name a pattern: the files it matches are looked up by their own handler.
+		if (request.header.m_op == Request::EOp::CLI_FILE_REMOVE_MATCHING || request.header.m_op == Request::EOp::CLI_FILE_STAT_MATCHING)
+		{
+			std::string pattern;
+			if (!parseFilename(request.nameLen, request.filename, pattern) || !FileMatcher::validPattern(pattern, request.nameLen) || VersionStore::reserved(pattern))
+			{
+				err << "Request Error for user ID #" << +request.header.m_userID << ": Invalid filename pattern!" << std::endl;
+				response->status = ServerResponse::Response::ERROR_GENERIC;
+				return false;
+			}
+			copyFilename(request, *response);
+			validationSpan.end();
+			response->status = ServerResponse::Response::ERROR_GENERIC;  // until proven otherwise..
+			uint8_t buffer[PACKET_SIZE];
+			return ServerActions::fileBulk(request, response, responseSent, sock, *userDir, err, pattern, buffer);
+		}
+
+		// Usage comes from the quota counters: the user's files are not looked at.
+		if (request.header.m_op == Request::EOp::CLI_USAGE)
+		{
+			validationSpan.end();
+			uint8_t buffer[PACKET_SIZE];
+			return ServerActions::userUsage(request, response, responseSent, sock, *userDir, err, buffer);
+		}
+
+		// Prechecks name a file that need not exist, and carry its size and digest instead of its content.
+		if (request.header.m_op == Request::EOp::CLI_FILE_PRECHECK)
+		{
+			std::string parsedFileName;
+			if (!parseFilename(request.nameLen, request.filename, parsedFileName) || VersionStore::reserved(parsedFileName))
+			{
+				err << "Request Error for user ID #" << +request.header.m_userID << ": Invalid filename!" << std::endl;
+				response->status = ServerResponse::Response::ERROR_GENERIC;
+				return false;
+			}
+			copyFilename(request, *response);
+			validationSpan.end();
+			response->status = ServerResponse::Response::ERROR_GENERIC;  // until proven otherwise..
+			return ServerActions::filePrecheck(request, response, *userDir, err, parsedFileName);
+		}
 
 		// Common validation for FILE_RESTORE | FILE_REMOVE | FILE_DIR requests.
 		if ((request.header.m_op & (Request::EOp::CLI_FILE_RESTORE | Request::EOp::CLI_FILE_REMOVE | Request::EOp::CLI_FILE_LIST)) == request.header.m_op)
 		{
-			if (!userHasFiles(request.header.m_userID))
+			if (!FileManager::userHasFilesAt(*userDir))
 			{
 				err << "User #" << +request.header.m_userID << " has no files!" << std::endl;
 				response->status = ServerResponse::Response::ERROR_NO_FILES;
@@ -123,7 +172,7 @@ namespace ServerRequestFuncs {
 		std::string parsedFileName; // will be used as parsed filename string.
 		if ((request.header.m_op & (Request::EOp::CLI_FILE_BACKUP | Request::EOp::CLI_FILE_RESTORE | Request::EOp::CLI_FILE_REMOVE)) == request.header.m_op)
 		{
-			if (!parseFilename(request.nameLen, request.filename, parsedFileName))
+			if (!parseFilename(request.nameLen, request.filename, parsedFileName) || VersionStore::reserved(parsedFileName))
 			{
 				err << "Request Error for user ID #" << +request.header.m_userID << ": Invalid filename!" << std::endl;
 				response->status = ServerResponse::Response::ERROR_GENERIC;
@@ -132,16 +181,10 @@ namespace ServerRequestFuncs {
 			copyFilename(request, *response);
 		}
 
-		std::stringstream userPathSS;
-		std::stringstream filepathSS;
-		userPathSS << BACKUP_FOLDER << request.header.m_userID << "/";
-		filepathSS << userPathSS.str() << parsedFileName;
-		const std::string filepath = filepathSS.str();
-
 		// Common validation for FILE_RESTORE | FILE_REMOVE requests.
 		if ((request.header.m_op & (Request::EOp::CLI_FILE_RESTORE | Request::EOp::CLI_FILE_REMOVE)) == request.header.m_op)
 		{
-			if (!FileManager::fileExists(filepath))
+			if (!FileManager::fileExistsAt(*userDir, parsedFileName))
 			{
 				err << "Request Error for user ID #" << +request.header.m_userID << ": File not exists!" << std::endl;
 				response->status = ServerResponse::Response::ERROR_NOT_EXIST;
@@ -149,6 +192,8 @@ namespace ServerRequestFuncs {
 			}
 		}
 
+		validationSpan.end();
+
 		// Specifics
 		response->status = ServerResponse::Response::ERROR_GENERIC;  // until proven otherwise..
 		uint8_t buffer[PACKET_SIZE];
@@ -159,7 +204,7 @@ namespace ServerRequestFuncs {
 			 */
 		case Request::EOp::CLI_FILE_BACKUP:
 		{
-			return ServerActions::fileBackup(request, response, sock, filepath, err, parsedFileName, buffer);
+			return ServerActions::fileBackup(request, response, sock, *userDir, err, parsedFileName, buffer);
 		}
 
 		/**
@@ -167,7 +212,7 @@ namespace ServerRequestFuncs {
 		 */
 		case Request::EOp::CLI_FILE_RESTORE:
 		{
-			return ServerActions::fileRestore(request, response, responseSent, sock, filepath, err, parsedFileName, buffer);
+			return ServerActions::fileRestore(request, response, responseSent, sock, *userDir, err, parsedFileName, buffer);
 		}
 
 		/**
@@ -175,13 +220,8 @@ namespace ServerRequestFuncs {
 		 */
 		case Request::EOp::CLI_FILE_REMOVE:
 		{
-			if (!FileManager::fileRemove(filepath))
-			{
-				err << "Request Error for user ID #" << +request.header.m_userID << ": File deletion failed!" << std::endl;
-				return false;
-			}
-			response->status = ServerResponse::Response::SUCCESS_BACKUP_DELETE;
-			return true;
+			response->status = RequestOps::remove(request, *userDir, parsedFileName, err);
+			return response->status == ServerResponse::Response::SUCCESS_BACKUP_DELETE;
 		}
 
 
@@ -191,7 +231,7 @@ namespace ServerRequestFuncs {
 		*/
 		case Request::EOp::CLI_FILE_LIST:
 		{
-			return ServerActions::fileList(request, response, responseSent, sock, filepath, err, parsedFileName, buffer, userPathSS);
+			return ServerActions::fileList(request, response, responseSent, sock, err, buffer, userDir->folder);
 
 		}
 		default:  // response handled outside.
@@ -8,7 +8,7 @@
 #include <fstream>
 #include <thread>
 #include "ServerActions.h"
-#define PACKET_SIZE  1024
+#include "ProtocolCodec.h"
 //#include "ServerActions.h"
 
 
@@ -29,7 +29,13 @@
 			CLI_FILE_BACKUP = 100,  // Save file backup. All fields should be valid.
 			CLI_FILE_RESTORE = 200,  // Restore a file. size, payload unused.
 			CLI_FILE_REMOVE = 201,  // Delete a file. size, payload unused.
-			CLI_FILE_LIST = 202   // List all client's files. name_len, filename, size, payload unused.
+			CLI_FILE_LIST = 202,  // List all client's files. name_len, filename, size, payload unused.
+			CLI_FILE_VERSIONS = 203,  // List a file's versions. size, payload unused.
+			CLI_FILE_RESTORE_VERSION = 204,  // Restore a file's version. payload: uint64 version id / timestamp (ns since epoch), 0 or absent = newest.
+			CLI_FILE_REMOVE_MATCHING = 205,  // Delete every file matching the filename as a prefix or glob (FileMatcher). size, payload unused.
+			CLI_FILE_STAT_MATCHING = 206,  // Size and mtime of every file matching the filename as a prefix or glob. size, payload unused.
+			CLI_USAGE = 207,  // The user's stored bytes and files and its quotas (QuotaManager). name_len, filename, size, payload unused.
+			CLI_FILE_PRECHECK = 208  // Is the content stored already? payload: uint64 size, SHA-256 of the content (ContentIndex).
 		};
 
 		RequestHeader header;  // request header
@@ -39,7 +45,7 @@
 		Request() : nameLen(0), filename(nullptr) {}
 		uint32_t sizeWithoutPayload() const
 		{
-			return (sizeof(header) + sizeof(nameLen) + nameLen + sizeof(payload.m_size));
+			return ProtocolCodec::requestOverhead(header.m_version, nameLen);
 		}
 
 
@@ -2,24 +2,15 @@
 
 namespace ServerResponseFuncs {
 
+	/**
+	   @brief encode the response's first frame in the layout of its version (ProtocolCodec).
+	 */
 	void serializeResponse(const ServerResponse::Response& response, uint8_t* buffer)
 	{
-		uint8_t* ptr = buffer;
-		uint32_t size = (PACKET_SIZE - response.sizeWithoutPayload());
-		if (response.payload.m_size < size)
-			size = response.payload.m_size;
-
-		memcpy(ptr, &(response.version), sizeof(response.version));
-		ptr += sizeof(response.version);
-		memcpy(ptr, &(response.status), sizeof(response.status));
-		ptr += sizeof(response.status);
-		memcpy(ptr, &(response.nameLen), sizeof(response.nameLen));
-		ptr += sizeof(response.nameLen);
-		memcpy(ptr, (response.filename), response.nameLen);
-		ptr += response.nameLen;
-		memcpy(ptr, &(response.payload.m_size), sizeof(response.payload.m_size));
-		ptr += sizeof(response.payload.m_size);
-		memcpy(ptr, (response.payload.m_payload), size);
+		(void)ProtocolCodec::forVersion(response.version, [&](auto codec)
+		{
+			return codec.encodeResponse(buffer, response.status, response.filename, response.nameLen, response.payload.m_size, response.payload.m_payload);
+		});
 	}
 
 
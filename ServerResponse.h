@@ -4,6 +4,7 @@
 #include <atomic>
 #include <boost/asio/ip/tcp.hpp>
 #include "ServerActions.h"
+#include "ProtocolCodec.h"
 
 
 class ServerResponse
@@ -16,9 +17,12 @@ public:
             SUCCESS_RESTORE = 210,   // File was found and restored. all fields are valid.
             SUCCESS_DIR = 211,   // Files listing returned successfully. all fields are valid.
             SUCCESS_BACKUP_DELETE = 212,   // File was successfully backed up or deleted. size, payload are invalid. [From forum].
+            SUCCESS_ALREADY_STORED = 213,   // Precheck: the file holds the content, as it did or linked from identical content (ContentIndex). size, payload are invalid.
+            SUCCESS_SEND_CONTENT = 214,   // Precheck: the content is not stored, back the file up. size, payload are invalid.
             ERROR_NOT_EXIST = 1001,  // File doesn't exist. size, payload are invalid.
             ERROR_NO_FILES = 1002,  // Client has no files. Only status & version are valid.
-            ERROR_GENERIC = 1003   // Generic server error. Only status & version are valid.
+            ERROR_GENERIC = 1003,   // Generic server error. Only status & version are valid.
+            ERROR_QUOTA = 1004   // Backup refused: it would exceed the user's quota (QuotaManager). size, payload are invalid.
         };
 
         const uint8_t version;    // Server Version
@@ -27,7 +31,7 @@ public:
         uint8_t* filename;        // FileName
         Payload payload;
         Response() : version(SERVER_VERSION), status(0), nameLen(0), filename(nullptr) {}
-        uint32_t sizeWithoutPayload() const { return (sizeof(version) + sizeof(status) + sizeof(nameLen) + nameLen + sizeof(payload.size)); }
+        uint32_t sizeWithoutPayload() const { return ProtocolCodec::responseOverhead(version, nameLen); }
 
     };
     
@@ -0,0 +1,905 @@
+/**
+  @SmallFileStore coalesced storage of tiny backups.
+  A backup whose whole payload arrives in the request frame does not get a file of its own:
+  it is buffered in memory and written, with the user's other small files buffered meanwhile,
+  to the user's container in .smallfiles/:
+      pack.<generation>  file contents, appended.
+      index              "BSVRSFIX", uint64 generation, then one record per put or remove,
+                         appended: uint8 op, uint8 cipher, uint16 nameLen, uint32 size,
+                         uint64 offset, uint8 nonce[12], name. the last record of a name wins.
+  A flush costs two appends (and two fdatasyncs when synced) per user and batch, instead of an
+  open, write and close per file. Each storage root has its own flusher thread, so roots
+  flush in parallel and a slow disk holds up only its own users. Reads are served from the
+  buffer or with one pread of the pack. FileManager looks names up here for
+  exists/list/restore/remove, so clients see ordinary files. A regular file and a small entry
+  of one name replace each other, once the replacing one is stored.
+  Containers are loaded on first use and at most SMALL_FILE_CONTAINERS idle ones stay cached,
+  least recently used first out. A user without a container costs one stat and is not cached.
+  Durability of an acknowledged backup:
+      buffered  acknowledged once buffered. a crash loses up to one flush interval.
+      flushed   acknowledged once its batch is written to the container.
+      synced    acknowledged once its batch is written and synced (default).
+  A waiting backup starts a flush at once, which takes along everything buffered while the
+  previous flush ran (group commit); otherwise batches are flushed every interval.
+  A failed flush fails its waiting backups and drops their data, so a backup reported failed
+  never shows up later. Removes are applied at once and written with the next flush, retried
+  until written.
+  When dead bytes (overwritten or removed entries) are most of a pack of at least
+  SMALL_FILE_COMPACT_MIN, the live entries are copied to the next pack generation and the
+  index is replaced by rename, which switches packs atomically. Compaction runs after the
+  flush's backups are acknowledged.
+  With encryption at rest every entry is sealed on its own (AtRestCipher, AAD = name).
+  A versioned file needs a file per version, so the store is used only with versioning off.
+  Configuration: BACKUPSVR_SMALL_FILES (0 disables), BACKUPSVR_SMALL_FILE_MAX (bytes),
+                 BACKUPSVR_SMALL_FILE_FLUSH_MS, BACKUPSVR_SMALL_FILE_BATCH (pending bytes
+                 that start a flush early), BACKUPSVR_SMALL_FILE_DURABILITY (buffered | flushed | synced).
+ */
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "DirectoryCache.h"
+#include "AtRestCipher.h"
+#include <openssl/crypto.h>
+#include "VersionStore.h"
+
+#define SMALL_FILES_DIR  DIRECTORY_SMALL_FILES_ENTRY
+#define SMALL_FILE_MAX  1024                       // largest payload stored in the container.
+#define SMALL_FILE_FLUSH_MS  20
+#define SMALL_FILE_BATCH  (1024 * 1024)            // pending bytes that start a flush before the interval ends.
+#define SMALL_FILE_COMPACT_MIN  (4 * 1024 * 1024)  // pack size before dead bytes are reclaimed.
+#define SMALL_FILE_RECORD  28                      // index record without the name.
+#define SMALL_FILE_INDEX_HEADER  16
+#define SMALL_FILE_CONTAINERS  4096                // idle containers kept loaded.
+#define SMALL_FILES_ENV  "BACKUPSVR_SMALL_FILES"
+#define SMALL_FILE_MAX_ENV  "BACKUPSVR_SMALL_FILE_MAX"
+#define SMALL_FILE_FLUSH_ENV  "BACKUPSVR_SMALL_FILE_FLUSH_MS"
+#define SMALL_FILE_BATCH_ENV  "BACKUPSVR_SMALL_FILE_BATCH"
+#define SMALL_FILE_DURABILITY_ENV  "BACKUPSVR_SMALL_FILE_DURABILITY"
+
+namespace SmallFileStore {
+
+	enum EDurability { BUFFERED, FLUSHED, SYNCED };
+
+	struct Config
+	{
+		bool enabled = true;
+		uint32_t maxSize = SMALL_FILE_MAX;
+		std::chrono::milliseconds flushInterval{ SMALL_FILE_FLUSH_MS };
+		uint64_t batchBytes = SMALL_FILE_BATCH;
+		EDurability durability = SYNCED;
+	};
+
+	inline const Config& config()
+	{
+		static const Config configured = []()
+		{
+			Config c;
+			const char* enabled = getenv(SMALL_FILES_ENV);
+			const char* maxSize = getenv(SMALL_FILE_MAX_ENV);
+			const char* flush = getenv(SMALL_FILE_FLUSH_ENV);
+			const char* batch = getenv(SMALL_FILE_BATCH_ENV);
+			const char* durability = getenv(SMALL_FILE_DURABILITY_ENV);
+			if (enabled != nullptr)
+				c.enabled = (atoi(enabled) != 0);
+			if (maxSize != nullptr && atoi(maxSize) >= 0)
+				c.maxSize = static_cast<uint32_t>(atoi(maxSize));
+			if (flush != nullptr && atoi(flush) > 0)
+				c.flushInterval = std::chrono::milliseconds(atoi(flush));
+			if (batch != nullptr && atoll(batch) > 0)
+				c.batchBytes = static_cast<uint64_t>(atoll(batch));
+			if (durability != nullptr && strcmp(durability, "buffered") == 0)
+				c.durability = BUFFERED;
+			else if (durability != nullptr && strcmp(durability, "flushed") == 0)
+				c.durability = FLUSHED;
+			return c;
+		}();
+		return configured;
+	}
+
+	/**
+	   @brief should a backup of this size go to the container?
+	 */
+	inline bool accepts(const uint32_t size)
+	{
+		const Config& c = config();
+		return c.enabled && size > 0 && size <= c.maxSize && !VersionStore::retention().enabled;
+	}
+
+	struct Stats
+	{
+		std::atomic<uint64_t> stored{ 0 };          // small backups accepted.
+		std::atomic<uint64_t> flushes{ 0 };         // container appends (one per user and batch).
+		std::atomic<uint64_t> flushedFiles{ 0 };
+		std::atomic<uint64_t> flushErrors{ 0 };
+		std::atomic<uint64_t> compactions{ 0 };
+		std::atomic<uint64_t> pendingBytes{ 0 };
+	};
+
+	inline Stats& stats()
+	{
+		static Stats s;
+		return s;
+	}
+
+	using Done = std::function<void(bool)>;
+
+
+	class Store
+	{
+	public:
+		static Store& instance()
+		{
+			static Store store;
+			return store;
+		}
+
+		/**
+		   @brief store a small file. `done` is called once the backup is as durable as configured,
+		          on this thread or the flusher's.
+		 */
+		void put(const DirectoryCache::Directory& dir, const std::string& name, const uint8_t* data, const uint32_t size, Done done)
+		{
+			const std::shared_ptr<Container> c = container(dir.folder, dir.userID);
+			bool wait = false;
+			{
+				std::lock_guard<std::mutex> lock(c->mutex);
+				if (!load(*c))
+				{
+					done(false);
+					return;
+				}
+				Pending& pending = c->pending[name];
+				stats().pendingBytes.fetch_add(size, std::memory_order_relaxed);
+				stats().pendingBytes.fetch_sub(pending.data.size(), std::memory_order_relaxed);
+				c->pendingBytes += size;
+				c->pendingBytes -= pending.data.size();
+				pending.data.assign(data, data + size);
+				pending.removed = false;
+				wait = (config().durability != BUFFERED);
+				if (wait)
+					c->waiting.push_back(std::move(done));
+			}
+			stats().stored.fetch_add(1, std::memory_order_relaxed);
+			markDirty(c, wait);
+			if (!wait)
+				done(true);
+		}
+
+		/**
+		   @brief the content of a small file.
+		   @return false if there is no such small file (or it could not be read).
+		 */
+		bool get(const DirectoryCache::Directory& dir, const std::string& name, std::vector<uint8_t>& data)
+		{
+			const std::shared_ptr<Container> c = find(dir.folder, dir.userID);
+			if (c == nullptr)
+				return false;
+			std::lock_guard<std::mutex> lock(c->mutex);
+			const auto pending = c->pending.find(name);
+			if (pending != c->pending.end())
+			{
+				if (pending->second.removed)
+					return false;
+				data = pending->second.data;
+				return true;
+			}
+			const auto entry = c->entries.find(name);
+			return entry != c->entries.end() && read(*c, name, entry->second, data);
+		}
+
+		bool contains(const DirectoryCache::Directory& dir, const std::string& name)
+		{
+			const std::shared_ptr<Container> c = find(dir.folder, dir.userID);
+			if (c == nullptr)
+				return false;
+			std::lock_guard<std::mutex> lock(c->mutex);
+			return live(*c, name);
+		}
+
+		/**
+		   @brief remove a small file. written to the container with the next flush.
+		   @return false if there is no such small file.
+		 */
+		bool remove(const DirectoryCache::Directory& dir, const std::string& name)
+		{
+			const std::shared_ptr<Container> c = find(dir.folder, dir.userID);
+			if (c == nullptr)
+				return false;
+			{
+				std::lock_guard<std::mutex> lock(c->mutex);
+				if (!live(*c, name))
+					return false;
+				Pending& pending = c->pending[name];
+				stats().pendingBytes.fetch_sub(pending.data.size(), std::memory_order_relaxed);
+				c->pendingBytes -= pending.data.size();
+				pending.data.clear();
+				pending.removed = true;
+			}
+			markDirty(c, false);
+			return true;
+		}
+
+		/**
+		   @brief add the user's small file names to a listing. nested names add their first component, as directories do.
+		   @param folder the user's folder, as DirectoryCache::Directory::folder.
+		 */
+		void names(const std::string& folder, std::set<std::string>& files)
+		{
+			const std::shared_ptr<Container> c = find(folder, 0);
+			if (c == nullptr)
+				return;
+			std::lock_guard<std::mutex> lock(c->mutex);
+			for (const auto& entry : c->entries)
+			{
+				if (live(*c, entry.first))
+					files.insert(entry.first.substr(0, entry.first.find('/')));
+			}
+			for (const auto& pending : c->pending)
+			{
+				if (!pending.second.removed)
+					files.insert(pending.first.substr(0, pending.first.find('/')));
+			}
+		}
+
+		/**
+		   @brief the user's small files by full name, with their content sizes.
+		   @param folder the user's folder, as DirectoryCache::Directory::folder.
+		 */
+		void sizes(const std::string& folder, std::map<std::string, uint64_t>& files)
+		{
+			const std::shared_ptr<Container> c = find(folder, 0);
+			if (c == nullptr)
+				return;
+			std::lock_guard<std::mutex> lock(c->mutex);
+			for (const auto& entry : c->entries)
+			{
+				if (live(*c, entry.first))
+					files[entry.first] = entry.second.size - ((entry.second.cipher != 0) ? AT_REST_TAG : 0);
+			}
+			for (const auto& pending : c->pending)
+			{
+				if (!pending.second.removed)
+					files[pending.first] = pending.second.data.size();
+			}
+		}
+
+		/**
+		   @brief the content size of one small file.
+		   @return false if there is no such small file.
+		 */
+		bool size(const std::string& folder, const std::string& name, uint64_t& size)
+		{
+			const std::shared_ptr<Container> c = find(folder, 0);
+			if (c == nullptr)
+				return false;
+			std::lock_guard<std::mutex> lock(c->mutex);
+			const auto pending = c->pending.find(name);
+			if (pending != c->pending.end())
+			{
+				size = pending->second.data.size();
+				return !pending->second.removed;
+			}
+			const auto entry = c->entries.find(name);
+			if (entry == c->entries.end())
+				return false;
+			size = entry->second.size - ((entry->second.cipher != 0) ? AT_REST_TAG : 0);
+			return true;
+		}
+
+		bool hasFiles(const DirectoryCache::Directory& dir)
+		{
+			std::set<std::string> files;
+			names(dir.folder, files);
+			return !files.empty();
+		}
+
+		/**
+		   @brief write out a folder's pending files and forget its container, e.g. before the folder is moved.
+		   @return false if the pending files could not be written. the container is kept then.
+		 */
+		bool release(const std::string& folder)
+		{
+			std::shared_ptr<Container> c;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				const auto it = _containers.find(folder);
+				if (it == _containers.end())
+					return true;
+				c = it->second;
+			}
+			std::vector<Done> waiting;
+			bool ok = false;
+			{
+				std::lock_guard<std::mutex> lock(c->mutex);
+				ok = flush(*c);
+				if (!ok)
+					failed(*c);
+				waiting.swap(c->waiting);
+			}
+			for (auto& done : waiting)
+				done(ok);
+			if (!ok)
+				return false;
+			std::lock_guard<std::mutex> lock(_mutex);
+			_containers.erase(folder);
+			c->root->dirty.erase(c);
+			return true;
+		}
+
+		~Store()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stopping = true;
+			}
+			for (auto& root : _roots)
+			{
+				root.second->wake.notify_all();
+				root.second->flusher.join();
+			}
+		}
+
+		Store(const Store&) = delete;
+		Store& operator=(const Store&) = delete;
+
+	private:
+		struct Entry
+		{
+			uint64_t offset = 0;
+			uint32_t size = 0;     // stored bytes (with the tag when sealed).
+			uint8_t cipher = 0;    // 0: plaintext.
+			uint8_t nonce[12] = {};
+		};
+
+		struct Pending
+		{
+			std::vector<uint8_t> data;
+			bool removed = false;
+		};
+
+		struct Container;
+
+		/**
+		   The flusher of one storage root and the containers it has to write.
+		 */
+		struct Root
+		{
+			std::set<std::shared_ptr<Container>> dirty;
+			std::condition_variable wake;
+			bool early = false;   // a flush is due before the interval ends.
+			std::thread flusher;
+		};
+
+		/**
+		   One user's container. Requests of a user are served one at a time, so the lock is
+		   shared only with the flusher.
+		 */
+		struct Container
+		{
+			std::mutex mutex;
+			std::string folder;
+			Root* root = nullptr;
+			uint64_t used = 0;      // last use, in _clock ticks. guarded by the store's mutex.
+			uint32_t userID = 0;
+			bool loaded = false;
+			uint64_t generation = 0;
+			uint64_t packSize = 0;
+			uint64_t indexSize = 0;
+			uint64_t liveBytes = 0;
+			std::map<std::string, Entry> entries;
+			std::map<std::string, Pending> pending;   // not flushed yet. wins over entries.
+			uint64_t pendingBytes = 0;
+			std::vector<Done> waiting;                // acknowledgments held for the next flush.
+		};
+
+		Store() : _clock(0), _stopping(false)
+		{
+			(void)config();   // constructed first, so they outlive the final flush at exit.
+			(void)stats();
+			(void)AtRestCipher::Keys::instance();
+			(void)OPENSSL_init_crypto(0, nullptr);
+		}
+
+		std::string containerPath(const Container& c) const { return c.folder + SMALL_FILES_DIR + "/"; }
+		std::string packPath(const Container& c, const uint64_t generation) const { return containerPath(c) + "pack." + std::to_string(generation); }
+		std::string indexPath(const Container& c) const { return containerPath(c) + "index"; }
+
+		/**
+		   @brief the storage root of a user's folder: the folder's parent.
+		 */
+		static std::string rootOf(const std::string& folder)
+		{
+			const size_t end = folder.find_last_not_of('/');
+			const size_t slash = (end == std::string::npos) ? std::string::npos : folder.rfind('/', end);
+			return (slash == std::string::npos) ? std::string() : folder.substr(0, slash + 1);
+		}
+
+		/**
+		   @brief the root's flusher, started on its first container.
+		 */
+		Root* rootLocked(const std::string& folder)
+		{
+			std::unique_ptr<Root>& root = _roots[rootOf(folder)];
+			if (root == nullptr)
+			{
+				root = std::make_unique<Root>();
+				root->flusher = std::thread(&Store::run, this, root.get());
+			}
+			return root.get();
+		}
+
+		/**
+		   @brief forget the least recently used containers nobody holds (not dirty, no request in them).
+		 */
+		void evictLocked()
+		{
+			if (_containers.size() < SMALL_FILE_CONTAINERS)
+				return;
+			std::vector<std::pair<uint64_t, std::string>> idle;
+			for (const auto& c : _containers)
+			{
+				if (c.second.use_count() == 1)
+					idle.emplace_back(c.second->used, c.first);
+			}
+			std::sort(idle.begin(), idle.end());
+			const size_t excess = _containers.size() - SMALL_FILE_CONTAINERS + SMALL_FILE_CONTAINERS / 8;   // a batch, not one per lookup.
+			for (size_t i = 0; i < idle.size() && i <= excess; ++i)
+				_containers.erase(idle[i].second);
+		}
+
+		std::shared_ptr<Container> container(const std::string& folder, const uint32_t userID)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			auto it = _containers.find(folder);
+			if (it == _containers.end())
+			{
+				evictLocked();
+				auto c = std::make_shared<Container>();
+				c->folder = folder;
+				c->root = rootLocked(folder);
+				it = _containers.emplace(folder, std::move(c)).first;
+			}
+			const std::shared_ptr<Container>& c = it->second;
+			c->used = ++_clock;
+			if (c->userID == 0)
+				c->userID = userID;
+			return c;
+		}
+
+		/**
+		   @return the loaded container of a folder, or nullptr if the user has none. a folder
+		           without a container is not cached.
+		 */
+		std::shared_ptr<Container> find(const std::string& folder, const uint32_t userID)
+		{
+			bool cached = false;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				cached = (_containers.count(folder) != 0);
+			}
+			std::error_code error;
+			if (!cached && !std::filesystem::exists(folder + SMALL_FILES_DIR + "/index", error))
+				return nullptr;
+			const std::shared_ptr<Container> c = container(folder, userID);
+			std::lock_guard<std::mutex> lock(c->mutex);
+			if (!load(*c) || (c->entries.empty() && c->pending.empty()))
+				return nullptr;
+			return c;
+		}
+
+		static bool live(const Container& c, const std::string& name)
+		{
+			const auto pending = c.pending.find(name);
+			if (pending != c.pending.end())
+				return !pending->second.removed;
+			return c.entries.count(name) != 0;
+		}
+
+		/**
+		   @param waited a backup waits for the flush: flush now (group commit), taking along
+		          whatever arrived during the previous flush.
+		 */
+		void markDirty(const std::shared_ptr<Container>& c, const bool waited)
+		{
+			bool early = false;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				c->root->dirty.insert(c);
+				early = waited || (stats().pendingBytes.load(std::memory_order_relaxed) >= config().batchBytes);
+				c->root->early = c->root->early || early;
+			}
+			if (early)
+				c->root->wake.notify_one();
+		}
+
+		static bool readAll(const int fd, uint8_t* data, const size_t length, const uint64_t offset)
+		{
+			size_t done = 0;
+			while (done < length)
+			{
+				const ssize_t res = ::pread(fd, data + done, length - done, static_cast<off_t>(offset + done));
+				if (res < 0 && errno == EINTR)
+					continue;
+				if (res <= 0)
+					return false;
+				done += static_cast<size_t>(res);
+			}
+			return true;
+		}
+
+		static bool writeAll(const int fd, const uint8_t* data, const size_t length, const uint64_t offset)
+		{
+			size_t done = 0;
+			while (done < length)
+			{
+				const ssize_t res = ::pwrite(fd, data + done, length - done, static_cast<off_t>(offset + done));
+				if (res < 0 && errno == EINTR)
+					continue;
+				if (res <= 0)
+					return false;
+				done += static_cast<size_t>(res);
+			}
+			return true;
+		}
+
+		static void appendRecord(std::vector<uint8_t>& index, const uint8_t op, const std::string& name, const Entry& entry)
+		{
+			const size_t at = index.size();
+			index.resize(at + SMALL_FILE_RECORD + name.size());
+			uint8_t* p = index.data() + at;
+			const auto nameLen = static_cast<uint16_t>(name.size());
+			p[0] = op;
+			p[1] = entry.cipher;
+			memcpy(p + 2, &nameLen, sizeof(nameLen));
+			memcpy(p + 4, &entry.size, sizeof(entry.size));
+			memcpy(p + 8, &entry.offset, sizeof(entry.offset));
+			memcpy(p + 16, entry.nonce, sizeof(entry.nonce));
+			memcpy(p + SMALL_FILE_RECORD, name.data(), name.size());
+		}
+
+		static std::vector<uint8_t> indexHeader(const uint64_t generation)
+		{
+			std::vector<uint8_t> header(SMALL_FILE_INDEX_HEADER);
+			memcpy(header.data(), "BSVRSFIX", 8);
+			memcpy(header.data() + 8, &generation, sizeof(generation));
+			return header;
+		}
+
+		/**
+		   @brief read the index once. a record torn by a crash is cut off.
+		 */
+		bool load(Container& c)
+		{
+			if (c.loaded)
+				return true;
+			const int fd = ::open(indexPath(c).c_str(), O_RDWR | O_CLOEXEC);
+			if (fd < 0)
+			{
+				c.loaded = (errno == ENOENT || errno == ENOTDIR);   // no container yet.
+				return c.loaded;
+			}
+			struct stat st;
+			std::vector<uint8_t> index;
+			bool ok = (::fstat(fd, &st) == 0);
+			if (ok)
+			{
+				index.resize(static_cast<size_t>(st.st_size));
+				ok = readAll(fd, index.data(), index.size(), 0) && index.size() >= SMALL_FILE_INDEX_HEADER && memcmp(index.data(), "BSVRSFIX", 8) == 0;
+			}
+			if (!ok)
+			{
+				(void)::close(fd);
+				return false;
+			}
+			memcpy(&c.generation, index.data() + 8, sizeof(c.generation));
+			size_t pos = SMALL_FILE_INDEX_HEADER;
+			while (pos + SMALL_FILE_RECORD <= index.size())
+			{
+				const uint8_t* p = index.data() + pos;
+				uint16_t nameLen = 0;
+				memcpy(&nameLen, p + 2, sizeof(nameLen));
+				if (pos + SMALL_FILE_RECORD + nameLen > index.size())
+					break;
+				const std::string name(reinterpret_cast<const char*>(p + SMALL_FILE_RECORD), nameLen);
+				Entry entry;
+				entry.cipher = p[1];
+				memcpy(&entry.size, p + 4, sizeof(entry.size));
+				memcpy(&entry.offset, p + 8, sizeof(entry.offset));
+				memcpy(entry.nonce, p + 16, sizeof(entry.nonce));
+				const auto previous = c.entries.find(name);
+				if (previous != c.entries.end())
+				{
+					c.liveBytes -= previous->second.size;
+					c.entries.erase(previous);
+				}
+				if (p[0] == PUT)
+				{
+					c.entries[name] = entry;
+					c.liveBytes += entry.size;
+				}
+				pos += SMALL_FILE_RECORD + nameLen;
+			}
+			if (pos < index.size())
+				(void)::ftruncate(fd, static_cast<off_t>(pos));
+			(void)::close(fd);
+			c.indexSize = pos;
+			std::error_code error;
+			const auto packSize = std::filesystem::file_size(packPath(c, c.generation), error);
+			c.packSize = error ? 0 : static_cast<uint64_t>(packSize);   // data past the index (a crash between the appends) is skipped.
+			c.loaded = true;
+			return true;
+		}
+
+		bool read(const Container& c, const std::string& name, const Entry& entry, std::vector<uint8_t>& data) const
+		{
+			const int fd = ::open(packPath(c, c.generation).c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+				return false;
+			data.resize(entry.size);
+			const bool read = readAll(fd, data.data(), data.size(), entry.offset);
+			(void)::close(fd);
+			if (!read)
+				return false;
+			if (entry.cipher == 0)
+				return true;
+			AtRestCipher::Key key;
+			if (data.size() < AT_REST_TAG || !AtRestCipher::Keys::instance().userKey(c.userID, key))
+				return false;
+			AtRestCipher::Sealer sealer;
+			sealer.setKey(key, entry.cipher);
+			const auto length = static_cast<uint32_t>(data.size() - AT_REST_TAG);
+			if (!sealer.open(data.data(), length, entry.nonce, reinterpret_cast<const uint8_t*>(name.data()), static_cast<uint32_t>(name.size())))
+				return false;
+			data.resize(length);
+			return true;
+		}
+
+		/**
+		   @brief append the pending puts and removes of a container: contents to the pack, then records to the index.
+		 */
+		bool flush(Container& c)
+		{
+			if (c.pending.empty())
+				return true;   // pending implies loaded: puts and removes load the container first.
+			const bool synced = (config().durability == SYNCED);
+			std::error_code error;
+			(void)std::filesystem::create_directories(containerPath(c), error);
+			AtRestCipher::Sealer sealer;
+			uint8_t cipher = 0;
+			if (AtRestCipher::enabled())
+			{
+				AtRestCipher::Key key;
+				if (!AtRestCipher::Keys::instance().userKey(c.userID, key))
+					return false;
+				cipher = AtRestCipher::preferredCipher();
+				sealer.setKey(key, cipher);
+			}
+
+			std::vector<uint8_t> pack;
+			std::vector<uint8_t> index = (c.indexSize == 0) ? indexHeader(c.generation) : std::vector<uint8_t>();
+			std::vector<std::pair<std::string, Entry>> written;
+			for (auto& pending : c.pending)
+			{
+				Entry entry;
+				if (pending.second.removed)
+				{
+					if (c.entries.count(pending.first) != 0)
+						appendRecord(index, REMOVE, pending.first, entry);
+					continue;
+				}
+				entry.offset = c.packSize + pack.size();
+				entry.cipher = cipher;
+				const size_t at = pack.size();
+				pack.insert(pack.end(), pending.second.data.begin(), pending.second.data.end());
+				if (cipher != 0)
+				{
+					pack.resize(pack.size() + AT_REST_TAG);
+					if (RAND_bytes(entry.nonce, sizeof(entry.nonce)) != 1
+						|| !sealer.seal(pack.data() + at, static_cast<uint32_t>(pending.second.data.size()), entry.nonce, reinterpret_cast<const uint8_t*>(pending.first.data()), static_cast<uint32_t>(pending.first.size())))
+						return false;
+				}
+				entry.size = static_cast<uint32_t>(pack.size() - at);
+				appendRecord(index, PUT, pending.first, entry);
+				written.emplace_back(pending.first, entry);
+			}
+
+			if (!pack.empty())
+			{
+				const int fd = ::open(packPath(c, c.generation).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+				const bool ok = (fd >= 0) && writeAll(fd, pack.data(), pack.size(), c.packSize) && (!synced || ::fdatasync(fd) == 0);
+				if (fd >= 0)
+					(void)::close(fd);
+				if (!ok)
+					return false;
+			}
+			if (!index.empty())
+			{
+				const int fd = ::open(indexPath(c).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+				const bool ok = (fd >= 0) && writeAll(fd, index.data(), index.size(), c.indexSize) && (!synced || ::fdatasync(fd) == 0);
+				if (fd >= 0)
+					(void)::close(fd);
+				if (!ok)
+					return false;
+			}
+
+			c.packSize += pack.size();
+			c.indexSize += index.size();
+			for (const auto& pending : c.pending)
+			{
+				const auto previous = c.entries.find(pending.first);
+				if (previous == c.entries.end())
+					continue;
+				c.liveBytes -= previous->second.size;
+				c.entries.erase(previous);
+			}
+			for (const auto& entry : written)
+			{
+				c.entries[entry.first] = entry.second;
+				c.liveBytes += entry.second.size;
+			}
+			stats().flushes.fetch_add(1, std::memory_order_relaxed);
+			stats().flushedFiles.fetch_add(written.size(), std::memory_order_relaxed);
+			stats().pendingBytes.fetch_sub(c.pendingBytes, std::memory_order_relaxed);
+			c.pending.clear();
+			c.pendingBytes = 0;
+			return true;
+		}
+
+		/**
+		   @brief copy the live entries to the next pack generation and switch to it by replacing the index.
+		 */
+		bool compact(Container& c)
+		{
+			const uint64_t generation = c.generation + 1;
+			const int in = ::open(packPath(c, c.generation).c_str(), O_RDONLY | O_CLOEXEC);
+			const int out = ::open(packPath(c, generation).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			std::vector<uint8_t> index = indexHeader(generation);
+			std::map<std::string, Entry> entries;
+			std::vector<uint8_t> data;
+			uint64_t offset = 0;
+			bool ok = (in >= 0 && out >= 0);
+			for (auto it = c.entries.begin(); ok && it != c.entries.end(); ++it)
+			{
+				data.resize(it->second.size);
+				Entry entry = it->second;
+				entry.offset = offset;
+				ok = readAll(in, data.data(), data.size(), it->second.offset) && writeAll(out, data.data(), data.size(), offset);
+				offset += data.size();
+				appendRecord(index, PUT, it->first, entry);
+				entries[it->first] = entry;
+			}
+			ok = ok && (::fdatasync(out) == 0);
+			if (in >= 0)
+				(void)::close(in);
+			if (out >= 0)
+				(void)::close(out);
+			const std::string replacement = indexPath(c) + ".compact";
+			if (ok)
+			{
+				const int fd = ::open(replacement.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+				ok = (fd >= 0) && writeAll(fd, index.data(), index.size(), 0) && (::fdatasync(fd) == 0);
+				if (fd >= 0)
+					(void)::close(fd);
+			}
+			std::error_code error;
+			if (!ok || ::rename(replacement.c_str(), indexPath(c).c_str()) != 0)
+			{
+				std::filesystem::remove(replacement, error);
+				std::filesystem::remove(packPath(c, generation), error);
+				return false;
+			}
+			std::filesystem::remove(packPath(c, c.generation), error);
+			c.generation = generation;
+			c.entries.swap(entries);
+			c.packSize = offset;
+			c.indexSize = index.size();
+			c.liveBytes = offset;
+			stats().compactions.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+
+		/**
+		   @brief after a failed flush: drop the puts whose backups are failed now. acknowledged
+		          changes (removes, buffered puts) stay pending for the next flush.
+		   @return whether anything is left to retry.
+		 */
+		bool failed(Container& c)
+		{
+			stats().flushErrors.fetch_add(1, std::memory_order_relaxed);
+			if (config().durability != BUFFERED)
+			{
+				for (auto it = c.pending.begin(); it != c.pending.end();)
+				{
+					if (it->second.removed)
+					{
+						++it;
+						continue;
+					}
+					stats().pendingBytes.fetch_sub(it->second.data.size(), std::memory_order_relaxed);
+					c.pendingBytes -= it->second.data.size();
+					it = c.pending.erase(it);
+				}
+			}
+			return !c.pending.empty();
+		}
+
+		void flushAll(Root& root)
+		{
+			std::set<std::shared_ptr<Container>> dirty;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				dirty.swap(root.dirty);
+			}
+			for (const auto& c : dirty)
+			{
+				std::vector<Done> waiting;
+				bool ok = false;
+				bool retry = false;
+				{
+					std::lock_guard<std::mutex> lock(c->mutex);
+					ok = flush(*c);
+					retry = !ok && failed(*c);
+					waiting.swap(c->waiting);
+				}
+				if (retry)
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					root.dirty.insert(c);
+				}
+				for (auto& done : waiting)
+					done(ok);
+				if (!ok)
+					continue;
+				std::lock_guard<std::mutex> lock(c->mutex);   // the backups are acknowledged: compaction delays no one.
+				if (c->packSize >= SMALL_FILE_COMPACT_MIN && c->liveBytes * 2 < c->packSize)
+					(void)compact(*c);   // a failed compaction leaves the container as it was.
+			}
+		}
+
+		void run(Root* root)
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			while (!_stopping)
+			{
+				(void)root->wake.wait_for(lock, config().flushInterval, [this, root] { return root->early || _stopping; });
+				root->early = false;
+				lock.unlock();
+				flushAll(*root);
+				lock.lock();
+			}
+			lock.unlock();
+			flushAll(*root);
+			OPENSSL_thread_stop();   // per thread cipher and RNG state.
+		}
+
+		enum EOp : uint8_t { PUT = 1, REMOVE = 2 };
+
+		std::mutex _mutex;
+		std::unordered_map<std::string, std::shared_ptr<Container>> _containers;
+		std::map<std::string, std::unique_ptr<Root>> _roots;   // by root path.
+		uint64_t _clock;  // container uses, for eviction.
+		bool _stopping;
+	};
+
+	inline Store& instance()
+	{
+		return Store::instance();
+	}
+
+}
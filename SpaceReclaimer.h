@@ -0,0 +1,325 @@
+/**
+  @SpaceReclaimer lazy deletion of removed files.
+  Unlinking a large file frees all of its extents on the request thread, and mass removes
+  flood the filesystem journal while backups are written. A removed file is therefore only
+  renamed into its storage root's trash directory (<root>/.trash/, same filesystem), which
+  takes one metadata operation whatever the size, and the client is answered at once.
+  A reclaimer thread frees the space in the background at a limited rate: files larger than
+  RECLAIM_CHUNK are shrunk a chunk at a time before they are unlinked, so freeing is spread
+  over time instead of arriving as one burst. Entries left by a previous run are picked up at
+  startup. Anything that is not a regular file, or a rename that fails (e.g. the user folder
+  is on another filesystem than its root), is removed directly as before.
+  Configuration: BACKUPSVR_LAZY_DELETE (0 disables), BACKUPSVR_RECLAIM_BYTES_PER_S,
+                 BACKUPSVR_RECLAIM_FILES_PER_S.
+ */
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "DirectoryCache.h"
+#include "StorageRoots.h"
+
+#define RECLAIM_TRASH_DIR  ".trash"
+#define RECLAIM_BYTES_PER_S  (256ull * 1024 * 1024)
+#define RECLAIM_FILES_PER_S  1000
+#define RECLAIM_CHUNK  (64ull * 1024 * 1024)   // bytes freed per truncation step of a large file.
+#define LAZY_DELETE_ENV  "BACKUPSVR_LAZY_DELETE"
+#define RECLAIM_BYTES_PER_S_ENV  "BACKUPSVR_RECLAIM_BYTES_PER_S"
+#define RECLAIM_FILES_PER_S_ENV  "BACKUPSVR_RECLAIM_FILES_PER_S"
+
+namespace SpaceReclaimer {
+
+	struct Config
+	{
+		bool enabled = true;
+		uint64_t bytesPerSecond = RECLAIM_BYTES_PER_S;
+		uint64_t filesPerSecond = RECLAIM_FILES_PER_S;
+	};
+
+	inline const Config& config()
+	{
+		static const Config configured = []()
+		{
+			Config c;
+			const char* enabled = getenv(LAZY_DELETE_ENV);
+			const char* bytes = getenv(RECLAIM_BYTES_PER_S_ENV);
+			const char* files = getenv(RECLAIM_FILES_PER_S_ENV);
+			if (enabled != nullptr)
+				c.enabled = (atoi(enabled) != 0);
+			if (bytes != nullptr && atoll(bytes) > 0)
+				c.bytesPerSecond = static_cast<uint64_t>(atoll(bytes));
+			if (files != nullptr && atoll(files) > 0)
+				c.filesPerSecond = static_cast<uint64_t>(atoll(files));
+			return c;
+		}();
+		return configured;
+	}
+
+	struct Stats
+	{
+		std::atomic<uint64_t> discarded{ 0 };        // files moved to a trash directory.
+		std::atomic<uint64_t> reclaimedFiles{ 0 };
+		std::atomic<uint64_t> reclaimedBytes{ 0 };
+		std::atomic<uint64_t> errors{ 0 };           // trash entries that could not be freed. retried at the next start.
+		std::atomic<uint64_t> backlogFiles{ 0 };     // in the trash, not freed yet.
+		std::atomic<uint64_t> backlogBytes{ 0 };
+	};
+
+	inline Stats& stats()
+	{
+		static Stats s;
+		return s;
+	}
+
+
+	class Reclaimer
+	{
+	public:
+		static Reclaimer& instance()
+		{
+			static Reclaimer reclaimer;
+			return reclaimer;
+		}
+
+		bool enabled() const { return _enabled; }
+
+		/**
+		   @brief remove a user's file by moving it to the trash of its storage root.
+		   @return false if the file was not moved: lazy deletion is off, it is not a regular
+		           file, or the rename failed. the caller removes it directly then.
+		 */
+		bool discard(const DirectoryCache::Directory& dir, const std::string& filename)
+		{
+			if (!_enabled || filename.empty())
+				return false;
+			const std::string root = rootOf(dir.folder);
+			const std::string entry = entryName(dir.userID);
+			uint64_t bytes = 0;
+			bool moved = false;
+#if HAVE_OPENAT
+			struct stat st;
+			const int trashFd = (dir.fd >= 0) ? trash(root) : -1;
+			if (trashFd >= 0)
+			{
+				if (::fstatat(dir.fd, filename.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode))
+					return false;
+				bytes = static_cast<uint64_t>(st.st_blocks) * 512;   // allocated, not apparent, size.
+				moved = (::renameat(dir.fd, filename.c_str(), trashFd, entry.c_str()) == 0);
+			}
+			else
+#endif
+			{
+				namespace fs = std::filesystem;
+				std::error_code error;
+				const fs::path path(dir.folder + filename);
+				if (!fs::is_regular_file(fs::symlink_status(path, error)))
+					return false;
+				bytes = static_cast<uint64_t>(fs::file_size(path, error));
+				fs::create_directories(root + RECLAIM_TRASH_DIR, error);
+				fs::rename(path, root + RECLAIM_TRASH_DIR "/" + entry, error);
+				moved = !error;
+			}
+			if (!moved)
+				return false;
+			stats().discarded.fetch_add(1, std::memory_order_relaxed);
+			enqueue(root + RECLAIM_TRASH_DIR "/" + entry, bytes);
+			return true;
+		}
+
+		~Reclaimer()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stopping = true;
+			}
+			_wake.notify_all();
+			if (_worker.joinable())
+				_worker.join();
+#if HAVE_OPENAT
+			for (const auto& trash : _trashFds)
+				(void)::close(trash.second);
+#endif
+		}
+
+		Reclaimer(const Reclaimer&) = delete;
+		Reclaimer& operator=(const Reclaimer&) = delete;
+
+	private:
+		struct Item
+		{
+			std::string path;
+			uint64_t bytes = 0;
+		};
+
+		Reclaimer() : _enabled(config().enabled), _sequence(0), _stopping(false)
+		{
+			(void)stats();
+			(void)StorageRoots::instance();   // constructed first, so it outlives the worker.
+			if (_enabled)
+				_worker = std::thread(&Reclaimer::run, this);
+		}
+
+		/**
+		   @brief the storage root of a user folder: "<root>/<userID>/" -> "<root>/".
+		 */
+		static std::string rootOf(const std::string& folder)
+		{
+			const size_t end = (folder.size() > 1) ? folder.find_last_of("/\\", folder.size() - 2) : std::string::npos;
+			return (end == std::string::npos) ? std::string() : folder.substr(0, end + 1);
+		}
+
+		/**
+		   @brief a trash entry name unique across runs: <userID>.<start time>.<sequence>.
+		 */
+		std::string entryName(const uint32_t userID)
+		{
+			static const auto started = std::chrono::system_clock::now().time_since_epoch().count();
+			return std::to_string(userID) + "." + std::to_string(started) + "." + std::to_string(_sequence.fetch_add(1, std::memory_order_relaxed));
+		}
+
+#if HAVE_OPENAT
+		/**
+		   @return the root's trash directory, opened once. -1 if it cannot be created.
+		 */
+		int trash(const std::string& root)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			const auto it = _trashFds.find(root);
+			if (it != _trashFds.end())
+				return it->second;
+			const std::string path = root + RECLAIM_TRASH_DIR;
+			(void)::mkdir(path.c_str(), 0755);
+			const int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (fd >= 0)
+				_trashFds[root] = fd;
+			return fd;
+		}
+#endif
+
+		void enqueue(const std::string& path, const uint64_t bytes)
+		{
+			stats().backlogFiles.fetch_add(1, std::memory_order_relaxed);
+			stats().backlogBytes.fetch_add(bytes, std::memory_order_relaxed);
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_queue.push_back(Item{ path, bytes });
+			}
+			_wake.notify_one();
+		}
+
+		/**
+		   @brief queue the trash entries a previous run left behind.
+		 */
+		void resume()
+		{
+			namespace fs = std::filesystem;
+			StorageRoots::Manager& roots = StorageRoots::instance();
+			for (size_t r = 0; r < roots.rootsCount(); ++r)
+			{
+				std::error_code error;
+				for (fs::directory_iterator it(roots.rootPath(r) + RECLAIM_TRASH_DIR, error), end; !error && it != end; it.increment(error))
+				{
+					std::error_code sizeError;
+					const auto size = it->file_size(sizeError);
+					enqueue(it->path().string(), sizeError ? 0 : static_cast<uint64_t>(size));
+				}
+			}
+		}
+
+		/**
+		   @brief wait until the rate limits allow `bytes` more freed bytes (and a file, if `unlink`).
+		   @return false if the reclaimer is stopping.
+		 */
+		bool pace(const uint64_t bytes, const bool unlink)
+		{
+			const Config& c = config();
+			const auto cost = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(
+				static_cast<double>(bytes) / static_cast<double>(c.bytesPerSecond) + (unlink ? 1.0 / static_cast<double>(c.filesPerSecond) : 0.0)));
+			std::unique_lock<std::mutex> lock(_mutex);
+			if (_wake.wait_until(lock, _next, [this] { return _stopping; }))
+				return false;
+			_next = std::max(_next, std::chrono::steady_clock::now()) + cost;
+			return true;
+		}
+
+		/**
+		   @brief free one trash entry: shrink a large file a chunk at a time, then unlink it.
+		          a file with other hard links is only unlinked.
+		   @return false if the reclaimer stopped before the entry was freed.
+		 */
+		bool reclaim(const Item& item)
+		{
+			namespace fs = std::filesystem;
+			std::error_code error;
+			uint64_t size = static_cast<uint64_t>(fs::file_size(item.path, error));
+			const bool shared = !error && fs::hard_link_count(item.path, error) > 1;   // the content stays in use elsewhere.
+			while (!error && !shared && size > RECLAIM_CHUNK)
+			{
+				if (!pace(RECLAIM_CHUNK, false))
+					return false;
+				size -= RECLAIM_CHUNK;
+				fs::resize_file(item.path, size, error);
+			}
+			if (!pace(error ? 0 : size, true))
+				return false;
+			error.clear();
+			if (!fs::remove(item.path, error) || error)
+				stats().errors.fetch_add(1, std::memory_order_relaxed);
+			else
+			{
+				stats().reclaimedFiles.fetch_add(1, std::memory_order_relaxed);
+				stats().reclaimedBytes.fetch_add(item.bytes, std::memory_order_relaxed);
+			}
+			stats().backlogFiles.fetch_sub(1, std::memory_order_relaxed);
+			stats().backlogBytes.fetch_sub(item.bytes, std::memory_order_relaxed);
+			return true;
+		}
+
+		void run()
+		{
+			resume();
+			std::unique_lock<std::mutex> lock(_mutex);
+			while (true)
+			{
+				_wake.wait(lock, [this] { return _stopping || !_queue.empty(); });
+				if (_stopping)
+					break;
+				const Item item = _queue.front();
+				_queue.pop_front();
+				lock.unlock();
+				const bool done = reclaim(item);
+				lock.lock();
+				if (!done)
+					break;   // left in the trash. picked up by the next run.
+			}
+		}
+
+		const bool _enabled;
+		std::atomic<uint64_t> _sequence;
+		std::mutex _mutex;
+		std::condition_variable _wake;
+		std::deque<Item> _queue;
+		std::chrono::steady_clock::time_point _next;   // when the rate limits allow the next step.
+#if HAVE_OPENAT
+		std::map<std::string, int> _trashFds;          // storage root -> its trash directory.
+#endif
+		bool _stopping;
+		std::thread _worker;
+	};
+
+	inline Reclaimer& instance()
+	{
+		return Reclaimer::instance();
+	}
+
+}
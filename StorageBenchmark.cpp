@@ -0,0 +1,605 @@
+/**
+  @StorageBenchmark compare I/O strategies for backup/restore storage.
+  Reproduces the fileBackup/fileRestore access patterns (sequential streaming at several
+  block sizes, many small files, concurrent writers) through each strategy:
+    fstream   std::fstream, opened and flushed as FileManager's fstream backend does (current default).
+    io_uring  UringStorage::File, the engine behind FileManager's io_uring backend.
+    pwrite    raw pwrite/pread on a file descriptor.
+    mmap      ftruncate + MAP_SHARED mapping, copied block by block.
+    direct    O_DIRECT with aligned buffers. blocks are rounded up to DIRECT_ALIGNMENT.
+    aes-gcm   AtRestCipher::File (encryption at rest) with AES-256-GCM, over pwrite/pread.
+    chacha    the same with ChaCha20-Poly1305. compare both with pwrite for the cipher overhead.
+  Written files are synced before close (like a durable backup) unless --no-sync is given,
+  and dropped from the page cache before the read phase, so reads come from the device.
+  CPU per byte is user + system time of this process (io_uring kernel workers excluded).
+  usage: StorageBenchmark <scratch dir> [--size=MB] [--blocks=1K,4K,64K,1M] [--threads=N]
+                          [--small=COUNT] [--small-size=KB] [--strategies=fstream,io_uring,pwrite,mmap,direct,aes-gcm,chacha] [--no-sync]
+  build: g++ -std=c++20 -O2 -I. StorageBenchmark.cpp -o StorageBenchmark -lpthread -lcrypto [-luring]
+ */
+
+#include "AtRestCipher.h"
+#include "ProtocolCodec.h"
+#include "UringStorage.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#define HAVE_POSIX_IO 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define HAVE_POSIX_IO 0
+#endif
+
+#define DIRECT_ALIGNMENT  4096   // O_DIRECT buffer, offset and length alignment.
+
+namespace {
+
+	enum EStrategy { FSTREAM, URING, PWRITE, MMAP, DIRECT, SEALED_GCM, SEALED_CHACHA, STRATEGIES };
+	const char* strategyNames[STRATEGIES] = { "fstream", "io_uring", "pwrite", "mmap", "direct", "aes-gcm", "chacha" };
+
+	struct Options
+	{
+		std::string folder;
+		uint32_t fileSize = 256 * 1024 * 1024;
+		std::vector<uint32_t> blocks{ PACKET_SIZE, 4096, 64 * 1024, 1024 * 1024 };
+		uint32_t threads = std::thread::hardware_concurrency();
+		uint32_t smallFiles = 2000;
+		uint32_t smallSize = 4096;
+		bool strategies[STRATEGIES] = { true, true, true, true, true, true, true };
+		bool sync = true;
+	};
+
+	/**
+	   One access pattern: every thread writes `files` files of `fileSize` bytes in `block` pieces,
+	   then reads them back the same way.
+	 */
+	struct Pattern
+	{
+		std::string name;
+		uint32_t threads;
+		uint32_t files;
+		uint32_t fileSize;
+		uint32_t block;
+	};
+
+	struct Result
+	{
+		bool ok = false;
+		double seconds = 0;
+		double cpuSeconds = 0;
+		uint64_t bytes = 0;
+		uint64_t ops = 0;      // write/read calls. block sized copies for mmap.
+	};
+
+	double cpuSeconds()
+	{
+#if HAVE_POSIX_IO
+		rusage usage{};
+		(void)getrusage(RUSAGE_SELF, &usage);
+		return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) + static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#else
+		return 0;
+#endif
+	}
+
+	uint32_t parseSize(const std::string& text)
+	{
+		double value = atof(text.c_str());
+		switch (text.empty() ? ' ' : text.back())
+		{
+		case 'K': case 'k': value *= 1024; break;
+		case 'M': case 'm': value *= 1024 * 1024; break;
+		case 'G': case 'g': value *= 1024.0 * 1024 * 1024; break;
+		default: break;
+		}
+		return (value >= UINT32_MAX) ? UINT32_MAX : static_cast<uint32_t>(value);
+	}
+
+	uint32_t alignUp(const uint32_t value, const uint32_t alignment)
+	{
+		return (value + alignment - 1) / alignment * alignment;
+	}
+
+	// std::fstream, as FileManager's fstream backend: binary streams, a sync is a flush.
+
+	bool fstreamWrite(const std::string& path, const Pattern& pattern, const uint8_t* data, const bool sync, uint64_t& ops)
+	{
+		std::fstream file(path, std::fstream::binary | std::fstream::out);
+		if (!file.is_open())
+			return false;
+		for (uint32_t bytes = 0; bytes < pattern.fileSize; bytes += pattern.block)
+		{
+			const uint32_t length = (pattern.fileSize - bytes < pattern.block) ? (pattern.fileSize - bytes) : pattern.block;
+			file.write(reinterpret_cast<const char*>(data), length);
+			++ops;
+		}
+		if (sync)
+			file.flush();
+		file.close();
+		return !file.fail();
+	}
+
+	bool fstreamRead(const std::string& path, const Pattern& pattern, uint8_t* data, uint64_t& ops)
+	{
+		std::fstream file(path, std::fstream::binary | std::fstream::in);
+		if (!file.is_open())
+			return false;
+		file.seekg(0, std::fstream::end);
+		const auto size = static_cast<uint64_t>(file.tellg());
+		file.seekg(0);
+		for (uint64_t bytes = 0; bytes < size; bytes += pattern.block)
+		{
+			file.read(reinterpret_cast<char*>(data), pattern.block);
+			++ops;
+		}
+		return !file.bad();
+	}
+
+	// UringStorage, as FileManager's io_uring backend.
+
+	bool uringWrite(const std::string& path, const Pattern& pattern, const uint8_t* data, const bool sync, uint64_t& ops)
+	{
+		UringStorage::File file;
+		if (!UringStorage::open(path, file, true))
+			return false;
+		bool ok = true;
+		for (uint32_t bytes = 0; ok && bytes < pattern.fileSize; bytes += pattern.block)
+		{
+			const uint32_t length = (pattern.fileSize - bytes < pattern.block) ? (pattern.fileSize - bytes) : pattern.block;
+			ok = UringStorage::write(file, data, length);
+			++ops;
+		}
+		ok = ok && (!sync || UringStorage::sync(file));
+		return UringStorage::close(file) && ok;
+	}
+
+	bool uringRead(const std::string& path, const Pattern& pattern, uint8_t* data, uint64_t& ops)
+	{
+		UringStorage::File file;
+		if (!UringStorage::open(path, file, false))
+			return false;
+		const uint64_t size = UringStorage::Engine::instance().size(file.file);
+		bool ok = true;
+		for (uint64_t bytes = 0; ok && bytes < size; bytes += pattern.block)
+		{
+			ok = UringStorage::read(file, data, pattern.block);
+			++ops;
+		}
+		return UringStorage::close(file) && ok;
+	}
+
+#if HAVE_POSIX_IO
+	// pwrite / pread.
+
+	bool posixWrite(const std::string& path, const Pattern& pattern, const uint8_t* data, const bool sync, uint64_t& ops)
+	{
+		const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return false;
+		bool ok = true;
+		for (uint32_t bytes = 0; ok && bytes < pattern.fileSize; bytes += pattern.block)
+		{
+			const uint32_t length = (pattern.fileSize - bytes < pattern.block) ? (pattern.fileSize - bytes) : pattern.block;
+			ok = (::pwrite(fd, data, length, bytes) == static_cast<ssize_t>(length));
+			++ops;
+		}
+		if (ok && sync)
+			ok = (::fsync(fd) == 0);
+		return (::close(fd) == 0) && ok;
+	}
+
+	bool posixRead(const std::string& path, const Pattern& pattern, uint8_t* data, uint64_t& ops)
+	{
+		const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+		bool ok = true;
+		for (uint64_t offset = 0; ok; offset += pattern.block)
+		{
+			const ssize_t got = ::pread(fd, data, pattern.block, static_cast<off_t>(offset));
+			ok = (got >= 0);
+			++ops;
+			if (got < static_cast<ssize_t>(pattern.block))
+				break;   // EOF.
+		}
+		return (::close(fd) == 0) && ok;
+	}
+
+	// mmap.
+
+	bool mmapWrite(const std::string& path, const Pattern& pattern, const uint8_t* data, const bool sync, uint64_t& ops)
+	{
+		const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return false;
+		if (pattern.fileSize == 0)
+			return ::close(fd) == 0;
+		if (::ftruncate(fd, pattern.fileSize) != 0)
+		{
+			(void)::close(fd);
+			return false;
+		}
+		void* map = ::mmap(nullptr, pattern.fileSize, PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+		{
+			(void)::close(fd);
+			return false;
+		}
+		auto* dst = static_cast<uint8_t*>(map);
+		for (uint32_t bytes = 0; bytes < pattern.fileSize; bytes += pattern.block)
+		{
+			const uint32_t length = (pattern.fileSize - bytes < pattern.block) ? (pattern.fileSize - bytes) : pattern.block;
+			memcpy(dst + bytes, data, length);
+			++ops;
+		}
+		bool ok = true;
+		if (sync)
+			ok = (::msync(map, pattern.fileSize, MS_SYNC) == 0);
+		(void)::munmap(map, pattern.fileSize);
+		return (::close(fd) == 0) && ok;
+	}
+
+	bool mmapRead(const std::string& path, const Pattern& pattern, uint8_t* data, uint64_t& ops)
+	{
+		const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		if (::fstat(fd, &st) != 0)
+		{
+			(void)::close(fd);
+			return false;
+		}
+		const auto size = static_cast<size_t>(st.st_size);
+		if (size == 0)
+			return ::close(fd) == 0;
+		void* map = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+		{
+			(void)::close(fd);
+			return false;
+		}
+		(void)::madvise(map, size, MADV_SEQUENTIAL);
+		const auto* src = static_cast<const uint8_t*>(map);
+		for (size_t bytes = 0; bytes < size; bytes += pattern.block)
+		{
+			const size_t length = (size - bytes < pattern.block) ? (size - bytes) : pattern.block;
+			memcpy(data, src + bytes, length);
+			++ops;
+		}
+		(void)::munmap(map, size);
+		return ::close(fd) == 0;
+	}
+
+	// O_DIRECT. the tail is written as a padded block and the file truncated to its size.
+
+	bool directWrite(const std::string& path, const Pattern& pattern, const uint8_t* data, const bool sync, uint64_t& ops)
+	{
+		const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+		if (fd < 0)
+			return false;   // e.g. tmpfs does not support O_DIRECT.
+		const uint32_t block = alignUp(pattern.block, DIRECT_ALIGNMENT);
+		bool ok = true;
+		for (uint32_t bytes = 0; ok && bytes < pattern.fileSize; bytes += block)
+		{
+			ok = (::pwrite(fd, data, block, bytes) == static_cast<ssize_t>(block));
+			++ops;
+		}
+		if (ok)
+			ok = (::ftruncate(fd, pattern.fileSize) == 0);
+		if (ok && sync)
+			ok = (::fdatasync(fd) == 0);
+		return (::close(fd) == 0) && ok;
+	}
+
+	bool directRead(const std::string& path, const Pattern& pattern, uint8_t* data, uint64_t& ops)
+	{
+		const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+		if (fd < 0)
+			return false;
+		const uint32_t block = alignUp(pattern.block, DIRECT_ALIGNMENT);
+		bool ok = true;
+		for (uint64_t offset = 0; ok; offset += block)
+		{
+			const ssize_t got = ::pread(fd, data, block, static_cast<off_t>(offset));
+			ok = (got >= 0);
+			++ops;
+			if (got < static_cast<ssize_t>(block))
+				break;
+		}
+		return (::close(fd) == 0) && ok;
+	}
+
+#if HAVE_AT_REST_CIPHER
+	// AtRestCipher: chunks sealed with the benchmark key, written with pwrite.
+
+	bool sealedWrite(const std::string& path, const Pattern& pattern, const uint8_t* data, const uint8_t cipher, const bool sync, uint64_t& ops)
+	{
+		AtRestCipher::File file;
+		if (!file.create(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644), 1, cipher))
+			return false;
+		bool ok = true;
+		for (uint32_t bytes = 0; ok && bytes < pattern.fileSize; bytes += pattern.block)
+		{
+			const uint32_t length = (pattern.fileSize - bytes < pattern.block) ? (pattern.fileSize - bytes) : pattern.block;
+			ok = file.write(data, length);
+			++ops;
+		}
+		if (!file.close() || !ok)   // seals the last chunk.
+			return false;
+		if (!sync)
+			return true;
+		const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		ok = (fd >= 0) && (::fdatasync(fd) == 0);
+		return (fd < 0 || ::close(fd) == 0) && ok;
+	}
+
+	bool sealedRead(const std::string& path, const Pattern& pattern, uint8_t* data, uint64_t& ops)
+	{
+		AtRestCipher::File file;
+		if (!file.open(::open(path.c_str(), O_RDONLY | O_CLOEXEC), 1))
+			return false;
+		bool ok = true;
+		for (uint64_t offset = 0; ok && offset < file.size(); offset += pattern.block)
+		{
+			ok = file.read(data, pattern.block);
+			++ops;
+		}
+		return file.close() && ok;
+	}
+#endif
+
+	/**
+	   @brief flush a file and drop its pages so the read phase hits the device.
+	 */
+	void evict(const std::string& path)
+	{
+		const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return;
+		(void)::fdatasync(fd);
+		(void)::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		(void)::close(fd);
+	}
+#else
+	void evict(const std::string&) {}
+#endif
+
+	std::string pathOf(const Options& options, const EStrategy strategy, const uint32_t thread, const uint32_t file)
+	{
+		return options.folder + "/" + strategyNames[strategy] + "_" + std::to_string(thread) + "_" + std::to_string(file);
+	}
+
+	bool writeFile(const EStrategy strategy, const std::string& path, const Pattern& pattern, const uint8_t* data, const bool sync, uint64_t& ops)
+	{
+		switch (strategy)
+		{
+#if HAVE_POSIX_IO
+		case PWRITE: return posixWrite(path, pattern, data, sync, ops);
+		case MMAP: return mmapWrite(path, pattern, data, sync, ops);
+		case DIRECT: return directWrite(path, pattern, data, sync, ops);
+#endif
+#if HAVE_AT_REST_CIPHER
+		case SEALED_GCM: return sealedWrite(path, pattern, data, AtRestCipher::AES_256_GCM, sync, ops);
+		case SEALED_CHACHA: return sealedWrite(path, pattern, data, AtRestCipher::CHACHA20_POLY1305, sync, ops);
+#endif
+		case FSTREAM: return fstreamWrite(path, pattern, data, sync, ops);
+		case URING: return uringWrite(path, pattern, data, sync, ops);
+		default: return false;
+		}
+	}
+
+	bool readFile(const EStrategy strategy, const std::string& path, const Pattern& pattern, uint8_t* data, uint64_t& ops)
+	{
+		switch (strategy)
+		{
+#if HAVE_POSIX_IO
+		case PWRITE: return posixRead(path, pattern, data, ops);
+		case MMAP: return mmapRead(path, pattern, data, ops);
+		case DIRECT: return directRead(path, pattern, data, ops);
+#endif
+#if HAVE_AT_REST_CIPHER
+		case SEALED_GCM:
+		case SEALED_CHACHA: return sealedRead(path, pattern, data, ops);
+#endif
+		case FSTREAM: return fstreamRead(path, pattern, data, ops);
+		case URING: return uringRead(path, pattern, data, ops);
+		default: return false;
+		}
+	}
+
+	/**
+	   @brief run one phase of a pattern on every thread.
+	 */
+	Result runPhase(const Options& options, const Pattern& pattern, const EStrategy strategy, const bool write)
+	{
+		std::vector<std::thread> workers;
+		std::vector<int> ok(pattern.threads, 1);
+		std::vector<uint64_t> ops(pattern.threads, 0);
+		Result result;
+		const double cpuStart = cpuSeconds();
+		const auto start = std::chrono::steady_clock::now();
+		for (uint32_t t = 0; t < pattern.threads; ++t)
+		{
+			workers.emplace_back([&, t]()
+			{
+				// aligned for O_DIRECT, large enough for a rounded up block.
+				const size_t length = alignUp(pattern.block, DIRECT_ALIGNMENT);
+				auto* data = static_cast<uint8_t*>(::operator new(length, std::align_val_t(DIRECT_ALIGNMENT)));
+				memset(data, 'x', length);
+				for (uint32_t i = 0; i < pattern.files && ok[t]; ++i)
+				{
+					const std::string path = pathOf(options, strategy, t, i);
+					if (!(write ? writeFile(strategy, path, pattern, data, options.sync, ops[t]) : readFile(strategy, path, pattern, data, ops[t])))
+						ok[t] = 0;
+				}
+				::operator delete(data, std::align_val_t(DIRECT_ALIGNMENT));
+			});
+		}
+		for (auto& worker : workers)
+			worker.join();
+		result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		result.cpuSeconds = cpuSeconds() - cpuStart;
+		result.bytes = static_cast<uint64_t>(pattern.fileSize) * pattern.files * pattern.threads;
+		result.ok = true;
+		for (uint32_t t = 0; t < pattern.threads; ++t)
+		{
+			result.ok = result.ok && (ok[t] != 0);
+			result.ops += ops[t];
+		}
+		return result;
+	}
+
+	void printRow(const Pattern& pattern, const EStrategy strategy, const char* phase, const Result& result)
+	{
+		if (!result.ok)
+		{
+			printf("%-18s %-9s %-6s %12s\n", pattern.name.c_str(), strategyNames[strategy], phase, "failed");
+			return;
+		}
+		const double seconds = (result.seconds > 0) ? result.seconds : 1e-9;
+		printf("%-18s %-9s %-6s %12.1f %12.0f %12.3f\n", pattern.name.c_str(), strategyNames[strategy], phase,
+			static_cast<double>(result.bytes) / (1024.0 * 1024.0) / seconds,
+			static_cast<double>(result.ops) / seconds,
+			(result.bytes == 0) ? 0.0 : result.cpuSeconds * 1e9 / static_cast<double>(result.bytes));
+	}
+
+	void runPattern(const Options& options, const Pattern& pattern, const EStrategy strategy)
+	{
+		if (strategy == URING && !UringStorage::Engine::instance().available())
+		{
+			printf("%-18s %-9s %-6s %12s\n", pattern.name.c_str(), strategyNames[strategy], "", "unavailable (not compiled in or io_uring_setup failed)");
+			return;
+		}
+		const Result written = runPhase(options, pattern, strategy, true);
+		printRow(pattern, strategy, "write", written);
+		if (written.ok)
+		{
+			for (uint32_t t = 0; t < pattern.threads; ++t)
+			{
+				for (uint32_t i = 0; i < pattern.files; ++i)
+					evict(pathOf(options, strategy, t, i));
+			}
+			printRow(pattern, strategy, "read", runPhase(options, pattern, strategy, false));
+		}
+		std::error_code error;
+		for (uint32_t t = 0; t < pattern.threads; ++t)
+		{
+			for (uint32_t i = 0; i < pattern.files; ++i)
+				(void)std::filesystem::remove(pathOf(options, strategy, t, i), error);
+		}
+	}
+
+	bool parseOptions(int argc, char* argv[], Options& options)
+	{
+		if (argc < 2 || argv[1][0] == '-')
+			return false;
+		options.folder = argv[1];
+		for (int i = 2; i < argc; ++i)
+		{
+			const std::string arg(argv[i]);
+			const size_t eq = arg.find('=');
+			const std::string key = arg.substr(0, eq);
+			const std::string value = (eq == std::string::npos) ? "" : arg.substr(eq + 1);
+			std::stringstream list(value);
+			std::string item;
+			if (key == "--size")
+				options.fileSize = parseSize(value + "M");
+			else if (key == "--threads")
+				options.threads = static_cast<uint32_t>(atoi(value.c_str()));
+			else if (key == "--small")
+				options.smallFiles = static_cast<uint32_t>(atoi(value.c_str()));
+			else if (key == "--small-size")
+				options.smallSize = parseSize(value + "K");
+			else if (key == "--no-sync")
+				options.sync = false;
+			else if (key == "--blocks")
+			{
+				options.blocks.clear();
+				while (std::getline(list, item, ','))
+				{
+					if (parseSize(item) > 0)
+						options.blocks.push_back(parseSize(item));
+				}
+			}
+			else if (key == "--strategies")
+			{
+				for (bool& enabled : options.strategies)
+					enabled = false;
+				while (std::getline(list, item, ','))
+				{
+					for (int s = 0; s < STRATEGIES; ++s)
+					{
+						if (item == strategyNames[s])
+							options.strategies[s] = true;
+					}
+				}
+			}
+			else
+				return false;
+		}
+		if (options.threads == 0)
+			options.threads = 1;
+		return !options.blocks.empty();
+	}
+
+	std::string sizeName(const uint32_t bytes)
+	{
+		if (bytes >= 1024 * 1024 && bytes % (1024 * 1024) == 0)
+			return std::to_string(bytes / (1024 * 1024)) + "M";
+		if (bytes >= 1024 && bytes % 1024 == 0)
+			return std::to_string(bytes / 1024) + "K";
+		return std::to_string(bytes);
+	}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	if (!parseOptions(argc, argv, options))
+	{
+		printf("usage: %s <scratch dir> [--size=MB] [--blocks=1K,4K,64K,1M] [--threads=N] [--small=COUNT] [--small-size=KB]\n"
+			"          [--strategies=fstream,io_uring,pwrite,mmap,direct,aes-gcm,chacha] [--no-sync]\n", argv[0]);
+		return 1;
+	}
+#if HAVE_AT_REST_CIPHER
+	AtRestCipher::Key key(AT_REST_KEY);
+	if (RAND_bytes(key.data(), static_cast<int>(key.size())) != 1 || !AtRestCipher::Keys::instance().setMasterKey(key))
+	{
+		options.strategies[SEALED_GCM] = false;
+		options.strategies[SEALED_CHACHA] = false;
+	}
+#endif
+
+	std::vector<Pattern> patterns;
+	for (const uint32_t block : options.blocks)
+		patterns.push_back({ "stream/" + sizeName(block), 1, 1, options.fileSize, block });
+	patterns.push_back({ "small/" + sizeName(options.smallSize), 1, options.smallFiles, options.smallSize, PACKET_SIZE });
+	patterns.push_back({ "concurrent/" + std::to_string(options.threads) + "x", options.threads, 1, options.fileSize / options.threads, PACKET_SIZE });
+
+	printf("scratch %s, stream file %s, %u small files of %s, %u concurrent writers, %s\n\n", options.folder.c_str(), sizeName(options.fileSize).c_str(),
+		options.smallFiles, sizeName(options.smallSize).c_str(), options.threads, options.sync ? "synced" : "not synced");
+	printf("%-18s %-9s %-6s %12s %12s %12s\n", "pattern", "strategy", "phase", "MB/s", "IOPS", "CPU ns/B");
+	for (const Pattern& pattern : patterns)
+	{
+		for (int s = 0; s < STRATEGIES; ++s)
+		{
+			if (options.strategies[s])
+				runPattern(options, pattern, static_cast<EStrategy>(s));
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,44 @@
+/**
+  @StorageEvents the bookkeeping that follows every committed change to a user's files.
+  Whatever stored or removed the file (a backup on either request path, a precheck link, a
+  bulk remove), the same followers are told, in the same order: the replication log, the
+  metadata index and the quota counters. Sites call onCommitted() once the new content is
+  stored and versioned, and onRemoved() once the file is gone; neither is called for a
+  change that failed. The user lock is held.
+ */
+
+#pragma once
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include "DirectoryCache.h"
+#include "MetadataSnapshot.h"
+#include "QuotaManager.h"
+#include "ReplicationLog.h"
+
+namespace StorageEvents {
+
+	/**
+	   @brief a file was stored under `name`.
+	   @param prior what the name held before, from QuotaManager::Ledger::prior() taken ahead of the write.
+	   @param size content size, as the client sent it.
+	 */
+	inline void onCommitted(const DirectoryCache::Directory& dir, const std::string& name, const QuotaManager::Prior& prior, const uint64_t size, std::stringstream& err)
+	{
+		(void)ReplicationLog::instance().append(ReplicationLog::BACKUP, dir.userID, name, err);   // the mirror catches up asynchronously.
+		MetadataSnapshot::instance().backedUp(dir.userID, name, size);
+		QuotaManager::instance().stored(dir, name, prior, size);
+	}
+
+	/**
+	   @brief the file `name` was removed, or lost to a backup that failed after truncating it.
+	   @param prior what the name held, taken before the remove.
+	 */
+	inline void onRemoved(const DirectoryCache::Directory& dir, const std::string& name, const QuotaManager::Prior& prior, std::stringstream& err)
+	{
+		(void)ReplicationLog::instance().append(ReplicationLog::REMOVE, dir.userID, name, err);
+		MetadataSnapshot::instance().removed(dir.userID, name);
+		QuotaManager::instance().removed(dir, name, prior);
+	}
+
+}
@@ -0,0 +1,517 @@
+/**
+  @StorageRoots place users on one of several storage roots (one root per data disk).
+  Users are mapped to roots with a consistent hash ring, so adding a root only moves
+  the users that now hash to it. Every root owns an I/O worker pool with its own queue,
+  so a saturated disk only delays the requests whose users live on it.
+  Roots are read from BACKUPSVR_ROOTS, separated by ';'. Defaults to BACKUP_FOLDER.
+ */
+
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "SmallFileStore.h"
+
+#define BACKUP_FOLDER  "c:/backupsvr/"
+#define STORAGE_ROOTS_ENV  "BACKUPSVR_ROOTS"
+#define STORAGE_IO_THREADS_ENV  "BACKUPSVR_IO_THREADS"
+#define STORAGE_IO_THREADS  4       // default I/O workers per root.
+#define STORAGE_VIRTUAL_NODES  128  // points per root on the hash ring.
+
+namespace StorageRoots {
+
+	/**
+	   @brief 64 bit FNV-1a, finalized with a splitmix64 step for a better spread on the ring.
+	 */
+	inline uint64_t hash(const void* data, const size_t length)
+	{
+		const auto bytes = static_cast<const uint8_t*>(data);
+		uint64_t h = 14695981039346656037ULL;
+		for (size_t i = 0; i < length; ++i)
+		{
+			h ^= bytes[i];
+			h *= 1099511628211ULL;
+		}
+		h ^= h >> 30;
+		h *= 0xbf58476d1ce4e5b9ULL;
+		h ^= h >> 27;
+		h *= 0x94d049bb133111ebULL;
+		h ^= h >> 31;
+		return h;
+	}
+
+
+	/**
+	   Fixed set of worker threads draining one FIFO queue. One pool per storage root.
+	 */
+	class IoPool
+	{
+	public:
+		explicit IoPool(const size_t threads) : _stopping(false), _busy(0)
+		{
+			for (size_t i = 0; i < (threads == 0 ? 1 : threads); ++i)
+				_workers.emplace_back(&IoPool::work, this);
+		}
+
+		~IoPool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stopping = true;
+			}
+			_wake.notify_all();
+			for (auto& worker : _workers)
+				worker.join();
+		}
+
+		IoPool(const IoPool&) = delete;
+		IoPool& operator=(const IoPool&) = delete;
+
+		void post(std::function<void()> task)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_queue.push_back(std::move(task));
+			}
+			_wake.notify_one();
+		}
+
+		size_t queued()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _queue.size();
+		}
+
+		size_t busy()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _busy;
+		}
+
+		size_t threads() const { return _workers.size(); }
+
+	private:
+		void work()
+		{
+			while (true)
+			{
+				std::function<void()> task;
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					_wake.wait(lock, [this] { return !_queue.empty() || _stopping; });
+					if (_queue.empty())
+						return;
+					task = std::move(_queue.front());
+					_queue.pop_front();
+					++_busy;
+				}
+				task();
+				std::lock_guard<std::mutex> lock(_mutex);
+				--_busy;
+			}
+		}
+
+		bool _stopping;
+		size_t _busy;
+		std::mutex _mutex;
+		std::condition_variable _wake;
+		std::deque<std::function<void()>> _queue;
+		std::vector<std::thread> _workers;
+	};
+
+
+	struct Root
+	{
+		std::string path;                 // always ends with '/'.
+		std::unique_ptr<IoPool> pool;
+	};
+
+
+	class Manager
+	{
+	public:
+		static Manager& instance()
+		{
+			static Manager manager;
+			return manager;
+		}
+
+		/**
+		   @brief the root index a user is placed on by the hash ring.
+		 */
+		size_t placement(const uint32_t userID)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return locate(userID);
+		}
+
+		/**
+		   @brief the user's folder, e.g. "<root>/<userID>/". While a user is migrated to
+		          another root, the old folder is returned until the move completes.
+		 */
+		std::string userFolder(const uint32_t userID)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return folderOf(userID);
+		}
+
+		IoPool& poolFor(const uint32_t userID)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return *_roots[rootOf(userID)]->pool;
+		}
+
+		/**
+		   @brief mark a user as in use by a request. blocks while the user is being migrated
+		          or held by tryExclusive().
+		   @return the user's folder.
+		 */
+		std::string acquire(const uint32_t userID)
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_changed.wait(lock, [this, userID] { return _migrating.count(userID) == 0 && _exclusive.count(userID) == 0; });
+			++_inUse[userID];
+			return folderOf(userID);
+		}
+
+		/**
+		   @brief acquire() without waiting, for callers that must not block (coroutines).
+		   @param folder set to the user's folder on success.
+		   @return false while the user is being migrated or held by tryExclusive().
+		 */
+		bool tryAcquire(const uint32_t userID, std::string& folder)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (_migrating.count(userID) != 0 || _exclusive.count(userID) != 0)
+				return false;
+			++_inUse[userID];
+			folder = folderOf(userID);
+			return true;
+		}
+
+		/**
+		   @return whether a request of the user is in flight, or the user is being migrated or held.
+		 */
+		bool busy(const uint32_t userID)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _inUse.count(userID) != 0 || _migrating.count(userID) != 0 || _exclusive.count(userID) != 0;
+		}
+
+		void release(const uint32_t userID)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				auto it = _inUse.find(userID);
+				if (it != _inUse.end() && --(it->second) == 0)
+					_inUse.erase(it);
+			}
+			_changed.notify_all();
+		}
+
+		/**
+		   @brief run `work` on the user's folder while no request of the user is in flight,
+		          blocking new ones meanwhile. does not wait: a busy user is left alone.
+		   @return false if the user was in use or being migrated, and `work` did not run.
+		 */
+		bool tryExclusive(const uint32_t userID, const std::function<void(const std::string&)>& work)
+		{
+			std::string folder;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				if (_inUse.count(userID) != 0 || _migrating.count(userID) != 0 || _exclusive.count(userID) != 0)
+					return false;
+				_exclusive.insert(userID);
+				folder = folderOf(userID);
+			}
+			work(folder);
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_exclusive.erase(userID);
+			}
+			_changed.notify_all();
+			return true;
+		}
+
+		/**
+		   @brief add a storage root and move the users that now hash to it, in the background.
+		   @return false if the root is already configured or cannot be created.
+		 */
+		bool addRoot(const std::string& path)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				const std::string normalized = normalize(path);
+				for (const auto& root : _roots)
+				{
+					if (root->path == normalized)
+						return false;
+				}
+				try
+				{
+					(void)std::filesystem::create_directories(normalized);
+				}
+				catch (std::exception&)
+				{
+					return false;
+				}
+				insertRoot(normalized);
+			}
+			rebalance();
+			return true;
+		}
+
+		/**
+		   @brief find users stored on a root other than their placement and queue their migration
+		          on the mover thread. the root pools are left to requests: a migration waits for
+		          the user's in-flight requests, which may need those workers to finish.
+		   @return number of users queued for migration.
+		 */
+		size_t rebalance()
+		{
+			std::vector<std::string> paths;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				for (const auto& root : _roots)
+					paths.push_back(root->path);
+			}
+			std::vector<std::pair<uint32_t, size_t>> found;  // (user, root holding a folder). walked without the lock.
+			for (size_t r = 0; r < paths.size(); ++r)
+			{
+				try
+				{
+					if (!std::filesystem::exists(paths[r]))
+						continue;
+					for (const auto& entry : std::filesystem::directory_iterator(paths[r]))
+					{
+						if (!entry.is_directory())
+							continue;
+						const std::string name = entry.path().filename().string();
+						char* end = nullptr;
+						const unsigned long id = strtoul(name.c_str(), &end, 10);
+						if (end == name.c_str() || *end != '\0' || id == 0 || id > UINT32_MAX)
+							continue;
+						found.emplace_back(static_cast<uint32_t>(id), r);
+					}
+				}
+				catch (std::exception&)
+				{
+					continue;
+				}
+			}
+			std::vector<uint32_t> moves;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				for (const auto& user : found)
+				{
+					const uint32_t userID = user.first;
+					if (locate(userID) == user.second || _queued.count(userID) != 0)
+						continue;
+					_location[userID] = user.second;
+					_queued.insert(userID);
+					moves.push_back(userID);
+				}
+			}
+			for (const uint32_t userID : moves)
+				_mover->post([this, userID] { migrate(userID); });
+			return moves.size();
+		}
+
+		size_t rootsCount()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _roots.size();
+		}
+
+		std::string rootPath(const size_t index)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return (index < _roots.size()) ? _roots[index]->path : std::string();
+		}
+
+		IoPool& rootPool(const size_t index)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return *_roots[index]->pool;
+		}
+
+		Manager(const Manager&) = delete;
+		Manager& operator=(const Manager&) = delete;
+
+	private:
+		Manager() : _mover(std::make_unique<IoPool>(1))
+		{
+			const char* threadsEnv = getenv(STORAGE_IO_THREADS_ENV);
+			_threadsPerRoot = (threadsEnv != nullptr && atoi(threadsEnv) > 0) ? static_cast<size_t>(atoi(threadsEnv)) : STORAGE_IO_THREADS;
+			const char* rootsEnv = getenv(STORAGE_ROOTS_ENV);
+			std::stringstream roots(rootsEnv != nullptr ? rootsEnv : "");
+			std::string path;
+			while (std::getline(roots, path, ';'))
+			{
+				if (!path.empty())
+					insertRoot(normalize(path));
+			}
+			if (_roots.empty())
+				insertRoot(BACKUP_FOLDER);
+			rebalance();
+		}
+
+		static std::string normalize(std::string path)
+		{
+			if (!path.empty() && path.back() != '/' && path.back() != '\\')
+				path += '/';
+			return path;
+		}
+
+		void insertRoot(const std::string& path)
+		{
+			auto root = std::make_unique<Root>();
+			root->path = path;
+			root->pool = std::make_unique<IoPool>(_threadsPerRoot);
+			const size_t index = _roots.size();
+			_roots.push_back(std::move(root));
+			for (uint32_t v = 0; v < STORAGE_VIRTUAL_NODES; ++v)
+			{
+				const std::string point = path + "#" + std::to_string(v);
+				_ring[hash(point.data(), point.size())] = index;
+			}
+		}
+
+		// callers hold _mutex.
+		size_t locate(const uint32_t userID) const
+		{
+			auto it = _ring.lower_bound(hash(&userID, sizeof(userID)));
+			if (it == _ring.end())
+				it = _ring.begin();
+			return it->second;
+		}
+
+		// callers hold _mutex. root that currently holds the user's data.
+		size_t rootOf(const uint32_t userID) const
+		{
+			const auto it = _location.find(userID);
+			return (it != _location.end()) ? it->second : locate(userID);
+		}
+
+		// callers hold _mutex.
+		std::string folderOf(const uint32_t userID) const
+		{
+			return _roots[rootOf(userID)]->path + std::to_string(userID) + "/";
+		}
+
+		/**
+		   move one user's folder to its placement. waits for in-flight requests of the user
+		   and blocks new ones until done. runs on the mover thread.
+		 */
+		void migrate(const uint32_t userID)
+		{
+			std::string from;
+			std::string to;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_migrating.insert(userID);
+				_changed.wait(lock, [this, userID] { return _inUse.count(userID) == 0 && _exclusive.count(userID) == 0; });
+				from = folderOf(userID);
+				to = _roots[locate(userID)]->path + std::to_string(userID) + "/";
+			}
+			bool moved = (from == to);   // already on its placement: nothing to move.
+			if (!moved)
+			{
+				try
+				{
+					moveFolder(from, to);
+					moved = true;
+				}
+				catch (std::exception&)
+				{
+					// keep serving from the old root. next rebalance retries.
+				}
+			}
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				if (moved)
+					_location.erase(userID);
+				_migrating.erase(userID);
+				_queued.erase(userID);
+			}
+			_changed.notify_all();
+		}
+
+		// rename when on the same device, copy otherwise. throws on failure.
+		static void moveFolder(const std::string& from, const std::string& to)
+		{
+			namespace fs = std::filesystem;
+			if (!SmallFileStore::instance().release(from))
+				throw std::runtime_error("small files of the user could not be written");
+			if (fs::exists(to))
+			{
+				// destination already has data for this user (e.g. partial move). merge, newest wins.
+				fs::copy(from, to, fs::copy_options::recursive | fs::copy_options::update_existing);
+				fs::remove_all(from);
+			}
+			else
+			{
+				std::error_code ec;
+				fs::rename(from, to, ec);
+				if (ec)  // cross device.
+				{
+					fs::copy(from, to, fs::copy_options::recursive);
+					fs::remove_all(from);
+				}
+			}
+		}
+
+		std::mutex _mutex;
+		std::condition_variable _changed;
+		size_t _threadsPerRoot;
+		std::vector<std::unique_ptr<Root>> _roots;
+		std::map<uint64_t, size_t> _ring;          // hash point -> root index.
+		std::map<uint32_t, size_t> _location;      // users not (yet) on their placement -> root holding them.
+		std::map<uint32_t, int> _inUse;            // user -> in-flight requests.
+		std::set<uint32_t> _migrating;
+		std::set<uint32_t> _exclusive;             // users held by tryExclusive().
+		std::set<uint32_t> _queued;                // users waiting for or under migration.
+		std::unique_ptr<IoPool> _mover;            // runs migrations one at a time. last member: joined first.
+	};
+
+	inline Manager& instance()
+	{
+		return Manager::instance();
+	}
+
+
+	/**
+	   RAII lease on a user's folder for the duration of a request.
+	 */
+	class UserLease
+	{
+	public:
+		explicit UserLease(const uint32_t userID) : _userID(userID), _folder(instance().acquire(userID)) {}
+		/**
+		   @brief take over a lease acquired with Manager::tryAcquire().
+		 */
+		UserLease(const uint32_t userID, std::string folder, std::adopt_lock_t) : _userID(userID), _folder(std::move(folder)) {}
+		~UserLease() { instance().release(_userID); }
+		UserLease(const UserLease&) = delete;
+		UserLease& operator=(const UserLease&) = delete;
+		const std::string& folder() const { return _folder; }
+		IoPool& pool() const { return instance().poolFor(_userID); }
+
+	private:
+		uint32_t _userID;
+		std::string _folder;
+	};
+
+}
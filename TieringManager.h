@@ -0,0 +1,1271 @@
+/**
+  @TieringManager hot/cold tiering of backups.
+  Files that were neither read nor written for BACKUPSVR_COLD_AFTER_S are moved in the
+  background from the user's folder (the hot tier) to a secondary root, BACKUPSVR_COLD_ROOT,
+  packed per user:
+      <cold root>/<userID>/pack.<n>  file contents, appended. deflated (zlib) unless sealed:
+                                     ciphertext does not compress.
+      <cold root>/<userID>/index     "BSVRCOLD", then one record per move or drop, appended:
+                                     uint8 op, uint8 codec, uint16 nameLen, uint32 pack,
+                                     uint64 offset, uint64 stored, uint64 raw, uint64 size,
+                                     uint64 mtime, name. the last record of a name wins.
+  The last access of a file is the later of its mtime and atime. Reads set the atime
+  themselves, so noatime mounts work too. FileManager and MetadataSnapshot look names up here
+  for exists/list/stat/remove, so a cold file still looks like an ordinary one. Opening it
+  for reading promotes it first: it is unpacked into the user's .promoting/ entry, synced, and
+  linked back under its name with its mtime, then dropped from the cold index. Writing a file
+  drops its cold copy.
+  The migrator walks the roots at start and every BACKUPSVR_TIER_SCAN_S. A user with a
+  request in flight is skipped before anything is read. A file is packed and synced without
+  any lock, at no more than BACKUPSVR_TIER_BYTES_PER_S, and waits while its root's I/O pool
+  has requests queued. The move is committed only while no request of the user is in flight
+  (StorageRoots::Manager::tryExclusive): the file is checked unchanged and still cold, its
+  record is appended and synced, and the hot file is freed in the background
+  (SpaceReclaimer). A busy user is retried at the next scan; a move that is given up is cut
+  from the pack again.
+  A pack is deleted once all its entries are gone. A pack whose entries fill less than
+  TIER_PACK_COMPACT_PERCENT of it has them copied to the current pack, at the migration rate,
+  and is deleted then. The index is rewritten once dead records are most of it. At most
+  TIER_CONTAINERS idle users' indexes stay loaded, least recently used first out.
+  Tiering is off while versioning is on: the newest version of a file keeps its content on
+  the hot tier, so moving the file would free nothing. Small files (.smallfiles/) stay on the
+  hot tier.
+  Configuration: BACKUPSVR_COLD_ROOT (no tiering without it), BACKUPSVR_COLD_AFTER_S,
+                 BACKUPSVR_COLD_MIN_SIZE, BACKUPSVR_TIER_SCAN_S, BACKUPSVR_TIER_BYTES_PER_S.
+ */
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "AtRestCipher.h"
+#include "DirectoryCache.h"
+#include "Scheduler.h"
+#include "SpaceReclaimer.h"
+#include "StorageRoots.h"
+#include "VersionStore.h"
+
+#if defined(__has_include)
+#if __has_include(<zlib.h>)
+#include <zlib.h>
+#define HAVE_ZLIB 1
+#endif
+#endif
+#ifndef HAVE_ZLIB
+#define HAVE_ZLIB 0
+#endif
+
+#define TIER_COLD_AFTER_S  (7 * 24 * 3600)
+#define TIER_COLD_MIN_SIZE  (64 * 1024)         // smaller files stay hot: not worth a pack entry.
+#define TIER_SCAN_S  3600
+#define TIER_BYTES_PER_S  (32ull * 1024 * 1024)
+#define TIER_PACK_MAX  (1024ull * 1024 * 1024)  // pack size before the next one is started.
+#define TIER_CHUNK  (1024 * 1024)
+#define TIER_ZLIB_LEVEL  6
+#define TIER_YIELD_MS  20                       // migrator wait while foreground requests are queued.
+#define TIER_RECORD  48                         // index record without the name.
+#define TIER_INDEX_HEADER  8
+#define TIER_INDEX_COMPACT_MIN  4096            // index records before dead ones are dropped.
+#define TIER_PACK_COMPACT_PERCENT  25           // packs less full of live entries are rewritten.
+#define TIER_CONTAINERS  4096                   // idle users' indexes kept loaded.
+#define COLD_ROOT_ENV  "BACKUPSVR_COLD_ROOT"
+#define COLD_AFTER_ENV  "BACKUPSVR_COLD_AFTER_S"
+#define COLD_MIN_SIZE_ENV  "BACKUPSVR_COLD_MIN_SIZE"
+#define TIER_SCAN_ENV  "BACKUPSVR_TIER_SCAN_S"
+#define TIER_BYTES_PER_S_ENV  "BACKUPSVR_TIER_BYTES_PER_S"
+
+namespace TieringManager {
+
+	struct Config
+	{
+		std::string coldRoot;   // ends with '/'. empty: tiering is off.
+		std::chrono::seconds coldAfter{ TIER_COLD_AFTER_S };
+		uint64_t minSize = TIER_COLD_MIN_SIZE;
+		std::chrono::seconds scanInterval{ TIER_SCAN_S };
+		uint64_t bytesPerSecond = TIER_BYTES_PER_S;
+	};
+
+	inline const Config& config()
+	{
+		static const Config configured = []()
+		{
+			Config c;
+			const char* root = getenv(COLD_ROOT_ENV);
+			const char* after = getenv(COLD_AFTER_ENV);
+			const char* minSize = getenv(COLD_MIN_SIZE_ENV);
+			const char* scan = getenv(TIER_SCAN_ENV);
+			const char* bytes = getenv(TIER_BYTES_PER_S_ENV);
+			if (root != nullptr && root[0] != '\0')
+			{
+				c.coldRoot = root;
+				if (c.coldRoot.back() != '/' && c.coldRoot.back() != '\\')
+					c.coldRoot += '/';
+			}
+			if (after != nullptr && atoll(after) >= 0)
+				c.coldAfter = std::chrono::seconds(atoll(after));
+			if (minSize != nullptr && atoll(minSize) >= 0)
+				c.minSize = static_cast<uint64_t>(atoll(minSize));
+			if (scan != nullptr && atoll(scan) > 0)
+				c.scanInterval = std::chrono::seconds(atoll(scan));
+			if (bytes != nullptr && atoll(bytes) > 0)
+				c.bytesPerSecond = static_cast<uint64_t>(atoll(bytes));
+			return c;
+		}();
+		return configured;
+	}
+
+	struct Stats
+	{
+		std::atomic<uint64_t> migratedFiles{ 0 };   // moved to the cold tier.
+		std::atomic<uint64_t> migratedBytes{ 0 };   // their size on the hot tier.
+		std::atomic<uint64_t> packedBytes{ 0 };     // what they take in packs.
+		std::atomic<uint64_t> promotedFiles{ 0 };   // restored to the hot tier on access.
+		std::atomic<uint64_t> promotedBytes{ 0 };
+		std::atomic<uint64_t> deferred{ 0 };        // moves given up: the user was busy or the file changed. retried at the next scan.
+		std::atomic<uint64_t> errors{ 0 };
+		std::atomic<uint64_t> throttledNs{ 0 };     // migrator time spent waiting for the rate limit or for foreground requests.
+		std::atomic<uint64_t> coldFiles{ 0 };
+		std::atomic<uint64_t> coldBytes{ 0 };       // content bytes of the cold files.
+		std::atomic<uint64_t> compactedPacks{ 0 };  // packs deleted after their entries were copied out.
+	};
+
+	inline Stats& stats()
+	{
+		static Stats s;
+		return s;
+	}
+
+	enum EOp { OP_PUT = 1, OP_DROP = 2 };
+	enum ECodec { CODEC_RAW = 0, CODEC_ZLIB = 1 };
+
+	/**
+	   A cold file: where its bytes are, and what it looked like on the hot tier.
+	 */
+	struct Entry
+	{
+		uint8_t codec = CODEC_RAW;
+		uint32_t pack = 0;
+		uint64_t offset = 0;
+		uint64_t stored = 0;    // bytes in the pack.
+		uint64_t raw = 0;       // bytes of the file on the hot tier, sealed if it was.
+		uint64_t size = 0;      // content size, as MetadataSnapshot reports it.
+		uint64_t mtimeNs = 0;
+
+		bool samePlace(const Entry& other) const { return pack == other.pack && offset == other.offset; }
+	};
+
+#if HAVE_OPENAT
+	inline bool readAll(const int fd, void* data, const size_t length, const uint64_t offset)
+	{
+		size_t done = 0;
+		while (done < length)
+		{
+			const ssize_t res = ::pread(fd, static_cast<uint8_t*>(data) + done, length - done, static_cast<off_t>(offset + done));
+			if (res < 0 && errno == EINTR)
+				continue;
+			if (res <= 0)
+				return false;
+			done += static_cast<size_t>(res);
+		}
+		return true;
+	}
+
+	inline bool writeAll(const int fd, const void* data, const size_t length, const uint64_t offset)
+	{
+		size_t done = 0;
+		while (done < length)
+		{
+			const ssize_t res = ::pwrite(fd, static_cast<const uint8_t*>(data) + done, length - done, static_cast<off_t>(offset + done));
+			if (res < 0 && errno == EINTR)
+				continue;
+			if (res <= 0)
+				return false;
+			done += static_cast<size_t>(res);
+		}
+		return true;
+	}
+
+	/**
+	   @brief make the entries of a directory durable.
+	 */
+	inline bool syncDir(const std::string& path)
+	{
+		const int fd = ::open(path.empty() ? "." : path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+		const bool synced = (::fsync(fd) == 0);
+		(void)::close(fd);
+		return synced;
+	}
+
+	inline uint64_t nanoseconds(const timespec& t)
+	{
+		return static_cast<uint64_t>(t.tv_sec) * 1000000000ull + static_cast<uint64_t>(t.tv_nsec);
+	}
+#endif
+
+#if HAVE_ZLIB
+	/**
+	   One deflate (pack) or inflate (unpack) stream.
+	 */
+	class ZStream
+	{
+	public:
+		explicit ZStream(const bool deflating) : _deflating(deflating), _ended(false), _out(TIER_CHUNK)
+		{
+			memset(&_z, 0, sizeof(_z));
+			_ok = ((deflating ? deflateInit(&_z, TIER_ZLIB_LEVEL) : inflateInit(&_z)) == Z_OK);
+			_initialized = _ok;
+		}
+
+		~ZStream()
+		{
+			if (_initialized)
+				(void)(_deflating ? deflateEnd(&_z) : inflateEnd(&_z));
+		}
+
+		ZStream(const ZStream&) = delete;
+		ZStream& operator=(const ZStream&) = delete;
+
+		/**
+		   @brief pass input through the stream. `sink(data, length)` takes the output as it comes.
+		   @param last the input ends here (deflate).
+		   @return false on a zlib error, a damaged stream, or a failed sink.
+		 */
+		template <class Sink>
+		bool feed(const uint8_t* data, const size_t length, const bool last, Sink&& sink)
+		{
+			_z.next_in = const_cast<Bytef*>(data);
+			_z.avail_in = static_cast<uInt>(length);
+			while (_ok && !_ended)
+			{
+				_z.next_out = _out.data();
+				_z.avail_out = static_cast<uInt>(_out.size());
+				const int status = _deflating ? deflate(&_z, last ? Z_FINISH : Z_NO_FLUSH) : inflate(&_z, Z_NO_FLUSH);
+				_ok = (status == Z_OK || status == Z_STREAM_END || status == Z_BUF_ERROR) && sink(_out.data(), _out.size() - _z.avail_out);
+				_ended = (status == Z_STREAM_END);
+				if (status == Z_BUF_ERROR || (_z.avail_in == 0 && _z.avail_out != 0 && !(_deflating && last)))
+					break;   // needs more input.
+			}
+			return _ok;
+		}
+
+		bool ended() const { return _ended; }
+
+	private:
+		z_stream _z;
+		const bool _deflating;
+		bool _initialized;
+		bool _ok;
+		bool _ended;
+		std::vector<uint8_t> _out;
+	};
+#endif
+
+
+	class Manager
+	{
+	public:
+		static Manager& instance()
+		{
+			static Manager manager;
+			return manager;
+		}
+
+		~Manager()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_workerMutex);
+				_stopping = true;
+			}
+			_wake.notify_all();
+			if (_worker.joinable())
+				_worker.join();
+#if HAVE_OPENAT
+			for (const auto& container : _containers)
+			{
+				if (container.second->index >= 0)
+					(void)::close(container.second->index);
+			}
+#endif
+		}
+
+		Manager(const Manager&) = delete;
+		Manager& operator=(const Manager&) = delete;
+
+		bool enabled() const { return _enabled; }
+
+		/**
+		   @brief the user of a user folder: "<root>/<userID>/" -> userID. 0 if it is not one.
+		 */
+		static uint32_t userOf(const std::string& folder)
+		{
+			const size_t end = (!folder.empty() && (folder.back() == '/' || folder.back() == '\\')) ? folder.size() - 1 : folder.size();
+			const size_t begin = folder.find_last_of("/\\", end == 0 ? 0 : end - 1);
+			const std::string name = folder.substr((begin == std::string::npos) ? 0 : begin + 1, end - ((begin == std::string::npos) ? 0 : begin + 1));
+			char* stop = nullptr;
+			const unsigned long id = strtoul(name.c_str(), &stop, 10);
+			if (name.empty() || *stop != '\0' || id > UINT32_MAX)
+				return 0;
+			return static_cast<uint32_t>(id);
+		}
+
+		bool contains(const uint32_t userID, const std::string& name)
+		{
+			Entry entry;
+			return find(userID, name, entry);
+		}
+
+		/**
+		   @brief copy a cold file, as it was on the hot tier (sealed if it was), to `target`
+		          without promoting it.
+		   @return false if the file is not cold or could not be unpacked.
+		 */
+		bool extract(const DirectoryCache::Directory& dir, const std::string& name, const std::string& target)
+		{
+			Entry entry;
+			if (!find(dir.userID, name, entry))
+				return false;
+			const std::shared_ptr<Container> c = container(dir.userID);
+			Entry moved;   // as in accessed(): a pack compaction may move the entry while it is unpacked.
+			return unpack(*c, entry, target) || (find(dir.userID, name, moved) && !moved.samePlace(entry) && unpack(*c, moved, target));
+		}
+
+		/**
+		   @brief extract() to a fresh name in the user's promoting entry, for a reader that opens
+		          it like any user file.
+		   @param staged set to that name, relative to the user's folder. the caller unlinks it.
+		 */
+		bool extractStaged(const DirectoryCache::Directory& dir, const std::string& name, std::string& staged)
+		{
+			std::error_code error;
+			(void)std::filesystem::create_directories(dir.folder + DIRECTORY_PROMOTING_ENTRY, error);
+			staged = DIRECTORY_PROMOTING_ENTRY "/" + std::to_string(_sequence.fetch_add(1, std::memory_order_relaxed));
+			if (extract(dir, name, dir.folder + staged))
+				return true;
+			(void)std::filesystem::remove(dir.folder + staged, error);
+			staged.clear();
+			return false;
+		}
+
+		/**
+		   @brief size and mtime of a cold file.
+		   @return false if the file is not cold.
+		 */
+		bool stat(const uint32_t userID, const std::string& name, uint64_t& size, uint64_t& mtimeNs)
+		{
+			Entry entry;
+			if (!find(userID, name, entry))
+				return false;
+			size = entry.size;
+			mtimeNs = entry.mtimeNs;
+			return true;
+		}
+
+		/**
+		   @brief add the cold files of a user folder.
+		 */
+		void files(const std::string& folder, std::vector<std::pair<std::string, Entry>>& found)
+		{
+			const std::shared_ptr<Container> c = container(userOf(folder));
+			if (c == nullptr)
+				return;
+			std::lock_guard<std::mutex> lock(c->mutex);
+			if (ready(*c))
+				found.insert(found.end(), c->entries.begin(), c->entries.end());
+		}
+
+		void names(const std::string& folder, std::set<std::string>& filesList)
+		{
+			const std::shared_ptr<Container> c = container(userOf(folder));
+			if (c == nullptr)
+				return;
+			std::lock_guard<std::mutex> lock(c->mutex);
+			if (!ready(*c))
+				return;
+			for (const auto& entry : c->entries)
+				filesList.insert(entry.first);
+		}
+
+		bool hasFiles(const uint32_t userID)
+		{
+			const std::shared_ptr<Container> c = container(userID);
+			if (c == nullptr)
+				return false;
+			std::lock_guard<std::mutex> lock(c->mutex);
+			return ready(*c) && !c->entries.empty();
+		}
+
+		/**
+		   @brief drop a cold file: it is removed, or replaced by a write.
+		   @return true if the file was cold.
+		 */
+		bool remove(const DirectoryCache::Directory& dir, const std::string& name)
+		{
+			const std::shared_ptr<Container> c = container(dir.userID);
+			if (c == nullptr)
+				return false;
+			std::lock_guard<std::mutex> lock(c->mutex);
+			if (!ready(*c) || c->entries.count(name) == 0)
+				return false;
+			drop(*c, name);
+			return true;
+		}
+
+		/**
+		   @brief a file is about to be read: a cold file is promoted to the hot tier, a hot one
+		          has its atime set.
+		   @return false if the file is cold and could not be promoted.
+		 */
+		bool accessed(const DirectoryCache::Directory& dir, const std::string& name)
+		{
+			if (!_enabled || name.empty())
+				return true;
+			Entry entry;
+			if (find(dir.userID, name, entry))
+			{
+				Entry moved;   // a pack compaction may move the entry while it is unpacked: retried at its new place.
+				return promote(dir, name, entry) || (find(dir.userID, name, moved) && !moved.samePlace(entry) && promote(dir, name, moved));
+			}
+#if HAVE_OPENAT
+			const timespec times[2] = { { 0, UTIME_NOW }, { 0, UTIME_OMIT } };
+			(void)::utimensat((dir.fd >= 0) ? dir.fd : AT_FDCWD, (dir.fd >= 0) ? name.c_str() : (dir.folder + name).c_str(), times, AT_SYMLINK_NOFOLLOW);
+#endif
+			return true;
+		}
+
+	private:
+		/**
+		   One user's cold files. The migrator is the only one appending to packs.
+		 */
+		struct Container
+		{
+			std::mutex mutex;
+			bool loaded = false;
+			bool broken = false;                   // unreadable index: left alone.
+			std::string path;                      // "<cold root>/<userID>/".
+			int index = -1;                        // opened on the first record written.
+			uint64_t indexEnd = 0;
+			uint64_t records = 0;
+			std::map<std::string, Entry> entries;
+			std::map<uint32_t, uint64_t> live;     // pack -> entries in it.
+			uint32_t pack = 0;                     // current pack.
+			uint64_t packSize = 0;
+			bool packing = false;                  // the migrator is moving a file into the current pack.
+			bool counted = false;                  // its files are in the stats from before an eviction.
+			uint64_t used = 0;                     // last use, in _clock ticks. guarded by the manager's mutex.
+		};
+
+		Manager() : _enabled(HAVE_OPENAT && !config().coldRoot.empty() && !VersionStore::retention().enabled), _sequence(0), _clock(0), _stopping(false)
+		{
+			(void)stats();
+			(void)StorageRoots::instance();   // constructed first, so they outlive the worker.
+			(void)SpaceReclaimer::instance();
+			(void)DirectoryCache::Cache::instance();
+			if (!_enabled)
+				return;
+			std::error_code error;
+			(void)std::filesystem::create_directories(config().coldRoot, error);
+			_worker = std::thread(&Manager::run, this);
+		}
+
+		static std::string packPath(const Container& c, const uint32_t pack)
+		{
+			return c.path + "pack." + std::to_string(pack);
+		}
+
+		/**
+		   @brief forget the least recently used containers nobody holds. their files stay counted
+		          in the stats, and are not counted again when they are loaded back. _mutex is held.
+		 */
+		void evictLocked()
+		{
+			if (_containers.size() < TIER_CONTAINERS)
+				return;
+			std::vector<std::pair<uint64_t, uint32_t>> idle;
+			for (const auto& c : _containers)
+			{
+				if (c.second.use_count() == 1)
+					idle.emplace_back(c.second->used, c.first);
+			}
+			std::sort(idle.begin(), idle.end());
+			const size_t excess = _containers.size() - TIER_CONTAINERS + TIER_CONTAINERS / 8;   // a batch, not one per lookup.
+			for (size_t i = 0; i < idle.size() && i <= excess; ++i)
+			{
+				const auto it = _containers.find(idle[i].second);
+				Container& c = *it->second;
+#if HAVE_OPENAT
+				if (c.index >= 0)
+					(void)::close(c.index);
+#endif
+				if (c.loaded && !c.broken)
+					_counted.insert(it->first);
+				_containers.erase(it);
+			}
+		}
+
+		std::shared_ptr<Container> container(const uint32_t userID)
+		{
+			if (!_enabled || userID == 0)
+				return nullptr;
+			std::lock_guard<std::mutex> lock(_mutex);
+			auto it = _containers.find(userID);
+			if (it == _containers.end())
+			{
+				evictLocked();
+				auto c = std::make_shared<Container>();
+				c->path = config().coldRoot + std::to_string(userID) + "/";
+				c->counted = (_counted.erase(userID) != 0);
+				it = _containers.emplace(userID, std::move(c)).first;
+			}
+			it->second->used = ++_clock;
+			return it->second;
+		}
+
+		bool find(const uint32_t userID, const std::string& name, Entry& entry)
+		{
+			const std::shared_ptr<Container> c = container(userID);
+			if (c == nullptr)
+				return false;
+			std::lock_guard<std::mutex> lock(c->mutex);
+			if (!ready(*c))
+				return false;
+			const auto it = c->entries.find(name);
+			if (it == c->entries.end())
+				return false;
+			entry = it->second;
+			return true;
+		}
+
+		static void encode(std::vector<uint8_t>& out, const uint8_t op, const std::string& name, const Entry& e)
+		{
+			uint8_t record[TIER_RECORD];
+			const auto nameLen = static_cast<uint16_t>(name.size());
+			record[0] = op;
+			record[1] = e.codec;
+			memcpy(record + 2, &nameLen, sizeof(nameLen));
+			memcpy(record + 4, &e.pack, sizeof(e.pack));
+			memcpy(record + 8, &e.offset, sizeof(e.offset));
+			memcpy(record + 16, &e.stored, sizeof(e.stored));
+			memcpy(record + 24, &e.raw, sizeof(e.raw));
+			memcpy(record + 32, &e.size, sizeof(e.size));
+			memcpy(record + 40, &e.mtimeNs, sizeof(e.mtimeNs));
+			out.insert(out.end(), record, record + TIER_RECORD);
+			out.insert(out.end(), name.begin(), name.end());
+		}
+
+		/**
+		   @brief load a container on first use: replay the index, then drop entries whose pack
+		          is missing or short (a crash before their drop records were synced) and packs
+		          with no entries left. c.mutex is held.
+		   @return false if the user's cold files cannot be used.
+		 */
+		bool ready(Container& c)
+		{
+			if (c.loaded)
+				return !c.broken;
+			c.loaded = true;
+#if HAVE_OPENAT
+			namespace fs = std::filesystem;
+			std::vector<uint8_t> data;
+			const int fd = ::open((c.path + "index").c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd >= 0)
+			{
+				struct stat st;
+				if (::fstat(fd, &st) == 0)
+					data.resize(static_cast<size_t>(st.st_size));
+				c.broken = data.size() < TIER_INDEX_HEADER || !readAll(fd, data.data(), data.size(), 0) || memcmp(data.data(), "BSVRCOLD", TIER_INDEX_HEADER) != 0;
+				(void)::close(fd);
+			}
+			else
+				c.broken = (errno != ENOENT);
+			if (c.broken)
+			{
+				stats().errors.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			size_t pos = data.empty() ? 0 : TIER_INDEX_HEADER;
+			while (pos + TIER_RECORD <= data.size())
+			{
+				const uint8_t* p = data.data() + pos;
+				Entry e;
+				uint16_t nameLen = 0;
+				e.codec = p[1];
+				memcpy(&nameLen, p + 2, sizeof(nameLen));
+				memcpy(&e.pack, p + 4, sizeof(e.pack));
+				memcpy(&e.offset, p + 8, sizeof(e.offset));
+				memcpy(&e.stored, p + 16, sizeof(e.stored));
+				memcpy(&e.raw, p + 24, sizeof(e.raw));
+				memcpy(&e.size, p + 32, sizeof(e.size));
+				memcpy(&e.mtimeNs, p + 40, sizeof(e.mtimeNs));
+				if (pos + TIER_RECORD + nameLen > data.size())
+					break;   // torn by a crash: cut by the next append.
+				const std::string name(reinterpret_cast<const char*>(p + TIER_RECORD), nameLen);
+				if (p[0] == OP_PUT)
+					c.entries[name] = e;
+				else
+					c.entries.erase(name);
+				c.pack = std::max(c.pack, e.pack);
+				c.records += 1;
+				pos += TIER_RECORD + nameLen;
+			}
+			c.indexEnd = pos;
+
+			std::map<uint32_t, uint64_t> packs;   // on disk: pack -> size.
+			std::error_code error;
+			for (fs::directory_iterator it(c.path, error), end; !error && it != end; it.increment(error))
+			{
+				const std::string name = it->path().filename().string();
+				if (name.compare(0, 5, "pack.") != 0)
+					continue;
+				const auto pack = static_cast<uint32_t>(strtoul(name.c_str() + 5, nullptr, 10));
+				std::error_code sizeError;
+				packs[pack] = static_cast<uint64_t>(it->file_size(sizeError));
+				c.pack = std::max(c.pack, pack);
+			}
+			for (auto it = c.entries.begin(); it != c.entries.end();)
+			{
+				const auto pack = packs.find(it->second.pack);
+				if (pack == packs.end() || it->second.offset + it->second.stored > pack->second)
+				{
+					it = c.entries.erase(it);
+					continue;
+				}
+				c.live[it->second.pack] += 1;
+				if (!c.counted)
+				{
+					stats().coldFiles.fetch_add(1, std::memory_order_relaxed);
+					stats().coldBytes.fetch_add(it->second.size, std::memory_order_relaxed);
+				}
+				++it;
+			}
+			c.counted = true;
+			for (const auto& pack : packs)
+			{
+				if (c.live.count(pack.first) == 0)
+					(void)::unlink(packPath(c, pack.first).c_str());
+			}
+			const auto current = packs.find(c.pack);
+			c.packSize = (current != packs.end() && c.live.count(c.pack) != 0) ? current->second : 0;
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		/**
+		   @brief write one index record. c.mutex is held.
+		   @param sync wait until the record is durable.
+		 */
+		bool append(Container& c, const uint8_t op, const std::string& name, const Entry& e, const bool sync)
+		{
+#if HAVE_OPENAT
+			std::vector<uint8_t> out;
+			if (c.index < 0)
+			{
+				std::error_code error;
+				(void)std::filesystem::create_directories(c.path, error);
+				c.index = ::open((c.path + "index").c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+				if (c.index < 0)
+					return false;
+				if (c.indexEnd == 0)
+				{
+					out.insert(out.end(), "BSVRCOLD", "BSVRCOLD" + TIER_INDEX_HEADER);
+					(void)syncDir(config().coldRoot);
+					(void)syncDir(c.path);
+				}
+				(void)::ftruncate(c.index, static_cast<off_t>(c.indexEnd));   // drops a torn tail.
+			}
+			encode(out, op, name, e);
+			if (!writeAll(c.index, out.data(), out.size(), c.indexEnd) || (sync && ::fdatasync(c.index) != 0))
+			{
+				stats().errors.fetch_add(1, std::memory_order_relaxed);
+				(void)::ftruncate(c.index, static_cast<off_t>(c.indexEnd));
+				return false;
+			}
+			c.indexEnd += out.size();
+			c.records += 1;
+			return true;
+#else
+			(void)c; (void)op; (void)name; (void)e; (void)sync;
+			return false;
+#endif
+		}
+
+		// c.mutex is held.
+		void put(Container& c, const std::string& name, const Entry& e)
+		{
+			c.entries[name] = e;
+			c.live[e.pack] += 1;
+			stats().coldFiles.fetch_add(1, std::memory_order_relaxed);
+			stats().coldBytes.fetch_add(e.size, std::memory_order_relaxed);
+		}
+
+		/**
+		   @brief forget a cold file. its drop record is synced only when its pack is deleted,
+		          which the current pack is only while no file is being moved into it.
+		          c.mutex is held.
+		 */
+		void drop(Container& c, const std::string& name)
+		{
+			const auto it = c.entries.find(name);
+			if (it == c.entries.end())
+				return;
+			const Entry e = it->second;
+			(void)append(c, OP_DROP, name, e, false);
+			c.entries.erase(it);
+			stats().coldFiles.fetch_sub(1, std::memory_order_relaxed);
+			stats().coldBytes.fetch_sub(e.size, std::memory_order_relaxed);
+			if (--c.live[e.pack] != 0)
+				return;
+			c.live.erase(e.pack);
+#if HAVE_OPENAT
+			if ((e.pack != c.pack || !c.packing) && c.index >= 0 && ::fdatasync(c.index) == 0 && ::unlink(packPath(c, e.pack).c_str()) == 0 && e.pack == c.pack)
+				c.packSize = 0;
+#endif
+		}
+
+		/**
+		   @brief replace the index by the records of the live entries, once dead ones are most
+		          of it. c.mutex is held.
+		 */
+		void compact(Container& c)
+		{
+#if HAVE_OPENAT
+			if (!c.loaded || c.broken || c.records < TIER_INDEX_COMPACT_MIN || c.records < 2 * c.entries.size())
+				return;
+			std::vector<uint8_t> out("BSVRCOLD", "BSVRCOLD" + TIER_INDEX_HEADER);
+			for (const auto& entry : c.entries)
+				encode(out, OP_PUT, entry.first, entry.second);
+			const std::string replacement = c.path + "index.tmp";
+			const int fd = ::open(replacement.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (fd < 0)
+				return;
+			bool written = writeAll(fd, out.data(), out.size(), 0) && ::fdatasync(fd) == 0;
+			written = (::close(fd) == 0) && written;
+			if (!written || ::rename(replacement.c_str(), (c.path + "index").c_str()) != 0)
+			{
+				(void)::unlink(replacement.c_str());
+				stats().errors.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			(void)syncDir(c.path);
+			if (c.index >= 0)
+				(void)::close(c.index);
+			c.index = -1;
+			c.indexEnd = out.size();
+			c.records = c.entries.size();
+#else
+			(void)c;
+#endif
+		}
+
+		/**
+		   @brief unpack a cold file into `staged`, synced, with its mtime.
+		 */
+		bool unpack(const Container& c, const Entry& e, const std::string& staged)
+		{
+#if HAVE_OPENAT
+			const int in = ::open(packPath(c, e.pack).c_str(), O_RDONLY | O_CLOEXEC);
+			const int out = ::open(staged.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			bool ok = (in >= 0 && out >= 0 && (e.codec == CODEC_RAW || (HAVE_ZLIB && e.codec == CODEC_ZLIB)));
+			uint64_t written = 0;
+			const auto sink = [out, &written](const uint8_t* data, const size_t length)
+			{
+				const bool done = writeAll(out, data, length, written);
+				written += length;
+				return done;
+			};
+#if HAVE_ZLIB
+			ZStream z(false);
+#endif
+			std::vector<uint8_t> input(TIER_CHUNK);
+			for (uint64_t read = 0; ok && read < e.stored;)
+			{
+				const size_t chunk = static_cast<size_t>(std::min<uint64_t>(TIER_CHUNK, e.stored - read));
+				ok = readAll(in, input.data(), chunk, e.offset + read);
+				read += chunk;
+#if HAVE_ZLIB
+				if (ok && e.codec == CODEC_ZLIB)
+				{
+					ok = z.feed(input.data(), chunk, read == e.stored, sink);
+					continue;
+				}
+#endif
+				ok = ok && sink(input.data(), chunk);
+			}
+#if HAVE_ZLIB
+			ok = ok && (e.codec == CODEC_RAW || z.ended());
+#endif
+			ok = ok && written == e.raw && ::fdatasync(out) == 0;
+			if (ok)
+			{
+				const timespec times[2] = { { 0, UTIME_NOW }, { static_cast<time_t>(e.mtimeNs / 1000000000ull), static_cast<long>(e.mtimeNs % 1000000000ull) } };
+				ok = (::futimens(out, times) == 0);
+			}
+			if (in >= 0)
+				(void)::close(in);
+			if (out >= 0)
+				ok = (::close(out) == 0) && ok;
+			return ok;
+#else
+			(void)c; (void)e; (void)staged;
+			return false;
+#endif
+		}
+
+		/**
+		   @brief bring a cold file back under its name. a hot file of the name, left by a crash
+		          between a move and its cleanup, is kept.
+		 */
+		bool promote(const DirectoryCache::Directory& dir, const std::string& name, const Entry& e)
+		{
+#if HAVE_OPENAT
+			namespace fs = std::filesystem;
+			const std::shared_ptr<Container> held = container(dir.userID);
+			Container& c = *held;
+			std::error_code error;
+			const std::string staging = dir.folder + DIRECTORY_PROMOTING_ENTRY "/";
+			(void)fs::create_directories(staging, error);
+			const std::string staged = staging + std::to_string(_sequence.fetch_add(1, std::memory_order_relaxed));
+			bool ok = unpack(c, e, staged);
+			{
+				std::lock_guard<std::mutex> lock(c.mutex);
+				const auto it = c.entries.find(name);
+				if (it != c.entries.end() && !it->second.samePlace(e))
+					ok = false;   // moved to another pack meanwhile: the copy may be cut short.
+				else if (ok && it != c.entries.end())   // not dropped or promoted meanwhile.
+				{
+					const fs::path target(dir.folder + name);
+					(void)fs::create_directories(target.parent_path(), error);
+					ok = (::link(staged.c_str(), target.c_str()) == 0 || errno == EEXIST) && syncDir(target.parent_path().string());
+					if (ok)
+					{
+						drop(c, name);
+						stats().promotedFiles.fetch_add(1, std::memory_order_relaxed);
+						stats().promotedBytes.fetch_add(e.raw, std::memory_order_relaxed);
+					}
+				}
+			}
+			(void)::unlink(staged.c_str());
+			if (!ok)
+				stats().errors.fetch_add(1, std::memory_order_relaxed);
+			return ok;
+#else
+			(void)dir; (void)name; (void)e;
+			return false;
+#endif
+		}
+
+		bool stopping() const { return _stopping.load(std::memory_order_relaxed); }
+
+		/**
+		   @brief wait while the root's I/O pool has foreground requests queued, then until the
+		          migration rate allows `bytes` more.
+		   @return false if the migrator is stopping.
+		 */
+		bool pace(StorageRoots::IoPool& pool, const uint64_t bytes)
+		{
+			const auto started = std::chrono::steady_clock::now();
+			std::unique_lock<std::mutex> lock(_workerMutex);
+			while (!_stopping && pool.queued() > 0)
+				(void)_wake.wait_for(lock, std::chrono::milliseconds(TIER_YIELD_MS));
+			const auto wait = _bucket.reserve(bytes, config().bytesPerSecond, std::chrono::steady_clock::now());
+			if (wait.count() > 0)
+				(void)_wake.wait_for(lock, wait, [this] { return stopping(); });
+			stats().throttledNs.fetch_add(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count()), std::memory_order_relaxed);
+			return !_stopping;
+		}
+
+#if HAVE_OPENAT
+		/**
+		   @brief not read or written for the configured time, and worth moving.
+		 */
+		static bool cold(const struct stat& st)
+		{
+			const Config& c = config();
+			const uint64_t lastAccess = std::max(nanoseconds(st.st_atim), nanoseconds(st.st_mtim));
+			const auto now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+			return S_ISREG(st.st_mode) && st.st_size > 0 && static_cast<uint64_t>(st.st_size) >= c.minSize
+				&& lastAccess + static_cast<uint64_t>(c.coldAfter.count()) * 1000000000ull <= now;
+		}
+
+		/**
+		   @brief append a hot file to the current pack, synced, at the migration rate. the pack
+		          is kept (c.packing) until the caller commits or gives up the move.
+		   @param sealed set if the file is sealed (stored raw).
+		 */
+		bool packFile(StorageRoots::IoPool& pool, const int fd, const uint64_t raw, Container& c, Entry& e, bool& sealed)
+		{
+			{
+				std::lock_guard<std::mutex> lock(c.mutex);
+				if (c.packSize >= TIER_PACK_MAX)
+				{
+					c.pack += 1;
+					c.packSize = 0;
+				}
+				e.pack = c.pack;
+				e.offset = c.packSize;
+				c.packing = true;
+			}
+			std::error_code error;
+			(void)std::filesystem::create_directories(c.path, error);
+			const int out = ::open(packPath(c, e.pack).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+			e.raw = raw;
+			e.stored = 0;
+			const auto sink = [out, &e](const uint8_t* data, const size_t length)
+			{
+				const bool done = writeAll(out, data, length, e.offset + e.stored);
+				e.stored += length;
+				return done;
+			};
+#if HAVE_ZLIB
+			std::unique_ptr<ZStream> z;
+#endif
+			std::vector<uint8_t> input(TIER_CHUNK);
+			bool ok = (out >= 0);
+			sealed = false;
+			for (uint64_t done = 0; ok && done < raw;)
+			{
+				const size_t chunk = static_cast<size_t>(std::min<uint64_t>(TIER_CHUNK, raw - done));
+				ok = pace(pool, chunk) && readAll(fd, input.data(), chunk, done);
+				if (ok && done == 0)
+				{
+#if HAVE_AT_REST_CIPHER
+					sealed = (chunk >= AT_REST_HEADER && AtRestCipher::sealedHeader(input.data(), raw) && AtRestCipher::sealedSize(input.data(), raw, e.size));
+#endif
+#if HAVE_ZLIB
+					if (!sealed)
+					{
+						e.codec = CODEC_ZLIB;
+						z = std::make_unique<ZStream>(true);
+					}
+#endif
+				}
+				done += chunk;
+#if HAVE_ZLIB
+				if (ok && z)
+				{
+					ok = z->feed(input.data(), chunk, done == raw, sink);
+					continue;
+				}
+#endif
+				ok = ok && sink(input.data(), chunk);
+			}
+#if HAVE_ZLIB
+			ok = ok && (!z || z->ended());
+#endif
+			ok = ok && ::fdatasync(out) == 0 && (e.offset != 0 || syncDir(c.path));
+			if (out >= 0)
+				ok = (::close(out) == 0) && ok;
+			std::lock_guard<std::mutex> lock(c.mutex);
+			if (e.pack == c.pack)
+				c.packSize = std::max(c.packSize, e.offset + e.stored);   // cut by abandon() if the move is not committed.
+			return ok;
+		}
+
+		/**
+		   @brief give up a move into the current pack: the pack is cut back to where the move
+		          started, or deleted if the move started it. c.mutex is held.
+		 */
+		void abandon(Container& c, const Entry& e)
+		{
+			c.packing = false;
+			if (e.pack != c.pack)
+				return;
+			const std::string path = packPath(c, e.pack);
+			if (e.offset == 0 && c.live.count(e.pack) == 0)
+				(void)::unlink(path.c_str());
+			else
+				(void)::truncate(path.c_str(), static_cast<off_t>(e.offset));
+			c.packSize = e.offset;
+		}
+
+		/**
+		   @brief move one file of a user to the cold tier, if it is still cold and unchanged.
+		 */
+		void migrate(const size_t root, const uint32_t userID, const std::string& folder, const std::string& name)
+		{
+			const std::string path = folder + name;
+			int fd = ::open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_NOATIME | O_CLOEXEC);   // reading it is not an access.
+			if (fd < 0 && errno == EPERM)
+				fd = ::open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+			if (fd < 0)
+				return;
+			struct stat st;
+			const std::shared_ptr<Container> c = container(userID);
+			bool usable = (::fstat(fd, &st) == 0 && cold(st));
+			if (usable)
+			{
+				std::lock_guard<std::mutex> lock(c->mutex);
+				usable = ready(*c);
+			}
+			if (!usable)
+			{
+				(void)::close(fd);
+				return;
+			}
+			if (StorageRoots::instance().busy(userID))
+			{
+				(void)::close(fd);
+				stats().deferred.fetch_add(1, std::memory_order_relaxed);   // would not be committed: not worth reading.
+				return;
+			}
+			Entry e;
+			bool sealed = false;
+			e.mtimeNs = nanoseconds(st.st_mtim);
+			e.size = static_cast<uint64_t>(st.st_size);
+			const bool packed = packFile(StorageRoots::instance().rootPool(root), fd, static_cast<uint64_t>(st.st_size), *c, e, sealed);
+			(void)::close(fd);
+			if (!packed)
+			{
+				{
+					std::lock_guard<std::mutex> lock(c->mutex);
+					abandon(*c, e);
+				}
+				if (!stopping())
+					stats().errors.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+
+			bool committed = false;
+			(void)StorageRoots::instance().tryExclusive(userID, [&](const std::string& current)
+			{
+				struct stat now;
+				if (current != folder || ::lstat(path.c_str(), &now) != 0 || now.st_ino != st.st_ino || now.st_size != st.st_size || nanoseconds(now.st_mtim) != e.mtimeNs || !cold(now))
+					return;   // moved, changed or read meanwhile.
+				std::lock_guard<std::mutex> lock(c->mutex);
+				if (!append(*c, OP_PUT, name, e, true))
+					return;
+				put(*c, name, e);
+				const DirectoryCache::Handle dir = DirectoryCache::get(userID, folder, false);
+				committed = (dir != nullptr && SpaceReclaimer::instance().discard(*dir, name)) || ::unlink(path.c_str()) == 0;
+				if (!committed)
+					drop(*c, name);   // the hot file stays: one copy only.
+			});
+			{
+				std::lock_guard<std::mutex> lock(c->mutex);
+				if (committed)
+					c->packing = false;
+				else
+					abandon(*c, e);
+			}
+			if (!committed)
+			{
+				stats().deferred.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			stats().migratedFiles.fetch_add(1, std::memory_order_relaxed);
+			stats().migratedBytes.fetch_add(e.raw, std::memory_order_relaxed);
+			stats().packedBytes.fetch_add(e.stored, std::memory_order_relaxed);
+		}
+
+		/**
+		   @brief copy a cold file to the current pack, at the migration rate, and delete its old
+		          pack once it has no entry left.
+		   @return false if the entry changed meanwhile or could not be copied: it stays where it is.
+		 */
+		bool relocate(StorageRoots::IoPool& pool, Container& c, const std::string& name, const Entry& from)
+		{
+			Entry to = from;
+			{
+				std::lock_guard<std::mutex> lock(c.mutex);
+				if (c.packSize >= TIER_PACK_MAX)
+				{
+					c.pack += 1;
+					c.packSize = 0;
+				}
+				to.pack = c.pack;
+				to.offset = c.packSize;
+				c.packing = true;
+			}
+			const int in = ::open(packPath(c, from.pack).c_str(), O_RDONLY | O_CLOEXEC);
+			const int out = ::open(packPath(c, to.pack).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+			bool ok = (in >= 0 && out >= 0);
+			std::vector<uint8_t> buffer(TIER_CHUNK);
+			for (uint64_t done = 0; ok && done < from.stored;)
+			{
+				const size_t chunk = static_cast<size_t>(std::min<uint64_t>(TIER_CHUNK, from.stored - done));
+				ok = pace(pool, chunk) && readAll(in, buffer.data(), chunk, from.offset + done) && writeAll(out, buffer.data(), chunk, to.offset + done);
+				done += chunk;
+			}
+			ok = ok && ::fdatasync(out) == 0 && (to.offset != 0 || syncDir(c.path));
+			if (in >= 0)
+				(void)::close(in);
+			if (out >= 0)
+				ok = (::close(out) == 0) && ok;
+			std::lock_guard<std::mutex> lock(c.mutex);
+			if (to.pack == c.pack)
+				c.packSize = std::max(c.packSize, to.offset + to.stored);
+			const auto it = c.entries.find(name);
+			if (!ok || it == c.entries.end() || !it->second.samePlace(from) || !append(c, OP_PUT, name, to, true))
+			{
+				abandon(c, to);
+				return false;
+			}
+			it->second = to;
+			c.live[to.pack] += 1;
+			c.packing = false;
+			if (--c.live[from.pack] == 0)
+			{
+				c.live.erase(from.pack);
+				if (::unlink(packPath(c, from.pack).c_str()) == 0)   // after the put record above is durable.
+					stats().compactedPacks.fetch_add(1, std::memory_order_relaxed);
+			}
+			return true;
+		}
+
+		/**
+		   @brief copy the entries of the user's packs that are mostly dead to the current pack.
+		 */
+		void compactPacks(const uint32_t userID, Container& c)
+		{
+			std::map<uint32_t, std::vector<std::pair<std::string, Entry>>> packs;   // pack -> its entries.
+			std::vector<std::pair<std::string, Entry>> moving;
+			{
+				std::lock_guard<std::mutex> lock(c.mutex);
+				if (!c.loaded || c.broken)
+					return;
+				for (const auto& entry : c.entries)
+				{
+					if (entry.second.pack != c.pack)
+						packs[entry.second.pack].push_back(entry);
+				}
+			}
+			for (auto& pack : packs)
+			{
+				uint64_t live = 0;
+				for (const auto& entry : pack.second)
+					live += entry.second.stored;
+				struct stat st;
+				if (::stat(packPath(c, pack.first).c_str(), &st) == 0 && live * 100 < static_cast<uint64_t>(st.st_size) * TIER_PACK_COMPACT_PERCENT)
+					moving.insert(moving.end(), pack.second.begin(), pack.second.end());
+			}
+			if (moving.empty())
+				return;
+			StorageRoots::IoPool& pool = StorageRoots::instance().poolFor(userID);
+			for (const auto& entry : moving)
+			{
+				if (stopping() || !relocate(pool, c, entry.first, entry.second))
+					return;   // the rest waits for the next scan.
+			}
+		}
+
+		/**
+		   @brief the cold files of a user folder, server owned entries skipped.
+		 */
+		static std::vector<std::string> candidates(const std::string& folder)
+		{
+			namespace fs = std::filesystem;
+			std::vector<std::string> found;
+			std::error_code error;
+			fs::recursive_directory_iterator it(folder, fs::directory_options::skip_permission_denied, error);
+			for (const fs::recursive_directory_iterator end; !error && it != end; it.increment(error))
+			{
+				if (it.depth() == 0 && DirectoryCache::serverEntry(it->path().filename().string().c_str()))
+				{
+					it.disable_recursion_pending();
+					continue;
+				}
+				const std::string path = it->path().string();
+				struct stat st;
+				if (::lstat(path.c_str(), &st) == 0 && cold(st))
+					found.push_back(path.substr(folder.size()));
+			}
+			return found;
+		}
+#endif
+
+		/**
+		   @brief one pass over the user folders of every root, then over the loaded indexes.
+		 */
+		void scan()
+		{
+#if HAVE_OPENAT
+			namespace fs = std::filesystem;
+			StorageRoots::Manager& roots = StorageRoots::instance();
+			for (size_t r = 0; r < roots.rootsCount() && !stopping(); ++r)
+			{
+				const std::string root = roots.rootPath(r);
+				std::error_code error;
+				for (fs::directory_iterator it(root, error), end; !error && it != end && !stopping(); it.increment(error))
+				{
+					const uint32_t userID = userOf(it->path().filename().string());
+					const std::string folder = root + std::to_string(userID) + "/";
+					std::error_code typeError;
+					if (userID == 0 || !it->is_directory(typeError) || roots.userFolder(userID) != folder)
+						continue;   // not a user folder, or one being moved to another root.
+					{
+						const std::shared_ptr<Container> c = container(userID);
+						std::lock_guard<std::mutex> lock(c->mutex);
+						(void)ready(*c);   // counted in the stats from the first scan on.
+					}
+					for (const std::string& name : candidates(folder))
+					{
+						if (stopping())
+							break;
+						migrate(r, userID, folder, name);
+					}
+				}
+			}
+			std::vector<std::pair<uint32_t, std::shared_ptr<Container>>> loaded;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				loaded.assign(_containers.begin(), _containers.end());
+			}
+			for (const auto& c : loaded)
+			{
+				if (stopping())
+					break;
+				compactPacks(c.first, *c.second);
+				std::lock_guard<std::mutex> lock(c.second->mutex);
+				compact(*c.second);
+			}
+#endif
+		}
+
+		void run()
+		{
+			std::unique_lock<std::mutex> lock(_workerMutex);
+			while (!_stopping)
+			{
+				lock.unlock();
+				scan();
+				lock.lock();
+				(void)_wake.wait_for(lock, config().scanInterval, [this] { return stopping(); });
+			}
+		}
+
+		const bool _enabled;
+		std::atomic<uint64_t> _sequence;                               // names of promotions being staged.
+		std::mutex _mutex;
+		std::map<uint32_t, std::shared_ptr<Container>> _containers;   // loaded ones, at most TIER_CONTAINERS idle.
+		std::set<uint32_t> _counted;                                   // evicted users whose files stay in the stats.
+		uint64_t _clock;                                               // container uses. guarded by _mutex.
+		std::mutex _workerMutex;
+		std::condition_variable _wake;
+		Scheduler::TokenBucket _bucket;                                // migration rate.
+		std::atomic<bool> _stopping;
+		std::thread _worker;
+	};
+
+	inline Manager& instance()
+	{
+		return Manager::instance();
+	}
+
+}
@@ -0,0 +1,385 @@
+/**
+  @Tracing sampled per-request spans recorded into per-thread ring buffers.
+  A request is sampled when its connection is accepted; spans of unsampled requests
+  cost one thread-local check. Each thread owns a ring of TRACE_RING_EVENTS events that
+  is overwritten in place, so nothing is allocated on the hot path. The rings can be
+  dumped at any time in Chrome trace (chrome://tracing, Perfetto) JSON format.
+  The sampling rate can be changed at runtime with setSampleRate().
+  A request served by a coroutine moves between threads: its Trace is kept by the
+  coroutine and given to spans explicitly, and Adopt lends it to a pool thread.
+ */
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define TRACE_RING_EVENTS  4096                   // events kept per thread.
+#define TRACE_SAMPLE_ENV  "BACKUPSVR_TRACE_SAMPLE"  // initial sampling rate, 0..1. default 0 (off).
+
+namespace Tracing {
+
+	inline uint64_t nowNanos()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	/**
+	   One complete ("X") event.
+	 */
+	struct EventData
+	{
+		const char* name = nullptr;      // static string.
+		const char* argName = nullptr;   // optional numeric argument. static string.
+		uint64_t argValue = 0;
+		uint64_t requestID = 0;
+		uint32_t userID = 0;
+		uint64_t startNs = 0;
+		uint64_t durationNs = 0;
+	};
+
+	/**
+	   Ring slot. seq is odd while the owning thread writes the slot, so a concurrent dump
+	   skips slots it would read torn.
+	 */
+	struct Event
+	{
+		std::atomic<uint64_t> seq{ 0 };
+		EventData data;
+	};
+
+	struct ThreadRing
+	{
+		uint32_t tid;
+		std::atomic<uint64_t> head{ 0 };  // events written so far.
+		Event events[TRACE_RING_EVENTS];
+		explicit ThreadRing(const uint32_t id) : tid(id) {}
+	};
+
+
+	class Tracer
+	{
+	public:
+		static Tracer& instance()
+		{
+			static Tracer tracer;
+			return tracer;
+		}
+
+		/**
+		   @brief fraction of requests to trace, 0 (off) to 1 (all).
+		 */
+		void setSampleRate(double rate)
+		{
+			if (rate < 0)
+				rate = 0;
+			if (rate > 1)
+				rate = 1;
+			_threshold.store(static_cast<uint64_t>(rate * static_cast<double>(UINT32_MAX)), std::memory_order_relaxed);
+		}
+
+		double sampleRate() const
+		{
+			return static_cast<double>(_threshold.load(std::memory_order_relaxed)) / static_cast<double>(UINT32_MAX);
+		}
+
+		bool sample()
+		{
+			const uint64_t threshold = _threshold.load(std::memory_order_relaxed);
+			if (threshold == 0)
+				return false;
+			// xorshift per thread. good enough for sampling.
+			thread_local uint64_t state = 0x9E3779B97F4A7C15ULL ^ reinterpret_cast<uintptr_t>(&state);
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			return (state & UINT32_MAX) <= threshold;
+		}
+
+		uint64_t nextRequestID() { return _requestIDs.fetch_add(1, std::memory_order_relaxed) + 1; }
+
+		ThreadRing& ring()
+		{
+			thread_local ThreadRing* mine = nullptr;
+			if (mine == nullptr)
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_rings.push_back(std::make_unique<ThreadRing>(static_cast<uint32_t>(_rings.size() + 1)));
+				mine = _rings.back().get();   // rings are never freed. threads are reused by the server.
+			}
+			return *mine;
+		}
+
+		/**
+		   @brief dump every ring as Chrome trace JSON. safe while requests are being traced.
+		 */
+		std::string chromeTrace()
+		{
+			std::ostringstream out;
+			out << "{\"traceEvents\":[";
+			bool first = true;
+			std::lock_guard<std::mutex> lock(_mutex);
+			for (const auto& ring : _rings)
+			{
+				const uint64_t head = ring->head.load(std::memory_order_acquire);
+				const uint64_t begin = (head > TRACE_RING_EVENTS) ? (head - TRACE_RING_EVENTS) : 0;
+				for (uint64_t i = begin; i < head; ++i)
+				{
+					const Event& slot = ring->events[i % TRACE_RING_EVENTS];
+					const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+					if (seq & 1)
+						continue;
+					const EventData copy = slot.data;
+					std::atomic_thread_fence(std::memory_order_acquire);
+					if (slot.seq.load(std::memory_order_relaxed) != seq || copy.name == nullptr)
+						continue;   // overwritten while copying.
+					out << (first ? "" : ",") << "\n{\"name\":\"" << copy.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->tid
+						<< ",\"ts\":" << (copy.startNs / 1000) << "." << ((copy.startNs / 100) % 10)
+						<< ",\"dur\":" << (copy.durationNs / 1000) << "." << ((copy.durationNs / 100) % 10)
+						<< ",\"args\":{\"request\":" << copy.requestID << ",\"user\":" << copy.userID;
+					if (copy.argName != nullptr)
+						out << ",\"" << copy.argName << "\":" << copy.argValue;
+					out << "}}";
+					first = false;
+				}
+			}
+			out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+			return out.str();
+		}
+
+		Tracer(const Tracer&) = delete;
+		Tracer& operator=(const Tracer&) = delete;
+
+	private:
+		Tracer() : _threshold(0), _requestIDs(0)
+		{
+			const char* env = getenv(TRACE_SAMPLE_ENV);
+			if (env != nullptr)
+				setSampleRate(atof(env));
+		}
+
+		std::atomic<uint64_t> _threshold;   // sample when random 32 bit value <= threshold.
+		std::atomic<uint64_t> _requestIDs;
+		std::mutex _mutex;
+		std::vector<std::unique_ptr<ThreadRing>> _rings;
+	};
+
+	inline Tracer& instance()
+	{
+		return Tracer::instance();
+	}
+
+	inline void setSampleRate(const double rate)
+	{
+		instance().setSampleRate(rate);
+	}
+
+	inline double sampleRate()
+	{
+		return instance().sampleRate();
+	}
+
+	inline std::string chromeTrace()
+	{
+		return instance().chromeTrace();
+	}
+
+
+	/**
+	   The request traced on this thread. requestID 0 means not sampled.
+	 */
+	struct Trace
+	{
+		uint64_t requestID = 0;
+		uint32_t userID = 0;
+	};
+
+	inline Trace& current()
+	{
+		thread_local Trace trace;
+		return trace;
+	}
+
+	inline bool active()
+	{
+		return current().requestID != 0;
+	}
+
+	/**
+	   @brief record a complete span of the given request.
+	 */
+	inline void record(const Trace& trace, const char* name, const uint64_t startNs, const uint64_t durationNs, const char* argName = nullptr, const uint64_t argValue = 0)
+	{
+		if (trace.requestID == 0)
+			return;
+		ThreadRing& ring = instance().ring();
+		const uint64_t index = ring.head.load(std::memory_order_relaxed);
+		Event& slot = ring.events[index % TRACE_RING_EVENTS];
+		const uint64_t seq = slot.seq.load(std::memory_order_relaxed);
+		slot.seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		slot.data.name = name;
+		slot.data.argName = argName;
+		slot.data.argValue = argValue;
+		slot.data.requestID = trace.requestID;
+		slot.data.userID = trace.userID;
+		slot.data.startNs = startNs;
+		slot.data.durationNs = durationNs;
+		slot.seq.store(seq + 2, std::memory_order_release);
+		ring.head.store(index + 1, std::memory_order_release);
+	}
+
+	/**
+	   @brief record a complete span of the current request.
+	 */
+	inline void record(const char* name, const uint64_t startNs, const uint64_t durationNs, const char* argName = nullptr, const uint64_t argValue = 0)
+	{
+		record(current(), name, startNs, durationNs, argName, argValue);
+	}
+
+
+	/**
+	   RAII: decide whether a connection is sampled. By default the request is the one handled
+	   on this thread; a coroutine passes its own Trace. Spans recorded until the scope ends
+	   belong to this request.
+	 */
+	class RequestScope
+	{
+	public:
+		RequestScope() : RequestScope(current()) {}
+
+		explicit RequestScope(Trace& trace) : _trace(trace), _start(0)
+		{
+			if (instance().sample())
+			{
+				_trace.requestID = instance().nextRequestID();
+				_trace.userID = 0;
+				_start = nowNanos();
+			}
+		}
+
+		~RequestScope()
+		{
+			if (_trace.requestID != 0)
+				record(_trace, "request", _start, nowNanos() - _start);
+			_trace = Trace();
+		}
+
+		void setUser(const uint32_t userID)
+		{
+			_trace.userID = userID;
+		}
+
+		RequestScope(const RequestScope&) = delete;
+		RequestScope& operator=(const RequestScope&) = delete;
+
+	private:
+		Trace& _trace;
+		uint64_t _start;
+	};
+
+
+	/**
+	   RAII: the calling thread works for `trace` until the scope ends, e.g. a pool thread
+	   running a storage call of a coroutine. Spans taken from the thread go to that request.
+	 */
+	class Adopt
+	{
+	public:
+		explicit Adopt(const Trace& trace) : _previous(current()) { current() = trace; }
+		~Adopt() { current() = _previous; }
+		Adopt(const Adopt&) = delete;
+		Adopt& operator=(const Adopt&) = delete;
+
+	private:
+		Trace _previous;
+	};
+
+
+	/**
+	   RAII span of a request: the current one, or the given one. no clock reads when the
+	   request is not sampled.
+	 */
+	class Span
+	{
+	public:
+		explicit Span(const char* name) : Span(current(), name) {}
+		Span(const Trace& trace, const char* name) : _trace(trace), _name(name), _start(trace.requestID != 0 ? nowNanos() : 0), _done(trace.requestID == 0) {}
+		~Span() { end(); }
+
+		void end()
+		{
+			if (_done)
+				return;
+			_done = true;
+			record(_trace, _name, _start, nowNanos() - _start);
+		}
+
+		Span(const Span&) = delete;
+		Span& operator=(const Span&) = delete;
+
+	private:
+		const Trace& _trace;
+		const char* _name;
+		uint64_t _start;
+		bool _done;
+	};
+
+
+	/**
+	   Accumulates the time of a stage repeated inside a transfer loop (e.g. every disk read)
+	   and records it as one span, starting at the first measured iteration.
+	 */
+	class StageTimer
+	{
+	public:
+		explicit StageTimer(const char* name) : StageTimer(current(), name) {}
+		StageTimer(const Trace& trace, const char* name) : _trace(trace), _name(name), _first(0), _total(0), _count(0), _start(0) {}
+		~StageTimer() { flush(); }
+
+		void begin()
+		{
+			if (_trace.requestID == 0)
+				return;
+			_start = nowNanos();
+			if (_count == 0)
+				_first = _start;
+		}
+
+		void end()
+		{
+			if (_trace.requestID == 0 || _start == 0)
+				return;
+			_total += nowNanos() - _start;
+			++_count;
+			_start = 0;
+		}
+
+		void flush()
+		{
+			if (_count == 0)
+				return;
+			record(_trace, _name, _first, _total, "iterations", _count);
+			_count = 0;
+			_total = 0;
+		}
+
+		StageTimer(const StageTimer&) = delete;
+		StageTimer& operator=(const StageTimer&) = delete;
+
+	private:
+		const Trace& _trace;
+		const char* _name;
+		uint64_t _first;
+		uint64_t _total;
+		uint64_t _count;
+		uint64_t _start;
+	};
+
+}
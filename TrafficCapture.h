@@ -0,0 +1,351 @@
+/**
+  @TrafficCapture optional binary capture of served requests, for deterministic replay.
+  Enabled by setting BACKUPSVR_CAPTURE to a log path. Each handled request appends one
+  record: arrival offset, duration, user ID, version, op, status, filename and payload size,
+  and only when BACKUPSVR_CAPTURE_PAYLOAD=1 the payload bytes of the first request frame.
+  Records are buffered and handed in CAPTURE_FLUSH_BYTES batches to a writer thread, so a
+  request never waits on the log's disk; if the writer falls CAPTURE_MAX_PENDING batches
+  behind, records are dropped and counted. When capture is off the hot path costs one
+  relaxed atomic load.
+
+  log layout (little endian):
+    header  "BSVRCAP\0" | u32 format version | u64 capture start (unix ns)
+    record  u32 record length (after this field) | u64 arrival offset ns | u64 duration ns |
+            u32 user ID | u8 version | u8 op | u16 status | u32 payload size |
+            u16 name length | name | u32 captured payload length | payload
+ */
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define CAPTURE_ENV  "BACKUPSVR_CAPTURE"                  // capture log path. unset: capture off.
+#define CAPTURE_PAYLOAD_ENV  "BACKUPSVR_CAPTURE_PAYLOAD"  // "1": keep first frame payload bytes.
+#define CAPTURE_FLUSH_BYTES  (256 * 1024)
+#define CAPTURE_MAX_PENDING  64                          // batches queued for the writer before records are dropped.
+#define CAPTURE_MAX_RECORD_BYTES  (16 * 1024 * 1024)     // longer record lengths in a log are corruption.
+#define CAPTURE_FORMAT_VERSION  1
+
+namespace TrafficCapture {
+
+	const char MAGIC[8] = { 'B', 'S', 'V', 'R', 'C', 'A', 'P', '\0' };
+
+	struct Record
+	{
+		uint64_t offsetNs = 0;     // arrival, relative to capture start.
+		uint64_t durationNs = 0;   // request handling time on the server.
+		uint32_t userID = 0;
+		uint8_t version = 0;
+		uint8_t op = 0;
+		uint16_t status = 0;
+		uint32_t size = 0;         // request payload size.
+		std::string filename;
+		std::string payload;       // first frame payload bytes, empty unless captured.
+	};
+
+	template <typename T>
+	void put(std::vector<uint8_t>& out, const T& value)
+	{
+		const auto* bytes = reinterpret_cast<const uint8_t*>(&value);
+		out.insert(out.end(), bytes, bytes + sizeof(T));
+	}
+
+	template <typename T>
+	bool get(const uint8_t*& ptr, const uint8_t* end, T& value)
+	{
+		if (static_cast<size_t>(end - ptr) < sizeof(T))
+			return false;
+		memcpy(&value, ptr, sizeof(T));
+		ptr += sizeof(T);
+		return true;
+	}
+
+	/**
+	   @brief append an encoded record (with its length prefix) to out.
+	 */
+	inline void encode(const Record& record, std::vector<uint8_t>& out)
+	{
+		const size_t lengthAt = out.size();
+		put(out, static_cast<uint32_t>(0));
+		put(out, record.offsetNs);
+		put(out, record.durationNs);
+		put(out, record.userID);
+		put(out, record.version);
+		put(out, record.op);
+		put(out, record.status);
+		put(out, record.size);
+		put(out, static_cast<uint16_t>(record.filename.size()));
+		out.insert(out.end(), record.filename.begin(), record.filename.end());
+		put(out, static_cast<uint32_t>(record.payload.size()));
+		out.insert(out.end(), record.payload.begin(), record.payload.end());
+		const auto length = static_cast<uint32_t>(out.size() - lengthAt - sizeof(uint32_t));
+		memcpy(out.data() + lengthAt, &length, sizeof(length));
+	}
+
+	/**
+	   @brief decode one record body (without its length prefix).
+	   @return false if the body is truncated or malformed.
+	 */
+	inline bool decode(const uint8_t* ptr, const uint8_t* end, Record& record)
+	{
+		uint16_t nameLen = 0;
+		uint32_t payloadLen = 0;
+		if (!get(ptr, end, record.offsetNs) || !get(ptr, end, record.durationNs) || !get(ptr, end, record.userID) ||
+			!get(ptr, end, record.version) || !get(ptr, end, record.op) || !get(ptr, end, record.status) ||
+			!get(ptr, end, record.size) || !get(ptr, end, nameLen) || static_cast<size_t>(end - ptr) < nameLen)
+			return false;
+		record.filename.assign(reinterpret_cast<const char*>(ptr), nameLen);
+		ptr += nameLen;
+		if (!get(ptr, end, payloadLen) || static_cast<size_t>(end - ptr) < payloadLen)
+			return false;
+		record.payload.assign(reinterpret_cast<const char*>(ptr), payloadLen);
+		return true;
+	}
+
+
+	class Capture
+	{
+	public:
+		static Capture& instance()
+		{
+			static Capture capture;
+			return capture;
+		}
+
+		bool enabled() const { return _enabled.load(std::memory_order_relaxed); }
+		bool withPayload() const { return _withPayload; }
+		uint64_t records() const { return _records.load(std::memory_order_relaxed); }
+		uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+		/**
+		   @brief start capturing to a new log. an open log is closed first.
+		   @return false if the log cannot be created.
+		 */
+		bool start(const std::string& path, const bool withPayload)
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			closeLocked(lock);
+			_file = fopen(path.c_str(), "wb");
+			if (_file == nullptr)
+				return false;
+			_withPayload = withPayload;
+			_start = std::chrono::steady_clock::now();
+			const uint32_t format = CAPTURE_FORMAT_VERSION;
+			const auto wallNs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+			std::vector<uint8_t> header(MAGIC, MAGIC + sizeof(MAGIC));
+			put(header, format);
+			put(header, wallNs);
+			(void)fwrite(header.data(), 1, header.size(), _file);
+			_enabled.store(true, std::memory_order_release);
+			return true;
+		}
+
+		void stop()
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			closeLocked(lock);
+		}
+
+		/**
+		   @brief append a record of a handled request.
+		   @param arrival when the request's first frame was received.
+		   @param payload first frame payload bytes. dropped unless payload capture is on.
+		 */
+		void record(const std::chrono::steady_clock::time_point& arrival, const uint32_t userID, const uint8_t version, const uint8_t op, const uint16_t status,
+			const uint8_t* filename, const uint16_t nameLen, const uint32_t size, const uint8_t* payload, const uint32_t payloadLen)
+		{
+			if (!enabled())
+				return;
+			const auto now = std::chrono::steady_clock::now();
+			Record rec;
+			rec.durationNs = (now > arrival) ? static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - arrival).count()) : 0;
+			rec.userID = userID;
+			rec.version = version;
+			rec.op = op;
+			rec.status = status;
+			rec.size = size;
+			if (filename != nullptr)
+				rec.filename.assign(reinterpret_cast<const char*>(filename), nameLen);
+
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (_file == nullptr)
+				return;
+			rec.offsetNs = (arrival > _start) ? static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(arrival - _start).count()) : 0;
+			if (_withPayload && payload != nullptr)
+				rec.payload.assign(reinterpret_cast<const char*>(payload), payloadLen);
+			encode(rec, _buffer);
+			++_buffered;
+			_records.fetch_add(1, std::memory_order_relaxed);
+			if (_buffer.size() >= CAPTURE_FLUSH_BYTES)
+				handOffLocked();
+		}
+
+		/**
+		   @brief write every buffered record and wait until the writer is done with them.
+		 */
+		void flush()
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			handOffLocked();
+			_written.wait(lock, [this] { return _pending.empty() && !_writing; });
+		}
+
+		~Capture()
+		{
+			stop();
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stopping = true;
+			}
+			_wake.notify_one();
+			_writer.join();
+		}
+
+		Capture(const Capture&) = delete;
+		Capture& operator=(const Capture&) = delete;
+
+	private:
+		Capture() : _enabled(false), _withPayload(false), _records(0), _dropped(0), _file(nullptr), _buffered(0), _writing(false), _stopping(false)
+		{
+			_writer = std::thread(&Capture::write, this);
+			const char* path = getenv(CAPTURE_ENV);
+			const char* payload = getenv(CAPTURE_PAYLOAD_ENV);
+			if (path != nullptr && *path != '\0')
+				(void)start(path, payload != nullptr && strcmp(payload, "1") == 0);
+		}
+
+		// queue the buffered records for the writer, or drop them if it is too far behind.
+		void handOffLocked()
+		{
+			if (_buffer.empty())
+				return;
+			if (_pending.size() >= CAPTURE_MAX_PENDING)
+				_dropped.fetch_add(_buffered, std::memory_order_relaxed);
+			else
+				_pending.push_back(std::move(_buffer));
+			_buffer.clear();
+			_buffered = 0;
+			_wake.notify_one();
+		}
+
+		void closeLocked(std::unique_lock<std::mutex>& lock)
+		{
+			_enabled.store(false, std::memory_order_release);
+			handOffLocked();
+			_written.wait(lock, [this] { return _pending.empty() && !_writing; });
+			if (_file != nullptr)
+				(void)fclose(_file);
+			_file = nullptr;
+		}
+
+		/**
+		   writer thread: append queued batches to the log, outside the lock taken by record().
+		 */
+		void write()
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			while (true)
+			{
+				_wake.wait(lock, [this] { return !_pending.empty() || _stopping; });
+				if (_pending.empty())
+					return;
+				std::vector<uint8_t> batch = std::move(_pending.front());
+				_pending.pop_front();
+				FILE* file = _file;   // stays open: closeLocked() waits for !_writing.
+				_writing = true;
+				lock.unlock();
+				if (file != nullptr)
+				{
+					(void)fwrite(batch.data(), 1, batch.size(), file);
+					(void)fflush(file);
+				}
+				lock.lock();
+				_writing = false;
+				_written.notify_all();
+			}
+		}
+
+		std::atomic<bool> _enabled;
+		bool _withPayload;
+		std::atomic<uint64_t> _records;
+		std::atomic<uint64_t> _dropped;          // records lost because the writer fell behind.
+		std::mutex _mutex;
+		FILE* _file;
+		std::vector<uint8_t> _buffer;            // batch being filled by record().
+		size_t _buffered;                        // records in _buffer.
+		std::deque<std::vector<uint8_t>> _pending;   // filled batches waiting for the writer.
+		bool _writing;                           // the writer has a batch out of _pending.
+		bool _stopping;
+		std::condition_variable _wake;
+		std::condition_variable _written;
+		std::thread _writer;
+		std::chrono::steady_clock::time_point _start;
+	};
+
+	inline Capture& instance()
+	{
+		return Capture::instance();
+	}
+
+
+	/**
+	   Sequential reader of a capture log.
+	 */
+	class Reader
+	{
+	public:
+		~Reader()
+		{
+			if (_file != nullptr)
+				(void)fclose(_file);
+		}
+
+		/**
+		   @brief open a log and validate its header.
+		 */
+		bool open(const std::string& path)
+		{
+			_file = fopen(path.c_str(), "rb");
+			if (_file == nullptr)
+				return false;
+			char magic[sizeof(MAGIC)];
+			uint32_t format = 0;
+			return (fread(magic, 1, sizeof(magic), _file) == sizeof(magic)) && (memcmp(magic, MAGIC, sizeof(MAGIC)) == 0) &&
+				(fread(&format, sizeof(format), 1, _file) == 1) && (format == CAPTURE_FORMAT_VERSION) &&
+				(fread(&_startWallNs, sizeof(_startWallNs), 1, _file) == 1);
+		}
+
+		/**
+		   @return false at the end of the log, on a truncated record (e.g. the server was killed mid flush)
+		           or on a record length over CAPTURE_MAX_RECORD_BYTES.
+		 */
+		bool next(Record& record)
+		{
+			uint32_t length = 0;
+			if (_file == nullptr || fread(&length, sizeof(length), 1, _file) != 1 || length > CAPTURE_MAX_RECORD_BYTES)
+				return false;
+			_body.resize(length);
+			if (length > 0 && fread(_body.data(), 1, length, _file) != length)
+				return false;
+			return decode(_body.data(), _body.data() + _body.size(), record);
+		}
+
+		uint64_t startWallNs() const { return _startWallNs; }
+
+	private:
+		FILE* _file = nullptr;
+		uint64_t _startWallNs = 0;
+		std::vector<uint8_t> _body;
+	};
+
+}
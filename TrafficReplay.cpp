@@ -0,0 +1,184 @@
+/**
+  @TrafficReplay re-drive a TrafficCapture log against a server.
+  Requests are issued in recorded order, each at its recorded arrival offset divided by the
+  speed factor (or back to back with --speed=max), from a fixed pool of client threads.
+  Backups carry synthetic payloads of the recorded sizes, so the same log always sends the
+  same bytes. Reports per operation replayed latency next to the recorded server latency,
+  status mismatches against the capture and how far dispatch lagged behind the schedule.
+
+  usage: TrafficReplay <capture log> [--host=127.0.0.1] [--port=8080] [--speed=1|N|max] [--threads=N]
+ */
+
+#include "TrafficCapture.h"
+#include "ProtocolClient.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+	struct Options
+	{
+		std::string log;
+		std::string host = "127.0.0.1";
+		uint16_t port = 8080;
+		double speed = 1;       // 0: as fast as possible.
+		uint32_t threads = 64;
+	};
+
+	struct OpStats
+	{
+		std::atomic<uint64_t> count{ 0 };
+		std::atomic<uint64_t> errors{ 0 };      // connection failures.
+		std::atomic<uint64_t> mismatches{ 0 };  // status differs from the recorded one.
+		Metrics::Histogram replayed;            // microseconds, client side.
+		Metrics::Histogram recorded;            // microseconds, server side at capture time.
+	};
+
+	const char* opName(const uint8_t op)
+	{
+		switch (op)
+		{
+		case ProtocolClient::CLI_FILE_BACKUP: return "backup";
+		case ProtocolClient::CLI_FILE_RESTORE: return "restore";
+		case ProtocolClient::CLI_FILE_REMOVE: return "remove";
+		case ProtocolClient::CLI_FILE_LIST: return "list";
+		default: return "other";
+		}
+	}
+
+	bool parseOptions(int argc, char* argv[], Options& options)
+	{
+		if (argc < 2 || argv[1][0] == '-')
+			return false;
+		options.log = argv[1];
+		for (int i = 2; i < argc; ++i)
+		{
+			const std::string arg(argv[i]);
+			const size_t eq = arg.find('=');
+			const std::string key = arg.substr(0, eq);
+			const std::string value = (eq == std::string::npos) ? "" : arg.substr(eq + 1);
+			if (key == "--host")
+				options.host = value;
+			else if (key == "--port")
+				options.port = static_cast<uint16_t>(atoi(value.c_str()));
+			else if (key == "--speed")
+				options.speed = (value == "max") ? 0 : atof(value.c_str());
+			else if (key == "--threads")
+				options.threads = static_cast<uint32_t>(atoi(value.c_str()));
+			else
+				return false;
+		}
+		return options.threads > 0 && options.speed >= 0;
+	}
+
+	bool replay(ProtocolClient::Client& client, const TrafficCapture::Record& record, const std::vector<uint8_t>& pattern, ProtocolClient::Reply& reply)
+	{
+		switch (record.op)
+		{
+		case ProtocolClient::CLI_FILE_BACKUP: return client.backup(record.userID, record.filename, record.size, pattern, reply);
+		case ProtocolClient::CLI_FILE_LIST: return client.list(record.userID, reply);
+		default: return client.simple(record.userID, record.op, record.filename, reply, false);
+		}
+	}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	if (!parseOptions(argc, argv, options))
+	{
+		printf("usage: %s <capture log> [--host=H] [--port=P] [--speed=1|N|max] [--threads=N]\n", argv[0]);
+		return 1;
+	}
+	TrafficCapture::Reader reader;
+	if (!reader.open(options.log))
+	{
+		printf("%s is not a capture log\n", options.log.c_str());
+		return 1;
+	}
+	std::vector<TrafficCapture::Record> records;
+	TrafficCapture::Record record;
+	while (reader.next(record))
+		records.push_back(record);
+	std::stable_sort(records.begin(), records.end(), [](const TrafficCapture::Record& a, const TrafficCapture::Record& b) { return a.offsetNs < b.offsetNs; });
+	if (records.empty())
+	{
+		printf("no records\n");
+		return 1;
+	}
+	const double recordedSeconds = static_cast<double>(records.back().offsetNs) / 1e9;
+	if (options.speed > 0)
+		printf("%zu requests over %.1f s, replaying at %gx with %u threads\n", records.size(), recordedSeconds, options.speed, options.threads);
+	else
+		printf("%zu requests over %.1f s, replaying at max speed with %u threads\n", records.size(), recordedSeconds, options.threads);
+
+	const boost::asio::ip::tcp::endpoint server(boost::asio::ip::make_address(options.host), options.port);
+	std::vector<uint8_t> pattern(1024 * 1024 + 7);
+	std::mt19937 random(42);
+	for (auto& byte : pattern)
+		byte = static_cast<uint8_t>(random());
+
+	std::map<uint8_t, OpStats> stats;
+	for (const auto& r : records)
+		(void)stats[r.op];   // created up front: workers only read the map.
+	Metrics::Histogram lag;   // dispatch delay behind schedule, microseconds.
+	std::atomic<size_t> next{ 0 };
+	const auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for (uint32_t t = 0; t < options.threads; ++t)
+	{
+		workers.emplace_back([&]()
+		{
+			boost::asio::io_context io;
+			ProtocolClient::Client client(io, server);
+			for (size_t i = next++; i < records.size(); i = next++)
+			{
+				const TrafficCapture::Record& r = records[i];
+				if (options.speed > 0)
+				{
+					const auto due = start + std::chrono::nanoseconds(static_cast<uint64_t>(static_cast<double>(r.offsetNs) / options.speed));
+					std::this_thread::sleep_until(due);
+					lag.record(Metrics::elapsedMicros(due));
+				}
+				OpStats& s = stats.at(r.op);
+				ProtocolClient::Reply reply;
+				const auto issued = std::chrono::steady_clock::now();
+				const bool ok = replay(client, r, pattern, reply);
+				s.replayed.record(Metrics::elapsedMicros(issued));
+				s.recorded.record(r.durationNs / 1000);
+				s.count.fetch_add(1, std::memory_order_relaxed);
+				if (!ok)
+					s.errors.fetch_add(1, std::memory_order_relaxed);
+				else if (reply.status != r.status)
+					s.mismatches.fetch_add(1, std::memory_order_relaxed);
+			}
+		});
+	}
+	for (auto& worker : workers)
+		worker.join();
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("replayed in %.1f s (%.1f req/s)", seconds, static_cast<double>(records.size()) / seconds);
+	if (options.speed > 0)
+		printf(", schedule lag p50 %.3f ms p99 %.3f ms", lag.quantile(0.5) / 1000.0, lag.quantile(0.99) / 1000.0);
+	printf("\n%-8s %10s %8s %10s %12s %12s %12s %12s\n", "op", "requests", "errors", "mismatch", "p50 ms", "p99 ms", "rec p50 ms", "rec p99 ms");
+	for (const auto& entry : stats)
+	{
+		const OpStats& s = entry.second;
+		printf("%-8s %10llu %8llu %10llu %12.3f %12.3f %12.3f %12.3f\n", opName(entry.first),
+			static_cast<unsigned long long>(s.count.load()), static_cast<unsigned long long>(s.errors.load()), static_cast<unsigned long long>(s.mismatches.load()),
+			s.replayed.quantile(0.5) / 1000.0, s.replayed.quantile(0.99) / 1000.0, s.recorded.quantile(0.5) / 1000.0, s.recorded.quantile(0.99) / 1000.0);
+	}
+	return 0;
+}
@@ -0,0 +1,564 @@
+/**
+  @UringStorage io_uring storage engine used by FileManager on Linux.
+  Every worker thread queues its open/read/write/fsync/close operations on one shared
+  ring. A submitter thread pushes whatever is queued in a single io_uring_submit, so
+  concurrent requests are batched together, and a reaper thread completes them.
+  Opened files are registered (fixed files) and data moves through registered buffers.
+  When io_uring is not compiled in or cannot be initialised, available() is false and
+  FileManager keeps using std::fstream. BACKUPSVR_URING=0 turns the engine off. An open the
+  ring cannot take (fixed file table full, any other ring error) falls back to the POSIX
+  path for that file and is counted in fallbacks().
+ */
+
+#pragma once
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<liburing.h>)
+#include <liburing.h>
+#define HAVE_IO_URING 1
+#else
+#define HAVE_IO_URING 0
+#endif
+
+#define URING_QUEUE_DEPTH  256
+#define URING_REGISTERED_FILES  1024
+#define URING_REGISTERED_BUFFERS  64
+#define URING_BUFFER_SIZE  (64 * 1024)   // size of each registered buffer. also the engine's I/O chunk.
+#define URING_ENV  "BACKUPSVR_URING"
+
+namespace UringStorage {
+
+	/**
+	   A queued operation. The result is the cqe result: bytes / fd / 0 on success, -errno on failure.
+	 */
+	struct Op
+	{
+		enum EKind { OPEN, READ, WRITE, FSYNC, CLOSE };
+		EKind kind;
+		int fd;               // fixed file index when fixed == true. directory fd for OPEN.
+		bool fixed;
+		int bufIndex;         // registered buffer index, -1 if buf is a plain pointer.
+		std::string path;
+		int flags;
+		mode_t mode;
+		uint8_t* buf;
+		uint32_t length;
+		uint64_t offset;
+		std::promise<int64_t> result;
+		Op(const EKind k) : kind(k), fd(-1), fixed(false), bufIndex(-1), flags(0), mode(0), buf(nullptr), length(0), offset(0) {}
+	};
+
+
+	class Engine
+	{
+	public:
+		static Engine& instance()
+		{
+			static Engine engine;
+			return engine;
+		}
+
+		bool available() const { return _available; }
+
+		/**
+		   @brief open a file through the ring and register it as a fixed file.
+		   @return fixed file index, or -errno.
+		 */
+		int open(const std::string& path, const int flags, const mode_t mode, const int dirfd = AT_FDCWD)
+		{
+			Op op(Op::OPEN);
+			op.fd = dirfd;
+			op.path = path;
+			op.flags = flags;
+			op.mode = mode;
+			const int fd = static_cast<int>(execute(op));
+			if (fd < 0)
+				return fd;
+			const int slot = registerFile(fd);
+			if (slot < 0)
+				(void)::close(fd);
+			return slot;
+		}
+
+		int64_t read(const int file, uint8_t* buf, const uint32_t length, const uint64_t offset, const int bufIndex = -1)
+		{
+			Op op(Op::READ);
+			op.fd = file;
+			op.fixed = true;
+			op.buf = buf;
+			op.length = length;
+			op.offset = offset;
+			op.bufIndex = bufIndex;
+			return execute(op);
+		}
+
+		int64_t write(const int file, const uint8_t* buf, const uint32_t length, const uint64_t offset, const int bufIndex = -1)
+		{
+			Op op(Op::WRITE);
+			op.fd = file;
+			op.fixed = true;
+			op.buf = const_cast<uint8_t*>(buf);
+			op.length = length;
+			op.offset = offset;
+			op.bufIndex = bufIndex;
+			return execute(op);
+		}
+
+		int fsync(const int file)
+		{
+			Op op(Op::FSYNC);
+			op.fd = file;
+			op.fixed = true;
+			return static_cast<int>(execute(op));
+		}
+
+		/**
+		   @brief unregister a fixed file and close its descriptor through the ring.
+		 */
+		int close(const int file)
+		{
+			const int fd = unregisterFile(file);
+			if (fd < 0)
+				return fd;
+			Op op(Op::CLOSE);
+			op.fd = fd;
+			return static_cast<int>(execute(op));
+		}
+
+		/**
+		   @brief size of an opened fixed file. 0 if failed.
+		 */
+		uint64_t size(const int file)
+		{
+			struct stat st;
+			std::lock_guard<std::mutex> lock(_filesMutex);
+			if (file < 0 || file >= static_cast<int>(_files.size()) || _files[file] < 0 || ::fstat(_files[file], &st) != 0)
+				return 0;
+			return static_cast<uint64_t>(st.st_size);
+		}
+
+		/**
+		   @brief borrow a registered buffer of URING_BUFFER_SIZE bytes.
+		   @return buffer index, or -1 if all buffers are in use (caller should use its own memory).
+		 */
+		int acquireBuffer(uint8_t*& ptr)
+		{
+			std::lock_guard<std::mutex> lock(_buffersMutex);
+			if (_freeBuffers.empty())
+				return -1;
+			const int index = _freeBuffers.back();
+			_freeBuffers.pop_back();
+			ptr = _arena.data() + (static_cast<size_t>(index) * URING_BUFFER_SIZE);
+			return index;
+		}
+
+		void releaseBuffer(const int index)
+		{
+			if (index < 0)
+				return;
+			std::lock_guard<std::mutex> lock(_buffersMutex);
+			_freeBuffers.push_back(index);
+		}
+
+		/**
+		   @brief number of io_uring_submit calls and operations submitted. ops / submits is the batching factor.
+		 */
+		uint64_t submits() const { return _submits.load(std::memory_order_relaxed); }
+		uint64_t submitted() const { return _submitted.load(std::memory_order_relaxed); }
+
+		~Engine()
+		{
+#if HAVE_IO_URING
+			if (!_available)
+				return;
+			{
+				std::lock_guard<std::mutex> lock(_queueMutex);
+				_stopping = true;
+			}
+			_queued.notify_one();
+			if (_submitter.joinable())
+				_submitter.join();
+			if (_reaper.joinable())
+				_reaper.join();
+			io_uring_queue_exit(&_ring);
+#endif
+		}
+
+		Engine(const Engine&) = delete;
+		Engine& operator=(const Engine&) = delete;
+
+	private:
+		Engine() : _available(false), _stopping(false), _submits(0), _submitted(0)
+		{
+#if HAVE_IO_URING
+			if (io_uring_queue_init(URING_QUEUE_DEPTH, &_ring, 0) < 0)
+				return;
+			_files.assign(URING_REGISTERED_FILES, -1);
+			if (io_uring_register_files(&_ring, _files.data(), URING_REGISTERED_FILES) < 0)
+			{
+				io_uring_queue_exit(&_ring);
+				return;
+			}
+			_arena.resize(static_cast<size_t>(URING_REGISTERED_BUFFERS) * URING_BUFFER_SIZE);
+			std::vector<iovec> iovecs(URING_REGISTERED_BUFFERS);
+			for (int i = 0; i < URING_REGISTERED_BUFFERS; ++i)
+			{
+				iovecs[i].iov_base = _arena.data() + (static_cast<size_t>(i) * URING_BUFFER_SIZE);
+				iovecs[i].iov_len = URING_BUFFER_SIZE;
+				_freeBuffers.push_back(i);
+			}
+			if (io_uring_register_buffers(&_ring, iovecs.data(), URING_REGISTERED_BUFFERS) < 0)
+				_freeBuffers.clear();  // no registered buffers. plain read/write still work.
+			_available = true;
+			_submitter = std::thread(&Engine::submitLoop, this);
+			_reaper = std::thread(&Engine::reapLoop, this);
+#endif
+		}
+
+		int64_t execute(Op& op)
+		{
+			if (!_available)
+				return -ENOSYS;
+			auto future = op.result.get_future();
+			{
+				std::lock_guard<std::mutex> lock(_queueMutex);
+				_queue.push_back(&op);
+			}
+			_queued.notify_one();
+			return future.get();
+		}
+
+		int registerFile(const int fd)
+		{
+#if HAVE_IO_URING
+			std::lock_guard<std::mutex> lock(_filesMutex);
+			for (size_t i = 0; i < _files.size(); ++i)
+			{
+				if (_files[i] != -1)
+					continue;
+				if (io_uring_register_files_update(&_ring, static_cast<unsigned>(i), &fd, 1) < 0)
+					return -EBADF;
+				_files[i] = fd;
+				return static_cast<int>(i);
+			}
+			return -EMFILE;
+#else
+			(void)fd;
+			return -ENOSYS;
+#endif
+		}
+
+		int unregisterFile(const int file)
+		{
+#if HAVE_IO_URING
+			std::lock_guard<std::mutex> lock(_filesMutex);
+			if (file < 0 || file >= static_cast<int>(_files.size()) || _files[file] < 0)
+				return -EBADF;
+			const int fd = _files[file];
+			const int none = -1;
+			(void)io_uring_register_files_update(&_ring, static_cast<unsigned>(file), &none, 1);
+			_files[file] = -1;
+			return fd;
+#else
+			(void)file;
+			return -ENOSYS;
+#endif
+		}
+
+#if HAVE_IO_URING
+		/**
+		   submitter: take everything queued since the last round and submit it in one syscall.
+		   the submission queue is only touched by this thread.
+		 */
+		void submitLoop()
+		{
+			while (true)
+			{
+				std::deque<Op*> batch;
+				{
+					std::unique_lock<std::mutex> lock(_queueMutex);
+					_queued.wait(lock, [this] { return !_queue.empty() || _stopping; });
+					if (_queue.empty() && _stopping)
+						break;
+					batch.swap(_queue);
+				}
+				unsigned prepared = 0;
+				for (Op* op : batch)
+				{
+					io_uring_sqe* sqe = io_uring_get_sqe(&_ring);
+					while (sqe == nullptr)  // submission queue full. flush and retry.
+					{
+						(void)io_uring_submit(&_ring);
+						_submits.fetch_add(1, std::memory_order_relaxed);
+						sqe = io_uring_get_sqe(&_ring);
+					}
+					prepare(sqe, *op);
+					++prepared;
+				}
+				(void)io_uring_submit(&_ring);
+				_submits.fetch_add(1, std::memory_order_relaxed);
+				_submitted.fetch_add(prepared, std::memory_order_relaxed);
+			}
+			// wake the reaper with an empty completion. it waits for nothing else, so the nop
+			// must get in: a full submission queue is flushed until a slot frees.
+			io_uring_sqe* sqe = io_uring_get_sqe(&_ring);
+			while (sqe == nullptr)
+			{
+				(void)io_uring_submit(&_ring);
+				std::this_thread::yield();
+				sqe = io_uring_get_sqe(&_ring);
+			}
+			io_uring_prep_nop(sqe);
+			io_uring_sqe_set_data(sqe, nullptr);
+			int submitted = io_uring_submit(&_ring);
+			while (submitted == -EINTR || submitted == -EAGAIN || submitted == -EBUSY)
+			{
+				std::this_thread::yield();   // completions not reaped yet. the reaper makes room.
+				submitted = io_uring_submit(&_ring);
+			}
+		}
+
+		void prepare(io_uring_sqe* sqe, Op& op)
+		{
+			switch (op.kind)
+			{
+			case Op::OPEN:
+				io_uring_prep_openat(sqe, op.fd, op.path.c_str(), op.flags, op.mode);
+				break;
+			case Op::READ:
+				if (op.bufIndex >= 0)
+					io_uring_prep_read_fixed(sqe, op.fd, op.buf, op.length, op.offset, op.bufIndex);
+				else
+					io_uring_prep_read(sqe, op.fd, op.buf, op.length, op.offset);
+				break;
+			case Op::WRITE:
+				if (op.bufIndex >= 0)
+					io_uring_prep_write_fixed(sqe, op.fd, op.buf, op.length, op.offset, op.bufIndex);
+				else
+					io_uring_prep_write(sqe, op.fd, op.buf, op.length, op.offset);
+				break;
+			case Op::FSYNC:
+				io_uring_prep_fsync(sqe, op.fd, 0);
+				break;
+			case Op::CLOSE:
+				io_uring_prep_close(sqe, op.fd);
+				break;
+			}
+			if (op.fixed)
+				io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+			io_uring_sqe_set_data(sqe, &op);
+		}
+
+		/**
+		   reaper: complete operations. the completion queue is only touched by this thread.
+		 */
+		void reapLoop()
+		{
+			while (true)
+			{
+				io_uring_cqe* cqe = nullptr;
+				if (io_uring_wait_cqe(&_ring, &cqe) < 0)
+					continue;
+				auto op = static_cast<Op*>(io_uring_cqe_get_data(cqe));
+				const int64_t res = cqe->res;
+				io_uring_cqe_seen(&_ring, cqe);
+				if (op == nullptr)
+					return;  // shutdown nop.
+				op->result.set_value(res);
+			}
+		}
+
+		io_uring _ring;
+#endif
+
+		bool _available;
+		bool _stopping;
+		std::mutex _queueMutex;
+		std::condition_variable _queued;
+		std::deque<Op*> _queue;
+		std::thread _submitter;
+		std::thread _reaper;
+		std::mutex _filesMutex;
+		std::vector<int> _files;       // fixed file slot -> fd. -1 if free.
+		std::mutex _buffersMutex;
+		std::vector<uint8_t> _arena;   // backing memory of the registered buffers.
+		std::vector<int> _freeBuffers;
+		std::atomic<uint64_t> _submits;
+		std::atomic<uint64_t> _submitted;
+	};
+
+	inline std::atomic<bool>& enabledSetting()
+	{
+		static std::atomic<bool> enabled{ getenv(URING_ENV) == nullptr || atoi(getenv(URING_ENV)) != 0 };
+		return enabled;
+	}
+
+	/**
+	   @return opens the ring failed for its own reasons, served by the POSIX path instead.
+	 */
+	inline std::atomic<uint64_t>& fallbacks()
+	{
+		static std::atomic<uint64_t> count{ 0 };
+		return count;
+	}
+
+	/**
+	   @brief should FileManager route I/O through io_uring? false when unavailable.
+	 */
+	inline bool enabled()
+	{
+		return enabledSetting().load(std::memory_order_relaxed) && Engine::instance().available();
+	}
+
+	/**
+	   @brief force the fstream path (false) or allow io_uring (true).
+	 */
+	inline void setEnabled(const bool enable)
+	{
+		enabledSetting().store(enable, std::memory_order_relaxed);
+	}
+
+
+	/**
+	   A file opened through the engine. Writes are gathered and reads served from one
+	   registered buffer, so the engine moves URING_BUFFER_SIZE chunks instead of packets.
+	 */
+	struct File
+	{
+		int file;             // fixed file index.
+		bool write;
+		uint64_t offset;      // file offset of the chunk buffer.
+		int bufIndex;         // registered buffer index, -1 if heap allocated.
+		uint8_t* buf;
+		uint32_t bufLen;      // valid bytes in buf.
+		uint32_t bufPos;      // read position in buf.
+		File() : file(-1), write(false), offset(0), bufIndex(-1), buf(nullptr), bufLen(0), bufPos(0) {}
+	};
+
+	/**
+	   @brief open a file. path is relative to dirfd when given.
+	   @return false with errno set if the file could not be opened.
+	 */
+	inline bool open(const std::string& path, File& f, const bool write, const int dirfd = AT_FDCWD)
+	{
+		Engine& engine = Engine::instance();
+		const int flags = write ? (O_WRONLY | O_CREAT | O_TRUNC) : O_RDONLY;
+		f.file = engine.open(path, flags | O_CLOEXEC, 0644, dirfd);
+		if (f.file < 0)
+		{
+			errno = -f.file;
+			return false;
+		}
+		f.write = write;
+		f.offset = 0;
+		f.bufLen = 0;
+		f.bufPos = 0;
+		f.bufIndex = engine.acquireBuffer(f.buf);
+		if (f.bufIndex < 0)
+			f.buf = new uint8_t[URING_BUFFER_SIZE];
+		return true;
+	}
+
+	inline bool flush(File& f)
+	{
+		if (f.bufLen == 0)
+			return true;
+		uint32_t done = 0;
+		while (done < f.bufLen)
+		{
+			const int64_t res = Engine::instance().write(f.file, f.buf + done, f.bufLen - done, f.offset + done, f.bufIndex);
+			if (res <= 0)
+				return false;
+			done += static_cast<uint32_t>(res);
+		}
+		f.offset += f.bufLen;
+		f.bufLen = 0;
+		return true;
+	}
+
+	inline bool write(File& f, const uint8_t* data, uint32_t bytes)
+	{
+		while (bytes > 0)
+		{
+			uint32_t chunk = URING_BUFFER_SIZE - f.bufLen;
+			if (chunk > bytes)
+				chunk = bytes;
+			memcpy(f.buf + f.bufLen, data, chunk);
+			f.bufLen += chunk;
+			data += chunk;
+			bytes -= chunk;
+			if (f.bufLen == URING_BUFFER_SIZE && !flush(f))
+				return false;
+		}
+		return true;
+	}
+
+	/**
+	   @brief read bytes. like fstream::read, a read past end of file is zero-filled and is not an error.
+	 */
+	inline bool read(File& f, uint8_t* data, uint32_t bytes)
+	{
+		while (bytes > 0)
+		{
+			if (f.bufPos == f.bufLen)
+			{
+				f.offset += f.bufLen;
+				f.bufPos = 0;
+				const int64_t res = Engine::instance().read(f.file, f.buf, URING_BUFFER_SIZE, f.offset, f.bufIndex);
+				if (res < 0)
+					return false;
+				f.bufLen = static_cast<uint32_t>(res);
+				if (res == 0)
+				{
+					memset(data, 0, bytes);
+					return true;
+				}
+			}
+			uint32_t chunk = f.bufLen - f.bufPos;
+			if (chunk > bytes)
+				chunk = bytes;
+			memcpy(data, f.buf + f.bufPos, chunk);
+			f.bufPos += chunk;
+			data += chunk;
+			bytes -= chunk;
+		}
+		return true;
+	}
+
+	inline bool sync(File& f)
+	{
+		return flush(f) && (Engine::instance().fsync(f.file) == 0);
+	}
+
+	inline bool close(File& f)
+	{
+		if (f.file < 0)
+			return true;
+		const bool flushed = !f.write || flush(f);
+		const bool closed = (Engine::instance().close(f.file) == 0);
+		if (f.bufIndex >= 0)
+			Engine::instance().releaseBuffer(f.bufIndex);
+		else
+			delete[] f.buf;
+		f.file = -1;
+		f.buf = nullptr;
+		f.bufIndex = -1;
+		return flushed && closed;
+	}
+
+}
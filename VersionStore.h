@@ -0,0 +1,364 @@
+/**
+  @VersionStore point-in-time versions of backed up files.
+  Every successful backup of (user, filename) also records an immutable version under
+  the user's folder: .versions/<filename>/<id>, where the id is the backup time in
+  nanoseconds since the epoch (20 digits, so names sort by time). The live file keeps
+  being what restore/list/remove work on; removing it leaves its versions restorable.
+  A version shares storage where it can: a FICLONE reflink of the live file where the
+  filesystem supports it, which costs no read at all. Elsewhere, identical to the previous
+  version, it is a hard link to it (versions are never written after creation), otherwise
+  a copy. (Sealed files never compare identical: each is encrypted under its own file ID.)
+  Versions are created under a temporary name and renamed, so a listed version is whole.
+  A version that cannot be created does not fail the backup: the live file is stored, the
+  failure is reported to the caller and counted.
+  Retention keeps the newest `keep` versions and drops versions older than `maxAge`,
+  except for the newest one.
+  Versioning is off unless asked for: without reflinks every overwrite copies the file, and
+  a versioned store keeps each file's content where its versions can share it, so while it
+  is on tiny backups get files of their own (SmallFileStore) and nothing is moved to the
+  cold root (TieringManager). Server::serve logs what it turns off.
+  Configuration: BACKUPSVR_VERSIONS (1 enables), BACKUPSVR_VERSIONS_KEEP,
+                 BACKUPSVR_VERSIONS_MAX_AGE (seconds, 0 = no age limit).
+ */
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "DirectoryCache.h"
+#include "AtRestCipher.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+#define VERSIONS_DIR  DIRECTORY_VERSIONS_ENTRY
+#define VERSIONS_KEEP  16                  // versions kept per file.
+#define VERSIONS_MAX_AGE_S  0              // 0: versions do not expire by age.
+#define VERSIONS_ID_DIGITS  20
+#define VERSIONS_COMPARE_CHUNK  (64 * 1024)
+#define VERSIONS_ENV  "BACKUPSVR_VERSIONS"
+#define VERSIONS_KEEP_ENV  "BACKUPSVR_VERSIONS_KEEP"
+#define VERSIONS_MAX_AGE_ENV  "BACKUPSVR_VERSIONS_MAX_AGE"
+
+namespace VersionStore {
+
+	struct Retention
+	{
+		bool enabled = false;
+		uint32_t keep = VERSIONS_KEEP;
+		std::chrono::seconds maxAge{ VERSIONS_MAX_AGE_S };
+	};
+
+	inline const Retention& retention()
+	{
+		static const Retention configured = []()
+		{
+			Retention r;
+			const char* enabled = getenv(VERSIONS_ENV);
+			const char* keep = getenv(VERSIONS_KEEP_ENV);
+			const char* maxAge = getenv(VERSIONS_MAX_AGE_ENV);
+			if (enabled != nullptr)
+				r.enabled = (atoi(enabled) != 0);
+			if (keep != nullptr && atoi(keep) > 0)
+				r.keep = static_cast<uint32_t>(atoi(keep));
+			if (maxAge != nullptr)
+				r.maxAge = std::chrono::seconds(strtoll(maxAge, nullptr, 10));
+			return r;
+		}();
+		return configured;
+	}
+
+	struct Stats
+	{
+		std::atomic<uint64_t> reflinked{ 0 };   // versions sharing extents with the live file.
+		std::atomic<uint64_t> shared{ 0 };      // versions hard linked to an identical previous version.
+		std::atomic<uint64_t> copied{ 0 };
+		std::atomic<uint64_t> pruned{ 0 };
+		std::atomic<uint64_t> failed{ 0 };      // backups stored without a version.
+	};
+
+	inline Stats& stats()
+	{
+		static Stats s;
+		return s;
+	}
+
+	struct Version
+	{
+		uint64_t id = 0;     // creation time, ns since the epoch.
+		uint64_t size = 0;
+	};
+
+	/**
+	   @brief is the name inside a server owned tree (versions, small file container)? clients may not address it.
+	 */
+	inline bool reserved(const std::string& filename)
+	{
+		return DirectoryCache::serverEntry(filename.substr(0, filename.find('/')).c_str());
+	}
+
+	inline std::string idString(const uint64_t id)
+	{
+		char text[VERSIONS_ID_DIGITS + 1];
+		snprintf(text, sizeof(text), "%020llu", static_cast<unsigned long long>(id));
+		return text;
+	}
+
+	/**
+	   @return path of a version relative to the user's folder.
+	 */
+	inline std::string path(const std::string& filename, const uint64_t id)
+	{
+		return std::string(VERSIONS_DIR) + "/" + filename + "/" + idString(id);
+	}
+
+	inline std::string folder(const DirectoryCache::Directory& dir, const std::string& filename)
+	{
+		return dir.folder + VERSIONS_DIR + "/" + filename + "/";
+	}
+
+	/**
+	   @brief the versions of a file, oldest first.
+	   @return false on error. no versions is not an error.
+	 */
+	inline bool list(const DirectoryCache::Directory& dir, const std::string& filename, std::vector<Version>& versions)
+	{
+		versions.clear();
+		try
+		{
+			const std::filesystem::path versionsFolder(folder(dir, filename));
+			std::error_code error;
+			if (!std::filesystem::is_directory(versionsFolder, error))
+				return true;
+			for (const auto& entry : std::filesystem::directory_iterator(versionsFolder))
+			{
+				const std::string name = entry.path().filename().string();
+				if (name.size() != VERSIONS_ID_DIGITS || !entry.is_regular_file() || name.find_first_not_of("0123456789") != std::string::npos)
+					continue;   // e.g. an unfinished version.
+				Version version;
+				version.id = strtoull(name.c_str(), nullptr, 10);
+#if HAVE_AT_REST_CIPHER
+				if (!AtRestCipher::plainSize(entry.path().string(), version.size))
+					continue;
+#else
+				version.size = entry.file_size();
+#endif
+				versions.push_back(version);
+			}
+			std::sort(versions.begin(), versions.end(), [](const Version& a, const Version& b) { return a.id < b.id; });
+			return true;
+		}
+		catch (std::exception&)
+		{
+			versions.clear();
+			return false;
+		}
+	}
+
+	/**
+	   @brief the version current at a point in time: the newest one created at or before `at`.
+	   @param at version id or timestamp, ns since the epoch. 0: the newest version.
+	   @return false if there is no such version.
+	 */
+	inline bool find(const DirectoryCache::Directory& dir, const std::string& filename, const uint64_t at, Version& version)
+	{
+		std::vector<Version> versions;
+		if (!list(dir, filename, versions))
+			return false;
+		for (auto it = versions.rbegin(); it != versions.rend(); ++it)
+		{
+			if (at == 0 || it->id <= at)
+			{
+				version = *it;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	   @brief byte compare two files. false on any error.
+	 */
+	inline bool sameContent(const std::string& a, const std::string& b)
+	{
+		try
+		{
+			if (std::filesystem::file_size(a) != std::filesystem::file_size(b))
+				return false;
+			std::ifstream fa(a, std::ios::binary);
+			std::ifstream fb(b, std::ios::binary);
+			std::vector<char> bufA(VERSIONS_COMPARE_CHUNK), bufB(VERSIONS_COMPARE_CHUNK);
+			while (fa && fb)
+			{
+				fa.read(bufA.data(), bufA.size());
+				fb.read(bufB.data(), bufB.size());
+				if (fa.gcount() != fb.gcount() || memcmp(bufA.data(), bufB.data(), static_cast<size_t>(fa.gcount())) != 0)
+					return false;
+			}
+			return !fa.bad() && !fb.bad() && fa.eof() && fb.eof();
+		}
+		catch (std::exception&)
+		{
+			return false;
+		}
+	}
+
+	/**
+	   @brief reflink `source` to `target` (FICLONE).
+	   @return false where the filesystem cannot share the extents. `target` may be left empty then.
+	 */
+	inline bool reflinkFile(const std::string& source, const std::string& target)
+	{
+		bool reflinked = false;
+#if defined(__linux__) && defined(FICLONE)
+		const int in = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+		if (in >= 0)
+		{
+			const int out = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (out >= 0)
+			{
+				reflinked = (::ioctl(out, FICLONE, in) == 0);
+				(void)::close(out);
+			}
+			(void)::close(in);
+		}
+#else
+		(void)source;
+		(void)target;
+#endif
+		return reflinked;
+	}
+
+	/**
+	   @brief reflink `source` to `target` (FICLONE), or copy it where reflinks are not supported.
+	   @param reflinked set when the extents are shared.
+	 */
+	inline bool cloneFile(const std::string& source, const std::string& target, bool& reflinked)
+	{
+		reflinked = reflinkFile(source, target);
+		if (reflinked)
+			return true;
+		try
+		{
+			return std::filesystem::copy_file(source, target, std::filesystem::copy_options::overwrite_existing);
+		}
+		catch (std::exception&)
+		{
+			return false;
+		}
+	}
+
+	/**
+	   @brief drop versions beyond the retention limits. the newest version is always kept.
+	 */
+	inline void prune(const DirectoryCache::Directory& dir, const std::string& filename)
+	{
+		const Retention& r = retention();
+		std::vector<Version> versions;
+		if (!list(dir, filename, versions) || versions.size() <= 1)
+			return;
+		const uint64_t now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+		const uint64_t maxAge = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(r.maxAge).count());
+		const std::string versionsFolder = folder(dir, filename);
+		for (size_t i = 0; i + 1 < versions.size(); ++i)
+		{
+			const bool overCount = (versions.size() - i > r.keep);
+			const bool expired = (maxAge != 0 && now > versions[i].id && now - versions[i].id > maxAge);
+			if (!overCount && !expired)
+				continue;
+			std::error_code error;
+			if (std::filesystem::remove(versionsFolder + idString(versions[i].id), error))
+				stats().pruned.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	/**
+	   @brief record the just written live file as a new version, then apply retention.
+	   @param dir the user's directory.
+	   @param filename the live file, relative to the user's folder.
+	   @param err error output.
+	   @return true if the version was recorded (or versioning is disabled). on false the live
+	           file is untouched: the caller keeps the backup and reports the missing version.
+	 */
+	inline bool snapshot(const DirectoryCache::Directory& dir, const std::string& filename, std::stringstream& err)
+	{
+		if (!retention().enabled)
+			return true;
+		try
+		{
+			const std::string versionsFolder = folder(dir, filename);
+			(void)std::filesystem::create_directories(versionsFolder);
+			Version latest;
+			const bool hasLatest = find(dir, filename, 0, latest);
+			uint64_t id = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+			if (hasLatest && id <= latest.id)
+				id = latest.id + 1;   // ids stay ordered even if the clock steps back.
+
+			const std::string live = dir.folder + filename;
+			const std::string target = versionsFolder + idString(id);
+			const std::string pending = versionsFolder + ".pending";
+			std::error_code error;
+			std::filesystem::remove(pending, error);
+			bool created = reflinkFile(live, pending);   // shares the extents without reading them: no compare needed.
+			if (created)
+				stats().reflinked.fetch_add(1, std::memory_order_relaxed);
+			else
+			{
+				std::filesystem::remove(pending, error);
+				if (hasLatest && sameContent(live, versionsFolder + idString(latest.id)))
+				{
+					std::filesystem::create_hard_link(versionsFolder + idString(latest.id), pending, error);
+					created = !error;
+					if (created)
+						stats().shared.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+			if (!created)
+			{
+				if (!std::filesystem::copy_file(live, pending, std::filesystem::copy_options::overwrite_existing, error))
+				{
+					err << "user ID #" << +dir.userID << ": version of " << filename << " could not be created, the backup is kept without it." << std::endl;
+					std::filesystem::remove(pending, error);
+					stats().failed.fetch_add(1, std::memory_order_relaxed);
+					return false;
+				}
+				stats().copied.fetch_add(1, std::memory_order_relaxed);
+			}
+			std::filesystem::rename(pending, target);
+			prune(dir, filename);
+			return true;
+		}
+		catch (std::exception& e)
+		{
+			err << "user ID #" << +dir.userID << ": version of " << filename << " failed, the backup is kept without it: " << e.what() << std::endl;
+			stats().failed.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+	}
+
+	/**
+	   @brief the version listing sent to clients: one "<id> <size>" line per version, oldest first.
+	 */
+	inline std::vector<std::string> listing(const std::vector<Version>& versions)
+	{
+		std::vector<std::string> lines;
+		lines.reserve(versions.size());
+		for (const auto& version : versions)
+			lines.push_back(idString(version.id) + " " + std::to_string(version.size));
+		return lines;
+	}
+
+}